@@ -29,6 +29,7 @@
 #include "sysemu/arch_init.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include "sysemu/qtest.h"
 #include "hw/xen/xen.h"
 #include "qom/object.h"
@@ -39,7 +40,21 @@ static bool tcg_allowed = true;
 
 static int tcg_init(MachineState *ms)
 {
+    Error *err = NULL;
+
+    qemu_tcg_configure(ms->tcg_thread, &err);
+    if (err) {
+        error_report_err(err);
+        return -EINVAL;
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    if (ms->tb_cache) {
+        tb_cache_init(ms->tb_cache, &err);
+        if (err) {
+            error_report_err(err);
+            return -EINVAL;
+        }
+    }
     return 0;
 }
 
@@ -17,12 +17,17 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
@@ -41,6 +46,188 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Number of file descriptors at which aio_poll switches to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+    if (ctx->epollfd != -1) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    trace_aio_epoll_enable(ctx);
+    return true;
+}
+
+/* Keep the epoll set in sync with a handler that was added, changed or
+ * removed (pfd.events == 0).  If the kernel refuses to add or modify an
+ * fd, for example because it is a regular file, go back to ppoll for good.
+ * Removal fails harmlessly when the fd was closed before its handler was
+ * removed, since closing it already took it out of the epoll set.
+ */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int ctl;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        ctl = EPOLL_CTL_DEL;
+    } else {
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        ctl = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    }
+
+    if (epoll_ctl(ctx->epollfd, ctl, node->pfd.fd, &event)) {
+        if (ctl == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF)) {
+            return;
+        }
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Wait for the epoll fd itself with ppoll(), which unlike epoll_wait()
+ * has nanosecond resolution.  Called without the AioContext held.
+ */
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+
+    return qemu_poll_ns(&pfd, 1, timeout);
+}
+
+/* Copy the ready events into the handlers' revents */
+static int aio_epoll_fetch(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event events[128];
+    int i, ret;
+
+    do {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+    } while (ret < 0 && errno == EINTR);
+
+    for (i = 0; i < ret; i++) {
+        int ev = events[i].events;
+
+        node = events[i].data.ptr;
+        node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                            (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                            (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                            (ev & EPOLLERR ? G_IO_ERR : 0);
+    }
+    return ret;
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+    }
+    return false;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd != -1;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd != -1) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+static int aio_epoll_fetch(AioContext *ctx)
+{
+    abort();
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -56,6 +243,13 @@ void aio_set_fd_handler(AioContext *ctx,
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
 
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            }
+
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
+
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
@@ -70,13 +264,17 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
+            is_new = true;
             node = g_new0(AioHandler, 1);
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            ctx->poll_disable_cnt++;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -85,6 +283,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -98,6 +297,25 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    ctx->poll_disable_cnt += !io_poll - !node->io_poll;
+    node->io_poll = io_poll;
+
+    /* A blocked aio_poll may be able to start polling now */
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -230,12 +448,96 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Busy-poll the handlers for up to @max_ns, or until one of them makes
+ * progress.  The AioContext stays acquired; a thread waiting for it
+ * schedules notify_dummy_bh, which ends the loop through the poll
+ * handler of ctx->notifier.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers_end(ctx, progress);
+
+    return progress;
+}
+
+static bool try_poll_mode(AioContext *ctx, int64_t timeout)
+{
+    /* timeout is -1 for "infinite", which makes it the biggest unsigned */
+    int64_t max_ns = MIN((uint64_t)timeout, (uint64_t)ctx->poll_ns);
+
+    if (max_ns == 0 || ctx->poll_disable_cnt) {
+        return false;
+    }
+    return run_poll_handlers(ctx, max_ns);
+}
+
+/* Adjust the polling time to how long this aio_poll call waited */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling caught the event, that's the sweet spot */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        if (ctx->poll_ns != old) {
+            trace_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* The event came in after a short while, poll a bit longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = 4000;
+        } else {
+            ctx->poll_ns *= grow;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
+    bool use_epoll = false;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -253,31 +555,61 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers++;
 
-    assert(npfd == 0);
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events) {
-            add_pollfd(node);
-        }
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    ret = 0;
+    if (timeout && try_poll_mode(ctx, timeout)) {
+        progress = true;
+        if (blocking) {
+            atomic_sub(&ctx->notify_me, 2);
+        }
+    } else {
+        assert(npfd == 0);
+
+        /* fill pollfds, unless the epoll set already has all of them */
+        if (!aio_epoll_enabled(ctx)) {
+            QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+                if (!node->deleted && node->pfd.events) {
+                    add_pollfd(node);
+                }
+            }
+        }
 
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
-    }
-    ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
-    if (blocking) {
-        atomic_sub(&ctx->notify_me, 2);
-    }
-    if (timeout) {
-        aio_context_acquire(ctx);
+        if (aio_epoll_check_poll(ctx, npfd)) {
+            use_epoll = true;
+            npfd = 0;
+        }
+
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+        }
+        if (use_epoll) {
+            ret = timeout ? aio_epoll_wait(ctx, timeout) : 1;
+        } else {
+            ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+        }
+        if (blocking) {
+            atomic_sub(&ctx->notify_me, 2);
+        }
+        if (timeout) {
+            aio_context_acquire(ctx);
+        }
+        if (use_epoll && ret > 0) {
+            ret = aio_epoll_fetch(ctx);
+        }
     }
 
     aio_notify_accept(ctx);
 
+    if (blocking && ctx->poll_max_ns) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
@@ -297,3 +629,17 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     return progress;
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
@@ -0,0 +1,628 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Requests are queued as submission queue entries in a ring shared with
+ * the kernel and handed over with one io_uring_enter() per batch, so
+ * unlike linux-aio this works without O_DIRECT, and flushes and
+ * fallocate don't have to go through the thread pool.  Completions are
+ * read straight from the completion ring; the kernel signals an eventfd
+ * when new ones arrive.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "block/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/iov.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+
+/* Submission queue size (per-device); the completion queue is twice that */
+#define MAX_ENTRIES 128
+
+typedef struct LuringState LuringState;
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    int type;
+    int fd;
+    uint64_t offset;
+    uint64_t nbytes;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+
+    /*
+     * Buffered reads can come back short without being at EOF; the rest
+     * is read again through this vector.
+     */
+    QEMUIOVector resubmit_qiov;
+    uint64_t total_read;
+
+    Coroutine *co;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    int ring_fd;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    bool has_fallocate;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    int ret = luringcb->ret;
+
+    if (ret >= 0 && (luringcb->type & QEMU_AIO_TYPE_MASK) == QEMU_AIO_READ) {
+        uint64_t done = luringcb->total_read + ret;
+
+        if (ret > 0 && done < luringcb->nbytes) {
+            /* Short read: go for the rest */
+            luringcb->total_read = done;
+            qemu_iovec_reset(&luringcb->resubmit_qiov);
+            qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                              done, luringcb->nbytes - done);
+            trace_luring_resubmit_short_read(s, luringcb, done);
+            QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+            s->io_q.in_queue++;
+            return;
+        }
+        /* Zero bytes means EOF, pad with zeros. */
+        if (done < luringcb->nbytes) {
+            qemu_iovec_memset(luringcb->qiov, done, 0,
+                              luringcb->nbytes - done);
+        }
+        ret = 0;
+    } else if (ret >= 0 && (luringcb->type & QEMU_AIO_TYPE_MASK) ==
+                           QEMU_AIO_WRITE) {
+        ret = ret == luringcb->nbytes ? 0 : -EINVAL;
+    } else if (ret > 0) {
+        ret = 0;
+    } else if (ret == -EOPNOTSUPP) {
+        ret = -ENOTSUP;
+    }
+
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    trace_luring_process_completion(s, luringcb, ret);
+    if (luringcb->co) {
+        luringcb->ret = ret;
+        qemu_coroutine_enter(luringcb->co, NULL);
+    } else {
+        luringcb->common.cb(luringcb->common.opaque, ret);
+    }
+    qemu_aio_unref(luringcb);
+}
+
+/* The completion BH reaps the completion ring and invokes the callbacks.
+ *
+ * Like the linux-aio one, it supports nested event loops, for example when
+ * a request callback invokes aio_poll().  Each completion is consumed from
+ * the ring before its callback runs, and the BH reschedules itself while
+ * it works so that a nested event loop carries on where it stopped.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (true) {
+        unsigned head = *s->cq_head;
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *luringcb;
+
+        if (head == atomic_read(s->cq_tail)) {
+            break;
+        }
+        /* Read the entry only after seeing the tail that covers it */
+        smp_rmb();
+        cqe = &s->cqes[head & *s->cq_mask];
+        luringcb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        luringcb->ret = cqe->res;
+
+        /* Hand the entry back to the kernel before anything can nest */
+        atomic_mb_set(s->cq_head, head + 1);
+        s->io_q.in_flight--;
+
+        luring_process_completion(s, luringcb);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    /* Retry both queued requests and entries the kernel refused before */
+    if (!s->io_q.plugged &&
+        (s->io_q.in_queue || *s->sq_tail != atomic_read(s->sq_head))) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (*s->cq_head == atomic_read(s->cq_tail)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void luring_prep_sqe(struct io_uring_sqe *sqe, LuringAIOCB *luringcb)
+{
+    QEMUIOVector *qiov = luringcb->total_read ? &luringcb->resubmit_qiov :
+                                                luringcb->qiov;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = luringcb->fd;
+    sqe->user_data = (uintptr_t)luringcb;
+
+    switch (luringcb->type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        sqe->off = luringcb->offset + luringcb->total_read;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        break;
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->off = luringcb->offset;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    case QEMU_AIO_DISCARD:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = luringcb->offset;
+        sqe->addr = luringcb->nbytes;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+    case QEMU_AIO_WRITE_ZEROES:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = luringcb->offset;
+        sqe->addr = luringcb->nbytes;
+        sqe->len = FALLOC_FL_ZERO_RANGE;
+        break;
+    default:
+        abort();
+    }
+}
+
+/*
+ * io_uring_enter() failed and took no entries.  Take them back out of
+ * the submission ring (the kernel only looks at it during the system
+ * call) and fail their requests, together with those still queued.
+ */
+static void ioq_fail(LuringState *s, int ret)
+{
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed = QSIMPLEQ_HEAD_INITIALIZER(failed);
+    unsigned head = atomic_read(s->sq_head);
+    unsigned tail = *s->sq_tail;
+    LuringAIOCB *luringcb;
+
+    for (; head != tail; head++) {
+        unsigned idx = s->sq_array[head & *s->sq_mask];
+
+        luringcb = (LuringAIOCB *)(uintptr_t)s->sqes[idx].user_data;
+        QSIMPLEQ_INSERT_TAIL(&failed, luringcb, next);
+        s->io_q.in_flight--;
+    }
+    atomic_set(s->sq_tail, atomic_read(s->sq_head));
+
+    QSIMPLEQ_CONCAT(&failed, &s->io_q.pending);
+    s->io_q.in_queue = 0;
+    s->io_q.blocked = false;
+
+    /* The callbacks may submit new requests, so complete them last */
+    while (!QSIMPLEQ_EMPTY(&failed)) {
+        luringcb = QSIMPLEQ_FIRST(&failed);
+        QSIMPLEQ_REMOVE_HEAD(&failed, next);
+        luringcb->ret = ret;
+        luring_process_completion(s, luringcb);
+    }
+}
+
+/*
+ * Move pending requests into the submission ring and submit everything
+ * the kernel hasn't taken yet with a single io_uring_enter().
+ */
+static void ioq_submit(LuringState *s)
+{
+    unsigned tail = *s->sq_tail;
+    unsigned to_submit;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           tail - atomic_read(s->sq_head) < s->sq_entries &&
+           s->io_q.in_flight < s->sq_entries) {
+        LuringAIOCB *luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        unsigned idx = tail & *s->sq_mask;
+
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+
+        luring_prep_sqe(&s->sqes[idx], luringcb);
+        s->sq_array[idx] = idx;
+        tail++;
+    }
+
+    /* The entries must be visible before the kernel can see the new tail */
+    smp_wmb();
+    atomic_set(s->sq_tail, tail);
+
+    to_submit = tail - atomic_read(s->sq_head);
+    if (to_submit) {
+        do {
+            ret = io_uring_enter(s->ring_fd, to_submit);
+        } while (ret == -1 && errno == EINTR);
+        trace_luring_io_uring_enter(s, to_submit, ret);
+        if (ret == -1 && errno != EAGAIN && errno != EBUSY) {
+            ioq_fail(s, -errno);
+            return;
+        }
+        /* Anything not taken stays in the ring for the next round */
+        to_submit = tail - atomic_read(s->sq_head);
+
+        /*
+         * That round normally comes with the next completion; if the
+         * kernel holds no request of ours, there won't be one.
+         */
+        if (to_submit && s->io_q.in_flight == to_submit) {
+            qemu_bh_schedule(s->completion_bh);
+        }
+    }
+    s->io_q.blocked = to_submit > 0 || s->io_q.in_queue > 0;
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending) ||
+        *s->sq_tail != atomic_read(s->sq_head)) {
+        ioq_submit(s);
+    }
+}
+
+static LuringAIOCB *luring_queue(BlockDriverState *bs, LuringState *s,
+                                 int fd, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockCompletionFunc *cb, void *opaque,
+                                 int type)
+{
+    LuringAIOCB *luringcb;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->s = s;
+    luringcb->type = type;
+    luringcb->fd = fd;
+    luringcb->offset = sector_num * BDRV_SECTOR_SIZE;
+    luringcb->nbytes = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    luringcb->qiov = qiov;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->total_read = 0;
+    luringcb->co = NULL;
+    qemu_iovec_init(&luringcb->resubmit_qiov, qiov ? qiov->niov : 1);
+
+    trace_luring_submit(s, luringcb, type, luringcb->offset,
+                        luringcb->nbytes);
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return luringcb;
+}
+
+/*
+ * Reads and writes go through @qiov; for QEMU_AIO_FLUSH, QEMU_AIO_DISCARD
+ * and QEMU_AIO_WRITE_ZEROES (the latter two with fallocate, for regular
+ * files only) it is NULL.
+ */
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *luringcb;
+
+    luringcb = luring_queue(bs, aio_ctx, fd, sector_num, qiov, nb_sectors,
+                            cb, opaque, type);
+    return &luringcb->common;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors, int type)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    luringcb = luring_queue(bs, aio_ctx, fd, sector_num, qiov, nb_sectors,
+                            NULL, NULL, type);
+    /* Keep it alive until we've read the result */
+    qemu_aio_ref(luringcb);
+    luringcb->co = qemu_coroutine_self();
+    qemu_coroutine_yield();
+    ret = luringcb->ret;
+    qemu_aio_unref(luringcb);
+    return ret;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+static int luring_map_rings(LuringState *s, struct io_uring_params *p)
+{
+    s->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->cq_ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        s->sq_ring_size = s->cq_ring_size =
+            MAX(s->sq_ring_size, s->cq_ring_size);
+    }
+
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        s->sq_ring = NULL;
+        return -errno;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        s->cq_ring = s->sq_ring;
+    } else {
+        s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if (s->cq_ring == MAP_FAILED) {
+            s->cq_ring = NULL;
+            return -errno;
+        }
+    }
+
+    s->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        return -errno;
+    }
+
+    s->sq_head = s->sq_ring + p->sq_off.head;
+    s->sq_tail = s->sq_ring + p->sq_off.tail;
+    s->sq_mask = s->sq_ring + p->sq_off.ring_mask;
+    s->sq_array = s->sq_ring + p->sq_off.array;
+    s->sq_entries = p->sq_entries;
+
+    s->cq_head = s->cq_ring + p->cq_off.head;
+    s->cq_tail = s->cq_ring + p->cq_off.tail;
+    s->cq_mask = s->cq_ring + p->cq_off.ring_mask;
+    s->cqes = s->cq_ring + p->cq_off.cqes;
+    return 0;
+}
+
+static void luring_unmap_rings(LuringState *s)
+{
+    if (s->sqes) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring && s->cq_ring != s->sq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+/*
+ * IORING_OP_FALLOCATE came later than io_uring itself, so whether the
+ * kernel knows it has to be asked.  Kernels without it don't know
+ * IORING_REGISTER_PROBE either.
+ */
+static bool luring_probe_fallocate(LuringState *s)
+{
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    bool ret = false;
+
+    probe = g_malloc0(len);
+    if (!io_uring_register(s->ring_fd, IORING_REGISTER_PROBE, probe, 256)) {
+        ret = probe->last_op >= IORING_OP_FALLOCATE &&
+              (probe->ops[IORING_OP_FALLOCATE].flags & IO_URING_OP_SUPPORTED);
+    }
+    g_free(probe);
+    return ret;
+}
+
+/*
+ * Sets up a new io_uring instance in *s_.  Returns 0 on success and
+ * -errno on failure.
+ */
+int luring_init(void **s_)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int efd, ret;
+
+    s = g_malloc0(sizeof(*s));
+    ret = event_notifier_init(&s->e, false);
+    if (ret < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    s->ring_fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (s->ring_fd == -1) {
+        ret = -errno;
+        goto out_close_efd;
+    }
+
+    ret = luring_map_rings(s, &p);
+    if (ret < 0) {
+        goto out_close_ring;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_EVENTFD, &efd, 1)) {
+        ret = -errno;
+        goto out_close_ring;
+    }
+
+    s->has_fallocate = luring_probe_fallocate(s);
+    ioq_init(&s->io_q);
+    trace_luring_init(s, s->sq_entries, s->has_fallocate);
+
+    *s_ = s;
+    return 0;
+
+out_close_ring:
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return ret;
+}
+
+/*
+ * Returns whether discard and write zeroes requests can be submitted, which
+ * otherwise fail with -EINVAL.
+ */
+bool luring_has_fallocate(void *s_)
+{
+    LuringState *s = s_;
+
+    return s->has_fallocate;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+    g_free(s);
+}
@@ -46,26 +46,34 @@ struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Only the first 'limit' entries are used for new tables.  The limit may
+     * be lowered from outside the AioContext of the image, so it is read
+     * atomically and tables beyond it are dropped on the next miss. */
+    int                     limit;
+    int                     applied_limit;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
@@ -73,10 +81,9 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -119,16 +126,24 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
 
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size));
+    assert(table_size >= (1 << MIN_CLUSTER_BITS));
+    assert(table_size <= s->cluster_size);
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->limit = c->applied_limit = num_tables;
+    c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * c->table_size);
 
     if (!c->entries || !c->table_array) {
         qemu_vfree(c->table_array);
@@ -155,6 +170,28 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
+int qcow2_cache_get_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+int qcow2_cache_get_limit(Qcow2Cache *c)
+{
+    return atomic_read(&c->limit);
+}
+
+/* May be called without holding the AioContext of the image */
+void qcow2_cache_set_limit(Qcow2Cache *c, int num_tables)
+{
+    atomic_set(&c->limit, MAX(1, MIN(num_tables, c->size)));
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -197,13 +234,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -217,7 +254,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -303,6 +340,52 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
+/*
+ * Write back and drop the unused tables that lie beyond the limit of the
+ * cache, and give their memory back to the host.  Tables that are still
+ * referenced stay where they are; they cannot be replaced any more, and the
+ * next trim or clean-up gets rid of them.
+ *
+ * Returns 1 if referenced tables were left beyond the limit, 0 if none were,
+ * and -errno on failure.
+ */
+static int qcow2_cache_trim(BlockDriverState *bs, Qcow2Cache *c, int limit)
+{
+    int i = limit;
+    int ret;
+    bool busy = false;
+
+    while (i < c->size) {
+        int to_release = 0;
+
+        while (i < c->size && c->entries[i].ref) {
+            busy = true;
+            i++;
+        }
+
+        while (i < c->size && !c->entries[i].ref) {
+            ret = qcow2_cache_entry_flush(bs, c, i);
+            if (ret < 0) {
+                if (to_release > 0) {
+                    qcow2_cache_table_release(bs, c, i - to_release,
+                                              to_release);
+                }
+                return ret;
+            }
+            c->entries[i].offset = 0;
+            c->entries[i].lru_counter = 0;
+            i++;
+            to_release++;
+        }
+
+        if (to_release > 0) {
+            qcow2_cache_table_release(bs, c, i - to_release, to_release);
+        }
+    }
+
+    return busy;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
@@ -310,20 +393,26 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int i;
     int ret;
     int lookup_index;
+    int limit;
     uint64_t min_lru_counter = UINT64_MAX;
     int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    limit = atomic_read(&c->limit);
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
+    i = lookup_index = (offset / c->table_size * 4) % c->size;
     do {
         const Qcow2CachedTable *t = &c->entries[i];
         if (t->offset == offset) {
+            if (read_from_disk) {
+                c->hits++;
+            }
             goto found;
         }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
+        if (i < limit && t->ref == 0 && t->lru_counter < min_lru_counter) {
             min_lru_counter = t->lru_counter;
             min_lru_index = i;
         }
@@ -338,6 +427,23 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         abort();
     }
 
+    if (read_from_disk) {
+        c->misses++;
+    }
+
+    if (limit < c->applied_limit) {
+        ret = qcow2_cache_trim(bs, c, limit);
+        if (ret < 0) {
+            return ret;
+        }
+        /* Try again on the next miss while referenced tables remain */
+        if (ret == 0) {
+            c->applied_limit = limit;
+        }
+    } else {
+        c->applied_limit = limit;
+    }
+
     /* Cache miss: write a table back and replace it */
     i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
@@ -357,7 +463,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
 
         ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
@@ -462,6 +462,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -530,9 +535,72 @@ static void qcow2_attach_aio_context(BlockDriverState *bs,
     cache_clean_timer_init(bs, new_context);
 }
 
+/*
+ * L2 caches without an explicit size share DEFAULT_L2_CACHE_BUDGET.  Each of
+ * them is allocated large enough to map its whole image, but may only fill
+ * its share of the budget; the shares are recomputed (under the BQL) whenever
+ * an image joins or leaves.  Images that need less than an even share leave
+ * the rest to the others.
+ */
+static QLIST_HEAD(, BDRVQcow2State) l2_budget_images =
+    QLIST_HEAD_INITIALIZER(l2_budget_images);
+static int l2_budget_count;
+
+static uint64_t l2_cache_capacity(BDRVQcow2State *s)
+{
+    return (uint64_t) qcow2_cache_get_size(s->l2_table_cache)
+           * s->l2_slice_size * sizeof(uint64_t);
+}
+
+static void l2_budget_rebalance(void)
+{
+    BDRVQcow2State *s;
+    uint64_t share, remaining;
+    int n;
+    bool changed;
+
+    if (!l2_budget_count) {
+        return;
+    }
+
+    share = DEFAULT_L2_CACHE_BUDGET / l2_budget_count;
+    do {
+        changed = false;
+        remaining = DEFAULT_L2_CACHE_BUDGET;
+        n = l2_budget_count;
+        QLIST_FOREACH(s, &l2_budget_images, l2_budget_next) {
+            if (l2_cache_capacity(s) < share) {
+                remaining -= l2_cache_capacity(s);
+                n--;
+            }
+        }
+        if (n && remaining / n > share) {
+            share = remaining / n;
+            changed = true;
+        }
+    } while (changed);
+
+    QLIST_FOREACH(s, &l2_budget_images, l2_budget_next) {
+        uint64_t entries = share / (s->l2_slice_size * sizeof(uint64_t));
+        qcow2_cache_set_limit(s->l2_table_cache,
+                              MAX(entries, MIN_L2_CACHE_SIZE));
+    }
+}
+
+static void l2_budget_leave(BDRVQcow2State *s)
+{
+    if (s->l2_cache_budgeted) {
+        QLIST_REMOVE(s, l2_budget_next);
+        l2_budget_count--;
+        s->l2_cache_budgeted = false;
+        l2_budget_rebalance();
+    }
+}
+
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
-                             uint64_t *refcount_cache_size, Error **errp)
+                             uint64_t *refcount_cache_size,
+                             bool *l2_cache_budgeted, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t combined_cache_size;
@@ -542,6 +610,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
     refcount_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE);
 
+    *l2_cache_budgeted = false;
+
     combined_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_CACHE_SIZE, 0);
     *l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
     *refcount_cache_size = qemu_opt_get_size(opts,
@@ -574,10 +644,17 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
         }
     } else {
         if (!l2_cache_size_set && !refcount_cache_size_set) {
-            *l2_cache_size = MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
-                                 (uint64_t)DEFAULT_L2_CACHE_CLUSTERS
-                                 * s->cluster_size);
-            *refcount_cache_size = *l2_cache_size
+            /* Enough to map the whole image, within the shared budget */
+            uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+
+            *l2_cache_size = MIN(QEMU_ALIGN_UP(size_to_clusters(s,
+                                     virtual_disk_size) * sizeof(uint64_t),
+                                     s->cluster_size),
+                                 DEFAULT_L2_CACHE_BUDGET);
+            *l2_cache_budgeted = true;
+            *refcount_cache_size = MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
+                                       (uint64_t)DEFAULT_L2_CACHE_CLUSTERS
+                                       * s->cluster_size)
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         } else if (!l2_cache_size_set) {
             *l2_cache_size = *refcount_cache_size
@@ -592,6 +669,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
+    bool l2_cache_budgeted;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
@@ -607,7 +686,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -622,14 +701,28 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
 
     /* get L2 table/refcount block cache size from command line options */
     read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+                     &r->l2_cache_budgeted, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+        MIN(s->cluster_size, DEFAULT_L2_CACHE_ENTRY_SIZE));
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -667,8 +760,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -775,6 +870,16 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
+
+    if (r->l2_cache_budgeted && !s->l2_cache_budgeted) {
+        QLIST_INSERT_HEAD(&l2_budget_images, s, l2_budget_next);
+        l2_budget_count++;
+        s->l2_cache_budgeted = true;
+    } else if (!r->l2_cache_budgeted) {
+        l2_budget_leave(s);
+    }
+    l2_budget_rebalance();
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -1181,6 +1286,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
     cache_clean_timer_del(bs);
+    l2_budget_leave(s);
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
@@ -1616,8 +1722,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     while (l2meta != NULL) {
         QCowL2Meta *next;
 
@@ -1631,6 +1735,12 @@ fail:
         l2meta = next;
     }
 
+    /* Don't keep a reservation once the last allocating write is done */
+    if (QLIST_EMPTY(&s->cluster_allocs)) {
+        qcow2_release_data_clusters(bs);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
@@ -1666,6 +1776,7 @@ static void qcow2_close(BlockDriverState *bs)
     }
 
     cache_clean_timer_del(bs);
+    l2_budget_leave(s);
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -2702,6 +2813,9 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    /* Reserved clusters that aren't handed out yet aren't referenced */
+    qcow2_release_data_clusters(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
@@ -2762,6 +2876,31 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = g_new(BlockStatsSpecificQCow2, 1),
+        },
+    };
+    *stats->qcow2 = (BlockStatsSpecificQCow2){
+        .l2_cache_hits          = hits,
+        .l2_cache_misses        = misses,
+        .l2_cache_size          = (int64_t) s->l2_slice_size * sizeof(uint64_t)
+                                  * qcow2_cache_get_limit(s->l2_table_cache),
+        .l2_cache_entry_size    = s->l2_slice_size * sizeof(uint64_t),
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -3167,6 +3306,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -68,10 +68,22 @@
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
 
+/* Data clusters are reserved in batches of at most this size */
+#define QCOW2_DATA_RESERVE_SIZE (1024 * 1024) /* bytes */
+
 /* Whichever is more */
 #define DEFAULT_L2_CACHE_CLUSTERS 8 /* clusters */
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
 
+/* L2 tables are cached in slices of this size (or of one cluster, if that is
+ * smaller), so that a lookup only has to read the part of a table it needs */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 4096 /* bytes */
+
+/* Shared by the L2 caches of all images that are not given an explicit
+ * l2-cache-size or cache-size; each gets at most what it needs to map the
+ * whole virtual disk */
+#define DEFAULT_L2_CACHE_BUDGET (32 * 1024 * 1024) /* bytes */
+
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
@@ -95,6 +107,7 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
 
@@ -228,6 +241,7 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -243,6 +257,10 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Whether the L2 cache is sized from DEFAULT_L2_CACHE_BUDGET */
+    bool l2_cache_budgeted;
+    QLIST_ENTRY(BDRVQcow2State) l2_budget_next;
+
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -254,6 +272,11 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Clusters with a raised refcount that allocating writes can use
+     * without updating refcounts, see qcow2_alloc_data_clusters() */
+    uint64_t data_reserve_offset;
+    uint64_t data_reserve_clusters;
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
@@ -431,6 +454,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -512,6 +540,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t host_offset,
+                                  uint64_t *nb_clusters);
+void qcow2_release_data_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -574,8 +605,13 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+int qcow2_cache_get_size(Qcow2Cache *c);
+int qcow2_cache_get_limit(Qcow2Cache *c);
+void qcow2_cache_set_limit(Qcow2Cache *c, int num_tables);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table);
@@ -28,6 +28,7 @@
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "qemu/main-loop.h"
 #include "tcg/tcg.h"
 
 //#define DEBUG_TLB
@@ -36,19 +37,7 @@
 /* statistics */
 int tlb_flush_count;
 
-/* NOTE:
- * If flush_global is true (the usual case), flush all tlb entries.
- * If flush_global is false, flush (at least) all tlb entries not
- * marked global.
- *
- * Since QEMU doesn't currently implement a global/not-global flag
- * for tlb entries, at the moment tlb_flush() will also flush all
- * tlb entries in the flush_global == false case. This is OK because
- * CPU architectures generally permit an implementation to drop
- * entries from the TLB at any time, so flushing more entries than
- * required is only an efficiency issue, not a correctness issue.
- */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
 
@@ -69,6 +58,41 @@ void tlb_flush(CPUState *cpu, int flush_global)
     tlb_flush_count++;
 }
 
+/* With multi-threaded TCG a vCPU's TLB may only be modified from its own
+ * thread; flushes requested from elsewhere are queued as async work, which
+ * runs before that vCPU executes any more guest code.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush_nocheck(opaque);
+}
+
+/* NOTE:
+ * If flush_global is true (the usual case), flush all tlb entries.
+ * If flush_global is false, flush (at least) all tlb entries not
+ * marked global.
+ *
+ * Since QEMU doesn't currently implement a global/not-global flag
+ * for tlb entries, at the moment tlb_flush() will also flush all
+ * tlb entries in the flush_global == false case. This is OK because
+ * CPU architectures generally permit an implementation to drop
+ * entries from the TLB at any time, so flushing more entries than
+ * required is only an efficiency issue, not a correctness issue.
+ */
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+    } else {
+        tlb_flush_nocheck(cpu);
+    }
+}
+
 static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -105,6 +129,12 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+
+    if (tlb_flush_is_remote(cpu)) {
+        /* Flushing every MMU index is a superset of what was asked for. */
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+        return;
+    }
     va_start(argp, cpu);
     v_tlb_flush_by_mmuidx(cpu, argp);
     va_end(argp);
@@ -122,12 +152,39 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+typedef struct TLBFlushPageWork {
+    CPUState *cpu;
+    target_ulong addr;
+} TLBFlushPageWork;
+
+static void tlb_flush_page_async_work(void *opaque)
+{
+    TLBFlushPageWork *work = opaque;
+
+    tlb_flush_page(work->cpu, work->addr);
+    g_free(work);
+}
+
+static void tlb_flush_page_remote(CPUState *cpu, target_ulong addr)
+{
+    TLBFlushPageWork *work = g_new(TLBFlushPageWork, 1);
+
+    work->cpu = cpu;
+    work->addr = addr;
+    async_run_on_cpu(cpu, tlb_flush_page_async_work, work);
+}
+
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_page_remote(cpu, addr);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -138,7 +195,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -168,6 +225,12 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     int i, k;
     va_list argp;
 
+    if (tlb_flush_is_remote(cpu)) {
+        /* Flushing the page in every MMU index is a superset of what was
+           asked for. */
+        tlb_flush_page_remote(cpu, addr);
+        return;
+    }
     va_start(argp, addr);
 
 #if defined(DEBUG_TLB)
@@ -246,7 +309,9 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* The entry may belong to a vCPU running in another thread.  */
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -486,6 +551,41 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #include "softmmu_template.h"
 #undef MMUSUFFIX
 
+/* Slow path of qemu_ld/st_v128: the access missed the TLB or crosses a
+   page, so split it into two 64-bit accesses in guest address order.
+   Both words are loaded before either is written back, so that a fault
+   on the second word leaves the destination untouched.  */
+void helper_ld_v128_mmu(CPUArchState *env, target_ulong addr, void *host,
+                        TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    uint64_t *d = host;
+    uint64_t w0, w1;
+
+    if ((get_memop(oi) & MO_BSWAP) == MO_LE) {
+        w0 = helper_le_ldq_mmu(env, addr, oi, retaddr);
+        w1 = helper_le_ldq_mmu(env, addr + 8, oi, retaddr);
+    } else {
+        w0 = helper_be_ldq_mmu(env, addr, oi, retaddr);
+        w1 = helper_be_ldq_mmu(env, addr + 8, oi, retaddr);
+    }
+    d[0] = w0;
+    d[1] = w1;
+}
+
+void helper_st_v128_mmu(CPUArchState *env, target_ulong addr, const void *host,
+                        TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    const uint64_t *d = host;
+
+    if ((get_memop(oi) & MO_BSWAP) == MO_LE) {
+        helper_le_stq_mmu(env, addr, d[0], oi, retaddr);
+        helper_le_stq_mmu(env, addr + 8, d[1], oi, retaddr);
+    } else {
+        helper_be_stq_mmu(env, addr, d[0], oi, retaddr);
+        helper_be_stq_mmu(env, addr + 8, d[1], oi, retaddr);
+    }
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC_ADJ
 #define GETPC_ADJ 0
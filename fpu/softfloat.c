@@ -88,6 +88,9 @@ this code that are retained.
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+/* float.h and math.h are for the host FPU fast path */
+#include <float.h>
+#include <math.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -106,6 +109,85 @@ this code that are retained.
 *----------------------------------------------------------------------------*/
 #include "softfloat-specialize.h"
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When the rounding mode is round-to-nearest-even, the
+| inexact flag is already raised and the inputs are zeroes or normal numbers,
+| the host FPU computes exactly the same result as the code below, and the
+| only other flags that could be raised are overflow and underflow.  Results
+| that could have overflowed or underflowed (infinities, and anything not
+| bigger than the smallest normal number) are recomputed in software, so the
+| flags, the target's tininess rules and flush_to_zero are still honoured.
+| Invalid operations and division by zero never reach the host.  This needs
+| a host that evaluates float and double expressions in their own precision.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && !defined(__FAST_MATH__)
+#define USE_HARDFLOAT 1
+#else
+#define USE_HARDFLOAT 0
+#endif
+
+static inline bool can_use_hardfloat(float_status *status)
+{
+    return USE_HARDFLOAT
+        && status->float_rounding_mode == float_round_nearest_even
+        && (status->float_exception_flags & float_flag_inexact);
+}
+
+static inline bool float32_hard_input_ok(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+    return exp != 0xff && (exp != 0 || float32_is_zero(a));
+}
+
+static inline bool float64_hard_input_ok(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+
+    return exp != 0x7ff && (exp != 0 || float64_is_zero(a));
+}
+
+static inline float float32_to_host(float32 a)
+{
+    union { uint32_t i; float f; } u = { .i = float32_val(a) };
+    return u.f;
+}
+
+static inline float32 float32_from_host(float f)
+{
+    union { uint32_t i; float f; } u = { .f = f };
+    return make_float32(u.i);
+}
+
+static inline double float64_to_host(float64 a)
+{
+    union { uint64_t i; double d; } u = { .i = float64_val(a) };
+    return u.d;
+}
+
+static inline float64 float64_from_host(double d)
+{
+    union { uint64_t i; double d; } u = { .d = d };
+    return make_float64(u.i);
+}
+
+/* ZERO_OK says whether a zero result is known to be exact.  */
+static inline bool float32_hard_result_ok(float r, bool zero_ok)
+{
+    if (r == 0) {
+        return zero_ok;
+    }
+    return !isinf(r) && fabsf(r) > FLT_MIN;
+}
+
+static inline bool float64_hard_result_ok(double r, bool zero_ok)
+{
+    if (r == 0) {
+        return zero_ok;
+    }
+    return !isinf(r) && fabs(r) > DBL_MIN;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -2162,6 +2244,16 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 float32 float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (can_use_hardfloat(status)
+        && float32_hard_input_ok(a) && float32_hard_input_ok(b)) {
+        float r = float32_to_host(a) + float32_to_host(b);
+
+        if (likely(float32_hard_result_ok(r, true))) {
+            return float32_from_host(r);
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2185,6 +2277,16 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 float32 float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (can_use_hardfloat(status)
+        && float32_hard_input_ok(a) && float32_hard_input_ok(b)) {
+        float r = float32_to_host(a) - float32_to_host(b);
+
+        if (likely(float32_hard_result_ok(r, true))) {
+            return float32_from_host(r);
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2213,6 +2315,16 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (can_use_hardfloat(status)
+        && float32_hard_input_ok(a) && float32_hard_input_ok(b)) {
+        float r = float32_to_host(a) * float32_to_host(b);
+
+        if (likely(float32_hard_result_ok(r, float32_is_zero(a)
+                                              || float32_is_zero(b)))) {
+            return float32_from_host(r);
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2275,6 +2387,17 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+
+    if (can_use_hardfloat(status)
+        && float32_hard_input_ok(a) && float32_hard_input_ok(b)
+        && !float32_is_zero(b)) {
+        float r = float32_to_host(a) / float32_to_host(b);
+
+        if (likely(float32_hard_result_ok(r, float32_is_zero(a)))) {
+            return float32_from_host(r);
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2674,6 +2797,12 @@ float32 float32_sqrt(float32 a, float_status *status)
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+
+    if (can_use_hardfloat(status) && float32_hard_input_ok(a)
+        && (!float32_is_neg(a) || float32_is_zero(a))) {
+        return float32_from_host(sqrtf(float32_to_host(a)));
+    }
+
     a = float32_squash_input_denormal(a, status);
 
     aSig = extractFloat32Frac( a );
@@ -3948,6 +4077,16 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 float64 float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (can_use_hardfloat(status)
+        && float64_hard_input_ok(a) && float64_hard_input_ok(b)) {
+        double r = float64_to_host(a) + float64_to_host(b);
+
+        if (likely(float64_hard_result_ok(r, true))) {
+            return float64_from_host(r);
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3971,6 +4110,16 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 float64 float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (can_use_hardfloat(status)
+        && float64_hard_input_ok(a) && float64_hard_input_ok(b)) {
+        double r = float64_to_host(a) - float64_to_host(b);
+
+        if (likely(float64_hard_result_ok(r, true))) {
+            return float64_from_host(r);
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3997,6 +4146,16 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (can_use_hardfloat(status)
+        && float64_hard_input_ok(a) && float64_hard_input_ok(b)) {
+        double r = float64_to_host(a) * float64_to_host(b);
+
+        if (likely(float64_hard_result_ok(r, float64_is_zero(a)
+                                              || float64_is_zero(b)))) {
+            return float64_from_host(r);
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4061,6 +4220,17 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+
+    if (can_use_hardfloat(status)
+        && float64_hard_input_ok(a) && float64_hard_input_ok(b)
+        && !float64_is_zero(b)) {
+        double r = float64_to_host(a) / float64_to_host(b);
+
+        if (likely(float64_hard_result_ok(r, float64_is_zero(a)))) {
+            return float64_from_host(r);
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4473,6 +4643,12 @@ float64 float64_sqrt(float64 a, float_status *status)
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+
+    if (can_use_hardfloat(status) && float64_hard_input_ok(a)
+        && (!float64_is_neg(a) || float64_is_zero(a))) {
+        return float64_from_host(sqrt(float64_to_host(a)));
+    }
+
     a = float64_squash_input_denormal(a, status);
 
     aSig = extractFloat64Frac( a );
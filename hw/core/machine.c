@@ -31,6 +31,38 @@ static void machine_set_accel(Object *obj, const char *value, Error **errp)
     ms->accel = g_strdup(value);
 }
 
+static char *machine_get_tcg_thread(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return g_strdup(ms->tcg_thread);
+}
+
+static void machine_set_tcg_thread(Object *obj, const char *value,
+                                   Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    g_free(ms->tcg_thread);
+    ms->tcg_thread = g_strdup(value);
+}
+
+static char *machine_get_tb_cache(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return g_strdup(ms->tb_cache);
+}
+
+static void machine_set_tb_cache(Object *obj, const char *value,
+                                 Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    g_free(ms->tb_cache);
+    ms->tb_cache = g_strdup(value);
+}
+
 static void machine_set_kernel_irqchip(Object *obj, bool value, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -66,6 +98,37 @@ static void machine_set_kvm_shadow_mem(Object *obj, Visitor *v,
     ms->kvm_shadow_mem = value;
 }
 
+static void machine_get_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            void *opaque, const char *name,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    int64_t value = ms->kvm_dirty_ring_size;
+
+    visit_type_int(v, &value, name, errp);
+}
+
+static void machine_set_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            void *opaque, const char *name,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value < 0 || value > UINT32_MAX || (value & (value - 1))) {
+        error_setg(errp, "kvm-dirty-ring-size must be zero or a power of two");
+        return;
+    }
+
+    ms->kvm_dirty_ring_size = value;
+}
+
 static char *machine_get_kernel(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -341,6 +404,19 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "accel",
                                     "Accelerator list",
                                     NULL);
+    object_property_add_str(obj, "tcg-thread",
+                            machine_get_tcg_thread, machine_set_tcg_thread,
+                            NULL);
+    object_property_set_description(obj, "tcg-thread",
+                                    "TCG vCPU threading (single or multi)",
+                                    NULL);
+    object_property_add_str(obj, "tb-cache",
+                            machine_get_tb_cache, machine_set_tb_cache,
+                            NULL);
+    object_property_set_description(obj, "tb-cache",
+                                    "File caching translated code "
+                                    "across runs",
+                                    NULL);
     object_property_add_bool(obj, "kernel-irqchip",
                              NULL,
                              machine_set_kernel_irqchip,
@@ -355,6 +431,14 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "kvm-shadow-mem",
                                     "KVM shadow MMU size",
                                     NULL);
+    object_property_add(obj, "kvm-dirty-ring-size", "int",
+                        machine_get_kvm_dirty_ring_size,
+                        machine_set_kvm_dirty_ring_size,
+                        NULL, NULL, NULL);
+    object_property_set_description(obj, "kvm-dirty-ring-size",
+                                    "Entries in each vCPU's KVM dirty ring "
+                                    "(0 to use dirty bitmaps)",
+                                    NULL);
     object_property_add_str(obj, "kernel",
                             machine_get_kernel, machine_set_kernel, NULL);
     object_property_set_description(obj, "kernel",
@@ -448,6 +532,8 @@ static void machine_finalize(Object *obj)
     MachineState *ms = MACHINE(obj);
 
     g_free(ms->accel);
+    g_free(ms->tcg_thread);
+    g_free(ms->tb_cache);
     g_free(ms->kernel_filename);
     g_free(ms->initrd_filename);
     g_free(ms->kernel_cmdline);
@@ -482,6 +568,11 @@ int machine_kvm_shadow_mem(MachineState *machine)
     return machine->kvm_shadow_mem;
 }
 
+uint32_t machine_kvm_dirty_ring_size(MachineState *machine)
+{
+    return machine->kvm_dirty_ring_size;
+}
+
 int machine_phandle_start(MachineState *machine)
 {
     return machine->phandle_start;
@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -122,6 +123,34 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Number of AioHandlers without an io_poll callback.  Busy polling
+     * is only possible when this is zero, since otherwise events on
+     * those file descriptors would wait until polling times out.
+     */
+    int poll_disable_cnt;
+
+    /* Adaptive polling: aio_poll busy-polls for up to poll_ns before
+     * blocking.  poll_ns grows (by poll_grow, default 2) while events
+     * arrive shortly after the window would have ended and shrinks (by
+     * poll_shrink, or to 0 if that is 0) when waiting took longer than
+     * poll_max_ns.  poll_max_ns == 0 disables polling.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* With many handlers, aio_poll waits on an epoll set that is kept up
+     * to date by aio_set_fd_handler, instead of rebuilding the pollfds
+     * array every time.  epoll_available goes false for good if a file
+     * descriptor can't be added to the set.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /**
@@ -314,6 +343,44 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Give a file descriptor registered with aio_set_fd_handler a way to be
+ * checked without a system call.  While aio_poll busy-polls, @io_poll is
+ * called with the handler's opaque pointer instead of waiting for the
+ * file descriptor.  It should look for work cheaply (for example in a
+ * ring shared with the device or the kernel), process it and return
+ * true if it made progress.
+ *
+ * Removing the handler with aio_set_fd_handler also removes @io_poll.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll for an event notifier registered with
+ * aio_set_event_notifier.  @io_poll is called with @notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/* Set up and tear down the host-specific parts of an AioContext */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: factor to grow the polling time by, 0 for the default
+ * @shrink: factor to shrink the polling time by, 0 to stop polling
+ *          altogether after a long wait
+ *
+ * Busy polling can make aio_poll react to fast devices without the
+ * latency of going to sleep in ppoll() and being woken up again.  The
+ * polling time adapts itself between 0 and @max_ns to how long aio_poll
+ * has actually been waiting for events.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -167,8 +167,9 @@ static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial size of the physical TB hash table; it grows on demand */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -199,10 +200,9 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_INVALID     0x40000 /* TB has been invalidated or evicted */
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -227,19 +227,43 @@ struct TranslationBlock {
 };
 
 #include "qemu/thread.h"
+#include "qemu/qht.h"
+
+/* The code buffer is split into regions that are filled in turn.  When
+   the last one is full, the oldest region is evicted instead of flushing
+   the whole buffer.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct TBRegion TBRegion;
+
+struct TBRegion {
+    void *start;
+    void *end;              /* no TB may start at or beyond this point */
+    void *ptr;              /* end of the code, unless region is current */
+    TranslationBlock *tbs;  /* TBs whose code lives in this region */
+    int nb_tbs;
+};
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    struct qht htable;
     int nb_tbs;
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int region_max_tbs;
+    size_t region_size;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_evict_count;
+    unsigned long tb_evicted_tbs;
+    unsigned long tb_retranslate_count;
     int tb_phys_invalidate_count;
 
     int tb_invalidated_flag;
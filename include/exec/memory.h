@@ -212,6 +212,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -731,6 +732,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty logging in accelerators
+ *                                   for a range of a region
+ *
+ * Accelerators such as kvm can hand out their dirty log without resetting
+ * it, so that a page does not have to be write protected again until its
+ * user is about to read it.  Call this before copying pages that the last
+ * memory_region_sync_dirty_bitmap() reported dirty, so that writes made
+ * after the copy are logged.
+ *
+ * @mr: the region being updated.
+ * @start: the start of the subrange.
+ * @len: the size of the subrange.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
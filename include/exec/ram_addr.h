@@ -38,6 +38,12 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Chunks whose dirty log has to be re-armed, while migrating */
+    unsigned long *clear_bmap;
+    /* x-mapped-ram: pages written to the file, and where they are */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
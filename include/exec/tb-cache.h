@@ -0,0 +1,63 @@
+/*
+ * Persistent cache of translated blocks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_TB_CACHE_H
+#define EXEC_TB_CACHE_H
+
+#include "qemu-common.h"
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_SOFTMMU
+/* tb_cache_init, declared in qemu-common.h, opens the cache file.  Its
+   contents are read once the machine is created, because they are only
+   valid for the same machine type, CPU model and QEMU binary.  */
+
+/* Hash the guest page at PHYS_PC, which is part of the key of TB in the
+   cache.  Returns 0 without hashing if TB cannot be cached.  */
+uint64_t tb_cache_page_hash(CPUState *cpu, TranslationBlock *tb,
+                            tb_page_addr_t phys_pc);
+
+/* Try to fill TB, whose pc, cs_base, flags, cflags and tc_ptr are set,
+   from the cache.  On success the code has been copied to tc_ptr and
+   its size is stored in *CODE_SIZE.  */
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, uint64_t page_hash,
+                   int *code_size);
+
+/* Add TB, which has just been generated, to the cache.  */
+void tb_cache_save(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, uint64_t page_hash,
+                   int code_size);
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+#else
+static inline uint64_t tb_cache_page_hash(CPUState *cpu,
+                                          TranslationBlock *tb,
+                                          tb_page_addr_t phys_pc)
+{
+    return 0;
+}
+
+static inline bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                                 tb_page_addr_t phys_pc, uint64_t page_hash,
+                                 int *code_size)
+{
+    return false;
+}
+
+static inline void tb_cache_save(CPUState *cpu, TranslationBlock *tb,
+                                 tb_page_addr_t phys_pc, uint64_t page_hash,
+                                 int code_size)
+{
+}
+
+static inline void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+#endif
+
+#endif
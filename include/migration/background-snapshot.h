@@ -0,0 +1,48 @@
+/*
+ * Background snapshot: write protection of guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_BACKGROUND_SNAPSHOT_H
+#define QEMU_BACKGROUND_SNAPSHOT_H
+
+#include "qemu-common.h"
+#include "exec/cpu-common.h"
+
+struct RAMBlock;
+
+/* Return true if the host can write protect anonymous guest RAM */
+bool background_snapshot_supported_by_host(void);
+
+/*
+ * Fault in every page of guest RAM and register it for write protection
+ * faults.  Can run with the guest running; nothing is protected yet.
+ */
+int background_snapshot_prepare(void);
+
+/*
+ * Write protect all of guest RAM.  Must be called with the guest stopped,
+ * at the point in time the snapshot is taken of.
+ */
+int background_snapshot_protect(void);
+
+/*
+ * Return the block of the oldest page the guest is blocked writing to,
+ * and its offset in *offset, or NULL if there is none.  Doesn't wait.
+ * Called within an RCU critical section.
+ */
+struct RAMBlock *background_snapshot_get_fault(ram_addr_t *offset);
+
+/*
+ * Drop the write protection from 'length' bytes at 'offset' in 'rb' once
+ * they have been saved, waking up anything that was waiting to write.
+ */
+int background_snapshot_unprotect(struct RAMBlock *rb, ram_addr_t offset,
+                                  ram_addr_t length);
+
+/* Drop the remaining protection and stop tracking faults */
+void background_snapshot_cleanup(void);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Compression codecs for multithreaded RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+/*
+ * A codec compresses one page at a time.  Each compression or
+ * decompression thread keeps its own state, created by the setup hooks
+ * (which may be NULL for codecs that don't need any), and passes it to
+ * every call.
+ */
+struct MigrationCodec {
+    MigrationCompressMethod method;
+
+    /* Worst case compressed size of 'len' bytes */
+    size_t (*bound)(size_t len);
+
+    void *(*compress_setup)(void);
+    void (*compress_cleanup)(void *state);
+    /* Returns the compressed size, or -1 if it didn't fit in 'dst_len' */
+    ssize_t (*compress)(void *state, int level, uint8_t *dst, size_t dst_len,
+                        const uint8_t *src, size_t len);
+
+    void *(*decompress_setup)(void);
+    void (*decompress_cleanup)(void *state);
+    /* Returns the decompressed size, or -1 if the data is corrupted */
+    ssize_t (*decompress)(void *state, uint8_t *dst, size_t dst_len,
+                          const uint8_t *src, size_t len);
+};
+
+/* NULL if this build has no support for 'method' */
+const MigrationCodec *migration_codec_get(MigrationCompressMethod method);
+
+#endif
@@ -35,6 +35,7 @@
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
+#define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -42,6 +43,34 @@ struct MigrationParams {
     bool shared;
 };
 
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+
+    MIG_RP_MSG_MAX
+};
+
+/* Subcommands for QEMU_VM_COMMAND */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,       /* Must be 0 */
+    MIG_CMD_OPEN_RETURN_PATH,  /* Tell the dest to open the Return path */
+    MIG_CMD_POSTCOPY_ADVISE,   /* Prior to any page transfers, just
+                                  warn we might want to do PC */
+    MIG_CMD_POSTCOPY_LISTEN,   /* Start listening for incoming
+                                  pages as it's running. */
+    MIG_CMD_POSTCOPY_RUN,      /* Start execution */
+    MIG_CMD_POSTCOPY_RAM_DISCARD,  /* A list of pages to discard that
+                                      were previously sent during
+                                      precopy but are dirty. */
+    MIG_CMD_PACKAGED,          /* Send a wrapped stream within this stream */
+    MIG_CMD_MAX
+};
+
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 24)
+
 typedef struct MigrationState MigrationState;
 
 typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
@@ -50,6 +79,18 @@ typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
 struct MigrationIncomingState {
     QEMUFile *file;
 
+    /* Return path towards the source, opened on request of the source */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;    /* We send replies from multiple threads */
+
+    /* Postcopy: see postcopy-ram.c and savevm.c */
+    int userfault_fd;
+    int userfault_quit_fd;
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+    void *postcopy_tmp_page;
+
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
 };
@@ -57,6 +98,7 @@ struct MigrationIncomingState {
 MigrationIncomingState *migration_incoming_get_current(void);
 MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
 void migration_incoming_state_destroy(void);
+void migration_incoming_start_guest(void);
 
 struct MigrationState
 {
@@ -80,9 +122,46 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* Flag set once the migration has been asked to enter postcopy */
+    bool start_postcopy;
+
+    /* Background snapshot: device state saved when the snapshot started */
+    QEMUFile *snapshot_devices;
+
+    /* State of the return path from the destination */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool thread_created;
+        bool error;
+    } rp_state;
+
+    /*
+     * Opens multifd channel @id to the destination; set by transports
+     * that support multifd.  Called from the migration thread.
+     */
+    QEMUFile *(*multifd_connect)(MigrationState *s, int id, Error **errp);
+    /* Where multifd_connect connects to, for tcp: and unix: */
+    char *multifd_address;
+    /* The channels' file descriptors, for fd:; -1 once used */
+    int *multifd_fds;
+    int multifd_nr_fds;
 };
 
 void process_incoming_migration(QEMUFile *f);
+/*
+ * Hand a new incoming connection to the migration code: the first is the
+ * main stream, any following ones are multifd channels.  Returns true
+ * once no more connections are expected.
+ */
+bool migration_incoming_process_channel(QEMUFile *f);
+/*
+ * The listening socket of the incoming migration, kept open by tcp: and
+ * unix: while multifd channels may still connect.
+ */
+void migration_incoming_set_listener(int fd);
+void migration_incoming_close_listener(void);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -104,6 +183,11 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -119,7 +203,10 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+/* True if outgoing migration has entered postcopy phase */
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
+void migrate_generate_event(int new_state);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
@@ -143,9 +230,25 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+double compress_mig_compression_rate(void);
+double compress_mig_throughput(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+/* Postcopy RAM, see ram.c */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length);
+
+/* Multifd, see ram.c */
+void multifd_send_shutdown(void);
+void multifd_load_setup(void);
+void multifd_load_cleanup(void);
+bool multifd_recv_new_channel(QEMUFile *f);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -162,6 +265,8 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_zero_blocks(void);
 
+bool migrate_postcopy_ram(void);
+
 bool migrate_auto_converge(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
@@ -175,10 +280,23 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_cpu_throttle_initial(void);
+int migrate_cpu_throttle_increment(void);
+int migrate_bitmap_sync_threads(void);
+bool migrate_zero_copy_send(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
 bool migrate_use_events(void);
 
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
@@ -199,6 +317,14 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
 
 void ram_mig_init(void);
 void savevm_skip_section_footers(void);
+void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                              uint16_t len, uint8_t *data);
+int qemu_loadvm_get_command(QEMUFile *f, uint16_t *cmd, uint16_t *len);
+int qemu_loadvm_get_packaged(QEMUFile *f, QEMUSizedBuffer **qsb);
+int qemu_loadvm_get_discard_header(QEMUFile *f, uint16_t len, char *ramid,
+                                   uint16_t *count);
+void qemu_loadvm_get_discard_range(QEMUFile *f, uint64_t *start,
+                                   uint64_t *length);
 void register_global_state(void);
 void global_state_set_optional(void);
 void savevm_skip_configuration(void);
@@ -0,0 +1,63 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/migration.h"
+
+/* Incoming side: where the destination is in the postcopy protocol */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,    /* Source said we may enter postcopy */
+    POSTCOPY_INCOMING_DISCARD,   /* Receiving pages to throw away */
+    POSTCOPY_INCOMING_LISTENING, /* Listen thread owns the main stream */
+    POSTCOPY_INCOMING_RUNNING,   /* Guest has been started */
+    POSTCOPY_INCOMING_END
+} PostcopyState;
+
+PostcopyState postcopy_state_get(void);
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state);
+
+/* Return true if the host supports everything we need to do postcopy-ram */
+bool postcopy_ram_supported_by_host(void);
+
+/*
+ * Stop transparent huge pages from being assembled underneath the guest
+ * RAM while postcopy is possible; a huge page that gets filled in behind
+ * our back would hide pages that still have to come from the source.
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis);
+
+/*
+ * Discard the contents of 'length' bytes from 'start'; accesses to them
+ * will fault and be requested from the source.
+ */
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length);
+
+/*
+ * Register the guest RAM with userfaultfd and start the thread that
+ * turns faults into page requests on the return path.
+ */
+int postcopy_ram_enable_notify(MigrationIncomingState *mis);
+
+/*
+ * Atomically place a page received from the source, waking up anything
+ * waiting for it.  'from' must be a buffer of one host page.
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
+
+/* A page-sized buffer that incoming pages can be read into */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+
+/* Stop the fault thread and give the RAM back its normal behaviour */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
+
+#endif
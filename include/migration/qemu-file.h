@@ -96,6 +96,19 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
+
+/*
+ * Zero copy sending: once enabled, data queued with qemu_put_buffer_async
+ * is handed to writev_zero_copy, which may keep referencing it after it
+ * returns; flush_zero_copy waits until nothing is referenced any more.
+ */
+typedef int (QEMUFileEnableZeroCopyFunc)(void *opaque);
+typedef int (QEMUFileFlushZeroCopyFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -107,6 +120,10 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMURetPathFunc *get_return_path;
+    QEMUFileEnableZeroCopyFunc *enable_zero_copy;
+    QEMUFileWritevBufferFunc *writev_zero_copy;
+    QEMUFileFlushZeroCopyFunc *flush_zero_copy;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -163,7 +180,8 @@ void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_peek_buffer(QEMUFile *f, uint8_t **buf, int size, size_t offset);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+ssize_t qemu_put_compression_data(QEMUFile *f, const MigrationCodec *codec,
+                                  void *state, const uint8_t *p, size_t size,
                                   int level);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 /*
@@ -187,13 +205,19 @@ unsigned int qemu_get_be16(QEMUFile *f);
 unsigned int qemu_get_be32(QEMUFile *f);
 uint64_t qemu_get_be64(QEMUFile *f);
 
+int64_t qemu_file_get_offset(QEMUFile *f);
+int qemu_file_set_offset(QEMUFile *f, int64_t offset);
 int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
+int qemu_file_enable_zero_copy(QEMUFile *f);
+int qemu_file_flush_zero_copy(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
@@ -318,6 +318,8 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+/* Open the persistent TB cache in file 'path'; see exec/tb-cache.h */
+void tb_cache_init(const char *path, Error **errp);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -338,6 +340,7 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool safe;
 };
 
 
@@ -483,6 +486,9 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+#ifdef CONFIG_AVX2_OPT
+bool qemu_cpu_has_avx2(void);
+#endif
 
 /*
  * helper to parse debug environment variables
@@ -0,0 +1,70 @@
+/*
+ * Dirty page rings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DIRTY_RING_H
+#define QEMU_DIRTY_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A dirty ring is an array of entries filled in by a producer (KVM, for
+ * each vCPU) as pages get dirtied, and harvested by QEMU.  Harvesting
+ * flags the entries for reset; the producer only reuses them once it has
+ * been asked to recycle them (KVM_RESET_DIRTY_RINGS), and that is also
+ * when it write protects the pages again.  So collecting the dirty log
+ * costs in proportion to the number of dirty pages rather than to the
+ * size of guest memory.
+ *
+ * The entries have the layout of struct kvm_dirty_gfn.
+ */
+
+#define DIRTY_GFN_F_DIRTY   (1 << 0)
+#define DIRTY_GFN_F_RESET   (1 << 1)
+#define DIRTY_GFN_F_MASK    0x3
+
+typedef struct DirtyGfn {
+    uint32_t flags;
+    uint32_t slot;              /* (address space << 16) | slot id */
+    uint64_t offset;            /* page index inside the slot */
+} DirtyGfn;
+
+typedef struct DirtyRing {
+    DirtyGfn *gfns;
+    uint32_t size;              /* number of entries, a power of two */
+    uint32_t fetch_index;       /* next entry to harvest */
+} DirtyRing;
+
+typedef void DirtyRingFunc(void *opaque, uint32_t slot, uint64_t offset);
+
+/* Pass every dirty entry published so far to @func, in order, and flag
+ * them for reset.  Returns the number of entries harvested.  Several
+ * harvesters of one ring must be serialized by the caller.
+ */
+uint32_t dirty_ring_harvest(DirtyRing *ring, DirtyRingFunc *func,
+                            void *opaque);
+
+/* The producer side of a ring, with the same semantics as KVM's.  It
+ * stands in for the kernel where there is none, e.g. in unit tests.
+ */
+typedef struct DirtyRingProducer {
+    DirtyRing *ring;
+    uint32_t dirty_index;       /* next entry to fill */
+    uint32_t reset_index;       /* next entry to recycle */
+} DirtyRingProducer;
+
+/* Publish a dirty page.  Returns false if the ring is full, which is
+ * where a vCPU would exit with KVM_EXIT_DIRTY_RING_FULL.
+ */
+bool dirty_ring_push(DirtyRingProducer *p, uint32_t slot, uint64_t offset);
+
+/* Recycle the entries that were harvested, calling @reprotect for each
+ * of them.  Returns the number of entries recycled.
+ */
+uint32_t dirty_ring_reset(DirtyRingProducer *p, DirtyRingFunc *reprotect,
+                          void *opaque);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * QHT: a concurrent, resizable hash table
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "qemu/thread.h"
+
+/* Lookups are lock-free and only need to run inside an RCU read-side
+ * critical section, which the qht functions take themselves; callers of
+ * any qht function must therefore be registered with RCU.  Insertions and
+ * removals take a per-bucket spinlock, so writers to different buckets do
+ * not contend.  Resizing takes all the bucket locks and publishes the new
+ * bucket array with RCU.
+ *
+ * The table stores pointers together with a caller-provided 32-bit hash;
+ * it never dereferences the pointers.  NULL pointers cannot be stored,
+ * and the same pointer can be stored only once.
+ */
+
+struct qht {
+    struct qht_map *map;
+    QemuMutex lock; /* serializes setters of ht->map */
+    unsigned int mode;
+};
+
+/**
+ * struct qht_stats - statistics of a QHT
+ * @head_buckets: number of head buckets
+ * @used_head_buckets: number of non-empty head buckets
+ * @entries: total number of entries
+ * @chain_total: sum of the lengths, in buckets, of all non-empty chains
+ * @chain_max: length of the longest chain, in buckets
+ */
+struct qht_stats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    size_t chain_total;
+    size_t chain_max;
+};
+
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h, void *up);
+
+/* Grow the table when too many buckets have been chained to its heads */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+/**
+ * qht_init:
+ * @ht: QHT to be initialized
+ * @n_elems: number of entries the table should initially accommodate
+ * @mode: bitmask of QHT_MODE_* flags
+ */
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: QHT to be destroyed
+ *
+ * Frees the memory used by the table; the stored pointers are not freed.
+ */
+void qht_destroy(struct qht *ht);
+
+/**
+ * qht_insert:
+ * @ht: QHT to insert to
+ * @p: pointer to be inserted
+ * @hash: hash corresponding to @p
+ *
+ * Returns true on success, false if @p was already in the table.
+ */
+bool qht_insert(struct qht *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: QHT to be looked up
+ * @func: function to compare existing pointers against @userp
+ * @userp: pointer to pass to @func
+ * @hash: hash of the pointer to be looked up
+ *
+ * @func is called for every entry whose hash matches @hash, and may be
+ * called more than once for the same entry if the lookup races with a
+ * concurrent writer; it must not have side effects.
+ *
+ * Returns the matching pointer, or NULL if there is none.
+ */
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: QHT to remove from
+ * @p: pointer to be removed
+ * @hash: hash corresponding to @p
+ *
+ * Returns true on success, false if @p was not in the table.
+ */
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: QHT to reset
+ *
+ * Removes all entries from the table; its size is unchanged.
+ */
+void qht_reset(struct qht *ht);
+
+/**
+ * qht_reset_size:
+ * @ht: QHT to reset and resize
+ * @n_elems: number of entries the table should accommodate
+ *
+ * Removes all entries and, if needed, resizes the table for @n_elems.
+ *
+ * Returns true if the table was resized.
+ */
+bool qht_reset_size(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_resize:
+ * @ht: QHT to resize
+ * @n_elems: number of entries the table should accommodate
+ *
+ * Returns true if the table was resized.
+ */
+bool qht_resize(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_iter:
+ * @ht: QHT to iterate over
+ * @func: function to be called for each entry
+ * @userp: additional pointer to pass to @func
+ *
+ * Writers are blocked for the whole iteration, so @func must not insert
+ * into or remove from @ht.
+ */
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
+
+/**
+ * qht_statistics:
+ * @ht: QHT to examine
+ * @stats: pointer to the struct to be filled in
+ *
+ * The statistics are a snapshot and may be slightly off if writers run
+ * concurrently.
+ */
+void qht_statistics(struct qht *ht, struct qht_stats *stats);
+
+#endif /* QEMU_QHT_H */
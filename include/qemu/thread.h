@@ -3,12 +3,14 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include "qemu/atomic.h"
 
 typedef struct QemuMutex QemuMutex;
 typedef struct QemuCond QemuCond;
 typedef struct QemuSemaphore QemuSemaphore;
 typedef struct QemuEvent QemuEvent;
 typedef struct QemuThread QemuThread;
+typedef struct QemuSpin QemuSpin;
 
 #ifdef _WIN32
 #include "qemu/thread-win32.h"
@@ -58,6 +60,36 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/* A busy-waiting lock, only suitable for very short critical sections
+ * that never sleep.  */
+struct QemuSpin {
+    int value;
+};
+
+static inline void qemu_spin_init(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
+static inline void qemu_spin_lock(QemuSpin *spin)
+{
+    while (__sync_lock_test_and_set(&spin->value, true)) {
+        while (atomic_read(&spin->value)) {
+            /* spin on a plain read to keep the cache line shared */
+        }
+    }
+}
+
+static inline bool qemu_spin_locked(QemuSpin *spin)
+{
+    return atomic_read(&spin->value);
+}
+
+static inline void qemu_spin_unlock(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
 void qemu_thread_atexit_remove(struct Notifier *notifier);
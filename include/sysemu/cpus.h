@@ -1,6 +1,8 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qapi/error.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
@@ -14,6 +16,8 @@ void cpu_clean_all_dirty(void);
 
 void qtest_clock_warp(int64_t dest);
 
+void qemu_tcg_configure(const char *thread_mode, Error **errp);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -34,6 +34,8 @@
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/dirty-ring.h"
+#include "qemu/bitmap.h"
 #include "trace.h"
 #include "hw/irq.h"
 
@@ -59,6 +61,9 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Address spaces a slot id can refer to: memory, and SMRAM on x86 */
+#define KVM_MAX_AS              2
+
 struct KVMState
 {
     AccelState parent_obj;
@@ -95,8 +100,18 @@ struct KVMState
     bool direct_msi;
 #endif
     KVMMemoryListener memory_listener;
+    KVMMemoryListener *as_listeners[KVM_MAX_AS];
+    /* Entries in each vCPU's dirty ring, or 0 when using dirty bitmaps */
+    uint32_t dirty_ring_size;
+    /* KVM_GET_DIRTY_LOG leaves the pages writable; see kvm_log_clear */
+    bool manual_dirty_log_protect;
 };
 
+/* Protects the slots of all KVMMemoryListeners and their dirty bitmaps,
+ * which the migration thread uses through kvm_log_clear.
+ */
+static QemuMutex kml_slots_lock;
+
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
 bool kvm_async_interrupts_allowed;
@@ -273,6 +288,22 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        DirtyRing *ring = g_new0(DirtyRing, 1);
+
+        ring->size = s->dirty_ring_size;
+        ring->gfns = mmap(NULL, s->dirty_ring_size * sizeof(DirtyGfn),
+                          PROT_READ | PROT_WRITE, MAP_SHARED, cpu->kvm_fd,
+                          getpagesize() * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (ring->gfns == MAP_FAILED) {
+            ret = -errno;
+            g_free(ring);
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        cpu->kvm_dirty_ring = ring;
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -309,6 +340,10 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
         return 0;
     }
 
+    /* Whatever was read from the log before does not apply any more */
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+
     return kvm_set_user_memory_region(kml, mem);
 }
 
@@ -337,7 +372,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
@@ -354,7 +391,9 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
@@ -373,12 +412,127 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+static void kvm_dirty_ring_mark_page(void *opaque, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    KVMState *s = opaque;
+    uint32_t as_id = slot_id >> 16;
+    KVMSlot *mem;
+
+    slot_id &= 0xffff;
+    if (as_id >= KVM_MAX_AS || !s->as_listeners[as_id] ||
+        slot_id >= s->nr_slots) {
+        return;
+    }
+    mem = &s->as_listeners[as_id]->slots[slot_id];
+    if (offset >= mem->memory_size / getpagesize()) {
+        /* The slot went away since */
+        return;
+    }
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * getpagesize(),
+                                        getpagesize(), DIRTY_CLIENTS_NOCODE);
+}
+
+/*
+ * Collect the pages listed in the dirty rings of all vCPUs and let KVM
+ * recycle the entries, write protecting those pages again.
+ *
+ * Pages that are still in a vCPU's hardware log (e.g. Intel PML) reach
+ * its ring when it next exits; in particular they are all in the rings
+ * once the VM is stopped.
+ *
+ * Called with the iothread lock and kml_slots_lock held.
+ */
+static uint32_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint32_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_ring) {
+            total += dirty_ring_harvest(cpu->kvm_dirty_ring,
+                                        kvm_dirty_ring_mark_page, s);
+        }
+    }
+    if (total) {
+        kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+    }
+    trace_kvm_dirty_ring_reap(total);
+    return total;
+}
+
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    qemu_mutex_lock(&kml_slots_lock);
+    kvm_dirty_ring_reap_locked(s);
+    qemu_mutex_unlock(&kml_slots_lock);
+}
+
+/*
+ * Re-arm dirty logging for the pages of @mem in [@start, @start + @size),
+ * offsets from the start of the slot, that the last KVM_GET_DIRTY_LOG
+ * reported.  KVM wants the first page aligned to 64 and whole 64-bit words
+ * of bitmap, so the range is widened; that is harmless, because whatever
+ * is in dirty_bmap has already been copied to the dirty memory bitmaps.
+ *
+ * Called with kml_slots_lock held.
+ */
+static int kvm_log_clear_one_slot(KVMMemoryListener *kml, KVMSlot *mem,
+                                  uint64_t start, uint64_t size)
+{
+    KVMState *s = kvm_state;
+    uint64_t psize = getpagesize();
+    uint64_t slot_pages = mem->memory_size / psize;
+    uint64_t start_page, end_page;
+    struct kvm_clear_dirty_log d = {};
+    int ret;
+
+    if (!mem->dirty_bmap) {
+        /* Nothing was read from the log since logging (re)started */
+        return 0;
+    }
+
+    start_page = (start / psize) & ~63ULL;
+    end_page = MIN(ROUND_UP(DIV_ROUND_UP(start + size, psize), 64),
+                   slot_pages);
+    if (start_page >= end_page) {
+        return 0;
+    }
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    d.first_page = start_page;
+    d.num_pages = end_page - start_page;
+    d.dirty_bitmap = mem->dirty_bmap + start_page / BITS_PER_LONG;
+    ret = kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0) {
+        DPRINTF("KVM_CLEAR_DIRTY_LOG failed %d\n", ret);
+        return ret;
+    }
+
+    /* A second clear of the same pages before the next sync must not
+     * drop writes that happened in between.
+     */
+    bitmap_clear(mem->dirty_bmap, start_page, end_page - start_page);
+    trace_kvm_log_clear(mem->slot, start_page, end_page - start_page);
+    return 0;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection the pages stay writable, and are only
+ * protected again by kvm_log_clear when the user of the log is about to
+ * copy them.  Regions that migration is not logging have no such user, so
+ * their log is re-armed straight away.
+ *
+ * With dirty rings, all rings are harvested instead.
+ *
+ * Called with kml_slots_lock held.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -386,14 +540,21 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    bool lazy_clear = s->manual_dirty_log_protect &&
+        (memory_region_get_dirty_log_mask(section->mr) &
+         (1 << DIRTY_MEMORY_MIGRATION));
+
+    if (s->dirty_ring_size) {
+        kvm_dirty_ring_reap_locked(s);
+        return 0;
+    }
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -414,14 +575,12 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (!mem->dirty_bmap) {
+            /* Kept with the slot, kvm_log_clear needs it later */
+            mem->dirty_bmap = g_malloc0(size);
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
@@ -430,9 +589,14 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        if (s->manual_dirty_log_protect && !lazy_clear) {
+            ret = kvm_log_clear_one_slot(kml, mem, 0, mem->memory_size);
+            if (ret < 0) {
+                break;
+            }
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -636,6 +800,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = int128_get64(section->size);
     void *ram = NULL;
+    ram_addr_t ram_start_offset;
     unsigned delta;
 
     /* kvm works in page size chunks, but the function may be called
@@ -664,6 +829,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     }
 
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region + delta;
+    ram_start_offset = mr->ram_addr + section->offset_within_region + delta;
 
     while (1) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, start_addr + size);
@@ -688,6 +854,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -709,6 +877,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = old.memory_size;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -720,6 +889,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
             start_addr += old.memory_size;
             ram += old.memory_size;
+            ram_start_offset += old.memory_size;
             size -= old.memory_size;
             continue;
         }
@@ -730,6 +900,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = start_addr - old.start_addr;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags =  kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -754,6 +925,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             size_delta = mem->start_addr - old.start_addr;
             mem->memory_size = old.memory_size - size_delta;
             mem->ram = old.ram + size_delta;
+            mem->ram_start_offset = old.ram_start_offset + size_delta;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -776,6 +948,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem);
@@ -792,7 +965,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kml_slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kml_slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -800,7 +975,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kml_slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kml_slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -810,12 +987,48 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    hwaddr slot_start, slot_end;
+    KVMSlot *mem;
+    int i, r = 0;
+
+    if (!s->manual_dirty_log_protect) {
+        /* KVM_GET_DIRTY_LOG or the ring reset did it already */
+        return;
+    }
+
+    qemu_mutex_lock(&kml_slots_lock);
+    for (i = 0; i < s->nr_slots && r >= 0; i++) {
+        mem = &kml->slots[i];
+        slot_start = MAX(start, mem->start_addr);
+        slot_end = MIN(end, mem->start_addr + mem->memory_size);
+        if (slot_start < slot_end) {
+            r = kvm_log_clear_one_slot(kml, mem, slot_start - mem->start_addr,
+                                       slot_end - slot_start);
+        }
+    }
+    qemu_mutex_unlock(&kml_slots_lock);
+    if (r < 0) {
+        fprintf(stderr, "%s: error clearing dirty log: %s\n",
+                __func__, strerror(-r));
+        abort();
+    }
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -892,6 +1105,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_AS);
+    s->as_listeners[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -902,6 +1117,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1451,6 +1667,7 @@ static int kvm_init(MachineState *ms)
     int ret;
     int type = 0;
     const char *kvm_type;
+    uint32_t ring_size;
 
     s = KVM_STATE(ms->accelerator);
 
@@ -1624,6 +1841,42 @@ static int kvm_init(MachineState *ms)
     kvm_vm_attributes_allowed =
         (kvm_check_extension(s, KVM_CAP_VM_ATTRIBUTES) > 0);
 
+    qemu_mutex_init(&kml_slots_lock);
+
+    /* Both have to be set up before any slot or vCPU is created */
+    ring_size = machine_kvm_dirty_ring_size(ms);
+    if (ring_size) {
+        uint64_t ring_bytes = (uint64_t)ring_size * sizeof(struct kvm_dirty_gfn);
+        int max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+
+        QEMU_BUILD_BUG_ON(sizeof(DirtyGfn) != sizeof(struct kvm_dirty_gfn));
+        if (max_bytes <= 0) {
+            ret = -EINVAL;
+            fprintf(stderr, "kvm does not support dirty rings\n");
+            goto err;
+        }
+        if (ring_bytes < getpagesize() || ring_bytes > max_bytes) {
+            ret = -EINVAL;
+            fprintf(stderr, "kvm-dirty-ring-size must be between %d and %d\n",
+                    (int)(getpagesize() / sizeof(struct kvm_dirty_gfn)),
+                    (int)(max_bytes / sizeof(struct kvm_dirty_gfn)));
+            goto err;
+        }
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+        if (ret < 0) {
+            fprintf(stderr, "Enabling the KVM dirty ring failed: %s\n",
+                    strerror(-ret));
+            goto err;
+        }
+        s->dirty_ring_size = ring_size;
+    } else if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) &
+               KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+        /* Not fatal, KVM_GET_DIRTY_LOG keeps protecting pages itself */
+        s->manual_dirty_log_protect = ret == 0;
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1866,6 +2119,13 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* KVM is waiting for some entries to be harvested and reset */
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request();
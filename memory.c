@@ -1473,6 +1473,57 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection mrs;
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    hwaddr sec_start, sec_end, sec_size;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!listener->log_clear) {
+            continue;
+        }
+        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+            if (listener->address_space_filter &&
+                listener->address_space_filter != as) {
+                continue;
+            }
+            view = address_space_get_flatview(as);
+            FOR_EACH_FLAT_RANGE(fr, view) {
+                if (fr->mr != mr) {
+                    continue;
+                }
+
+                /* Only the part of the range that this FlatRange maps */
+                sec_start = MAX(fr->offset_in_region, start);
+                sec_end = MIN(fr->offset_in_region +
+                              int128_get64(fr->addr.size), start + len);
+                if (sec_start >= sec_end) {
+                    continue;
+                }
+                sec_size = sec_end - sec_start;
+
+                mrs = (MemoryRegionSection) {
+                    .mr = mr,
+                    .address_space = as,
+                    .offset_within_region = sec_start,
+                    .size = int128_make64(sec_size),
+                    .offset_within_address_space =
+                        int128_get64(fr->addr.start) +
+                        sec_start - fr->offset_in_region,
+                    .readonly = fr->readonly,
+                };
+                listener->log_clear(listener, &mrs);
+            }
+            flatview_unref(view);
+        }
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -0,0 +1,356 @@
+/*
+ * Background snapshot: write protection of guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * A background snapshot saves the guest as it was at one point in time
+ * without keeping it stopped while its RAM is written out.  At that point
+ * all of guest RAM is write protected with userfaultfd; a vCPU that then
+ * writes to a page blocks until the migration thread has saved the page
+ * and lifted the protection, so every page is saved with the contents it
+ * had when the snapshot was taken.
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/background-snapshot.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu_queue.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+#if defined(__linux__)
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <asm/types.h> /* for __u64 */
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+
+static int snapshot_ufd = -1;
+
+static bool ufd_wp_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("background snapshot: UFFDIO_API failed: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    if (!(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        error_report("background snapshot: userfault write protection "
+                     "is not supported by the host kernel");
+        return false;
+    }
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        return false;
+    }
+
+    return true;
+}
+
+static int ufd_register_wp(int ufd, void *start, uint64_t len)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)start;
+    reg_struct.range.len = len;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: write protection not available for this memory",
+                     __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ufd_change_protection(int ufd, void *start, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)start;
+    wp_struct.range.len = len;
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        error_report("%s: %s at %p+%" PRIx64 ": %s", __func__,
+                     wp ? "protect" : "unprotect", start, len,
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+bool background_snapshot_supported_by_host(void)
+{
+    long pagesize = getpagesize();
+    int ufd = -1;
+    bool ret = false; /* Error unless we change it */
+    void *testarea = NULL;
+    struct uffdio_range range_struct;
+
+    /* Pages are saved and unprotected one target page at a time */
+    if (TARGET_PAGE_SIZE != pagesize) {
+        error_report("Target page size %d doesn't match host page size %ld",
+                     TARGET_PAGE_SIZE, pagesize);
+        goto out;
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+
+    if (!ufd_wp_version_check(ufd)) {
+        goto out;
+    }
+
+    /* Check write protection is available for anonymous memory */
+    testarea = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                    MAP_ANONYMOUS, -1, 0);
+    if (testarea == MAP_FAILED) {
+        error_report("%s: Failed to map test area: %s", __func__,
+                     strerror(errno));
+        testarea = NULL;
+        goto out;
+    }
+
+    if (ufd_register_wp(ufd, testarea, pagesize)) {
+        goto out;
+    }
+
+    range_struct.start = (uintptr_t)testarea;
+    range_struct.len = pagesize;
+    if (ioctl(ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s userfault unregister: %s", __func__, strerror(errno));
+        goto out;
+    }
+
+    ret = true;
+out:
+    if (testarea) {
+        munmap(testarea, pagesize);
+    }
+    if (ufd != -1) {
+        close(ufd);
+    }
+    return ret;
+}
+
+int background_snapshot_prepare(void)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    snapshot_ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (snapshot_ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    if (!ufd_wp_version_check(snapshot_ufd)) {
+        ret = -1;
+        goto out;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t offset;
+
+        if (block->fd >= 0) {
+            error_report("Background snapshot does not support file backed "
+                         "RAM '%s'", block->idstr);
+            ret = -1;
+            break;
+        }
+
+        /*
+         * Only pages that are mapped can be write protected: a page the
+         * guest has never touched would be filled in on the first write
+         * without us noticing.  Reading it maps the shared zero page.
+         */
+        for (offset = 0; offset < block->used_length;
+             offset += qemu_real_host_page_size) {
+            (void)*(volatile uint8_t *)(block->host + offset);
+        }
+
+        ret = ufd_register_wp(snapshot_ufd, block->host, block->used_length);
+        if (ret) {
+            break;
+        }
+        trace_background_snapshot_prepare(block->idstr, block->used_length);
+    }
+    rcu_read_unlock();
+
+out:
+    if (ret) {
+        background_snapshot_cleanup();
+    }
+    return ret;
+}
+
+int background_snapshot_protect(void)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ret = ufd_change_protection(snapshot_ufd, block->host,
+                                    block->used_length, true);
+        if (ret) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/* Called within an RCU critical section */
+static RAMBlock *snapshot_block_from_host(uint8_t *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (host >= block->host && host < block->host + block->used_length) {
+            *offset = host - block->host;
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+RAMBlock *background_snapshot_get_fault(ram_addr_t *offset)
+{
+    struct uffd_msg msg;
+    RAMBlock *rb;
+    int ret;
+
+    if (snapshot_ufd == -1) {
+        return NULL;
+    }
+
+    while (true) {
+        ret = read(snapshot_ufd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+                error_report("%s: Failed to read userfault message: %s",
+                             __func__, strerror(errno));
+            }
+            return NULL;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rb = snapshot_block_from_host(
+                 (uint8_t *)(uintptr_t)msg.arg.pagefault.address, offset);
+        if (!rb) {
+            error_report("%s: Fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            continue;
+        }
+
+        *offset &= TARGET_PAGE_MASK;
+        trace_background_snapshot_get_fault(rb->idstr, *offset);
+        return rb;
+    }
+}
+
+int background_snapshot_unprotect(RAMBlock *rb, ram_addr_t offset,
+                                  ram_addr_t length)
+{
+    if (snapshot_ufd == -1) {
+        return 0;
+    }
+    return ufd_change_protection(snapshot_ufd, rb->host + offset, length,
+                                 false);
+}
+
+void background_snapshot_cleanup(void)
+{
+    RAMBlock *block;
+
+    if (snapshot_ufd == -1) {
+        return;
+    }
+
+    /* Unregistering wakes up anything still blocked on a protected page */
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        struct uffdio_range range_struct;
+
+        range_struct.start = (uintptr_t)block->host;
+        range_struct.len = block->used_length;
+        ioctl(snapshot_ufd, UFFDIO_UNREGISTER, &range_struct);
+    }
+    rcu_read_unlock();
+
+    close(snapshot_ufd);
+    snapshot_ufd = -1;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool background_snapshot_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int background_snapshot_prepare(void)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+int background_snapshot_protect(void)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+RAMBlock *background_snapshot_get_fault(ram_addr_t *offset)
+{
+    return NULL;
+}
+
+int background_snapshot_unprotect(RAMBlock *rb, ram_addr_t offset,
+                                  ram_addr_t length)
+{
+    return 0;
+}
+
+void background_snapshot_cleanup(void)
+{
+}
+#endif
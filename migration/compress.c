@@ -0,0 +1,161 @@
+/*
+ * Compression codecs for multithreaded RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu-common.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "migration/compress.h"
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static ssize_t zlib_compress(void *state, int level, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src, size_t len)
+{
+    uLongf blen = dst_len;
+
+    if (compress2(dst, &blen, src, len, level) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t zlib_decompress(void *state, uint8_t *dst, size_t dst_len,
+                               const uint8_t *src, size_t len)
+{
+    uLongf blen = dst_len;
+
+    if (uncompress(dst, &blen, src, len) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static const MigrationCodec zlib_codec = {
+    .method = MIGRATION_COMPRESS_METHOD_ZLIB,
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_LZ4
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(void *state, int level, uint8_t *dst,
+                            size_t dst_len, const uint8_t *src, size_t len)
+{
+    int ret;
+
+    ret = LZ4_compress_default((const char *)src, (char *)dst, len, dst_len);
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(void *state, uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t len)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe((const char *)src, (char *)dst, len, dst_len);
+    return ret >= 0 ? ret : -1;
+}
+
+static const MigrationCodec lz4_codec = {
+    .method = MIGRATION_COMPRESS_METHOD_LZ4,
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+#ifdef CONFIG_ZSTD
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+/* Reusing the contexts saves allocating several hundred KB per page */
+static void *zstd_compress_setup(void)
+{
+    return ZSTD_createCCtx();
+}
+
+static void zstd_compress_cleanup(void *state)
+{
+    ZSTD_freeCCtx(state);
+}
+
+static ssize_t zstd_compress(void *state, int level, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src, size_t len)
+{
+    size_t ret;
+
+    ret = ZSTD_compressCCtx(state, dst, dst_len, src, len, level);
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static void *zstd_decompress_setup(void)
+{
+    return ZSTD_createDCtx();
+}
+
+static void zstd_decompress_cleanup(void *state)
+{
+    ZSTD_freeDCtx(state);
+}
+
+static ssize_t zstd_decompress(void *state, uint8_t *dst, size_t dst_len,
+                               const uint8_t *src, size_t len)
+{
+    size_t ret;
+
+    ret = ZSTD_decompressDCtx(state, dst, dst_len, src, len);
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static const MigrationCodec zstd_codec = {
+    .method = MIGRATION_COMPRESS_METHOD_ZSTD,
+    .bound = zstd_bound,
+    .compress_setup = zstd_compress_setup,
+    .compress_cleanup = zstd_compress_cleanup,
+    .compress = zstd_compress,
+    .decompress_setup = zstd_decompress_setup,
+    .decompress_cleanup = zstd_decompress_cleanup,
+    .decompress = zstd_decompress,
+};
+#endif
+
+static const MigrationCodec *const migration_codecs[] = {
+    &zlib_codec,
+#ifdef CONFIG_LZ4
+    &lz4_codec,
+#endif
+#ifdef CONFIG_ZSTD
+    &zstd_codec,
+#endif
+};
+
+const MigrationCodec *migration_codec_get(MigrationCompressMethod method)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(migration_codecs); i++) {
+        if (migration_codecs[i]->method == method) {
+            return migration_codecs[i];
+        }
+    }
+    return NULL;
+}
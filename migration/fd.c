@@ -14,6 +14,7 @@
  */
 
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "migration/migration.h"
@@ -42,47 +43,133 @@ static bool fd_is_socket(int fd)
     return S_ISSOCK(stat.st_mode);
 }
 
-void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp)
+static QEMUFile *fd_open(int fd, const char *mode)
 {
-    int fd = monitor_get_fd(cur_mon, fdname, errp);
+    if (fd_is_socket(fd)) {
+        return qemu_fopen_socket(fd, mode);
+    }
+    return qemu_fdopen(fd, mode);
+}
+
+static QEMUFile *fd_multifd_connect(MigrationState *s, int id, Error **errp)
+{
+    QEMUFile *f;
+
+    if (id >= s->multifd_nr_fds) {
+        error_setg(errp, "multifd channel %d has no file descriptor; pass "
+                   "one per channel after the main one, as fd:main,fd1,...",
+                   id);
+        return NULL;
+    }
+    f = fd_open(s->multifd_fds[id], "wb");
+    if (f) {
+        s->multifd_fds[id] = -1;
+    } else {
+        error_setg_errno(errp, errno, "failed to open multifd channel %d", id);
+    }
+    return f;
+}
+
+/*
+ * @fdnames is the name of the main stream's fd, optionally followed by a
+ * comma separated list of the fds used by the multifd channels.
+ */
+void fd_start_outgoing_migration(MigrationState *s, const char *fdnames, Error **errp)
+{
+    gchar **names = g_strsplit(fdnames, ",", 0);
+    int nr_names = g_strv_length(names);
+    int fd;
+    int i;
+
+    fd = monitor_get_fd(cur_mon, names[0], errp);
     if (fd == -1) {
+        g_strfreev(names);
         return;
     }
 
-    if (fd_is_socket(fd)) {
-        s->file = qemu_fopen_socket(fd, "wb");
-    } else {
-        s->file = qemu_fdopen(fd, "wb");
+    if (nr_names > 1) {
+        s->multifd_fds = g_new(int, nr_names - 1);
+        for (i = 1; i < nr_names; i++) {
+            s->multifd_fds[i - 1] = monitor_get_fd(cur_mon, names[i], errp);
+            if (s->multifd_fds[i - 1] == -1) {
+                while (--i >= 1) {
+                    close(s->multifd_fds[i - 1]);
+                }
+                g_free(s->multifd_fds);
+                s->multifd_fds = NULL;
+                close(fd);
+                g_strfreev(names);
+                return;
+            }
+        }
+        s->multifd_nr_fds = nr_names - 1;
     }
+    s->multifd_connect = fd_multifd_connect;
+    g_strfreev(names);
 
+    s->file = fd_open(fd, "wb");
     migrate_fd_connect(s);
 }
 
+typedef struct {
+    QEMUFile *file;
+    /* The multifd channels, handed over once the main stream is going */
+    int *channel_fds;
+    int nr_channels;
+} FdIncoming;
+
 static void fd_accept_incoming_migration(void *opaque)
 {
-    QEMUFile *f = opaque;
+    FdIncoming *fi = opaque;
+    int i;
 
-    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
-    process_incoming_migration(f);
+    qemu_set_fd_handler(qemu_get_fd(fi->file), NULL, NULL, NULL);
+    migration_incoming_process_channel(fi->file);
+
+    for (i = 0; i < fi->nr_channels; i++) {
+        QEMUFile *f = fd_open(fi->channel_fds[i], "rb");
+
+        if (f == NULL) {
+            error_report("failed to open multifd channel fd %d",
+                         fi->channel_fds[i]);
+            close(fi->channel_fds[i]);
+            continue;
+        }
+        migration_incoming_process_channel(f);
+    }
+    g_free(fi->channel_fds);
+    g_free(fi);
 }
 
-void fd_start_incoming_migration(const char *infd, Error **errp)
+/*
+ * @infds is the main stream's fd, optionally followed by a comma
+ * separated list of the fds of the multifd channels.
+ */
+void fd_start_incoming_migration(const char *infds, Error **errp)
 {
+    gchar **fds = g_strsplit(infds, ",", 0);
+    FdIncoming *fi;
     int fd;
-    QEMUFile *f;
+    int i;
 
     DPRINTF("Attempting to start an incoming migration via fd\n");
 
-    fd = strtol(infd, NULL, 0);
-    if (fd_is_socket(fd)) {
-        f = qemu_fopen_socket(fd, "rb");
-    } else {
-        f = qemu_fdopen(fd, "rb");
-    }
-    if(f == NULL) {
+    fi = g_new0(FdIncoming, 1);
+    fd = strtol(fds[0], NULL, 0);
+    fi->file = fd_open(fd, "rb");
+    if (fi->file == NULL) {
         error_setg_errno(errp, errno, "failed to open the source descriptor");
+        g_free(fi);
+        g_strfreev(fds);
         return;
     }
 
-    qemu_set_fd_handler(fd, fd_accept_incoming_migration, NULL, f);
+    fi->nr_channels = g_strv_length(fds) - 1;
+    fi->channel_fds = g_new(int, fi->nr_channels);
+    for (i = 0; i < fi->nr_channels; i++) {
+        fi->channel_fds[i] = strtol(fds[i + 1], NULL, 0);
+    }
+    g_strfreev(fds);
+
+    qemu_set_fd_handler(fd, fd_accept_incoming_migration, NULL, fi);
 }
@@ -0,0 +1,68 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "trace.h"
+
+/*
+ * Unlike exec:cat, a file: target is seekable, which the x-mapped-ram
+ * capability needs to write every page at its own offset.
+ */
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    trace_file_start_outgoing_migration(path);
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    s->file = qemu_fdopen(fd, "wb");
+    if (s->file == NULL) {
+        close(fd);
+        error_setg(errp, "failed to open the migration file");
+        return;
+    }
+
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFile *f;
+    int fd;
+
+    trace_file_start_incoming_migration(path);
+    fd = qemu_open(path, O_RDONLY);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        close(fd);
+        error_setg(errp, "failed to open the migration file");
+        return;
+    }
+
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
@@ -18,6 +18,8 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/postcopy-ram.h"
+#include "migration/background-snapshot.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
@@ -29,6 +31,8 @@
 #include "trace.h"
 #include "qapi/util.h"
 #include "qapi-event.h"
+#include "qom/cpu.h"
+#include "migration/compress.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
@@ -44,6 +48,13 @@
 #define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
 /*0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Default number of multifd channels */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Define default autoconverge cpu throttle migration parameters */
+#define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
+#define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Threads merging the dirty log, the migration thread included */
+#define DEFAULT_MIGRATE_BITMAP_SYNC_THREADS 4
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -71,6 +82,16 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
         .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                 DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+                DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
+        .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+                DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                MIGRATION_COMPRESS_METHOD_ZLIB,
+        .parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS] =
+                DEFAULT_MIGRATE_BITMAP_SYNC_THREADS,
     };
 
     return &current_migration;
@@ -89,12 +110,22 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     mis_current = g_malloc0(sizeof(MigrationIncomingState));
     mis_current->file = f;
     QLIST_INIT(&mis_current->loadvm_handlers);
+    qemu_mutex_init(&mis_current->rp_mutex);
 
     return mis_current;
 }
 
 void migration_incoming_state_destroy(void)
 {
+    postcopy_ram_incoming_cleanup(mis_current);
+    postcopy_state_set(POSTCOPY_INCOMING_NONE);
+
+    if (mis_current->to_src_file) {
+        qemu_fclose(mis_current->to_src_file);
+        mis_current->to_src_file = NULL;
+    }
+    qemu_mutex_destroy(&mis_current->rp_mutex);
+
     loadvm_free_handlers(mis_current);
     g_free(mis_current);
     mis_current = NULL;
@@ -220,7 +251,7 @@ void register_global_state(void)
     vmstate_register(NULL, 0, &vmstate_globalstate, &global_state);
 }
 
-static void migrate_generate_event(int new_state)
+void migrate_generate_event(int new_state)
 {
     if (migrate_use_events()) {
         qapi_event_send_migration(new_state, &error_abort);
@@ -260,40 +291,87 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
 }
 
-static void process_incoming_migration_co(void *opaque)
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
 {
-    QEMUFile *f = opaque;
-    Error *local_err = NULL;
-    int ret;
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
 
-    migration_incoming_state_new(f);
-    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
-    ret = qemu_loadvm_state(f);
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
 
-    qemu_fclose(f);
-    free_xbzrle_decoded_buf();
-    migration_incoming_state_destroy();
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
 
-    if (ret < 0) {
-        migrate_generate_event(MIGRATION_STATUS_FAILED);
-        error_report("load of migration failed: %s", strerror(-ret));
-        migrate_decompress_threads_join();
-        exit(EXIT_FAILURE);
+/* Request a range of pages from the source VM at the given
+ * start address.
+ *   rbname: Name of the RAMBlock to request the page in, if NULL it's the same
+ *           as the last request (a name must have been given previously)
+ *   Start: Address offset within the RB
+ *   Len: Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname upto 256 */
+    size_t msglen = 12; /* start + len */
+
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
+
+    if (rbname) {
+        int rbname_len = strlen(rbname);
+        assert(rbname_len < 256);
+
+        bufc[msglen++] = rbname_len;
+        memcpy(bufc + msglen, rbname, rbname_len);
+        msglen += rbname_len;
+        migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES_ID, msglen, bufc);
+    } else {
+        migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, msglen, bufc);
     }
-    migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+}
+
+/*
+ * Announce ourselves and get the guest going once the incoming side has
+ * all the device state; in postcopy that is while RAM is still arriving.
+ */
+void migration_incoming_start_guest(void)
+{
+    Error *local_err = NULL;
+
     qemu_announce_self();
 
     /* Make sure all file formats flush their mutable metadata */
     bdrv_invalidate_cache_all(&local_err);
     if (local_err) {
         error_report_err(local_err);
-        migrate_decompress_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -311,6 +389,46 @@ static void process_incoming_migration_co(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+}
+
+static void process_incoming_migration_co(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis;
+    int ret;
+
+    mis = migration_incoming_state_new(f);
+    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
+    ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
+    migration_incoming_close_listener();
+
+    if (ret == 0 && postcopy_state_get() == POSTCOPY_INCOMING_RUNNING) {
+        /*
+         * Postcopy: the listen thread keeps reading RAM from f and
+         * cleans up after itself; the guest runs in the meantime.
+         */
+        free_xbzrle_decoded_buf();
+        migrate_decompress_threads_join();
+        migration_incoming_start_guest();
+        return;
+    }
+
+    if (mis->to_src_file) {
+        migrate_send_rp_shut(mis, ret < 0);
+    }
+    qemu_fclose(f);
+    free_xbzrle_decoded_buf();
+    migration_incoming_state_destroy();
+
+    if (ret < 0) {
+        migrate_generate_event(MIGRATION_STATUS_FAILED);
+        error_report("load of migration failed: %s", strerror(-ret));
+        migrate_decompress_threads_join();
+        exit(EXIT_FAILURE);
+    }
+    migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+    migration_incoming_start_guest();
     migrate_decompress_threads_join();
 }
 
@@ -325,6 +443,32 @@ void process_incoming_migration(QEMUFile *f)
     qemu_coroutine_enter(co, f);
 }
 
+static int incoming_listener = -1;
+
+void migration_incoming_set_listener(int fd)
+{
+    incoming_listener = fd;
+}
+
+void migration_incoming_close_listener(void)
+{
+    if (incoming_listener != -1) {
+        qemu_set_fd_handler(incoming_listener, NULL, NULL, NULL);
+        closesocket(incoming_listener);
+        incoming_listener = -1;
+    }
+}
+
+bool migration_incoming_process_channel(QEMUFile *f)
+{
+    if (!mis_current) {
+        multifd_load_setup();
+        process_incoming_migration(f);
+        return !migrate_use_multifd();
+    }
+    return multifd_recv_new_channel(f);
+}
+
 /* amount of nanoseconds we are willing to wait for migration to be down.
  * the choice of nanoseconds is because it is the maximum resolution that
  * get_clock() can achieve. It is an internal measure. All user-visible
@@ -372,6 +516,16 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     params->decompress_threads =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->x_cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    params->x_cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_compress_method =
+            s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+    params->x_bitmap_sync_threads =
+            s->parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS];
 
     return params;
 }
@@ -390,6 +544,19 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->method = migrate_compress_method();
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_compression_rate();
+        info->compression->throughput = compress_mig_throughput();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -404,6 +571,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_CANCELLING:
         info->has_status = true;
         info->has_total_time = true;
@@ -436,9 +604,16 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+
+        if (cpu_throttle_active()) {
+            info->has_x_cpu_throttle_percentage = true;
+            info->x_cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -479,6 +654,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationCapabilityStatusList *cap;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
         return;
@@ -487,6 +663,78 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
     }
+
+    if (migrate_postcopy_ram()) {
+        if (migrate_use_compression()) {
+            /* The decompression threads asynchronously write into RAM
+             * rather than use the atomic copies needed to avoid
+             * userfaulting.  It should be possible to fix the decompression
+             * threads for compatibility in future.
+             */
+            error_report("Postcopy is not currently compatible with "
+                         "compression");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM] =
+                false;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        /* Pages only go over the channels as plain or zero pages */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle()) {
+            error_report("Multifd is not currently compatible with postcopy, "
+                         "compression or xbzrle");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_background_snapshot()) {
+        /* Every page is saved once, as it was when the snapshot started */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_multifd()) {
+            error_report("Background snapshot is not compatible with "
+                         "postcopy, compression, xbzrle or multifd");
+            s->enabled_capabilities[
+                MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT] = false;
+        } else if (!background_snapshot_supported_by_host()) {
+            s->enabled_capabilities[
+                MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT] = false;
+        }
+    }
+
+    if (migrate_mapped_ram()) {
+        /* Pages are written to the file directly, each to its own place */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_multifd() ||
+            migrate_background_snapshot()) {
+            error_report("Mapped RAM is not compatible with postcopy, "
+                         "compression, xbzrle, multifd or background "
+                         "snapshots");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] = false;
+        }
+    }
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIGRATION_STATUS_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_set(&s->start_postcopy, true);
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -494,7 +742,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_compress_threads,
                                 int64_t compress_threads,
                                 bool has_decompress_threads,
-                                int64_t decompress_threads, Error **errp)
+                                int64_t decompress_threads,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_cpu_throttle_initial,
+                                int64_t x_cpu_throttle_initial,
+                                bool has_x_cpu_throttle_increment,
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_compress_method,
+                                MigrationCompressMethod x_compress_method,
+                                bool has_x_bitmap_sync_threads,
+                                int64_t x_bitmap_sync_threads,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -517,6 +776,40 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "is invalid, it should be in the range of 1 to 255");
         return;
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_cpu_throttle_initial &&
+            (x_cpu_throttle_initial < 1 || x_cpu_throttle_initial > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_cpu_throttle_initial",
+                   "an integer in the range of 1 to 99");
+        return;
+    }
+    if (has_x_cpu_throttle_increment &&
+            (x_cpu_throttle_increment < 1 || x_cpu_throttle_increment > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_cpu_throttle_increment",
+                   "an integer in the range of 1 to 99");
+        return;
+    }
+    if (has_x_compress_method && !migration_codec_get(x_compress_method)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_compress_method",
+                   "a compression method supported by this build");
+        return;
+    }
+    if (has_x_bitmap_sync_threads &&
+            (x_bitmap_sync_threads < 1 || x_bitmap_sync_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_bitmap_sync_threads",
+                   "an integer in the range of 1 to 64");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -528,6 +821,26 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                                                     decompress_threads;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_x_cpu_throttle_initial) {
+        s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+                                                    x_cpu_throttle_initial;
+    }
+    if (has_x_cpu_throttle_increment) {
+        s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+                                                    x_cpu_throttle_increment;
+    }
+    if (has_x_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                                                    x_compress_method;
+    }
+    if (has_x_bitmap_sync_threads) {
+        s->parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS] =
+                                                    x_bitmap_sync_threads;
+    }
 }
 
 /* shared migration helpers */
@@ -540,6 +853,24 @@ static void migrate_set_state(MigrationState *s, int old_state, int new_state)
     }
 }
 
+/* Forget the multifd channel addresses, closing fds that weren't used */
+static void migrate_multifd_release(MigrationState *s)
+{
+    int i;
+
+    for (i = 0; i < s->multifd_nr_fds; i++) {
+        if (s->multifd_fds[i] != -1) {
+            close(s->multifd_fds[i]);
+        }
+    }
+    g_free(s->multifd_fds);
+    s->multifd_fds = NULL;
+    s->multifd_nr_fds = 0;
+    g_free(s->multifd_address);
+    s->multifd_address = NULL;
+    s->multifd_connect = NULL;
+}
+
 static void migrate_fd_cleanup(void *opaque)
 {
     MigrationState *s = opaque;
@@ -557,8 +888,10 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    migrate_multifd_release(s);
 
-    assert(s->state != MIGRATION_STATUS_ACTIVE);
+    assert(s->state != MIGRATION_STATUS_ACTIVE &&
+           s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -588,7 +921,8 @@ static void migrate_fd_cancel(MigrationState *s)
     do {
         old_state = s->state;
         if (old_state != MIGRATION_STATUS_SETUP &&
-            old_state != MIGRATION_STATUS_ACTIVE) {
+            old_state != MIGRATION_STATUS_ACTIVE &&
+            old_state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
             break;
         }
         migrate_set_state(s, old_state, MIGRATION_STATUS_CANCELLING);
@@ -603,6 +937,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_send_shutdown();
     }
 }
 
@@ -621,6 +956,11 @@ bool migration_in_setup(MigrationState *s)
     return s->state == MIGRATION_STATUS_SETUP;
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIGRATION_STATUS_COMPLETED;
@@ -643,6 +983,19 @@ static MigrationState *migrate_init(const MigrationParams *params)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     int decompress_thread_count =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    int multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    int x_cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    int x_cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int x_compress_method =
+            s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+    int x_bitmap_sync_threads =
+            s->parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS];
+
+    /* In case the previous attempt failed before it got to cleanup */
+    migrate_multifd_release(s);
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -658,6 +1011,14 @@ static MigrationState *migrate_init(const MigrationParams *params)
                compress_thread_count;
     s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                decompress_thread_count;
+    s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] = multifd_channels;
+    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+                x_cpu_throttle_initial;
+    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+                x_cpu_throttle_increment;
+    s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] = x_compress_method;
+    s->parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS] =
+                x_bitmap_sync_threads;
     s->bandwidth_limit = bandwidth_limit;
     migrate_set_state(s, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
@@ -713,6 +1074,7 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP ||
         s->state == MIGRATION_STATUS_CANCELLING) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
@@ -732,6 +1094,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_zero_copy_send() && !migrate_use_multifd()) {
+        error_setg(errp, "Zero copy send is only supported with x-multifd");
+        return;
+    }
+
+    if (migrate_background_snapshot() && (params.blk || params.shared)) {
+        error_setg(errp, "Block migration is not supported with "
+                         "background snapshots");
+        return;
+    }
+
     /* We are starting a new migration, so we want to start in a clean
        state.  This change is only needed if previous migration
        failed/was cancelled.  We don't use migrate_set_state() because
@@ -753,6 +1126,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -841,6 +1216,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -868,6 +1252,15 @@ int migrate_compress_level(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -886,6 +1279,78 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+int migrate_cpu_throttle_initial(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+}
+
+int migrate_cpu_throttle_increment(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+}
+
+int migrate_bitmap_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -915,25 +1380,432 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+/*
+ * Something bad happened to the RP stream, mark an error
+ * The caller shall print or trace something to indicate why
+ */
+static void mark_source_rp_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+static struct rp_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} rp_cmd_args[] = {
+    [MIG_RP_MSG_INVALID]        = { .len = -1, .name = "INVALID" },
+    [MIG_RP_MSG_SHUT]           = { .len =  4, .name = "SHUT" },
+    [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
+    [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
+};
+
+/*
+ * Process a request for pages received on the return path,
+ * We're allowed to send more than requested (e.g. to round to our page size)
+ * and we don't need to send pages that have already been sent.
+ */
+static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
+                                       ram_addr_t start, size_t len)
+{
+    long our_host_ps = getpagesize();
+
+    trace_migrate_handle_rp_req_pages(rbname, start, len);
+
+    /*
+     * Since we currently insist on matching page sizes, just sanity check
+     * we're being asked for whole host pages.
+     */
+    if (start & (our_host_ps-1) ||
+       (len & (our_host_ps-1))) {
+        error_report("%s: Misaligned page request, start: " RAM_ADDR_FMT
+                     " len: %zd", __func__, start, len);
+        mark_source_rp_bad(ms);
+        return;
+    }
+
+    if (ram_save_queue_pages(rbname, start, len)) {
+        mark_source_rp_bad(ms);
+    }
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ *
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t tmp32, sibling_error;
+    ram_addr_t start = 0; /* =0 to silence warning */
+    size_t  len = 0, expected_len;
+    int res;
+
+    rcu_register_thread();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp) &&
+           (ms->state == MIGRATION_STATUS_SETUP ||
+            ms->state == MIGRATION_STATUS_ACTIVE ||
+            ms->state == MIGRATION_STATUS_POSTCOPY_ACTIVE)) {
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                    header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        if ((rp_cmd_args[header_type].len != -1 &&
+            header_len != rp_cmd_args[header_type].len) ||
+            header_len > sizeof(buf)) {
+            error_report("RP: Received '%s' message (0x%04x) with"
+                    "incorrect length %d expecting %zu",
+                    rp_cmd_args[header_type].name, header_type, header_len,
+                    (size_t)rp_cmd_args[header_type].len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* We know we've got a valid header by this point */
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* OK, we have the message and the data */
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            sibling_error = ldl_be_p(buf);
+            /*
+             * We'll let the main thread deal with closing the RP
+             * we could do a shutdown(2) on it, but we're the only user
+             * anyway, so there's nothing gained.
+             */
+            if (sibling_error) {
+                error_report("RP: Sibling indicated error %d", sibling_error);
+                mark_source_rp_bad(ms);
+            }
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            start = ldq_be_p(buf);
+            len = ldl_be_p(buf + 8);
+            migrate_handle_rp_req_pages(ms, NULL, start, len);
+            break;
+
+        case MIG_RP_MSG_REQ_PAGES_ID:
+            expected_len = 12 + 1; /* header + termination */
+
+            if (header_len >= expected_len) {
+                start = ldq_be_p(buf);
+                len = ldl_be_p(buf + 8);
+                /* Now we expect an idstr */
+                tmp32 = buf[12]; /* Length of the following idstr */
+                buf[13 + tmp32] = '\0';
+                expected_len += tmp32;
+            }
+            if (header_len != expected_len) {
+                error_report("RP: Req_Page_id with length %d expecting %zd",
+                        header_len, expected_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        mark_source_rp_bad(ms);
+    }
+
+out:
+    trace_source_return_path_thread_end(ms->rp_state.error);
+    ms->rp_state.from_dst_file = NULL;
+    qemu_fclose(rp);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.from_dst_file) {
+        return -1;
+    }
+
+    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+    ms->rp_state.thread_created = true;
+
+    return 0;
+}
+
+/*
+ * Wait for the destination to close the return path.  If the migration
+ * has already failed, force the thread out of its read first.
+ *
+ * Returns true if the return path reported an error.
+ */
+static bool await_return_path_close_on_source(MigrationState *ms, bool error)
+{
+    if (!ms->rp_state.thread_created) {
+        return false;
+    }
+    if (error) {
+        qemu_file_shutdown(ms->file);
+    }
+    qemu_thread_join(&ms->rp_state.rp_thread);
+    ms->rp_state.thread_created = false;
+
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from precopy to postcopy mode: stop the guest, finish the
+ * sections that can't be postcopied, tell the destination which pages
+ * were redirtied since they were sent, and send the device state
+ * packaged together with the commands that start the destination.
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    int ret;
+    const QEMUSizedBuffer *qsb;
+    QEMUFile *fb;
+    int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    migrate_set_state(ms, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* RAM carries on; everything else that is iterative finishes here */
+    qemu_savevm_state_complete_iterable(ms->file);
+
+    ret = ram_postcopy_send_discard_bitmap(ms);
+    if (ret) {
+        error_report("postcopy_start: Discard failed");
+        goto fail;
+    }
+
+    /*
+     * send rest of state - note things that are doing postcopy
+     * will notice we're in POSTCOPY_ACTIVE and not actually
+     * wrap their state up here
+     */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    /*
+     * The destination reads the whole package before loading any of it,
+     * so its listen thread can take over the main stream as soon as
+     * the LISTEN command at the start is processed.
+     */
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+        goto fail;
+    }
+
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_save_devices(fb);
+    qemu_savevm_send_postcopy_run(fb);
+
+    qsb = qemu_buf_get(fb);
+    ret = qemu_savevm_send_packaged(ms->file, qsb);
+    qemu_fclose(fb);
+    ms->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+
+    qemu_mutex_unlock_iothread();
+
+    if (!ret) {
+        ret = qemu_file_get_error(ms->file);
+    }
+    if (ret) {
+        error_report("postcopy_start: Migration stream errored");
+        migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    return ret;
+
+fail:
+    migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                      MIGRATION_STATUS_FAILED);
+    qemu_mutex_unlock_iothread();
+    return -1;
+}
+
+/*
+ * Finish the migration once the remaining state fits in the allowed
+ * downtime; in postcopy, once the pages that are left have been sent.
+ */
+static void migration_completion(MigrationState *s, int current_active_state,
+                                 bool *old_vm_running,
+                                 int64_t *start_time)
+{
+    int ret;
+
+    if (s->state == MIGRATION_STATUS_ACTIVE && s->snapshot_devices) {
+        /* The guest keeps running; what's left of RAM is protected */
+        qemu_file_set_rate_limit(s->file, INT64_MAX);
+        qemu_savevm_state_complete_snapshot(s->file,
+                                            qemu_buf_get(s->snapshot_devices));
+    } else if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+        *old_vm_running = runstate_is_running();
+
+        ret = global_state_store();
+        if (!ret) {
+            ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            if (ret >= 0) {
+                qemu_file_set_rate_limit(s->file, INT64_MAX);
+                qemu_savevm_state_complete(s->file);
+            }
+        }
+        qemu_mutex_unlock_iothread();
+
+        if (ret < 0) {
+            goto fail;
+        }
+    } else if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        qemu_savevm_state_complete_postcopy(s->file);
+        qemu_mutex_unlock_iothread();
+    }
+
+    /*
+     * If rp was opened we must clean up the thread before
+     * cleaning everything else up.  The destination says it has
+     * finished loading with a SHUT message.
+     */
+    if (await_return_path_close_on_source(s,
+                                          qemu_file_get_error(s->file))) {
+        goto fail;
+    }
+
+    if (qemu_file_get_error(s->file)) {
+        goto fail;
+    }
+
+    migrate_set_state(s, current_active_state, MIGRATION_STATUS_COMPLETED);
+    return;
+
+fail:
+    migrate_set_state(s, current_active_state, MIGRATION_STATUS_FAILED);
+}
+
+/*
+ * Take the point in time a background snapshot is of: with the guest
+ * stopped for a moment, write protect its RAM and save the device state
+ * into a buffer that is sent once all of RAM has gone.
+ */
+static int background_snapshot_start(MigrationState *s)
+{
+    int64_t start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    bool old_vm_running;
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    old_vm_running = runstate_is_running();
+
+    ret = global_state_store();
+    if (!ret && old_vm_running) {
+        ret = vm_stop_force_state(RUN_STATE_PAUSED);
+    }
+    if (!ret) {
+        ret = background_snapshot_protect();
+    }
+    if (!ret) {
+        s->snapshot_devices = qemu_bufopen("w", NULL);
+        qemu_savevm_state_save_devices(s->snapshot_devices);
+        ret = qemu_file_get_error(s->snapshot_devices);
+    }
+    if (old_vm_running) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+    trace_background_snapshot_start(s->downtime, ret);
+    return ret;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
+    /* Used by the bandwidth calcs, updated later */
     int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+    /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
+    int current_active_state = MIGRATION_STATUS_ACTIVE;
 
     rcu_register_thread();
 
     qemu_savevm_state_header(s->file);
+
+    if (migrate_postcopy_ram()) {
+        /* Now tell the dest that it should open its end so it can reply */
+        qemu_savevm_send_open_return_path(s->file);
+
+        if (open_return_path_on_source(s)) {
+            error_report("Unable to open return-path for postcopy");
+            migrate_set_state(s, MIGRATION_STATUS_SETUP,
+                              MIGRATION_STATUS_FAILED);
+            goto out;
+        }
+
+        /*
+         * Tell the destination that we *might* want to do postcopy later;
+         * if the other end can't do postcopy it should fail now, nice and
+         * early.
+         */
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
+
     qemu_savevm_state_begin(s->file, &s->params);
 
+    if (migrate_background_snapshot() &&
+        (qemu_file_get_error(s->file) || background_snapshot_start(s))) {
+        error_report("Unable to start background snapshot");
+        migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_FAILED);
+        goto out;
+    }
+
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    current_active_state = MIGRATION_STATUS_ACTIVE;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_ACTIVE);
 
-    while (s->state == MIGRATION_STATUS_ACTIVE) {
+    while (s->state == MIGRATION_STATUS_ACTIVE ||
+           s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -941,41 +1813,30 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
-                qemu_savevm_state_iterate(s->file);
-            } else {
-                int ret;
-
-                qemu_mutex_lock_iothread();
-                start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-                qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
-                old_vm_running = runstate_is_running();
-
-                ret = global_state_store();
-                if (!ret) {
-                    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
-                    if (ret >= 0) {
-                        qemu_file_set_rate_limit(s->file, INT64_MAX);
-                        qemu_savevm_state_complete(s->file);
-                    }
-                }
-                qemu_mutex_unlock_iothread();
+                /* Still a significant amount to transfer */
 
-                if (ret < 0) {
-                    migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
-                                      MIGRATION_STATUS_FAILED);
-                    break;
-                }
+                if (migrate_postcopy_ram() &&
+                    s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                    atomic_read(&s->start_postcopy)) {
 
-                if (!qemu_file_get_error(s->file)) {
-                    migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
-                                      MIGRATION_STATUS_COMPLETED);
-                    break;
+                    if (!postcopy_start(s, &old_vm_running)) {
+                        current_active_state =
+                            MIGRATION_STATUS_POSTCOPY_ACTIVE;
+                    }
+                    entered_postcopy = true;
+                    continue;
                 }
+                /* Just another iteration step */
+                qemu_savevm_state_iterate(s->file, entered_postcopy);
+            } else {
+                migration_completion(s, current_active_state,
+                                     &old_vm_running, &start_time);
+                break;
             }
         }
 
         if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+            migrate_set_state(s, current_active_state,
                               MIGRATION_STATUS_FAILED);
             break;
         }
@@ -1007,22 +1868,41 @@ static void *migration_thread(void *opaque)
         }
     }
 
+out:
+    /* Make sure the return path thread is gone whatever happened */
+    await_return_path_close_on_source(s, true);
+    /* and that nothing is left blocked on a write protected page */
+    background_snapshot_cleanup();
+
     qemu_mutex_lock_iothread();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy && !s->snapshot_devices) {
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        /* After a background snapshot the guest just carries on */
+        if (!s->snapshot_devices) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
-        if (old_vm_running) {
+        /*
+         * Once the device state has gone the destination may be running,
+         * so the source must stay stopped.
+         */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
+    if (s->snapshot_devices) {
+        qemu_fclose(s->snapshot_devices);
+        s->snapshot_devices = NULL;
+    }
     qemu_bh_schedule(s->cleanup_bh);
     qemu_mutex_unlock_iothread();
 
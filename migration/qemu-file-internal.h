@@ -48,6 +48,9 @@ struct QEMUFile {
     unsigned int iovcnt;
 
     int last_error;
+
+    /* Async buffers are sent with ops->writev_zero_copy */
+    bool zero_copy;
 };
 
 #endif
@@ -28,9 +28,18 @@
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
 
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <poll.h>
+#include <linux/errqueue.h>
+#define QEMU_FILE_ZERO_COPY
+#endif
+
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    /* MSG_ZEROCOPY sends made, and how many the kernel has finished with */
+    uint32_t zero_copy_sent;
+    uint32_t zero_copy_done;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -96,6 +105,153 @@ static int socket_shutdown(void *opaque, bool rd, bool wr)
     }
 }
 
+/* The return path shares the socket of the forward file, which closes it */
+static int socket_return_close(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    g_free(s);
+    return 0;
+}
+
+static const QEMUFileOps socket_return_read_ops = {
+    .get_fd     = socket_get_fd,
+    .get_buffer = socket_get_buffer,
+    .close      = socket_return_close,
+    .shut_down  = socket_shutdown
+};
+
+static const QEMUFileOps socket_return_write_ops = {
+    .get_fd        = socket_get_fd,
+    .writev_buffer = socket_writev_buffer,
+    .close         = socket_return_close,
+    .shut_down     = socket_shutdown
+};
+
+/*
+ * Give a QEMUFile* off the same socket but data in the opposite
+ * direction.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = forward->fd;
+    if (forward->file->ops->get_buffer != NULL) {
+        /* being called from the read side, so we need to be able to write */
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_write_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_read_ops);
+    }
+    return reverse->file;
+}
+
+#ifdef QEMU_FILE_ZERO_COPY
+static int socket_enable_zero_copy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int v = 1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static ssize_t socket_writev_zero_copy(void *opaque, struct iovec *iov,
+                                       int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    struct iovec local_iov[MAX_IOV_SIZE];
+    struct msghdr msg = { 0 };
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t done = 0;
+    ssize_t len;
+    int flags = MSG_ZEROCOPY;
+
+    assert(iovcnt <= MAX_IOV_SIZE);
+    while (done < size) {
+        msg.msg_iov = local_iov;
+        msg.msg_iovlen = iov_copy(local_iov, iovcnt, iov, iovcnt, done,
+                                  size - done);
+        len = sendmsg(s->fd, &msg, flags);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && flags) {
+                /* Over the locked memory limit; copy this lot instead */
+                flags = 0;
+                continue;
+            }
+            return -errno;
+        }
+        if (flags) {
+            s->zero_copy_sent++;
+        }
+        flags = MSG_ZEROCOPY;
+        done += len;
+    }
+    return done;
+}
+
+/*
+ * Each completion on the error queue covers a range of sends, numbered
+ * from 0 in the order they were made.
+ */
+static int socket_flush_zero_copy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct pollfd pfd;
+
+    while (s->zero_copy_done != s->zero_copy_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -errno;
+            }
+            /* A non-empty error queue shows up as POLLERR */
+            pfd.fd = s->fd;
+            pfd.events = 0;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -errno;
+            }
+            if ((pfd.revents & (POLLHUP | POLLNVAL)) &&
+                !(pfd.revents & POLLERR)) {
+                return -EPIPE;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) {
+            return -EIO;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+        s->zero_copy_done = serr->ee_data + 1;
+    }
+    return 0;
+}
+#endif
+
 static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
@@ -204,18 +360,24 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 }
 
 static const QEMUFileOps socket_read_ops = {
-    .get_fd     = socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close      = socket_close,
-    .shut_down  = socket_shutdown
-
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
 };
 
 static const QEMUFileOps socket_write_ops = {
-    .get_fd        = socket_get_fd,
-    .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifdef QEMU_FILE_ZERO_COPY
+    .enable_zero_copy = socket_enable_zero_copy,
+    .writev_zero_copy = socket_writev_zero_copy,
+    .flush_zero_copy  = socket_flush_zero_copy,
+#endif
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
@@ -21,7 +21,6 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -30,6 +29,7 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "migration/compress.h"
 #include "trace.h"
 
 /*
@@ -44,6 +44,18 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -91,6 +103,87 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+static bool qemu_iov_is_buffered(QEMUFile *f, const struct iovec *iov)
+{
+    uint8_t *base = iov->iov_base;
+
+    return base >= f->buf && base < f->buf + IO_BUF_SIZE;
+}
+
+/*
+ * Write out the iovec of a zero copy file: runs of entries pointing into
+ * our own buffer, which is reused right away, are copied as usual; the
+ * rest came from qemu_put_buffer_async and are sent without copying.
+ */
+static ssize_t qemu_writev_zero_copy(QEMUFile *f)
+{
+    ssize_t ret, total = 0;
+    unsigned int start, i = 0;
+
+    while (i < f->iovcnt) {
+        bool buffered = qemu_iov_is_buffered(f, &f->iov[i]);
+
+        start = i;
+        while (i < f->iovcnt &&
+               qemu_iov_is_buffered(f, &f->iov[i]) == buffered) {
+            i++;
+        }
+        if (buffered) {
+            ret = f->ops->writev_buffer(f->opaque, f->iov + start, i - start,
+                                        f->pos + total);
+        } else {
+            ret = f->ops->writev_zero_copy(f->opaque, f->iov + start,
+                                           i - start, f->pos + total);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        total += ret;
+    }
+    return total;
+}
+
+/*
+ * Send the buffers queued with qemu_put_buffer_async without copying them
+ * from now on.  They must then stay valid until qemu_file_flush_zero_copy
+ * returns, not only until the next qemu_fflush.
+ *
+ * Returns 0 on success, -ENOTSUP if the file or host can't do it.
+ */
+int qemu_file_enable_zero_copy(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->ops->enable_zero_copy) {
+        return -ENOTSUP;
+    }
+    ret = f->ops->enable_zero_copy(f->opaque);
+    if (!ret) {
+        f->zero_copy = true;
+    }
+    return ret;
+}
+
+/*
+ * Flush @f and wait until the kernel has finished with all the buffers
+ * sent without copying.
+ *
+ * Returns the error state of @f.
+ */
+int qemu_file_flush_zero_copy(QEMUFile *f)
+{
+    int ret;
+
+    qemu_fflush(f);
+    if (f->zero_copy && !qemu_file_get_error(f)) {
+        ret = f->ops->flush_zero_copy(f->opaque);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -106,7 +199,9 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->ops->writev_buffer) {
-        if (f->iovcnt > 0) {
+        if (f->zero_copy) {
+            ret = qemu_writev_zero_copy(f);
+        } else if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
     } else {
@@ -485,6 +580,57 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * For a stream on a seekable file: return the offset in the file that
+ * the stream has reached, or a negative errno.  Unlike qemu_ftell this
+ * is a real file offset, not counting data sent on other channels.
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int fd = qemu_get_fd(f);
+    off_t offset;
+
+    if (fd == -1) {
+        return -EINVAL;
+    }
+    qemu_fflush(f);
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == (off_t)-1) {
+        return -errno;
+    }
+    if (!qemu_file_is_writable(f)) {
+        /* Read ahead, but not consumed yet */
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+/*
+ * Carry on the stream at @offset in a seekable file, leaving a hole or
+ * skipping over what's in between.  Any read ahead is dropped.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int fd = qemu_get_fd(f);
+    int ret;
+
+    if (fd == -1) {
+        ret = -EINVAL;
+    } else {
+        qemu_fflush(f);
+        ret = lseek(fd, offset, SEEK_SET) == (off_t)-1 ? -errno : 0;
+    }
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    return 0;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -511,6 +657,15 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Account for @len bytes sent on behalf of @f through some other channel,
+ * so that they count against its rate limit.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -557,20 +712,24 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* compress size bytes of data start at p with the given codec and
+ * compression level and store the compressed data to the buffer of f.
+ * 'state' is the calling thread's state for the codec.
  */
 
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+ssize_t qemu_put_compression_data(QEMUFile *f, const MigrationCodec *codec,
+                                  void *state, const uint8_t *p, size_t size,
                                   int level)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
 
-    if (blen < compressBound(size)) {
+    if (blen < codec->bound(size)) {
         return 0;
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = codec->compress(state, level,
+                           f->buf + f->buf_index + sizeof(int32_t), blen,
+                           p, size);
+    if (blen < 0) {
         error_report("Compress Failed!");
         return 0;
     }
@@ -26,18 +26,25 @@
  * THE SOFTWARE.
  */
 #include <stdint.h>
-#include <zlib.h>
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "block/coroutine.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "migration/background-snapshot.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
+#include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/host-utils.h"
+#include "migration/compress.h"
+#include "qom/cpu.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -47,9 +54,7 @@
     do { } while (0)
 #endif
 
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
 
 static uint64_t bitmap_sync_count;
 
@@ -65,6 +70,15 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+/* With 1K target pages there are no flag bits left, so use a combination
+ * that can't otherwise occur.  Followed by a MigrationCompressMethod byte.
+ */
+#define RAM_SAVE_FLAG_COMPRESS_METHOD  (RAM_SAVE_FLAG_COMPRESS_PAGE | \
+                                        RAM_SAVE_FLAG_MEM_SIZE)
+
+/* Room for a compressed page with any codec; zstd has the worst bound */
+#define COMPRESS_BUF_SIZE (TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 64 + 128)
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -151,6 +165,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    int64_t compress_busy_ns;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -215,6 +232,35 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+double compress_mig_compression_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)acct_info.compress_pages * TARGET_PAGE_SIZE /
+           acct_info.compress_bytes;
+}
+
+/* MB of guest RAM compressed per second of compression thread time */
+double compress_mig_throughput(void)
+{
+    if (!acct_info.compress_busy_ns) {
+        return 0;
+    }
+    return (double)acct_info.compress_pages * TARGET_PAGE_SIZE * 1000 /
+           acct_info.compress_busy_ns;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -226,89 +272,200 @@ static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/*
+ * Saving a background snapshot: RAM is write protected instead of dirty
+ * logged, and every page is sent once.
+ */
+static bool background_snapshot;
+
+/*
+ * Pages the destination asked for while in postcopy; they are sent ahead
+ * of the background scan.  Queued by the return path thread, consumed by
+ * the migration thread.
+ */
+struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+};
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* Block of the last request, for requests that don't name one */
+static RAMBlock *last_req_rb;
+
+/*
+ * Multithreaded (de)compression
+ *
+ * Pages are handed to the (de)compression threads through a ring of
+ * slots.  The migration thread (or the incoming coroutine) is the only
+ * producer: it fills the slot at 'head' and publishes it by moving 'head'
+ * forward.  The threads claim published slots in order by moving 'tail'
+ * forward with a cmpxchg.  When the producer comes back round to a slot
+ * it waits for the thread that claimed it to be done with it; on the
+ * compression side it then copies the compressed page out into the
+ * migration stream.  No locks are taken, sleeping happens on two
+ * QemuEvents: one for new work and one for finished work.
+ */
+typedef enum {
+    COMP_SLOT_FREE,     /* No page, or the compressed page was sent */
+    COMP_SLOT_QUEUED,   /* Published, claimed or not by a thread */
+    COMP_SLOT_DONE,     /* Compressed page waiting in 'file' */
+} CompSlotState;
+
+typedef struct CompressRing {
+    unsigned int nr_slots;      /* power of two */
+    unsigned int head;          /* next slot the producer fills */
+    unsigned int tail;          /* next slot a thread claims */
+    bool quit;
+    QemuEvent work_ev;          /* a slot was published, or quit */
+    QemuEvent done_ev;          /* a thread finished with a slot */
+} CompressRing;
 
 struct CompressParam {
-    bool start;
-    bool done;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+    int state;
     RAMBlock *block;
     ram_addr_t offset;
+    QEMUFile *file;
+    int64_t busy_ns;            /* time it took to compress the page */
 };
 typedef struct CompressParam CompressParam;
 
 struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
+    int state;
+    const MigrationCodec *codec;
     void *des;
-    uint8 *compbuf;
+    uint8_t *compbuf;
     int len;
 };
 typedef struct DecompressParam DecompressParam;
 
+static CompressRing comp_ring;
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
- */
-static QemuMutex *comp_done_lock;
-static QemuCond *comp_done_cond;
+/* Compresses the first page of each block on the migration thread */
+static CompressParam comp_sync_param;
+static void *comp_sync_state;
+static const MigrationCodec *comp_codec;
 /* The empty QEMUFileOps will be used by file in CompressParam */
 static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
-static bool quit_comp_thread;
-static bool quit_decomp_thread;
+static CompressRing decomp_ring;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
-static uint8_t *compressed_data_buf;
+static const MigrationCodec *decomp_codec;
+
+static void comp_ring_init(CompressRing *ring, int thread_count)
+{
+    /* Enough for every thread to have a page in flight and one queued */
+    ring->nr_slots = pow2ceil(thread_count * 2);
+    ring->head = 0;
+    ring->tail = 0;
+    ring->quit = false;
+    qemu_event_init(&ring->work_ev, false);
+    qemu_event_init(&ring->done_ev, false);
+}
 
-static int do_compress_ram_page(CompressParam *param);
+static void comp_ring_destroy(CompressRing *ring)
+{
+    qemu_event_destroy(&ring->work_ev);
+    qemu_event_destroy(&ring->done_ev);
+}
 
-static void *do_data_compress(void *opaque)
+/* Index of the slot the producer fills next */
+static inline unsigned int comp_ring_head(CompressRing *ring)
 {
-    CompressParam *param = opaque;
+    return ring->head & (ring->nr_slots - 1);
+}
 
-    while (!quit_comp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        /* Re-check the quit_comp_thread in case of
-         * terminate_compression_threads is called just before
-         * qemu_mutex_lock(&param->mutex) and after
-         * while(!quit_comp_thread), re-check it here can make
-         * sure the compression thread terminate as expected.
-         */
-        while (!param->start && !quit_comp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
-        if (!quit_comp_thread) {
-            do_compress_ram_page(param);
+/* Producer: publish the slot at head, whose state was set to QUEUED */
+static void comp_ring_push(CompressRing *ring)
+{
+    atomic_mb_set(&ring->head, ring->head + 1);
+    qemu_event_set(&ring->work_ev);
+}
+
+/* Producer: wait for the thread that claimed a slot to finish with it */
+static void comp_ring_wait(CompressRing *ring, int *state)
+{
+    while (atomic_mb_read(state) == COMP_SLOT_QUEUED) {
+        qemu_event_reset(&ring->done_ev);
+        if (atomic_mb_read(state) != COMP_SLOT_QUEUED) {
+            break;
         }
-        param->start = false;
-        qemu_mutex_unlock(&param->mutex);
+        qemu_event_wait(&ring->done_ev);
+    }
+}
+
+/* Threads: mark a claimed slot as finished with */
+static void comp_ring_done(CompressRing *ring, int *state, int new_state)
+{
+    atomic_mb_set(state, new_state);
+    qemu_event_set(&ring->done_ev);
+}
+
+/*
+ * Threads: claim the next published slot and return its index.  Returns
+ * -1 once the ring is shut down and there is nothing left to do.
+ */
+static int comp_ring_pop(CompressRing *ring)
+{
+    unsigned int tail;
 
-        qemu_mutex_lock(comp_done_lock);
-        param->done = true;
-        qemu_cond_signal(comp_done_cond);
-        qemu_mutex_unlock(comp_done_lock);
+    for (;;) {
+        tail = atomic_mb_read(&ring->tail);
+        if (tail != atomic_mb_read(&ring->head)) {
+            if (atomic_cmpxchg(&ring->tail, tail, tail + 1) == tail) {
+                return tail & (ring->nr_slots - 1);
+            }
+            continue;
+        }
+        if (atomic_mb_read(&ring->quit)) {
+            return -1;
+        }
+        qemu_event_reset(&ring->work_ev);
+        /* Re-check, a push may have come before the reset */
+        if (atomic_mb_read(&ring->tail) == atomic_mb_read(&ring->head) &&
+            !atomic_mb_read(&ring->quit)) {
+            qemu_event_wait(&ring->work_ev);
+        }
     }
+}
 
-    return NULL;
+static void comp_ring_quit(CompressRing *ring)
+{
+    atomic_mb_set(&ring->quit, true);
+    qemu_event_set(&ring->work_ev);
 }
 
-static inline void terminate_compression_threads(void)
+static int do_compress_ram_page(CompressParam *param, void *state);
+
+static void *do_data_compress(void *opaque)
 {
-    int idx, thread_count;
+    const MigrationCodec *codec = comp_codec;
+    void *state = NULL;
+    int idx;
 
-    thread_count = migrate_compress_threads();
-    quit_comp_thread = true;
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+    if (codec->compress_setup) {
+        state = codec->compress_setup();
     }
+    while ((idx = comp_ring_pop(&comp_ring)) >= 0) {
+        CompressParam *param = &comp_param[idx];
+        int64_t t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        do_compress_ram_page(param, state);
+        param->busy_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+        comp_ring_done(&comp_ring, &param->state, COMP_SLOT_DONE);
+    }
+    if (codec->compress_cleanup) {
+        codec->compress_cleanup(state);
+    }
+
+    return NULL;
 }
 
 void migrate_compress_threads_join(void)
@@ -318,24 +475,25 @@ void migrate_compress_threads_join(void)
     if (!migrate_use_compression()) {
         return;
     }
-    terminate_compression_threads();
+    comp_ring_quit(&comp_ring);
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
+    }
+    for (i = 0; i < comp_ring.nr_slots; i++) {
         qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
     }
-    qemu_mutex_destroy(comp_done_lock);
-    qemu_cond_destroy(comp_done_cond);
+    qemu_fclose(comp_sync_param.file);
+    if (comp_codec->compress_cleanup) {
+        comp_codec->compress_cleanup(comp_sync_state);
+    }
+    comp_ring_destroy(&comp_ring);
     g_free(compress_threads);
     g_free(comp_param);
-    g_free(comp_done_cond);
-    g_free(comp_done_lock);
     compress_threads = NULL;
     comp_param = NULL;
-    comp_done_cond = NULL;
-    comp_done_lock = NULL;
+    comp_sync_param.file = NULL;
+    comp_sync_state = NULL;
 }
 
 void migrate_compress_threads_create(void)
@@ -345,25 +503,26 @@ void migrate_compress_threads_create(void)
     if (!migrate_use_compression()) {
         return;
     }
-    quit_comp_thread = false;
     compression_switch = true;
+    comp_codec = migration_codec_get(migrate_compress_method());
     thread_count = migrate_compress_threads();
+    comp_ring_init(&comp_ring, thread_count);
     compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    comp_done_cond = g_new0(QemuCond, 1);
-    comp_done_lock = g_new0(QemuMutex, 1);
-    qemu_cond_init(comp_done_cond);
-    qemu_mutex_init(comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
+    comp_param = g_new0(CompressParam, comp_ring.nr_slots);
+    /* comp_param[i].file is just used as a dummy buffer to save data, set
+     * it's ops to empty.
+     */
+    for (i = 0; i < comp_ring.nr_slots; i++) {
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
+        comp_param[i].state = COMP_SLOT_FREE;
+    }
+    comp_sync_param.file = qemu_fopen_ops(NULL, &empty_ops);
+    if (comp_codec->compress_setup) {
+        comp_sync_state = comp_codec->compress_setup();
+    }
+    for (i = 0; i < thread_count; i++) {
         qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
+                           do_data_compress, NULL,
                            QEMU_THREAD_JOINABLE);
     }
 }
@@ -495,11 +654,50 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return 1;
 }
 
+/*
+ * The dirty log that the accelerator keeps for migration is re-armed in
+ * chunks of (1 << CLEAR_BITMAP_SHIFT) pages, the first time a page of the
+ * chunk is about to be sent after a bitmap sync, rather than all at once
+ * when the log is read.  Pages that are not sent do not need protecting,
+ * and the guest is not hit by a burst of write faults after each sync.
+ */
+#define CLEAR_BITMAP_SHIFT      18
+
+static unsigned long clear_bmap_size(RAMBlock *rb)
+{
+    return DIV_ROUND_UP(rb->max_length >> TARGET_PAGE_BITS,
+                        1UL << CLEAR_BITMAP_SHIFT);
+}
+
+/* Called with rcu_read_lock(), before sending page @page of @rb */
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
+                                                       unsigned long page)
+{
+    unsigned long chunk = page >> CLEAR_BITMAP_SHIFT;
+    hwaddr chunk_size = (hwaddr)1 << (CLEAR_BITMAP_SHIFT + TARGET_PAGE_BITS);
+    hwaddr start;
+
+    if (!rb->clear_bmap) {
+        /* Block added while migrating */
+        memory_region_clear_dirty_bitmap(rb->mr, page << TARGET_PAGE_BITS,
+                                         TARGET_PAGE_SIZE);
+        return;
+    }
+    if (!test_and_clear_bit(chunk, rb->clear_bmap)) {
+        return;
+    }
+    start = chunk * chunk_size;
+    trace_migration_bitmap_clear_dirty(rb->idstr, start, chunk_size, page);
+    memory_region_clear_dirty_bitmap(rb->mr, start,
+                                     MIN(chunk_size, rb->used_length - start));
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static inline
-ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
+ram_addr_t migration_bitmap_find_and_reset_dirty(RAMBlock *rb,
                                                  ram_addr_t start)
 {
+    MemoryRegion *mr = rb->mr;
     unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
     uint64_t mr_size = TARGET_PAGE_ALIGN(memory_region_size(mr));
@@ -516,12 +714,34 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     }
 
     if (next < size) {
+        migration_clear_memory_region_dirty_bitmap(rb, next - base);
         clear_bit(next, bitmap);
         migration_dirty_pages--;
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/*
+ * Clear the dirty bit of the page at 'offset' in 'rb', returning true if
+ * it was set, i.e. if the page still has to be sent.
+ *
+ * Called within an RCU critical section.
+ */
+static bool migration_bitmap_test_and_reset_dirty(RAMBlock *rb,
+                                                  ram_addr_t offset)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap);
+    unsigned long page = (rb->offset + offset) >> TARGET_PAGE_BITS;
+
+    if (!test_bit(page, bitmap)) {
+        return false;
+    }
+    migration_clear_memory_region_dirty_bitmap(rb, offset >> TARGET_PAGE_BITS);
+    clear_bit(page, bitmap);
+    migration_dirty_pages--;
+    return true;
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
@@ -531,6 +751,260 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
         cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
 }
 
+/*
+ * Merging the dirty log into migration_bitmap happens with the iothread
+ * lock held, so for big guests it is shared out to a pool of threads.
+ * Each RAMBlock is cut into shards of at most SYNC_SHARD_PAGES pages that
+ * the threads, the migration thread included, claim one at a time.
+ *
+ * Shards only cover whole words of the bitmaps, so that no two threads
+ * write to the same word; the parts of a block that share a word with
+ * the next or previous block are merged by the migration thread itself.
+ *
+ * Host NUMA policies are set per memory backend, each of which is a
+ * RAMBlock of its own, so shards never straddle two of them.
+ */
+#define SYNC_SHARD_PAGES    (1UL << 18)
+
+typedef struct SyncShard {
+    ram_addr_t start;
+    ram_addr_t length;
+} SyncShard;
+
+static struct {
+    QemuThread *threads;
+    int nr_threads;
+    QemuMutex mutex;
+    /* Workers wait on cond for a new round, the migration thread on
+     * done_cond for them to finish it.  Both under mutex.
+     */
+    QemuCond cond;
+    QemuCond done_cond;
+    unsigned round;
+    int busy;
+    bool quit;
+    /* The current round */
+    unsigned long *bitmap;
+    SyncShard *shards;
+    int nr_shards;
+    int nr_allocated;
+    int next_shard;
+    uint64_t num_dirty;
+} sync_pool;
+
+static void sync_pool_run_shards(void)
+{
+    uint64_t num_dirty = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&sync_pool.next_shard)) <
+           sync_pool.nr_shards) {
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(sync_pool.bitmap,
+                                                sync_pool.shards[i].start,
+                                                sync_pool.shards[i].length);
+    }
+    atomic_add(&sync_pool.num_dirty, num_dirty);
+}
+
+static void *sync_pool_thread(void *opaque)
+{
+    unsigned round = 0;
+
+    qemu_mutex_lock(&sync_pool.mutex);
+    for (;;) {
+        while (!sync_pool.quit && sync_pool.round == round) {
+            qemu_cond_wait(&sync_pool.cond, &sync_pool.mutex);
+        }
+        if (sync_pool.quit) {
+            break;
+        }
+        round = sync_pool.round;
+        qemu_mutex_unlock(&sync_pool.mutex);
+
+        sync_pool_run_shards();
+
+        qemu_mutex_lock(&sync_pool.mutex);
+        if (--sync_pool.busy == 0) {
+            qemu_cond_signal(&sync_pool.done_cond);
+        }
+    }
+    qemu_mutex_unlock(&sync_pool.mutex);
+
+    return NULL;
+}
+
+static void sync_pool_setup(void)
+{
+    int i;
+
+    /* The migration thread is one of them */
+    sync_pool.nr_threads = migrate_bitmap_sync_threads() - 1;
+    if (sync_pool.nr_threads <= 0) {
+        return;
+    }
+
+    qemu_mutex_init(&sync_pool.mutex);
+    qemu_cond_init(&sync_pool.cond);
+    qemu_cond_init(&sync_pool.done_cond);
+    sync_pool.quit = false;
+    sync_pool.threads = g_new0(QemuThread, sync_pool.nr_threads);
+    for (i = 0; i < sync_pool.nr_threads; i++) {
+        qemu_thread_create(sync_pool.threads + i, "bitmapsync",
+                           sync_pool_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void sync_pool_cleanup(void)
+{
+    int i;
+
+    if (!sync_pool.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&sync_pool.mutex);
+    sync_pool.quit = true;
+    qemu_cond_broadcast(&sync_pool.cond);
+    qemu_mutex_unlock(&sync_pool.mutex);
+    for (i = 0; i < sync_pool.nr_threads; i++) {
+        qemu_thread_join(sync_pool.threads + i);
+    }
+
+    qemu_cond_destroy(&sync_pool.done_cond);
+    qemu_cond_destroy(&sync_pool.cond);
+    qemu_mutex_destroy(&sync_pool.mutex);
+    g_free(sync_pool.threads);
+    g_free(sync_pool.shards);
+    sync_pool.threads = NULL;
+    sync_pool.shards = NULL;
+    sync_pool.nr_allocated = 0;
+}
+
+static void sync_pool_add_shard(ram_addr_t start, ram_addr_t length)
+{
+    if (sync_pool.nr_shards == sync_pool.nr_allocated) {
+        sync_pool.nr_allocated = MAX(16, sync_pool.nr_allocated * 2);
+        sync_pool.shards = g_renew(SyncShard, sync_pool.shards,
+                                   sync_pool.nr_allocated);
+    }
+    sync_pool.shards[sync_pool.nr_shards].start = start;
+    sync_pool.shards[sync_pool.nr_shards].length = length;
+    sync_pool.nr_shards++;
+}
+
+/*
+ * Split the blocks into shards and the unaligned edges that are left to
+ * the caller.  Returns false if there is too little work to share.
+ *
+ * Called with rcu_read_lock()
+ */
+static bool sync_pool_build_shards(void)
+{
+    RAMBlock *block;
+    ram_addr_t first, last, page, pages;
+
+    sync_pool.nr_shards = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        first = ROUND_UP(block->mr->ram_addr >> TARGET_PAGE_BITS,
+                         BITS_PER_LONG);
+        last = ((block->mr->ram_addr + block->used_length) >>
+                TARGET_PAGE_BITS) & ~(BITS_PER_LONG - 1);
+        for (page = first; page < last; page += pages) {
+            pages = MIN(SYNC_SHARD_PAGES, last - page);
+            sync_pool_add_shard(page << TARGET_PAGE_BITS,
+                                pages << TARGET_PAGE_BITS);
+        }
+    }
+    return sync_pool.nr_shards > 1;
+}
+
+/*
+ * Merge the dirty log of every block into migration_bitmap, sharing the
+ * work with the pool.  Returns false, having done nothing, if it is not
+ * worth it.
+ *
+ * Called with rcu_read_lock() and migration_bitmap_mutex held
+ */
+static bool migration_bitmap_sync_parallel(void)
+{
+    RAMBlock *block;
+    ram_addr_t start, end, first, last;
+
+    if (!sync_pool.threads || !sync_pool_build_shards()) {
+        return false;
+    }
+
+    trace_migration_bitmap_sync_parallel(sync_pool.nr_shards,
+                                         sync_pool.nr_threads + 1);
+    sync_pool.bitmap = atomic_rcu_read(&migration_bitmap);
+    sync_pool.next_shard = 0;
+    sync_pool.num_dirty = 0;
+    qemu_mutex_lock(&sync_pool.mutex);
+    sync_pool.busy = sync_pool.nr_threads;
+    sync_pool.round++;
+    qemu_cond_broadcast(&sync_pool.cond);
+    qemu_mutex_unlock(&sync_pool.mutex);
+
+    /* The edges of the blocks while the pool gets going */
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        start = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        end = (block->mr->ram_addr + block->used_length) >> TARGET_PAGE_BITS;
+        first = MIN(ROUND_UP(start, BITS_PER_LONG), end);
+        last = MAX(end & ~(BITS_PER_LONG - 1), first);
+        if (start < first) {
+            migration_bitmap_sync_range(start << TARGET_PAGE_BITS,
+                                        (first - start) << TARGET_PAGE_BITS);
+        }
+        if (last < end) {
+            migration_bitmap_sync_range(last << TARGET_PAGE_BITS,
+                                        (end - last) << TARGET_PAGE_BITS);
+        }
+    }
+
+    sync_pool_run_shards();
+
+    qemu_mutex_lock(&sync_pool.mutex);
+    while (sync_pool.busy) {
+        qemu_cond_wait(&sync_pool.done_cond, &sync_pool.mutex);
+    }
+    qemu_mutex_unlock(&sync_pool.mutex);
+
+    migration_dirty_pages += sync_pool.num_dirty;
+    return true;
+}
+
+
+/* Reduce amount of guest cpu execution to hopefully slow down memory writes.
+ * If guest dirty memory rate is reduced below the rate at which we can
+ * transfer pages to the destination then we should be able to complete
+ * migration. Some workloads dirty memory way too fast and will not effectively
+ * converge, even with auto-converge.
+ *
+ * Rather than stepping blindly, size the next step from how far the dirty
+ * rate measured over the last period is above what we managed to send: the
+ * vcpus get (100 - pct)% of the time, so bringing 'dirty_bytes' down to half
+ * of 'xfer_bytes' (the threshold that triggered us) needs
+ *   100 - pct' = (100 - pct) * xfer_bytes / (2 * dirty_bytes)
+ * The step is at least 1% and at most x-cpu-throttle-increment.
+ */
+static void mig_throttle_guest_down(int64_t dirty_bytes, int64_t xfer_bytes)
+{
+    int pct_initial = migrate_cpu_throttle_initial();
+    int pct_increment = migrate_cpu_throttle_increment();
+    int pct_cur, pct_needed, pct_new;
+
+    /* We have not started throttling yet. Let's start it. */
+    if (!cpu_throttle_active()) {
+        pct_new = pct_initial;
+    } else {
+        pct_cur = cpu_throttle_get_percentage();
+        pct_needed = 100 - (100 - pct_cur) * xfer_bytes / (2 * dirty_bytes);
+        pct_new = pct_cur + MIN(pct_increment, MAX(pct_needed - pct_cur, 1));
+    }
+    pct_new = MIN(pct_new, 99);
+    trace_migration_throttle(dirty_bytes, xfer_bytes, pct_new);
+    cpu_throttle_set(pct_new);
+}
 
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
@@ -556,6 +1030,7 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t dirty_bytes_period, xfer_bytes_period;
 
     bitmap_sync_count++;
 
@@ -572,8 +1047,16 @@ static void migration_bitmap_sync(void)
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
+    if (!migration_bitmap_sync_parallel()) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            migration_bitmap_sync_range(block->mr->ram_addr,
+                                        block->used_length);
+        }
+    }
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->used_length);
+        if (block->clear_bmap) {
+            bitmap_set(block->clear_bmap, 0, clear_bmap_size(block));
+        }
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
@@ -586,23 +1069,25 @@ static void migration_bitmap_sync(void)
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Check to see if the bytes dirtied in this period are more
+               than half of the bytes that got transferred in the same
+               period.  If that happens a few periods in a row, throttle
+               the guest down by an amount proportional to the gap. */
             bytes_xfer_now = ram_bytes_transferred();
+            dirty_bytes_period = num_dirty_pages_period * TARGET_PAGE_SIZE;
+            xfer_bytes_period = bytes_xfer_now - bytes_xfer_prev;
             if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
+                dirty_bytes_period > xfer_bytes_period / 2) {
+                if (++dirty_rate_high_cnt >= 3) {
+                    mig_throttle_guest_down(dirty_bytes_period,
+                                            xfer_bytes_period);
                     dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+                }
+            } else {
+                /* only consecutive periods count */
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != acct_info.iterations) {
@@ -671,7 +1156,8 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     MemoryRegion *mr = block->mr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    /* A snapshot page is unprotected as soon as it's been queued */
+    bool send_async = !background_snapshot;
 
     p = memory_region_get_ram_ptr(mr) + offset;
 
@@ -706,7 +1192,8 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -737,7 +1224,7 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+static int do_compress_ram_page(CompressParam *param, void *state)
 {
     int bytes_sent, blen;
     uint8_t *p;
@@ -748,52 +1235,55 @@ static int do_compress_ram_page(CompressParam *param)
 
     bytes_sent = save_page_header(param->file, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
+    blen = qemu_put_compression_data(param->file, comp_codec, state, p,
+                                     TARGET_PAGE_SIZE,
                                      migrate_compress_level());
     bytes_sent += blen;
 
     return bytes_sent;
 }
 
-static inline void start_compression(CompressParam *param)
+static uint64_t bytes_transferred;
+
+/* Send a compressed page out of 'param' and account for it */
+static int put_compressed_page(QEMUFile *f, CompressParam *param)
 {
-    param->done = false;
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    int len;
+
+    len = qemu_put_qemu_file(f, param->file);
+    acct_info.compress_pages++;
+    acct_info.compress_bytes += len;
+    acct_info.compress_busy_ns += param->busy_ns;
+
+    return len;
 }
 
-static inline void start_decompression(DecompressParam *param)
+/* Wait for the slot to be compressed and send it, leaving it free */
+static int flush_compressed_slot(QEMUFile *f, CompressParam *param)
 {
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
-}
+    int len = 0;
 
-static uint64_t bytes_transferred;
+    comp_ring_wait(&comp_ring, &param->state);
+    if (param->state == COMP_SLOT_DONE) {
+        len = put_compressed_page(f, param);
+        param->state = COMP_SLOT_FREE;
+    }
+    return len;
+}
 
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    unsigned int i;
 
     if (!migrate_use_compression()) {
         return;
     }
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        if (!comp_param[idx].done) {
-            qemu_mutex_lock(comp_done_lock);
-            while (!comp_param[idx].done && !quit_comp_thread) {
-                qemu_cond_wait(comp_done_cond, comp_done_lock);
-            }
-            qemu_mutex_unlock(comp_done_lock);
-        }
-        if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
-        }
+    /* Oldest first, starting from the next slot to be reused */
+    for (i = 0; i < comp_ring.nr_slots; i++) {
+        CompressParam *param = &comp_param[(comp_ring.head + i) &
+                                           (comp_ring.nr_slots - 1)];
+
+        bytes_transferred += flush_compressed_slot(f, param);
     }
 }
 
@@ -808,31 +1298,18 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressParam *param = &comp_param[comp_ring_head(&comp_ring)];
+    int bytes_xmit;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
-        }
-    }
-    qemu_mutex_unlock(comp_done_lock);
+    /* The slot is reused once the page it was last given has been sent */
+    bytes_xmit = flush_compressed_slot(f, param);
+    set_compress_params(param, block, offset);
+    param->state = COMP_SLOT_QUEUED;
+    comp_ring_push(&comp_ring);
+    acct_info.norm_pages++;
+    *bytes_transferred += bytes_xmit;
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -855,6 +1332,7 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     MemoryRegion *mr = block->mr;
     uint8_t *p;
     int ret;
+    int64_t t0;
 
     p = memory_region_get_ram_ptr(mr) + offset;
 
@@ -887,13 +1365,16 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
+                set_compress_params(&comp_sync_param, block, offset);
                 /* Use the qemu thread to compress the data to make sure the
                  * first page is sent out before other pages
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+                do_compress_ram_page(&comp_sync_param, comp_sync_state);
+                comp_sync_param.busy_ns =
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
+                bytes_xmit = put_compressed_page(f, &comp_sync_param);
                 *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
@@ -909,34 +1390,1038 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
-/**
- * ram_find_and_save_block: Finds a dirty page and sends it to f
- *
- * Called within an RCU critical section.
- *
- * Returns:  The number of pages written
- *           0 means no dirty pages
- *
- * @f: QEMUFile where to send the data
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
- */
-
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
-                                   uint64_t *bytes_transferred)
+/* Called within an RCU critical section */
+static RAMBlock *ram_block_by_name(const char *name)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
-    int pages = 0;
-    MemoryRegion *mr;
+    RAMBlock *block;
 
-    if (!block)
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(name, block->idstr)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* How long the destination waits for channels that have not connected */
+#define MULTIFD_CONNECT_TIMEOUT_MS 5000
+
+/* Pages sent in one packet on a multifd channel */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+/* Packet flags */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Set in the low bits of a packet's page offset for an all-zero page */
+#define MULTIFD_PAGE_ZERO 0x1
+
+/*
+ * A run of pages from one RAMBlock; the offsets are page aligned, with
+ * MULTIFD_PAGE_ZERO set for pages that are only sent as a marker.
+ */
+typedef struct {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    QemuSemaphore sem;
+    /* everything below is protected by mutex */
+    QemuMutex mutex;
+    /* pages waiting to be sent by this channel */
+    MultiFDPages *pages;
+    bool pending;
+    /* a sync packet has been asked for */
+    bool sync;
+    bool quit;
+    /*
+     * With zero copy, the regions of the pages sent since the last flush;
+     * the kernel may still be reading from them.  Only used by the thread.
+     */
+    GSList *zero_copy_regions;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* posted each time a channel has no pages pending */
+    QemuSemaphore channels_ready;
+    /* filled in by the migration thread */
+    MultiFDPages *pages;
+    /* first error hit by a channel; read by the migration thread */
+    int error;
+} *multifd_send_state;
+
+static void multifd_send_packet(QEMUFile *f, MultiFDPages *pages)
+{
+    RAMBlock *block = pages->block;
+    size_t len = strlen(block->idstr);
+    uint32_t i;
+
+    qemu_put_be32(f, 0);
+    qemu_put_be32(f, pages->num);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    for (i = 0; i < pages->num; i++) {
+        if (!(pages->offset[i] & MULTIFD_PAGE_ZERO)) {
+            qemu_put_buffer_async(f, block->host + pages->offset[i],
+                                  TARGET_PAGE_SIZE);
+        }
+    }
+    /* The page data is referenced, not copied, until we flush */
+    qemu_fflush(f);
+}
+
+/* Wait for the kernel to be done with the pages sent without copying */
+static void multifd_flush_zero_copy(MultiFDSendParams *p)
+{
+    GSList *l;
+
+    qemu_file_flush_zero_copy(p->file);
+    for (l = p->zero_copy_regions; l; l = l->next) {
+        memory_region_unref(l->data);
+    }
+    g_slist_free(p->zero_copy_regions);
+    p->zero_copy_regions = NULL;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    int ret;
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_put_be32(p->file, multifd_send_state->count);
+    qemu_fflush(p->file);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending) {
+            MultiFDPages *pages = p->pages;
+
+            qemu_mutex_unlock(&p->mutex);
+            if (!qemu_file_get_error(p->file)) {
+                multifd_send_packet(p->file, pages);
+            }
+            if (migrate_zero_copy_send() && (!p->zero_copy_regions ||
+                p->zero_copy_regions->data != pages->block->mr)) {
+                /* Keep the reference until the flush */
+                p->zero_copy_regions = g_slist_prepend(p->zero_copy_regions,
+                                                       pages->block->mr);
+            } else {
+                memory_region_unref(pages->block->mr);
+            }
+            pages->block = NULL;
+            pages->num = 0;
+
+            qemu_mutex_lock(&p->mutex);
+            p->pending = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->sync) {
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+            /* Everything before the sync point must really be out */
+            multifd_flush_zero_copy(p);
+            qemu_put_be32(p->file, MULTIFD_FLAG_SYNC);
+            qemu_put_be32(p->file, 0);
+            qemu_fflush(p->file);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            multifd_flush_zero_copy(p);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+
+        ret = qemu_file_get_error(p->file);
+        if (ret) {
+            atomic_cmpxchg(&multifd_send_state->error, 0, ret);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Shut the channels down so that senders stuck on a dead connection
+ * give up; used when the migration is cancelled.
+ */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_file_shutdown(multifd_send_state->params[i].file);
+    }
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+
+        qemu_fclose(p->file);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/*
+ * Open the multifd channels of the outgoing migration on @f and start
+ * their threads.  Nothing is done for other streams, e.g. snapshots.
+ */
+static int multifd_save_setup(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    typeof(multifd_send_state) state;
+    int thread_count;
+    int i;
+
+    if (!migrate_use_multifd() || f != s->file) {
+        return 0;
+    }
+    if (!s->multifd_connect) {
+        error_report("multifd is not supported by this migration transport");
+        return -1;
+    }
+
+    thread_count = migrate_multifd_channels();
+    state = g_new0(typeof(*state), 1);
+    state->params = g_new0(MultiFDSendParams, thread_count);
+    state->pages = g_new0(MultiFDPages, 1);
+    state->count = thread_count;
+    qemu_sem_init(&state->channels_ready, thread_count);
+
+    /* Connecting may block; don't hold the big lock meanwhile */
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+        Error *local_err = NULL;
+
+        p->file = s->multifd_connect(s, i, &local_err);
+        if (!p->file) {
+            error_report_err(local_err);
+            goto err;
+        }
+        if (migrate_zero_copy_send()) {
+            int ret = qemu_file_enable_zero_copy(p->file);
+
+            if (ret < 0) {
+                error_report("multifd: zero copy send is not available: %s",
+                             strerror(-ret));
+                qemu_fclose(p->file);
+                goto err;
+            }
+        }
+        p->id = i;
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+    }
+
+    /* Published under the lock so that cancelling can shut channels down */
+    qemu_mutex_lock_iothread();
+    multifd_send_state = state;
+    qemu_mutex_unlock_iothread();
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        qemu_thread_create(&p->thread, "multifdsend", multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_multifd_save_setup(thread_count);
+
+    return 0;
+
+err:
+    while (i--) {
+        qemu_fclose(state->params[i].file);
+        qemu_mutex_destroy(&state->params[i].mutex);
+        qemu_sem_destroy(&state->params[i].sem);
+        g_free(state->params[i].pages);
+    }
+    qemu_sem_destroy(&state->channels_ready);
+    g_free(state->params);
+    g_free(state->pages);
+    g_free(state);
+    return -1;
+}
+
+/* Hand the pages collected so far to the next free channel */
+static void multifd_send_pages(QEMUFile *f)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    MultiFDSendParams *p = NULL;
+    int i, ret;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = 0; !p; i = (i + 1) % multifd_send_state->count) {
+        MultiFDSendParams *q = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&q->mutex);
+        if (!q->pending) {
+            p = q;
+            /* Swap buffers; the channel gives its one back empty */
+            multifd_send_state->pages = p->pages;
+            p->pages = pages;
+            p->pending = true;
+        }
+        qemu_mutex_unlock(&q->mutex);
+    }
+    qemu_sem_post(&p->sem);
+
+    ret = atomic_mb_read(&multifd_send_state->error);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/* Called within an RCU critical section */
+static void multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num && (pages->block != block ||
+                       pages->num == MULTIFD_PAGES_PER_PACKET)) {
+        multifd_send_pages(f);
+        pages = multifd_send_state->pages;
+    }
+    if (!pages->num) {
+        /* Keeps the block alive until the channel has sent it */
+        memory_region_ref(block->mr);
+        pages->block = block;
+    }
+    pages->offset[pages->num++] = offset;
+}
+
+/*
+ * Flush the queued pages and put a sync point in every channel and in
+ * the main stream: the destination has loaded everything sent before it
+ * once it is past the sync point, so later copies of a page can't be
+ * overtaken by older ones travelling on another channel.
+ */
+static void multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    if (multifd_send_state->pages->num) {
+        multifd_send_pages(f);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    trace_multifd_send_sync_main();
+}
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the main thread to let us past a sync point */
+    QemuSemaphore sem_sync;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* channels accepted so far */
+    int connected;
+    /* posted by each channel reaching a sync point */
+    QemuSemaphore sem_sync;
+    /* incoming coroutine waiting for the channels to connect */
+    Coroutine *waiting_co;
+    int error;
+    bool quit;
+} *multifd_recv_state;
+
+static int multifd_recv_packet(QEMUFile *f)
+{
+    char idstr[256];
+    RAMBlock *block;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    uint32_t num, i;
+    uint8_t len;
+    int ret = 0;
+
+    num = qemu_get_be32(f);
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: packet with %u pages", num);
+        return -EINVAL;
+    }
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)idstr, len);
+    idstr[len] = 0;
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+    }
+
+    rcu_read_lock();
+    block = ram_block_by_name(idstr);
+    if (!block) {
+        error_report("multifd: unknown RAM block '%s'", idstr);
+        ret = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < num; i++) {
+        ram_addr_t addr = offset[i] & TARGET_PAGE_MASK;
+
+        if (addr >= block->used_length) {
+            error_report("multifd: illegal RAM offset " RAM_ADDR_FMT
+                         " in '%s'", addr, idstr);
+            ret = -EINVAL;
+            goto out;
+        }
+        if (offset[i] & MULTIFD_PAGE_ZERO) {
+            ram_handle_compressed(block->host + addr, 0, TARGET_PAGE_SIZE);
+        } else {
+            qemu_get_buffer(f, block->host + addr, TARGET_PAGE_SIZE);
+        }
+    }
+    ret = qemu_file_get_error(f);
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t magic, version, id, count;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    magic = qemu_get_be32(p->file);
+    version = qemu_get_be32(p->file);
+    id = qemu_get_be32(p->file);
+    count = qemu_get_be32(p->file);
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd: bad channel header magic %x version %u",
+                     magic, version);
+        ret = -EINVAL;
+    } else if (count != multifd_recv_state->count) {
+        error_report("multifd: source uses %u channels, we expect %d",
+                     count, multifd_recv_state->count);
+        ret = -EINVAL;
+    }
+    p->id = id;
+
+    while (!ret) {
+        uint32_t flags = qemu_get_be32(p->file);
+
+        ret = qemu_file_get_error(p->file);
+        if (ret) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_get_be32(p->file);
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+            if (atomic_read(&multifd_recv_state->quit)) {
+                break;
+            }
+            continue;
+        }
+        ret = multifd_recv_packet(p->file);
+    }
+
+    if (ret && !atomic_read(&multifd_recv_state->quit)) {
+        /* Don't leave the main thread waiting for our sync point */
+        atomic_cmpxchg(&multifd_recv_state->error, 0, ret);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Prepare for the multifd channels of an incoming migration */
+void multifd_load_setup(void)
+{
+    int thread_count;
+
+    if (!migrate_use_multifd() || multifd_recv_state) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    atomic_set(&multifd_recv_state->quit, true);
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_file_shutdown(p->file);
+        qemu_sem_post(&p->sem_sync);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/*
+ * A multifd channel of the incoming migration has connected; start its
+ * thread.  Called from the main loop.
+ *
+ * Returns true once all the channels have connected.
+ */
+bool multifd_recv_new_channel(QEMUFile *f)
+{
+    MultiFDRecvParams *p;
+
+    if (!multifd_recv_state ||
+        multifd_recv_state->connected == multifd_recv_state->count) {
+        error_report("multifd: unexpected incoming connection");
+        qemu_fclose(f);
+        return true;
+    }
+
+    p = &multifd_recv_state->params[multifd_recv_state->connected++];
+    p->file = f;
+    /* The channel threads use blocking reads */
+    qemu_set_block(qemu_get_fd(f));
+    trace_multifd_recv_new_channel(multifd_recv_state->connected,
+                                   multifd_recv_state->count);
+    qemu_sem_init(&p->sem_sync, 0);
+    qemu_thread_create(&p->thread, "multifdrecv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+    if (multifd_recv_state->connected < multifd_recv_state->count) {
+        return false;
+    }
+    if (multifd_recv_state->waiting_co) {
+        Coroutine *co = multifd_recv_state->waiting_co;
+
+        multifd_recv_state->waiting_co = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+    return true;
+}
+
+static void multifd_recv_connect_timeout(void *opaque)
+{
+    Coroutine *co = multifd_recv_state->waiting_co;
+
+    if (co) {
+        multifd_recv_state->waiting_co = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+}
+
+/*
+ * The source has connected all of its channels before it sends the first
+ * sync point, but the main loop may not have accepted them yet.  Give it
+ * a little time, then fail rather than wait for channels that never come.
+ */
+static int multifd_recv_wait_channels(void)
+{
+    QEMUTimer *timer;
+
+    if (multifd_recv_state->connected == multifd_recv_state->count) {
+        return 0;
+    }
+
+    assert(qemu_in_coroutine());
+    timer = timer_new_ms(QEMU_CLOCK_REALTIME, multifd_recv_connect_timeout,
+                         NULL);
+    timer_mod(timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                     MULTIFD_CONNECT_TIMEOUT_MS);
+    multifd_recv_state->waiting_co = qemu_coroutine_self();
+    qemu_coroutine_yield();
+    timer_del(timer);
+    timer_free(timer);
+
+    if (multifd_recv_state->connected < multifd_recv_state->count) {
+        error_report("multifd: only %d of %d channels connected",
+                     multifd_recv_state->connected,
+                     multifd_recv_state->count);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * The main stream has reached a sync point: wait for every channel to
+ * load what was sent before it, then let them carry on.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int ret, i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd stream received, but multifd is not enabled");
+        return -EINVAL;
+    }
+    /* The channels are accepted by the main loop */
+    ret = multifd_recv_wait_channels();
+    if (ret) {
+        return ret;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return multifd_recv_state->error;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
+/*
+ * A RAM section after the setup one has ended without a sync point, so
+ * the source does not use multifd: stop waiting for its channels.
+ */
+static void multifd_recv_unused(void)
+{
+    if (multifd_recv_state && !multifd_recv_state->connected) {
+        multifd_load_cleanup();
+        migration_incoming_close_listener();
+    }
+}
+
+/**
+ * ram_save_multifd_page: queue a page on the multifd channels
+ *
+ * Returns: 1, the number of pages written
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_multifd_page(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    bool zero = is_zero_range(p, TARGET_PAGE_SIZE);
+
+    /* Zero pages only cost their offset in the packet */
+    multifd_queue_page(f, block, offset | (zero ? MULTIFD_PAGE_ZERO : 0));
+    if (!zero) {
+        /* The data goes over the channels; count it against the limit */
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    }
+    acct_update_position(f, TARGET_PAGE_SIZE, zero);
+    return 1;
+}
+
+/*
+ * Queue the pages for transmission, e.g. a request from postcopy destination
+ *   ms: MigrationStatus in which the queue is held
+ *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
+ *   start: Offset from the start of the RAMBlock
+ *   len: Length (in bytes) to send
+ *   Return: 0 on success
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+    struct RAMSrcPageRequest *new_entry;
+
+    trace_ram_save_queue_pages(rbname, start, len);
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        last_req_rb = ramblock;
+    }
+    if (start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    new_entry = g_new0(struct RAMSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+/*
+ * Take the next queued page that still needs sending off the request
+ * queue, clearing its dirty bit.
+ *
+ * Returns the block, with the page's offset in *offset, or NULL if there
+ * is nothing (left) to send on behalf of the destination.
+ *
+ * Called within an RCU critical section.
+ */
+static RAMBlock *unqueue_page(ram_addr_t *offset)
+{
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    while (!block && !QSIMPLEQ_EMPTY(&src_page_requests)) {
+        struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(&src_page_requests);
+
+        /* Already sent pages don't need sending again */
+        if (migration_bitmap_test_and_reset_dirty(entry->rb, entry->offset)) {
+            block = entry->rb;
+            *offset = entry->offset;
+        }
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(entry->rb->mr);
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return block;
+}
+
+/* Drop any requests still queued at the end of the migration */
+static void flush_page_queue(void)
+{
+    struct RAMSrcPageRequest *entry, *next;
+
+    rcu_read_lock();
+    QSIMPLEQ_FOREACH_SAFE(entry, &src_page_requests, next_req, next) {
+        memory_region_unref(entry->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(entry);
+    }
+    rcu_read_unlock();
+    last_req_rb = NULL;
+}
+
+/*
+ * x-mapped-ram: rather than going into the stream, pages are written to a
+ * fixed region of the migration file that each RAMBlock is given at setup:
+ *
+ *   bitmap_offset: little endian bitmap of the pages that are in the file
+ *   pages_offset:  the pages, each one at its own offset in the block
+ *
+ * A page that is sent again overwrites its old copy, so the file doesn't
+ * grow past the size of RAM; a page that was zero when it was last sent
+ * is left out of the bitmap and loaded as zero.  Contiguous pages are
+ * gathered into runs to keep the writes big.
+ */
+#define MAPPED_RAM_ALIGN    (1024 * 1024)
+#define MAPPED_RAM_RUN_MAX  (1024 * 1024)
+
+static bool mapped_ram;
+static struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t len;
+} mapped_ram_run;
+
+/* The bitmap in the file is a whole number of 64 bit words */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64) * 8;
+}
+
+/* Between host and file (little endian) order; it works both ways */
+static void mapped_ram_bitmap_swap(unsigned long *bmap, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(unsigned long); i++) {
+        bmap[i] = leul_to_cpu(bmap[i]);
+    }
+}
+
+/* Read or write all of @len bytes at @offset; returns 0 or -errno */
+static int mapped_ram_pio(int fd, uint8_t *buf, size_t len, uint64_t offset,
+                          bool write)
+{
+    while (len) {
+        ssize_t ret = write ? pwrite(fd, buf, len, offset) :
+                              pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * Give @block its region of the file, and move the stream past it.
+ * Called within an RCU critical section.
+ */
+static int mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    int64_t offset = qemu_file_get_offset(f);
+
+    if (offset < 0) {
+        error_report("x-mapped-ram needs a seekable migration file: %s",
+                     strerror(-offset));
+        return offset;
+    }
+
+    /* Leave room for the two offsets that are about to be written */
+    block->bitmap_offset = ROUND_UP(offset + 16, MAPPED_RAM_ALIGN);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_ALIGN);
+    block->file_bmap = g_malloc0(bitmap_size);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/* Write the pending run of pages to the file */
+static void mapped_ram_flush(QEMUFile *f)
+{
+    RAMBlock *block = mapped_ram_run.block;
+    int ret;
+
+    if (!mapped_ram_run.len) {
+        return;
+    }
+
+    ret = mapped_ram_pio(qemu_get_fd(f), block->host + mapped_ram_run.start,
+                         mapped_ram_run.len,
+                         block->pages_offset + mapped_ram_run.start, true);
+    if (ret) {
+        error_report("Failed to write pages of '%s' to the migration file: "
+                     "%s", block->idstr, strerror(-ret));
+        qemu_file_set_error(f, ret);
+    }
+    mapped_ram_run.len = 0;
+}
+
+/* Like ram_save_page, for x-mapped-ram */
+static int ram_save_mapped_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset,
+                                uint64_t *bytes_transferred)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+    set_bit(page, block->file_bmap);
+
+    if (mapped_ram_run.len &&
+        (mapped_ram_run.block != block ||
+         mapped_ram_run.start + mapped_ram_run.len != offset ||
+         mapped_ram_run.len >= MAPPED_RAM_RUN_MAX)) {
+        mapped_ram_flush(f);
+    }
+    if (!mapped_ram_run.len) {
+        mapped_ram_run.block = block;
+        mapped_ram_run.start = offset;
+    }
+    mapped_ram_run.len += TARGET_PAGE_SIZE;
+
+    /* Count the page against the stream, for rate limiting and stats */
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
+/*
+ * Once the last page has been written, write the bitmaps.
+ * Called within an RCU critical section.
+ */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret;
+
+    mapped_ram_flush(f);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        size_t bitmap_size = mapped_ram_bitmap_size(block);
+
+        mapped_ram_bitmap_swap(block->file_bmap, bitmap_size);
+        ret = mapped_ram_pio(qemu_get_fd(f), (uint8_t *)block->file_bmap,
+                             bitmap_size, block->bitmap_offset, true);
+        mapped_ram_bitmap_swap(block->file_bmap, bitmap_size);
+        if (ret) {
+            error_report("Failed to write the page bitmap of '%s': %s",
+                         block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+/**
+ * ram_find_and_save_block: Finds a dirty page and sends it to f
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns:  The number of pages written
+ *           0 means no dirty pages
+ *
+ * @f: QEMUFile where to send the data
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
+                                   uint64_t *bytes_transferred)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int pages = 0;
+
+    if (migration_in_postcopy(migrate_get_current())) {
+        ram_addr_t req_offset;
+        RAMBlock *req_block = unqueue_page(&req_offset);
+
+        /*
+         * Pages the destination is waiting for go first, and the scan
+         * carries on from there since it's likely to want the next ones.
+         */
+        if (req_block) {
+            pages = ram_save_page(f, req_block, req_offset, last_stage,
+                                  bytes_transferred);
+            if (pages > 0) {
+                last_sent_block = req_block;
+                last_seen_block = req_block;
+                last_offset = req_offset;
+                return pages;
+            }
+        }
+    }
+
+    if (background_snapshot) {
+        ram_addr_t fault_offset;
+        RAMBlock *fault_block;
+
+        /*
+         * Something is blocked writing to these pages: save them first if
+         * they haven't gone yet, then let the write through.
+         */
+        while ((fault_block = background_snapshot_get_fault(&fault_offset))) {
+            pages = 0;
+            if (migration_bitmap_test_and_reset_dirty(fault_block,
+                                                      fault_offset)) {
+                pages = ram_save_page(f, fault_block, fault_offset,
+                                      last_stage, bytes_transferred);
+            }
+            background_snapshot_unprotect(fault_block, fault_offset,
+                                          TARGET_PAGE_SIZE);
+            if (pages > 0) {
+                last_sent_block = fault_block;
+                return pages;
+            }
+        }
+    }
+
+    if (!block)
         block = QLIST_FIRST_RCU(&ram_list.blocks);
 
     while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        offset = migration_bitmap_find_and_reset_dirty(block, offset);
         if (complete_round && block == last_seen_block &&
             offset >= last_offset) {
             break;
@@ -957,13 +2442,21 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 }
             }
         } else {
-            if (compression_switch && migrate_use_compression()) {
+            if (mapped_ram) {
+                pages = ram_save_mapped_page(f, block, offset,
+                                             bytes_transferred);
+            } else if (multifd_send_state) {
+                pages = ram_save_multifd_page(f, block, offset);
+            } else if (compression_switch && migrate_use_compression()) {
                 pages = ram_save_compressed_page(f, block, offset, last_stage,
                                                  bytes_transferred);
             } else {
                 pages = ram_save_page(f, block, offset, last_stage,
                                       bytes_transferred);
             }
+            if (background_snapshot) {
+                background_snapshot_unprotect(block, offset, TARGET_PAGE_SIZE);
+            }
 
             /* if page is unmodified, continue to the next */
             if (pages > 0) {
@@ -1031,10 +2524,30 @@ static void migration_end(void)
      */
     unsigned long *bitmap = migration_bitmap;
     atomic_rcu_set(&migration_bitmap, NULL);
+    flush_page_queue();
+    multifd_save_cleanup();
+    sync_pool_cleanup();
+    cpu_throttle_stop();
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        RAMBlock *block;
+
+        if (background_snapshot) {
+            background_snapshot_cleanup();
+            background_snapshot = false;
+        } else {
+            memory_global_dirty_log_stop();
+        }
         synchronize_rcu();
         g_free(bitmap);
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->clear_bmap);
+            block->clear_bmap = NULL;
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        rcu_read_unlock();
     }
 
     XBZRLE_cache_lock();
@@ -1060,7 +2573,8 @@ static void reset_ram_globals(void)
     last_sent_block = NULL;
     last_offset = 0;
     last_version = ram_list.version;
-    ram_bulk_stage = true;
+    /* Snapshot pages are sent out of order, so the bitmap has to be read */
+    ram_bulk_stage = !background_snapshot;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -1101,11 +2615,27 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
+    background_snapshot = migrate_background_snapshot();
+    mapped_ram = migrate_mapped_ram();
+    mapped_ram_run.len = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
+    qemu_mutex_init(&src_page_req_mutex);
+
+    if (multifd_save_setup(f) < 0) {
+        return -1;
+    }
+    if (background_snapshot) {
+        /* Slow for big guests, so done before taking the iothread lock */
+        if (background_snapshot_prepare()) {
+            background_snapshot = false;
+            return -1;
+        }
+    } else {
+        sync_pool_setup();
+    }
 
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
@@ -1148,14 +2678,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
 
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->clear_bmap = bitmap_new(clear_bmap_size(block));
+    }
+
     /*
      * Count the total number of pages used by ram blocks not including any
      * gaps due to alignment or unplugs.
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    /* A snapshot keeps the pages from changing rather than logging them */
+    if (!background_snapshot) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -1165,10 +2702,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (mapped_ram && mapped_ram_setup_block(f, block)) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
 
+    /* zlib is what older destinations expect without being told */
+    if (migrate_use_compression() &&
+        migrate_compress_method() != MIGRATION_COMPRESS_METHOD_ZLIB) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMPRESS_METHOD);
+        qemu_put_byte(f, migrate_compress_method());
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1206,7 +2754,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         pages_sent += pages;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -1223,6 +2770,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (mapped_ram) {
+        mapped_ram_flush(f);
+    }
     rcu_read_unlock();
 
     /*
@@ -1231,6 +2781,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    multifd_send_sync_main(f);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     bytes_transferred += 8;
 
@@ -1242,12 +2793,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return pages_sent;
 }
 
-/* Called with iothread lock */
+/* Called with iothread lock, except when saving a background snapshot */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    migration_bitmap_sync();
+    /*
+     * In postcopy the guest is stopped and the bitmap is already final;
+     * a background snapshot never syncs, and runs without the lock.
+     */
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !background_snapshot) {
+        migration_bitmap_sync();
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -1265,10 +2823,14 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (mapped_ram) {
+        mapped_ram_save_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
+    multifd_send_sync_main(f);
     migration_end();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
@@ -1281,7 +2843,8 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
-    if (remaining_size < max_size) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !background_snapshot && remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
@@ -1292,6 +2855,113 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
+/* Largest number of ranges sent in one discard command */
+#define MAX_DISCARDS_PER_COMMAND 12
+
+/*
+ * Transmit the set of pages to be discarded after precopy to the target
+ * these are pages that:
+ *     a) Have been previously transmitted but are now dirty again
+ *     b) Pages that have never been transmitted, this ensures that
+ *        any pages on the destination that have been mapped by background
+ *        tasks get discarded (transparent huge pages is the specific concern)
+ * Hopefully this is pretty sparse
+ *
+ * Called with the iothread lock held and the guest stopped.
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    RAMBlock *block;
+    unsigned long *bitmap;
+    int ret = 0;
+
+    trace_ram_postcopy_send_discard_bitmap();
+    rcu_read_lock();
+
+    /* This should be our last sync, the src is now paused */
+    migration_bitmap_sync();
+    bitmap = atomic_rcu_read(&migration_bitmap);
+
+    /* Easiest way to make sure we don't resume in the middle of a host-page */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+        uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
+        uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+        unsigned int nsentlist = 0;
+        unsigned long run_start, run_end;
+
+        run_start = find_next_bit(bitmap, last, first);
+        while (run_start < last) {
+            run_end = find_next_zero_bit(bitmap, last, run_start + 1);
+
+            start_list[nsentlist] = (run_start - first) << TARGET_PAGE_BITS;
+            length_list[nsentlist] = (run_end - run_start) << TARGET_PAGE_BITS;
+            if (++nsentlist == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                      nsentlist, start_list,
+                                                      length_list);
+                nsentlist = 0;
+            }
+
+            run_start = find_next_bit(bitmap, last, run_end + 1);
+        }
+        if (nsentlist) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  nsentlist, start_list,
+                                                  length_list);
+        }
+    }
+    rcu_read_unlock();
+
+    ret = qemu_file_get_error(ms->file);
+    return ret;
+}
+
+/*
+ * At the start of the postcopy phase of migration, any now-dirty
+ * precopied pages are discarded.
+ *
+ * start, length describe a byte address range within the RAMBlock
+ *
+ * Returns 0 on success.
+ */
+int ram_discard_range(MigrationIncomingState *mis,
+                      const char *block_name,
+                      uint64_t start, size_t length)
+{
+    int ret = -1;
+    RAMBlock *rb;
+
+    rcu_read_lock();
+    rb = ram_block_by_name(block_name);
+
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    if ((start | length) & ~TARGET_PAGE_MASK ||
+        start + length > rb->used_length) {
+        error_report("ram_discard_range: Bad range for '%s' start=%" PRIx64
+                     " len=%zx blocklen=" RAM_ADDR_FMT,
+                     block_name, start, length, rb->used_length);
+        goto err;
+    }
+
+    ret = postcopy_ram_discard_range(mis, rb->host + start, length);
+
+err:
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     unsigned int xh_len;
@@ -1375,26 +3045,35 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 
 static void *do_data_decompress(void *opaque)
 {
-    DecompressParam *param = opaque;
-    unsigned long pagesize;
-
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+    const MigrationCodec *codec = NULL;
+    void *state = NULL;
+    int idx;
+
+    while ((idx = comp_ring_pop(&decomp_ring)) >= 0) {
+        DecompressParam *param = &decomp_param[idx];
+
+        /* The codec is only known once the stream has told us */
+        if (param->codec != codec) {
+            if (codec && codec->decompress_cleanup) {
+                codec->decompress_cleanup(state);
+            }
+            codec = param->codec;
+            state = NULL;
+            if (codec->decompress_setup) {
+                state = codec->decompress_setup();
             }
-            param->start = false;
         }
-        qemu_mutex_unlock(&param->mutex);
+        /* decompress() will return failed in some case, especially
+         * when the page is dirted when doing the compression, it's
+         * not a problem because the dirty page will be retransferred
+         * and decompress() won't break the data in other pages.
+         */
+        codec->decompress(state, param->des, TARGET_PAGE_SIZE,
+                          param->compbuf, param->len);
+        comp_ring_done(&decomp_ring, &param->state, COMP_SLOT_FREE);
+    }
+    if (codec && codec->decompress_cleanup) {
+        codec->decompress_cleanup(state);
     }
 
     return NULL;
@@ -1405,16 +3084,18 @@ void migrate_decompress_threads_create(void)
     int i, thread_count;
 
     thread_count = migrate_decompress_threads();
+    comp_ring_init(&decomp_ring, thread_count);
     decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-    quit_decomp_thread = false;
+    decomp_param = g_new0(DecompressParam, decomp_ring.nr_slots);
+    /* Streams that don't say otherwise are zlib compressed */
+    decomp_codec = migration_codec_get(MIGRATION_COMPRESS_METHOD_ZLIB);
+    for (i = 0; i < decomp_ring.nr_slots; i++) {
+        decomp_param[i].state = COMP_SLOT_FREE;
+        decomp_param[i].compbuf = g_malloc0(COMPRESS_BUF_SIZE);
+    }
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
         qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
+                           do_data_decompress, NULL,
                            QEMU_THREAD_JOINABLE);
     }
 }
@@ -1423,47 +3104,225 @@ void migrate_decompress_threads_join(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
+    comp_ring_quit(&decomp_ring);
     thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
-    }
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
+    }
+    for (i = 0; i < decomp_ring.nr_slots; i++) {
         g_free(decomp_param[i].compbuf);
     }
+    comp_ring_destroy(&decomp_ring);
     g_free(decompress_threads);
     g_free(decomp_param);
-    g_free(compressed_data_buf);
     decompress_threads = NULL;
     decomp_param = NULL;
-    compressed_data_buf = NULL;
 }
 
-static void decompress_data_with_multi_threads(uint8_t *compbuf,
+static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
-    int idx, thread_count;
+    DecompressParam *param = &decomp_param[comp_ring_head(&decomp_ring)];
+
+    comp_ring_wait(&decomp_ring, &param->state);
+    qemu_get_buffer(f, param->compbuf, len);
+    param->codec = decomp_codec;
+    param->des = host;
+    param->len = len;
+    param->state = COMP_SLOT_QUEUED;
+    comp_ring_push(&decomp_ring);
+}
 
-    thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
-                break;
+/* Wait until every page handed to the decompression threads is in RAM */
+static void wait_for_decompress_done(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_ring.nr_slots; i++) {
+        comp_ring_wait(&decomp_ring, &decomp_param[i].state);
+    }
+}
+
+/*
+ * x-mapped-ram: the pages of a block are read straight into guest RAM
+ * by several threads, each taking a slice of the block.
+ */
+typedef struct {
+    QemuThread thread;
+    RAMBlock *block;
+    const unsigned long *bmap;
+    uint64_t pages_offset;
+    int fd;
+    unsigned long first, last;
+    int ret;
+} MappedRamLoader;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoader *l = opaque;
+    unsigned long page = l->first;
+
+    while (page < l->last && !l->ret) {
+        uint8_t *host = l->block->host + (page << TARGET_PAGE_BITS);
+        unsigned long end;
+        size_t len;
+
+        if (test_bit(page, l->bmap)) {
+            end = find_next_zero_bit(l->bmap, l->last, page);
+            len = (end - page) << TARGET_PAGE_BITS;
+            l->ret = mapped_ram_pio(l->fd, host, len,
+                                    l->pages_offset +
+                                    (page << TARGET_PAGE_BITS), false);
+        } else {
+            /* Not in the file, so the page was zero */
+            end = find_next_bit(l->bmap, l->last, page);
+            len = (end - page) << TARGET_PAGE_BITS;
+            if (!is_zero_range(host, len)) {
+                memset(host, 0, len);
             }
         }
-        if (idx < thread_count) {
+        page = end;
+    }
+
+    return NULL;
+}
+
+/*
+ * Load @block from its region of the file, whose offsets follow in the
+ * stream, and move the stream past it.  The number of threads is the
+ * x-multifd-channels parameter.
+ * Called within an RCU critical section.
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    int nr_threads = migrate_multifd_channels();
+    unsigned long per_thread = DIV_ROUND_UP(pages, nr_threads);
+    MappedRamLoader *loaders;
+    unsigned long *bmap;
+    int fd = qemu_get_fd(f);
+    int i, ret;
+
+    bmap = g_malloc0(bitmap_size);
+    ret = mapped_ram_pio(fd, (uint8_t *)bmap, bitmap_size, bitmap_offset,
+                         false);
+    if (ret) {
+        error_report("Failed to read the page bitmap of '%s': %s",
+                     block->idstr, strerror(-ret));
+        g_free(bmap);
+        return ret;
+    }
+    mapped_ram_bitmap_swap(bmap, bitmap_size);
+
+    loaders = g_new0(MappedRamLoader, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        MappedRamLoader *l = &loaders[i];
+
+        l->block = block;
+        l->bmap = bmap;
+        l->pages_offset = pages_offset;
+        l->fd = fd;
+        l->first = MIN(i * per_thread, pages);
+        l->last = MIN(l->first + per_thread, pages);
+        /* The first slice is done by this thread */
+        if (i && l->first < l->last) {
+            qemu_thread_create(&l->thread, "mappedram",
+                               mapped_ram_load_thread, l,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+    mapped_ram_load_thread(&loaders[0]);
+
+    for (i = 0; i < nr_threads; i++) {
+        MappedRamLoader *l = &loaders[i];
+
+        if (i && l->first < l->last) {
+            qemu_thread_join(&l->thread);
+        }
+        if (l->ret && !ret) {
+            ret = l->ret;
+            error_report("Failed to read pages of '%s': %s", block->idstr,
+                         strerror(-ret));
+        }
+    }
+    trace_mapped_ram_load_block(block->idstr, nr_threads, ret);
+    g_free(loaders);
+    g_free(bmap);
+
+    if (!ret) {
+        ret = qemu_file_set_offset(f, pages_offset + block->used_length);
+    }
+    return ret;
+}
+
+/*
+ * Load pages while the guest is already running: every page has to be
+ * placed atomically, since a vCPU may be touching it right now.
+ *
+ * Called in postcopy mode by ram_load().
+ * rcu_read_lock is taken prior to this being called.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int flags = 0, ret = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *tmp_page = postcopy_get_tmp_page(mis);
+
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_page_zero(mis, host);
+            } else {
+                memset(tmp_page, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, tmp_page);
+            }
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, tmp_page, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(mis, host, tmp_page);
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
             break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
         }
     }
+
+    return ret;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -1471,6 +3330,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    bool setup = false, multifd_synced = false;
+    /*
+     * Once the listen thread has taken over the stream, pages must be
+     * placed with userfaultfd rather than written directly.
+     */
+    bool postcopy_running = postcopy_state_get() >=
+                            POSTCOPY_INCOMING_LISTENING;
 
     seq_iter++;
 
@@ -1484,10 +3350,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * critical section.
      */
     rcu_read_lock();
-    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+
+    if (postcopy_running) {
+        ret = ram_load_postcopy(f);
+    }
+
+    while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host;
-        uint8_t ch;
+        uint8_t ch, method;
 
         addr = qemu_get_be64(f);
         flags = addr & ~TARGET_PAGE_MASK;
@@ -1496,6 +3367,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
+            setup = true;
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
@@ -1519,6 +3391,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                         }
                         ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                               block->idstr);
+                        if (!ret && migrate_mapped_ram()) {
+                            ret = mapped_ram_load_block(f, block);
+                        }
                         break;
                     }
                 }
@@ -1560,13 +3435,22 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > COMPRESS_BUF_SIZE) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            decompress_data_with_multi_threads(f, host, len);
+            break;
+        case RAM_SAVE_FLAG_COMPRESS_METHOD:
+            method = qemu_get_byte(f);
+            decomp_codec = method < MIGRATION_COMPRESS_METHOD_MAX ?
+                           migration_codec_get(method) : NULL;
+            if (!decomp_codec) {
+                error_report("Compression method %d is not supported by "
+                             "this build", method);
+                ret = -EINVAL;
+            }
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1582,6 +3466,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            /* May have to wait for the channels, don't hold up RCU */
+            rcu_read_unlock();
+            ret = multifd_recv_sync_main();
+            rcu_read_lock();
+            multifd_synced = true;
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1599,12 +3490,22 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (!ret && !postcopy_running && !setup && !multifd_synced) {
+        multifd_recv_unused();
+    }
+
+    wait_for_decompress_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
 }
 
+static bool ram_can_postcopy(void *opaque)
+{
+    return migrate_postcopy_ram();
+}
+
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
@@ -1612,6 +3513,7 @@ static SaveVMHandlers savevm_ram_handlers = {
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
+    .can_postcopy = ram_can_postcopy,
 };
 
 void ram_mig_init(void)
@@ -1619,52 +3521,3 @@ void ram_mig_init(void)
     qemu_mutex_init(&XBZRLE.lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
-{
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
-    }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
-}
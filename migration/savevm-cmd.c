@@ -0,0 +1,274 @@
+/*
+ * Encoding and decoding of QEMU_VM_COMMAND stream elements
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The commands only frame their arguments; what the destination does with
+ * them is up to savevm.c.  Keeping the framing here, away from the target
+ * specific parts, lets the unit tests check both directions of the format.
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+static struct mig_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} mig_cmd_args[] = {
+    [MIG_CMD_INVALID]          = { .len = -1, .name = "INVALID" },
+    [MIG_CMD_OPEN_RETURN_PATH] = { .len =  0, .name = "OPEN_RETURN_PATH" },
+    [MIG_CMD_POSTCOPY_ADVISE]  = { .len =  8, .name = "POSTCOPY_ADVISE" },
+    [MIG_CMD_POSTCOPY_LISTEN]  = { .len =  0, .name = "POSTCOPY_LISTEN" },
+    [MIG_CMD_POSTCOPY_RUN]     = { .len =  0, .name = "POSTCOPY_RUN" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
+                                   .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
+    [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
+};
+
+/* Send a 'QEMU_VM_COMMAND' type element with the command
+ * and associated data.
+ *
+ * f: File to send command on
+ * command: Command type to send
+ * len: Length of associated data
+ * data: Data associated with command.
+ */
+void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                              uint16_t len, uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+void qemu_savevm_send_open_return_path(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, so the command contains just the length of the
+ * extra buffer that we then send straight after it.  The command length
+ * field is only 16 bits wide, while the device state is often larger.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
+{
+    size_t cur_iov;
+    size_t len = qsb_get_length(qsb);
+    uint32_t tmp;
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %zu",
+                     __func__, len);
+        return -1;
+    }
+
+    tmp = cpu_to_be32(len);
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
+
+    /* all the data follows (concatenating the iov's) */
+    for (cur_iov = 0; cur_iov < qsb->n_iov; cur_iov++) {
+        /* The iov entries are partially filled */
+        size_t towrite = MIN(qsb->iov[cur_iov].iov_len, len);
+        len -= towrite;
+
+        if (!towrite) {
+            break;
+        }
+
+        qemu_put_buffer(f, qsb->iov[cur_iov].iov_base, towrite);
+    }
+
+    return 0;
+}
+
+/* Sent prior to starting the destination running in postcopy, discard pages
+ * that have already been sent but redirtied on the source.
+ * CMD_POSTCOPY_RAM_DISCARD consist of:
+ *      byte   version (0)
+ *      byte   Length of name field
+ *  n x byte   RAM block name
+ *      [n x
+ *        be64 Start of discard range (offset into block)
+ *        be64 Length of discard range
+ *      ]
+ *
+ *  name:  RAMBlock name that these entries are part of
+ *  len: Number of page entries
+ *  start_list: 'len' addresses
+ *  length_list: 'len' lengths
+ *
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(2 + name_len + len * 16);
+    buf[0] = 0; /* Version */
+    buf[1] = name_len;
+    memcpy(buf + 2, name, name_len);
+    tmplen = 2 + name_len;
+
+    for (t = 0; t < len; t++) {
+        stq_be_p(buf + tmplen, start_list[t]);
+        tmplen += 8;
+        stq_be_p(buf + tmplen, length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
+/*
+ * Read the header of a 'QEMU_VM_COMMAND' element, whose type byte has
+ * already been consumed, and check the length that comes with it.
+ *
+ * Returns 0 on success, -EINVAL for an unknown command and -ERANGE if the
+ * length doesn't match the command.
+ */
+int qemu_loadvm_get_command(QEMUFile *f, uint16_t *cmd, uint16_t *len)
+{
+    *cmd = qemu_get_be16(f);
+    *len = qemu_get_be16(f);
+
+    trace_loadvm_process_command(*cmd, *len);
+    if (*cmd >= MIG_CMD_MAX || *cmd == MIG_CMD_INVALID) {
+        error_report("MIG_CMD 0x%x unknown (len 0x%x)", *cmd, *len);
+        return -EINVAL;
+    }
+
+    if (mig_cmd_args[*cmd].len != -1 && mig_cmd_args[*cmd].len != *len) {
+        error_report("%s received with bad length - expecting %zu, got %d",
+                     mig_cmd_args[*cmd].name,
+                     (size_t)mig_cmd_args[*cmd].len, *len);
+        return -ERANGE;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the blob of migration stream that follows a CMD_PACKAGED into a
+ * new buffer in *qsb, which the caller frees with qsb_free().
+ *
+ * Returns 0 on success and a negative value on error.
+ */
+int qemu_loadvm_get_packaged(QEMUFile *f, QEMUSizedBuffer **qsb)
+{
+    int ret;
+    uint8_t *buffer;
+    uint32_t length;
+
+    length = qemu_get_be32(f);
+    trace_loadvm_handle_cmd_packaged(length);
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+    buffer = g_malloc0(length);
+    ret = qemu_get_buffer(f, buffer, (int)length);
+    if (ret != length) {
+        g_free(buffer);
+        error_report("CMD_PACKAGED: Buffer receive fail ret=%d length=%u",
+                     ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+
+    *qsb = qsb_create(buffer, length);
+    g_free(buffer); /* Because qsb_create copies */
+    if (!*qsb) {
+        error_report("Unable to create qsb");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the fixed part of a CMD_POSTCOPY_RAM_DISCARD of length len: the
+ * version and the RAM block name, which is stored NUL-terminated in ramid
+ * (at least 256 bytes).  *count is set to the number of ranges that follow;
+ * read them with qemu_loadvm_get_discard_range().
+ *
+ * Returns 0 on success and -1 if the command is malformed.
+ */
+int qemu_loadvm_get_discard_header(QEMUFile *f, uint16_t len, char *ramid,
+                                   uint16_t *count)
+{
+    uint8_t ramid_len;
+
+    /* We're expecting a
+     *    Version (0)
+     *    a RAM ID string (length byte, name)
+     *    then at least 1 16 byte chunk
+    */
+    if (len < (1 + 1 + 1 + 16)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+
+    if (qemu_get_byte(f) != 0) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid version");
+        return -1;
+    }
+
+    ramid_len = qemu_get_byte(f);
+    if (ramid_len == 0 || len < 2 + ramid_len + 16 ||
+        (len - 2 - ramid_len) % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    qemu_get_buffer(f, (uint8_t *)ramid, ramid_len);
+    ramid[ramid_len] = '\0';
+    *count = (len - 2 - ramid_len) / 16;
+
+    return 0;
+}
+
+/* Read one range of a CMD_POSTCOPY_RAM_DISCARD */
+void qemu_loadvm_get_discard_range(QEMUFile *f, uint64_t *start,
+                                   uint64_t *length)
+{
+    uint8_t tmp[16];
+
+    qemu_get_buffer(f, tmp, 16);
+    *start = ldq_be_p(tmp);
+    *length = ldq_be_p(tmp + 8);
+}
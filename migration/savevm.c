@@ -37,6 +37,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
@@ -693,6 +694,16 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/* Send prior to any postcopy transfer; the destination checks that it
+ * can do postcopy and fails the migration early if not.
+ */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t tmp = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 8, (uint8_t *)&tmp);
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -759,7 +770,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
-int qemu_savevm_state_iterate(QEMUFile *f)
+int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret = 1;
@@ -774,6 +785,16 @@ int qemu_savevm_state_iterate(QEMUFile *f)
                 continue;
             }
         }
+        /*
+         * In the postcopy phase, any device that doesn't know how to
+         * do postcopy should have saved it's state in the _complete
+         * call that's already run, it might get confused if we call
+         * iterate afterwards.
+         */
+        if (postcopy &&
+            !(se->ops->can_postcopy && se->ops->can_postcopy(se->opaque))) {
+            continue;
+        }
         if (qemu_file_rate_limit(f)) {
             return 0;
         }
@@ -805,18 +826,20 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/*
+ * Send the END sections of the iterative handlers.  @precopy selects
+ * the handlers that can't continue once the destination runs, @postcopy
+ * the ones that can.
+ */
+static int savevm_state_complete_iterable(QEMUFile *f, bool precopy,
+                                          bool postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        bool can_postcopy;
+
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
@@ -825,6 +848,11 @@ void qemu_savevm_state_complete(QEMUFile *f)
                 continue;
             }
         }
+        can_postcopy = se->ops->can_postcopy &&
+                       se->ops->can_postcopy(se->opaque);
+        if (can_postcopy ? !postcopy : !precopy) {
+            continue;
+        }
         trace_savevm_section_start(se->idstr, se->section_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
@@ -834,13 +862,16 @@ void qemu_savevm_state_complete(QEMUFile *f)
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
+    return 0;
+}
+
+static void savevm_state_save_devices(QEMUFile *f, QJSON *vmdesc)
+{
+    SaveStateEntry *se;
 
-    vmdesc = qjson_new();
-    json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
-    json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -853,18 +884,41 @@ void qemu_savevm_state_complete(QEMUFile *f)
 
         trace_savevm_section_start(se->idstr, se->section_id);
 
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+        if (vmdesc) {
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+        }
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
 
         vmstate_save(f, se, vmdesc);
 
-        json_end_object(vmdesc);
+        if (vmdesc) {
+            json_end_object(vmdesc);
+        }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (savevm_state_complete_iterable(f, true, true) < 0) {
+        return;
+    }
+
+    vmdesc = qjson_new();
+    json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
+    json_start_array(vmdesc, "devices");
+    savevm_state_save_devices(f, vmdesc);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -882,6 +936,62 @@ void qemu_savevm_state_complete(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Entering postcopy: finish the iterative sections that can't carry on
+ * once the destination is running.
+ */
+void qemu_savevm_state_complete_iterable(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+    savevm_state_complete_iterable(f, true, false);
+}
+
+/* Entering postcopy: the device state, without any RAM or EOF marker */
+void qemu_savevm_state_save_devices(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+    savevm_state_save_devices(f, NULL);
+}
+
+/* End of postcopy: finish the sections still iterating, and the stream */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    if (savevm_state_complete_iterable(f, false, true) < 0) {
+        return;
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/*
+ * End of a background snapshot: finish RAM, then append the device state
+ * that was saved into 'devices' when the snapshot was taken.  Runs
+ * without the iothread lock, since whoever holds it may be blocked
+ * writing to a page that hasn't been saved yet.
+ */
+void qemu_savevm_state_complete_snapshot(QEMUFile *f,
+                                         const QEMUSizedBuffer *devices)
+{
+    size_t cur_iov;
+    size_t len = qsb_get_length(devices);
+
+    trace_savevm_state_complete();
+    if (savevm_state_complete_iterable(f, true, true) < 0) {
+        return;
+    }
+
+    /* The iov entries are partially filled */
+    for (cur_iov = 0; cur_iov < devices->n_iov && len; cur_iov++) {
+        size_t towrite = MIN(devices->iov[cur_iov].iov_len, len);
+
+        qemu_put_buffer(f, devices->iov[cur_iov].iov_base, towrite);
+        len -= towrite;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -931,7 +1041,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
     qemu_mutex_lock_iothread();
 
     while (qemu_file_get_error(f) == 0) {
-        if (qemu_savevm_state_iterate(f) > 0) {
+        if (qemu_savevm_state_iterate(f, false) > 0) {
             break;
         }
     }
@@ -1052,48 +1162,272 @@ void loadvm_free_handlers(MigrationIncomingState *mis)
     }
 }
 
-int qemu_loadvm_state(QEMUFile *f)
+/* Returned by qemu_loadvm_state_main when the stream hands over control */
+#define LOADVM_QUIT     1
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
+
+/*
+ * Thread that keeps reading the main migration stream once the destination
+ * is running in postcopy; the devices were loaded from the package that
+ * contained the RUN command, so all that is left is RAM pages and EOF.
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
 {
+    QEMUFile *f = opaque;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    Error *local_err = NULL;
-    uint8_t section_type;
-    unsigned int v;
-    int ret;
-    int file_error_after_eof = -1;
+    int load_res;
 
-    if (qemu_savevm_state_blocked(&local_err)) {
-        error_report_err(local_err);
-        return -EINVAL;
+    rcu_register_thread();
+    /*
+     * Because we're a thread and not a coroutine we can't yield
+     * in qemu_file, and thus we must be blocking now.
+     */
+    qemu_set_block(qemu_get_fd(f));
+    load_res = qemu_loadvm_state_main(f, mis);
+    /* And non-blocking again so we don't block in any cleanup */
+    qemu_set_nonblock(qemu_get_fd(f));
+
+    trace_postcopy_ram_listen_thread_exit(load_res);
+    if (load_res < 0) {
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        qemu_file_set_error(f, load_res);
+        migrate_generate_event(MIGRATION_STATUS_FAILED);
+        /*
+         * The guest is already running on this side and half of its RAM
+         * is still on the source; there is nothing sensible left to do.
+         */
+        exit(EXIT_FAILURE);
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        error_report("Not a migration stream");
-        return -EINVAL;
+    qemu_mutex_lock_iothread();
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+    migrate_send_rp_shut(mis, 0);
+    qemu_fclose(f);
+    migration_incoming_state_destroy();
+    migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Ask the source for a return path and open it; it will be used for
+ * page requests and for telling the source how we got on.
+ */
+static int loadvm_process_command_open_return_path(MigrationIncomingState *mis)
+{
+    mis->to_src_file = qemu_file_get_return_path(mis->file);
+    if (!mis->to_src_file) {
+        error_report("CMD_OPEN_RETURN_PATH failed");
+        return -1;
     }
+    return 0;
+}
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        error_report("SaveVM v2 format is obsolete and don't work anymore");
-        return -ENOTSUP;
+/* The source may want to use postcopy later: check we can do it */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_ADVISE);
+    uint64_t remote_tps;
+
+    trace_loadvm_postcopy_handle_advise();
+    if (ps != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)", ps);
+        return -1;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        error_report("Unsupported migration stream version");
-        return -ENOTSUP;
+
+    remote_tps = qemu_get_be64(f);
+    if (remote_tps != TARGET_PAGE_SIZE) {
+        error_report("Postcopy needs matching target page sizes (s=%"
+                     PRIu64 " d=%d)", remote_tps, TARGET_PAGE_SIZE);
+        return -1;
     }
 
-    if (!savevm_state.skip_configuration) {
-        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
-            error_report("Configuration section missing");
-            return -EINVAL;
-        }
-        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    if (postcopy_ram_incoming_init(mis)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              QEMUFile *f, uint16_t len)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_DISCARD);
+    char ramid[256];
+    uint16_t count;
+    int ret;
+
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     ps);
+        return -1;
+    }
+
+    if (qemu_loadvm_get_discard_header(f, len, ramid, &count)) {
+        return -1;
+    }
+
+    trace_loadvm_postcopy_ram_handle_discard(ramid, count);
+    while (count--) {
+        uint64_t start_addr, block_length;
+
+        qemu_loadvm_get_discard_range(f, &start_addr, &block_length);
 
+        ret = ram_discard_range(mis, ramid, start_addr, block_length);
         if (ret) {
             return ret;
         }
     }
 
+    return qemu_file_get_error(f);
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_LISTENING);
+
+    trace_loadvm_postcopy_handle_listen();
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+    if (!mis->to_src_file) {
+        error_report("CMD_POSTCOPY_LISTEN without a return path");
+        return -1;
+    }
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
+    }
+
+    migrate_generate_event(MIGRATION_STATUS_POSTCOPY_ACTIVE);
+
+    /*
+     * The rest of the main stream is read by the listen thread; the
+     * package we are being called from carries on in this coroutine.
+     */
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->file,
+                       QEMU_THREAD_DETACHED);
+
+    return 0;
+}
+
+/* After all discards we can start running and asking for pages */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_RUNNING);
+
+    trace_loadvm_postcopy_handle_run();
+    if (ps != POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    /* The guest is started by our caller once the package is loaded */
+    return LOADVM_QUIT;
+}
+
+/*
+ * Immediately following this command is a blob of data containing an
+ * embedded chunk of migration stream; read it and load it.
+ *
+ * Returns: Negative values on error
+ *          LOADVM_QUIT if the package contained a POSTCOPY_RUN
+ */
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis)
+{
+    int ret;
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+
+    ret = qemu_loadvm_get_packaged(mis->file, &qsb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Setup a dummy QEMUFile that actually reads from the buffer */
+    packf = qemu_bufopen("r", qsb);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    qemu_fclose(packf);
+    qsb_free(qsb);
+
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * 0           just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ * <0          Error
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint16_t len;
+    int ret;
+
+    ret = qemu_loadvm_get_command(f, &cmd, &len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    switch (cmd) {
+    case MIG_CMD_OPEN_RETURN_PATH:
+        return loadvm_process_command_open_return_path(mis);
+
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(mis);
+
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise(mis, f);
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen(mis);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, f, len);
+    }
+
+    return 0;
+}
+
+/*
+ * Load sections until EOF, or until a command tells us to stop.
+ *
+ * Returns: 0 on EOF
+ *          LOADVM_QUIT if a POSTCOPY_RUN handed over to the listen thread
+ *          <0 on error
+ */
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -1121,16 +1455,14 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 error_report("Unknown savevm section or instance '%s' %d",
                              idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 error_report("savevm: unsupported version %d for '%s' v%d",
                              version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1139,17 +1471,27 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state for instance 0x%x of"
                              " device '%s'", instance_id, idstr);
-                goto out;
+                g_free(le);
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                g_free(le);
+                return -EINVAL;
+            }
+            /*
+             * Only iterative sections are looked up again; keeping FULL
+             * ones off the list means the postcopy listen thread and a
+             * package loaded alongside it never walk it at the same time.
+             */
+            if (section_type == QEMU_VM_SECTION_START) {
+                QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            } else {
+                g_free(le);
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -1164,29 +1506,88 @@ int qemu_loadvm_state(QEMUFile *f)
             }
             if (le == NULL) {
                 error_report("Unknown savevm section %d", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state section id %d(%s)",
                              section_id, le->se->idstr);
-                goto out;
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret < 0 || ret == LOADVM_QUIT) {
+                return ret;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        error_report("Not a migration stream");
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        error_report("SaveVM v2 format is obsolete and don't work anymore");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        error_report("Unsupported migration stream version");
+        return -ENOTSUP;
+    }
+
+    if (!savevm_state.skip_configuration) {
+        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
+            error_report("Configuration section missing");
+            return -EINVAL;
+        }
+        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+
+        if (ret) {
+            return ret;
         }
     }
 
-    file_error_after_eof = qemu_file_get_error(f);
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret == LOADVM_QUIT) {
+        /*
+         * Postcopy: the listen thread owns the stream from here on and
+         * the devices are loaded; the caller starts the guest.
+         */
+        cpu_synchronize_all_post_init();
+        return 0;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qemu_file_get_error(f);
 
     /*
      * Try to read in the VMDESC section as well, so that dumping tools that
@@ -1198,10 +1599,10 @@ int qemu_loadvm_state(QEMUFile *f)
      * We also mustn't read data that isn't there; some transports (RDMA)
      * will stall waiting for that data when the source has already closed.
      */
-    if (should_send_vmdesc()) {
+    if (ret == 0 && should_send_vmdesc()) {
         uint8_t *buf;
         uint32_t size;
-        section_type = qemu_get_byte(f);
+        uint8_t section_type = qemu_get_byte(f);
 
         if (section_type != QEMU_VM_VMDESCRIPTION) {
             error_report("Expected vmdescription section, but got %d",
@@ -1225,14 +1626,7 @@ int qemu_loadvm_state(QEMUFile *f)
 
     cpu_synchronize_all_post_init();
 
-    ret = 0;
-
-out:
-    if (ret == 0) {
-        /* We may not have a VMDESC section, so ignore relative errors */
-        ret = file_error_after_eof;
-    }
-
+    /* We may not have a VMDESC section, so ignore relative errors */
     return ret;
 }
 
@@ -48,8 +48,20 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
     }
 }
 
+static QEMUFile *tcp_multifd_connect(MigrationState *s, int id, Error **errp)
+{
+    int fd = inet_connect(s->multifd_address, errp);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, "wb");
+}
+
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    s->multifd_address = g_strdup(host_port);
+    s->multifd_connect = tcp_multifd_connect;
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -65,28 +77,29 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = socket_error();
     } while (c < 0 && err == EINTR);
-    qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
-        return;
+        goto out;
     }
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        closesocket(c);
         goto out;
     }
 
-    process_incoming_migration(f);
-    return;
+    /* Keep listening while multifd channels are still to come */
+    if (!migration_incoming_process_channel(f)) {
+        return;
+    }
 
 out:
-    closesocket(c);
+    migration_incoming_close_listener();
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -98,6 +111,7 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp)
         return;
     }
 
+    migration_incoming_set_listener(s);
     qemu_set_fd_handler(s, tcp_accept_incoming_migration, NULL,
                         (void *)(intptr_t)s);
 }
@@ -48,8 +48,21 @@ static void unix_wait_for_connect(int fd, Error *err, void *opaque)
     }
 }
 
+static QEMUFile *unix_multifd_connect(MigrationState *s, int id,
+                                      Error **errp)
+{
+    int fd = unix_connect(s->multifd_address, errp);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, "wb");
+}
+
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp)
 {
+    s->multifd_address = g_strdup(path);
+    s->multifd_connect = unix_multifd_connect;
     unix_nonblocking_connect(path, unix_wait_for_connect, s, errp);
 }
 
@@ -65,28 +78,29 @@ static void unix_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = errno;
     } while (c < 0 && err == EINTR);
-    qemu_set_fd_handler(s, NULL, NULL, NULL);
-    close(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
-        return;
+        goto out;
     }
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        close(c);
         goto out;
     }
 
-    process_incoming_migration(f);
-    return;
+    /* Keep listening while multifd channels are still to come */
+    if (!migration_incoming_process_channel(f)) {
+        return;
+    }
 
 out:
-    close(c);
+    migration_incoming_close_listener();
 }
 
 void unix_start_incoming_migration(const char *path, Error **errp)
@@ -98,6 +112,7 @@ void unix_start_incoming_migration(const char *path, Error **errp)
         return;
     }
 
+    migration_incoming_set_listener(s);
     qemu_set_fd_handler(s, unix_accept_incoming_migration, NULL,
                         (void *)(intptr_t)s);
 }
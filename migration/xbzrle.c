@@ -11,6 +11,7 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -23,13 +24,174 @@
 
   length = uleb128 encoded integer
  */
+
+/*
+ * The encoder is the same for every host; only finding where a run
+ * ends is vectorized.  Each of these returns the length of the run of
+ * equal (zrun) or differing (nzrun) bytes at the start of @a and @b,
+ * at most @len.
+ */
+typedef int (*XBZRLERunFunc)(const uint8_t *a, const uint8_t *b, int len);
+
+static int zrun_len_long(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(a + i) % sizeof(long))) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + sizeof(long) <= len &&
+           *(long *)(a + i) == *(long *)(b + i)) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_len_long(const uint8_t *a, const uint8_t *b, int len)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    int i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(a + i) % sizeof(long))) {
+        if (a[i] == b[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i + sizeof(long) <= len) {
+        unsigned long xor;
+        xor = *(unsigned long *)(a + i) ^ *(unsigned long *)(b + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* the nzrun ends within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < len && a[i] != b[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Mask of the bytes that are equal in the 16 at @a and @b */
+static inline unsigned xbzrle_eq_mask_sse2(const uint8_t *a, const uint8_t *b)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+
+static int zrun_len_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        unsigned mask = xbzrle_eq_mask_sse2(a + i, b + i);
+
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    return i + zrun_len_long(a + i, b + i, len - i);
+}
+
+static int nzrun_len_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        unsigned mask = xbzrle_eq_mask_sse2(a + i, b + i);
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return i + nzrun_len_long(a + i, b + i, len - i);
+}
+
+static XBZRLERunFunc xbzrle_zrun_len = zrun_len_sse2;
+static XBZRLERunFunc xbzrle_nzrun_len = nzrun_len_sse2;
+#else
+static XBZRLERunFunc xbzrle_zrun_len = zrun_len_long;
+static XBZRLERunFunc xbzrle_nzrun_len = nzrun_len_long;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+static inline uint32_t __attribute__((target("avx2")))
+xbzrle_eq_mask_avx2(const uint8_t *a, const uint8_t *b)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i *)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i *)b);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+static int __attribute__((target("avx2")))
+zrun_len_avx2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        uint32_t mask = xbzrle_eq_mask_avx2(a + i, b + i);
+
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    return i + zrun_len_long(a + i, b + i, len - i);
+}
+
+static int __attribute__((target("avx2")))
+nzrun_len_avx2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        uint32_t mask = xbzrle_eq_mask_avx2(a + i, b + i);
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return i + nzrun_len_long(a + i, b + i, len - i);
+}
+
+static void __attribute__((constructor)) xbzrle_init(void)
+{
+    if (qemu_cpu_has_avx2()) {
+        xbzrle_zrun_len = zrun_len_avx2;
+        xbzrle_nzrun_len = nzrun_len_avx2;
+    }
+}
+#endif
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +202,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = xbzrle_zrun_len(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,51 +217,21 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = xbzrle_nzrun_len(old_buf + i, new_buf + i, slen - i);
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
@@ -32,9 +32,12 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                selects emulated machine ('-machine help' for list)\n"
     "                property accel=accel1[:accel2[:...]] selects accelerator\n"
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
+    "                tcg-thread=single|multi runs TCG vCPUs on one shared thread or one thread each (default: single)\n"
+    "                tb-cache=file keeps translated code in file for later runs\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm-dirty-ring-size=n tracks dirty pages in per-vCPU rings of n entries (default: 0, off)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -54,6 +57,27 @@ This is used to enable an accelerator. Depending on the target architecture,
 kvm, xen, or tcg can be available. By default, tcg is used. If there is more
 than one accelerator specified, the next one is used if the previous one fails
 to initialize.
+@item tcg-thread=single|multi
+Selects how TCG executes the guest vCPUs.  With @option{single} (the default)
+all vCPUs are run round-robin on one host thread.  With @option{multi} every
+vCPU gets its own host thread, so SMP guests can use several host cores.
+Multi-threaded TCG is only available for targets whose atomic operations are
+safe to run in parallel, and it cannot be combined with @option{-icount}.
+TCG does not add barriers for the guest's implicit memory ordering, so
+@option{multi} is not reliable when the guest orders memory accesses more
+strongly than the host (for example an x86 guest on an ARM host); QEMU
+warns when it is enabled in that case.
+@item tb-cache=@var{file}
+Keeps the code translated by TCG in @var{file}, and reuses it when the
+same guest code is executed again by a later run, for example when the
+same image is booted many times.  A block is reused only if the guest
+page it was translated from is unchanged, and the whole file is discarded
+when it was written by a different QEMU binary or for a different machine
+type, CPU model or TCG configuration.  The file can be shared by several
+QEMU processes of the same user.  Because the translated code in it is
+executed directly, QEMU refuses a file that is owned by another user or
+writable by group or others.  Blocks are not cached while the debugger
+has breakpoints set.  This is only supported on x86_64 Linux hosts.
 @item kernel_irqchip=on|off
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item gfx_passthru=on|off
@@ -64,6 +88,12 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=n
+Collect dirty pages from a ring of @var{n} entries per vCPU, which must be a
+power of two, instead of from per-slot bitmaps.  Syncing the dirty log then
+costs in proportion to the number of pages dirtied rather than to the size of
+guest memory.  A vCPU whose ring fills up waits until it has been harvested.
+The default, 0, uses bitmaps.  Needs host support for KVM_CAP_DIRTY_LOG_RING.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -464,8 +494,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring][,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
@@ -507,7 +537,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike "native", "io_uring" does not require @option{cache.direct=on}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3306,6 +3336,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                accept incoming migration from a file saved with file:\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3324,6 +3356,9 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{path}
+Accept incoming migration from a file written by @code{migrate file:path}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -659,6 +659,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an outgoing migration that has the x-postcopy-ram capability
+enabled from precopy into postcopy mode.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2491,6 +2513,13 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the format of the node,
+                     tagged with "type". For qcow2 it contains:
+    - "l2-cache-hits": L2 table lookups served from the cache (json-int)
+    - "l2-cache-misses": L2 table lookups that read the image (json-int)
+    - "l2-cache-size": bytes the L2 cache may currently use (json-int)
+    - "l2-cache-entry-size": size of a cached L2 slice in bytes (json-int)
+  (json-object, optional)
 
 Example:
 
@@ -2652,6 +2681,11 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum time aio_poll busy-polls for before blocking,
+                 0 if polling is disabled (json-int)
+- "poll-grow": factor the polling time grows by, 0 for the default (json-int)
+- "poll-shrink": factor the polling time shrinks by, 0 to disable polling
+                 after a long wait (json-int)
 
 Example:
 
@@ -2660,11 +2694,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3303,6 +3343,19 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following compression information:
+         - "method": codec used to compress the pages (json-string)
+         - "pages": number of compressed pages (json-int)
+         - "compressed-size": number of bytes sent for compressed pages
+           (json-int)
+         - "compression-rate": ratio between the size of the pages and
+           the bytes sent for them (json-number)
+         - "throughput": megabytes compressed per second of compression
+           thread time (json-number)
+- "x-cpu-throttle-percentage": only present while auto-converge is
+                               throttling the guest cpus; the percentage
+                               of time they are throttled (json-int)
 
 Examples:
 
@@ -3432,6 +3485,11 @@ Enable/Disable migration capabilities
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
 - "events": generate events for each migration state change
+- "x-postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM over several parallel connections
+- "x-zero-copy-send": send multifd pages without copying them
+- "x-background-snapshot": save a snapshot while the guest keeps running
+- "x-mapped-ram": write pages at fixed offsets of a migration file
 
 Arguments:
 
@@ -3484,6 +3542,15 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "x-multifd-channels": set the number of multifd channels (json-int)
+- "x-cpu-throttle-initial": set initial percentage of time guest cpus are
+                            throttled for auto-converge (json-int)
+- "x-cpu-throttle-increment": set the largest step the auto-converge throttle
+                              percentage is raised by (json-int)
+- "x-compress-method": set the codec used for compression, one of "zlib",
+                       "lz4" or "zstd" (json-string)
+- "x-bitmap-sync-threads": set the number of threads syncing the dirty
+                           bitmap (json-int)
 
 Arguments:
 
@@ -3497,7 +3564,10 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-multifd-channels:i?,x-cpu-throttle-initial:i?,"
+            "x-cpu-throttle-increment:i?,x-compress-method:s?,"
+            "x-bitmap-sync-threads:i?",
 	.mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
     },
 SQMP
@@ -3510,6 +3580,14 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "x-multifd-channels" : number of multifd channels (json-int)
+         - "x-cpu-throttle-initial" : initial percentage of time guest cpus are
+                                      throttled (json-int)
+         - "x-cpu-throttle-increment" : largest throttle percentage
+                                        increment (json-int)
+         - "x-compress-method" : codec used for compression (json-string)
+         - "x-bitmap-sync-threads" : number of threads syncing the dirty
+                                     bitmap (json-int)
 
 Arguments:
 
@@ -3520,7 +3598,12 @@ Example:
       "return": {
          "decompress-threads", 2,
          "compress-threads", 8,
-         "compress-level", 1
+         "compress-level", 1,
+         "x-multifd-channels", 2,
+         "x-cpu-throttle-initial", 20,
+         "x-cpu-throttle-increment", 10,
+         "x-compress-method", "zlib",
+         "x-bitmap-sync-threads", 4
       }
    }
 
@@ -530,6 +530,10 @@ DEF_HELPER_2(dc_zva, void, env, i64)
 DEF_HELPER_FLAGS_2(neon_pmull_64_lo, TCG_CALL_NO_RWG_SE, i64, i64, i64)
 DEF_HELPER_FLAGS_2(neon_pmull_64_hi, TCG_CALL_NO_RWG_SE, i64, i64, i64)
 
+#ifdef CONFIG_USER_ONLY
+DEF_HELPER_5(strex, i32, env, i64, i64, i64, i32)
+#endif
+
 #ifdef TARGET_AARCH64
 #include "helper-a64.h"
 #endif
@@ -72,6 +72,76 @@ uint32_t HELPER(neon_tbl)(CPUARMState *env, uint32_t ireg, uint32_t def,
     return val;
 }
 
+#ifdef CONFIG_USER_ONLY
+/* Guest memory image of a pair of 32-bit words, VAL holding the word at
+ * the lower address in its low half.
+ */
+static uint64_t strex_pair_image(uint64_t val)
+{
+    uint32_t w[2] = { tswap32(val), tswap32(val >> 32) };
+    uint64_t ret;
+
+    memcpy(&ret, w, sizeof(ret));
+    return ret;
+}
+
+/* Store exclusive for user-mode emulation.  The store succeeds if the
+ * monitor is still armed for ADDR and memory still holds CMPV, the value
+ * seen by the load exclusive.  Doing the comparison and the store with a
+ * host compare-and-swap makes them atomic with respect to the other guest
+ * threads, so unlike EXCP_STREX they need not be stopped.
+ * INFO is the log2 of the access size, ORed with 4 for a pair of 32-bit
+ * words.  Returns 0 on success and 1 on failure, like the instruction.
+ */
+uint32_t HELPER(strex)(CPUARMState *env, uint64_t addr, uint64_t cmpv,
+                       uint64_t newv, uint32_t info)
+{
+    int size = extract32(info, 0, 2);
+    bool is_pair = extract32(info, 2, 1);
+    void *haddr;
+    bool ok;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if (page_check_range(addr, (1 << size) << is_pair, PAGE_WRITE) < 0) {
+        env->exception.vaddress = addr;
+        raise_exception(env, EXCP_DATA_ABORT, 0, exception_target_el(env));
+    }
+
+    haddr = g2h(addr);
+    switch (size) {
+    case 0:
+        ok = atomic_cmpxchg((uint8_t *)haddr, (uint8_t)cmpv,
+                            (uint8_t)newv) == (uint8_t)cmpv;
+        break;
+    case 1:
+        ok = atomic_cmpxchg((uint16_t *)haddr, tswap16(cmpv),
+                            tswap16(newv)) == tswap16(cmpv);
+        break;
+    case 2:
+        if (!is_pair) {
+            ok = atomic_cmpxchg((uint32_t *)haddr, tswap32(cmpv),
+                                tswap32(newv)) == tswap32(cmpv);
+            break;
+        }
+        cmpv = strex_pair_image(cmpv);
+        newv = strex_pair_image(newv);
+        ok = atomic_cmpxchg((uint64_t *)haddr, cmpv, newv) == cmpv;
+        break;
+    case 3:
+        /* 128-bit pairs still go through EXCP_STREX.  */
+        assert(!is_pair);
+        ok = atomic_cmpxchg((uint64_t *)haddr, tswap64(cmpv),
+                            tswap64(newv)) == tswap64(cmpv);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return !ok;
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
 /* try to fill the TLB and return an exception if error. If retaddr is
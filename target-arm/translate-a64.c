@@ -291,7 +291,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
         } else if (s->singlestep_enabled) {
             gen_exception_internal(EXCP_DEBUG);
         } else {
-            tcg_gen_exit_tb(0);
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
             s->is_jmp = DISAS_TB_JUMP;
         }
     }
@@ -759,19 +759,18 @@ static void do_gpr_ld(DisasContext *s, TCGv_i64 dest, TCGv_i64 tcg_addr,
 static void do_fp_st(DisasContext *s, int srcidx, TCGv_i64 tcg_addr, int size)
 {
     /* This writes the bottom N bits of a 128 bit wide vector to memory */
-    TCGv_i64 tmp = tcg_temp_new_i64();
-    tcg_gen_ld_i64(tmp, cpu_env, fp_reg_offset(s, srcidx, MO_64));
-    if (size < 4) {
-        tcg_gen_qemu_st_i64(tmp, tcg_addr, get_mem_index(s), MO_TE + size);
-    } else {
-        TCGv_i64 tcg_hiaddr = tcg_temp_new_i64();
-        tcg_gen_qemu_st_i64(tmp, tcg_addr, get_mem_index(s), MO_TEQ);
-        tcg_gen_ld_i64(tmp, cpu_env, fp_reg_hi_offset(s, srcidx));
-        tcg_gen_addi_i64(tcg_hiaddr, tcg_addr, 8);
-        tcg_gen_qemu_st_i64(tmp, tcg_hiaddr, get_mem_index(s), MO_TEQ);
-        tcg_temp_free_i64(tcg_hiaddr);
+    TCGv_i64 tmp;
+
+    if (size == 4) {
+        /* The high half directly follows the low half in env.  */
+        tcg_gen_qemu_st_v128(cpu_env, fp_reg_offset(s, srcidx, MO_64),
+                             tcg_addr, get_mem_index(s), MO_TEQ);
+        return;
     }
 
+    tmp = tcg_temp_new_i64();
+    tcg_gen_ld_i64(tmp, cpu_env, fp_reg_offset(s, srcidx, MO_64));
+    tcg_gen_qemu_st_i64(tmp, tcg_addr, get_mem_index(s), MO_TE + size);
     tcg_temp_free_i64(tmp);
 }
 
@@ -781,24 +780,19 @@ static void do_fp_st(DisasContext *s, int srcidx, TCGv_i64 tcg_addr, int size)
 static void do_fp_ld(DisasContext *s, int destidx, TCGv_i64 tcg_addr, int size)
 {
     /* This always zero-extends and writes to a full 128 bit wide vector */
-    TCGv_i64 tmplo = tcg_temp_new_i64();
-    TCGv_i64 tmphi;
-
-    if (size < 4) {
-        TCGMemOp memop = MO_TE + size;
-        tmphi = tcg_const_i64(0);
-        tcg_gen_qemu_ld_i64(tmplo, tcg_addr, get_mem_index(s), memop);
-    } else {
-        TCGv_i64 tcg_hiaddr;
-        tmphi = tcg_temp_new_i64();
-        tcg_hiaddr = tcg_temp_new_i64();
+    TCGv_i64 tmplo, tmphi;
 
-        tcg_gen_qemu_ld_i64(tmplo, tcg_addr, get_mem_index(s), MO_TEQ);
-        tcg_gen_addi_i64(tcg_hiaddr, tcg_addr, 8);
-        tcg_gen_qemu_ld_i64(tmphi, tcg_hiaddr, get_mem_index(s), MO_TEQ);
-        tcg_temp_free_i64(tcg_hiaddr);
+    if (size == 4) {
+        /* All 128 bits are written, so there is nothing to zero-extend.  */
+        tcg_gen_qemu_ld_v128(cpu_env, fp_reg_offset(s, destidx, MO_64),
+                             tcg_addr, get_mem_index(s), MO_TEQ);
+        return;
     }
 
+    tmplo = tcg_temp_new_i64();
+    tmphi = tcg_const_i64(0);
+    tcg_gen_qemu_ld_i64(tmplo, tcg_addr, get_mem_index(s), MO_TE + size);
+
     tcg_gen_st_i64(tmplo, cpu_env, fp_reg_offset(s, destidx, MO_64));
     tcg_gen_st_i64(tmphi, cpu_env, fp_reg_hi_offset(s, destidx));
 
@@ -1621,7 +1615,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
             return;
         }
         gen_helper_exception_return(cpu_env);
-        s->is_jmp = DISAS_JUMP;
+        s->is_jmp = DISAS_EXIT;
         return;
     case 5: /* DRPS */
         if (rn != 0x1f) {
@@ -1679,8 +1673,10 @@ static void disas_b_exc_sys(DisasContext *s, uint32_t insn)
  * and avoids having to monitor regular stores.
  *
  * In system emulation mode only one CPU will be running at once, so
- * this sequence is effectively atomic.  In user emulation mode we
- * throw an exception and handle the atomic operation elsewhere.
+ * this sequence is effectively atomic.  In user emulation mode the
+ * store is done by a helper with a host compare-and-swap, except for
+ * 128-bit pairs, where we throw an exception and handle the atomic
+ * operation elsewhere.
  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i64 addr, int size, bool is_pair)
@@ -1715,10 +1711,41 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i64 addr, int size, int is_pair)
 {
-    tcg_gen_mov_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | is_pair << 2 | (rd << 4) | (rt << 9) | (rt2 << 14));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    TCGv_i64 cmpv, newv;
+    TCGv_i32 tmp, info;
+
+    if (is_pair && size == 3) {
+        /* No 128-bit host compare-and-swap; stop the world instead.  */
+        tcg_gen_mov_i64(cpu_exclusive_test, addr);
+        tcg_gen_movi_i32(cpu_exclusive_info,
+                         size | is_pair << 2 | (rd << 4) | (rt << 9) |
+                         (rt2 << 14));
+        gen_exception_internal_insn(s, 4, EXCP_STREX);
+        return;
+    }
+
+    cmpv = tcg_temp_new_i64();
+    newv = tcg_temp_new_i64();
+    if (is_pair) {
+        tcg_gen_deposit_i64(cmpv, cpu_exclusive_val, cpu_exclusive_high,
+                            32, 32);
+        tcg_gen_deposit_i64(newv, cpu_reg(s, rt), cpu_reg(s, rt2), 32, 32);
+    } else {
+        tcg_gen_mov_i64(cmpv, cpu_exclusive_val);
+        tcg_gen_mov_i64(newv, cpu_reg(s, rt));
+    }
+
+    /* The helper raises a data abort if the store faults.  */
+    gen_a64_set_pc_im(s->pc - 4);
+    tmp = tcg_temp_new_i32();
+    info = tcg_const_i32(size | is_pair << 2);
+    gen_helper_strex(tmp, cpu_env, addr, cmpv, newv, info);
+    tcg_gen_extu_i32_i64(cpu_reg(s, rd), tmp);
+    tcg_temp_free_i32(info);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i64(newv);
+    tcg_temp_free_i64(cmpv);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -11162,7 +11189,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        if (dc->is_jmp != DISAS_JUMP && dc->is_jmp != DISAS_EXIT) {
             gen_a64_set_pc_im(dc->pc);
         }
         if (cs->singlestep_enabled) {
@@ -11179,10 +11206,14 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
         case DISAS_UPDATE:
             gen_a64_set_pc_im(dc->pc);
             /* fall through */
-        case DISAS_JUMP:
+        case DISAS_EXIT:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_JUMP:
+            /* look up the next TB without leaving the generated code */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
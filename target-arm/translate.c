@@ -3989,7 +3989,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
         tcg_gen_exit_tb((uintptr_t)tb + n);
     } else {
         gen_set_pc_im(s, dest);
-        tcg_gen_exit_tb(0);
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     }
 }
 
@@ -4966,6 +4966,61 @@ static const uint8_t neon_3r_sizes[] = {
     [NEON_3R_FLOAT_MISC] = 0x5, /* size bit 1 encodes op */
 };
 
+/* Expand the Neon 3-reg-same integer ops that have a direct TCG vector
+ * equivalent, operating on whole D or Q registers in env.  Returns false
+ * if the insn must go through the per-pass code instead.
+ */
+static bool gen_neon_3r_vec(int op, int u, int size, int q,
+                            int rd, int rn, int rm)
+{
+    uint32_t dofs = vfp_reg_offset(1, rd);
+    uint32_t nofs = vfp_reg_offset(1, rn);
+    uint32_t mofs = vfp_reg_offset(1, rm);
+    uint32_t oprsz = q ? 16 : 8;
+
+    switch (op) {
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_gvec_and(cpu_env, dofs, nofs, mofs, oprsz);
+            return true;
+        case 1: /* VBIC */
+            tcg_gen_gvec_andc(cpu_env, dofs, nofs, mofs, oprsz);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_gvec_or(cpu_env, dofs, nofs, mofs, oprsz);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_gvec_xor(cpu_env, dofs, nofs, mofs, oprsz);
+            return true;
+        }
+        return false;
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_gvec_sub(cpu_env, size, dofs, nofs, mofs, oprsz);
+        } else {
+            tcg_gen_gvec_add(cpu_env, size, dofs, nofs, mofs, oprsz);
+        }
+        return true;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, dofs, nofs, mofs, oprsz);
+        return true;
+    case NEON_3R_VCGT:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GTU : TCG_COND_GT, size,
+                         dofs, nofs, mofs, oprsz);
+        return true;
+    case NEON_3R_VCGE:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GEU : TCG_COND_GE, size,
+                         dofs, nofs, mofs, oprsz);
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* Symbolic constants for op fields for Neon 2-register miscellaneous.
  * The values correspond to bits [17:16,10:7]; see the ARM ARM DDI0406B
  * table A7-13.
@@ -5206,6 +5261,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3r_vec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7421,8 +7479,9 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic.  In user emulation mode the
+   comparison and the store are done by a helper with a host
+   compare-and-swap, so other threads keep running.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7471,10 +7530,30 @@ static void gen_clrex(DisasContext *s)
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    TCGv_i64 extaddr = tcg_temp_new_i64();
+    TCGv_i64 val64 = tcg_temp_new_i64();
+    TCGv_i32 tmp, info;
+
+    tcg_gen_extu_i32_i64(extaddr, addr);
+    tmp = load_reg(s, rt);
+    if (size == 3) {
+        TCGv_i32 tmp2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(val64, tmp, tmp2);
+        tcg_temp_free_i32(tmp2);
+    } else {
+        tcg_gen_extu_i32_i64(val64, tmp);
+    }
+
+    /* The helper raises a data abort if the store faults.  */
+    gen_set_condexec(s);
+    gen_set_pc_im(s, s->pc - 4);
+    info = tcg_const_i32(size == 3 ? 2 | 4 : size);
+    gen_helper_strex(tmp, cpu_env, extaddr, cpu_exclusive_val, val64, info);
+    tcg_temp_free_i32(info);
+    tcg_temp_free_i64(val64);
+    tcg_temp_free_i64(extaddr);
+    store_reg(s, rd, tmp);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
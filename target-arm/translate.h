@@ -119,6 +119,10 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* Like DISAS_JUMP, but the CPU state may have changed as well, so the
+ * next TB must be looked up from the main loop rather than chained to.
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
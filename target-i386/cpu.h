@@ -29,6 +29,9 @@
 #define TARGET_LONG_BITS 32
 #endif
 
+/* The x86 has a strong memory model with some store-after-load re-ordering */
+#define TCG_GUEST_DEFAULT_MO      (TCG_MO_ALL & ~TCG_MO_ST_LD)
+
 /* Maximum instruction code size */
 #define TARGET_MAX_INSN_SIZE 16
 
@@ -1326,6 +1329,7 @@ void cpu_set_fpuc(CPUX86State *env, uint16_t val);
 
 /* mem_helper.c */
 void helper_lock_init(void);
+void helper_lock_reset(void);
 
 /* svm_helper.c */
 void cpu_svm_check_intercept_param(CPUX86State *env1, uint32_t type,
@@ -21,38 +21,44 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 
-/* broken thread support */
-
-#if defined(CONFIG_USER_ONLY)
-QemuMutex global_cpu_lock;
+/* Serialises LOCK-prefixed instructions between vCPU threads.  This is
+ * needed for user-mode emulation and for multi-threaded TCG; with a single
+ * TCG thread it is not taken at all.
+ */
+static QemuMutex global_cpu_lock;
+static __thread bool global_cpu_lock_held;
 
 void helper_lock(void)
 {
+#if !defined(CONFIG_USER_ONLY)
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+#endif
     qemu_mutex_lock(&global_cpu_lock);
+    global_cpu_lock_held = true;
 }
 
 void helper_unlock(void)
 {
-    qemu_mutex_unlock(&global_cpu_lock);
-}
-
-void helper_lock_init(void)
-{
-    qemu_mutex_init(&global_cpu_lock);
-}
-#else
-void helper_lock(void)
-{
+    if (global_cpu_lock_held) {
+        global_cpu_lock_held = false;
+        qemu_mutex_unlock(&global_cpu_lock);
+    }
 }
 
-void helper_unlock(void)
+/* Called when a LOCK-prefixed instruction faults and cpu_exec unwinds
+ * past the helper_unlock call at the end of the instruction.
+ */
+void helper_lock_reset(void)
 {
+    helper_unlock();
 }
 
 void helper_lock_init(void)
 {
+    qemu_mutex_init(&global_cpu_lock);
 }
-#endif
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
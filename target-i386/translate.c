@@ -128,6 +128,7 @@ typedef struct DisasContext {
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_jr(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d);
@@ -2208,9 +2209,9 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
         gen_jmp_im(eip);
         tcg_gen_exit_tb((uintptr_t)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to another page: look the block up at run time */
         gen_jmp_im(eip);
-        gen_eob(s);
+        gen_jr(s);
     }
 }
 
@@ -2535,11 +2536,15 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 
 /* generate a generic end of block. Trace exception is also generated
    if needed */
-static void gen_eob(DisasContext *s)
+/* End of block.  If JR is set, eip has just been loaded by a jump and
+   the next block can be looked up without leaving the generated code,
+   unless interrupts have to be checked first.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     gen_update_cc_op(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
         gen_helper_reset_inhibit_irq(cpu_env);
+        jr = false;
     }
     if (s->tb->flags & HF_RF_MASK) {
         gen_helper_reset_rf(cpu_env);
@@ -2548,12 +2553,25 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr) {
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* End of block after a jump to the address in eip.  */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2589,21 +2607,32 @@ static inline void gen_stq_env_A0(DisasContext *s, int offset)
 static inline void gen_ldo_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
+#ifdef HOST_WORDS_BIGENDIAN
+    /* XMM_Q(0) does not come first in host memory.  */
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
+#else
+    tcg_gen_qemu_ld_v128(cpu_env, offset + offsetof(XMMReg, XMM_Q(0)),
+                         cpu_A0, mem_index, MO_LEQ);
+#endif
 }
 
 static inline void gen_sto_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
+#ifdef HOST_WORDS_BIGENDIAN
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
+#else
+    tcg_gen_qemu_st_v128(cpu_env, offset + offsetof(XMMReg, XMM_Q(0)),
+                         cpu_A0, mem_index, MO_LEQ);
+#endif
 }
 
 static inline void gen_op_movo(int d_offset, int s_offset)
@@ -2962,6 +2991,81 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the common integer MMX/SSE operations inline instead of calling
+   the ops_sse.h helpers; OPRSZ is 8 for MMX and 16 for SSE.  Returns
+   false if B is not one of them.  */
+static bool gen_sse_vec(int b, int op1_offset, int op2_offset, int oprsz)
+{
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_gvec_add(cpu_env, b - 0xfc, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(cpu_env, MO_64, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_gvec_sub(cpu_env, b - 0xf8, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, b - 0x74, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_GT, b - 0x64, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Likewise for the shifts by immediate in opcodes 0x71...0x73.  */
+static bool gen_sse_shifti(int b, int op, int offset, int val, int oprsz)
+{
+    unsigned vece = (b & 0xff) - 0x70;
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2: /* psrlw, psrld, psrlq */
+        if (val >= bits) {
+            tcg_gen_gvec_dupi(cpu_env, MO_64, offset, oprsz, 0);
+        } else {
+            tcg_gen_gvec_shri(cpu_env, vece, offset, offset, val, oprsz);
+        }
+        break;
+    case 4: /* psraw, psrad */
+        tcg_gen_gvec_sari(cpu_env, vece, offset, offset,
+                          MIN(val, bits - 1), oprsz);
+        break;
+    case 6: /* psllw, pslld, psllq */
+        if (val >= bits) {
+            tcg_gen_gvec_dupi(cpu_env, MO_64, offset, oprsz, 0);
+        } else {
+            tcg_gen_gvec_shli(cpu_env, vece, offset, offset, val, oprsz);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3366,6 +3470,22 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto illegal_op;
             }
             val = cpu_ldub_code(env, s->pc++);
+            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
+                                       (((modrm >> 3)) & 7)][b1];
+            if (!sse_fn_epp) {
+                goto illegal_op;
+            }
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            if (gen_sse_shifti(b, (modrm >> 3) & 7, op2_offset, val,
+                               is_xmm ? 16 : 8)) {
+                break;
+            }
             if (is_xmm) {
                 tcg_gen_movi_tl(cpu_T[0], val);
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,xmm_t0.XMM_L(0)));
@@ -3379,18 +3499,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,mmx_t0.MMX_L(1)));
                 op1_offset = offsetof(CPUX86State,mmx_t0);
             }
-            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
-                                       (((modrm >> 3)) & 7)][b1];
-            if (!sse_fn_epp) {
-                goto illegal_op;
-            }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4378,6 +4486,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4925,7 +5036,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -4950,7 +5061,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -6345,14 +6456,14 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_stack_update(s, val + (1 << ot));
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
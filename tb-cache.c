@@ -0,0 +1,605 @@
+/*
+ * Persistent cache of translated blocks
+ *
+ * Copyright (c) 2015 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The cache file starts with a TBCacheHeader, followed by one record per
+ * block: a TBCacheEntry, the relocations of the host code, the host code
+ * itself and the guest code it was translated from, padded to 8 bytes.
+ *
+ * Blocks are looked up by guest pc, cs_base, flags, cflags and a hash of
+ * the guest page that contains pc; the guest code is compared byte by
+ * byte before a block is used.  The header identifies the QEMU binary
+ * and the machine configuration, and a file written by anything else is
+ * replaced rather than reused.  Files are never truncated in place, so
+ * that other QEMU processes can keep their mapping of an older cache.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/bitops.h"
+#include "exec/ram_addr.h"
+#include "exec/tb-cache.h"
+#include "hw/boards.h"
+#include "sysemu/sysemu.h"
+
+#define TB_CACHE_MAGIC      0x48434143425442ULL /* "BTCACH" */
+#define TB_CACHE_VERSION    1
+
+/* The whole file is mapped, so keep it bounded.  */
+#define TB_CACHE_MAX_SIZE   (256 * 1024 * 1024)
+
+/* New blocks are appended to the file in batches of this size.  */
+#define TB_CACHE_FLUSH_SIZE (1024 * 1024)
+
+typedef struct TBCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_bits;
+    uint64_t build_id;
+    uint64_t config_id;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t checksum;          /* of the rest of the record */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t page_hash[2];      /* of the one or two guest pages */
+    uint32_t cflags;
+    uint32_t code_size;
+    uint32_t nb_relocs;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+} TBCacheEntry;
+
+typedef struct TBCache {
+    char *path;
+    int fd;
+    Notifier init_done;
+    Notifier exit;
+    TBCacheHeader header;
+
+    void *map;
+    size_t map_size;
+    size_t file_size;
+    GHashTable *index;
+    GByteArray *pending;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long rejected;
+    unsigned long saved;
+    unsigned long uncacheable;
+} TBCache;
+
+static TBCache *tb_cache;
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+static inline uint64_t tb_cache_round(uint64_t acc, uint64_t v)
+{
+    acc += v * PRIME64_2;
+    acc = rol64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+/* A 64-bit hash in the style of xxh64; four independent lanes keep a
+   whole guest page cheap to hash.  */
+static uint64_t tb_cache_hash(const void *buf, size_t len, uint64_t seed)
+{
+    const uint8_t *p = buf;
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    uint64_t h;
+
+    h = len;
+    for (; len >= 32; len -= 32, p += 32) {
+        v1 = tb_cache_round(v1, ldq_le_p(p));
+        v2 = tb_cache_round(v2, ldq_le_p(p + 8));
+        v3 = tb_cache_round(v3, ldq_le_p(p + 16));
+        v4 = tb_cache_round(v4, ldq_le_p(p + 24));
+    }
+    h += rol64(v1, 1) + rol64(v2, 7) + rol64(v3, 12) + rol64(v4, 18);
+    for (; len >= 8; len -= 8, p += 8) {
+        h = tb_cache_round(h, ldq_le_p(p));
+    }
+    for (; len; len--, p++) {
+        h = tb_cache_round(h, *p);
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheEntry *e = p;
+
+    return e->pc ^ e->pc >> 32 ^ e->flags ^ e->cflags ^ e->page_hash[0];
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *x = a;
+    const TBCacheEntry *y = b;
+
+    return x->pc == y->pc && x->cs_base == y->cs_base &&
+           x->flags == y->flags && x->cflags == y->cflags &&
+           x->page_hash[0] == y->page_hash[0];
+}
+
+static size_t tb_cache_record_size(const TBCacheEntry *e)
+{
+    size_t size = sizeof(*e) + e->nb_relocs * sizeof(TCGCodeReloc) +
+                  e->code_size + e->size;
+
+    return ROUND_UP(size, 8);
+}
+
+static uint64_t tb_cache_checksum(const TBCacheEntry *e, size_t size)
+{
+    return tb_cache_hash(&e->pc, size - offsetof(TBCacheEntry, pc),
+                         tb_cache->header.build_id);
+}
+
+static inline const TCGCodeReloc *tb_cache_relocs(const TBCacheEntry *e)
+{
+    return (const TCGCodeReloc *)(e + 1);
+}
+
+static inline const uint8_t *tb_cache_code(const TBCacheEntry *e)
+{
+    return (const uint8_t *)(tb_cache_relocs(e) + e->nb_relocs);
+}
+
+static inline const uint8_t *tb_cache_guest(const TBCacheEntry *e)
+{
+    return tb_cache_code(e) + e->code_size;
+}
+
+/* The build is identified by the contents of the executable, which
+   covers both the front ends and the TCG backend.  */
+static bool tb_cache_build_id(uint64_t *id)
+{
+    uint8_t buf[65536];
+    uint64_t h = tb_cache_hash(QEMU_VERSION, strlen(QEMU_VERSION), 0);
+    ssize_t len;
+    int fd;
+
+    fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        h = tb_cache_hash(buf, len, h);
+    }
+    close(fd);
+    if (len < 0) {
+        return false;
+    }
+    *id = h;
+    return true;
+}
+
+/* Everything outside the translated bytes and the TB flags that the
+   generated code depends on.  */
+static uint64_t tb_cache_config_id(MachineState *ms)
+{
+    uint32_t features = 0;
+    char *config;
+    uint64_t h;
+
+#if TCG_TARGET_HAS_code_reloc
+    features = tcg_target_code_features();
+#endif
+    config = g_strdup_printf("%s,%s,%s,%u,%d",
+                             object_get_typename(OBJECT(ms)),
+                             ms->cpu_model ? ms->cpu_model : "",
+                             ms->tcg_thread ? ms->tcg_thread : "",
+                             features, use_icount);
+    h = tb_cache_hash(config, strlen(config), tb_cache->header.build_id);
+    g_free(config);
+    return h;
+}
+
+/* Start a new, empty cache file.  It is created next to the old one and
+   renamed over it, so that processes using the old file are unaffected.  */
+static bool tb_cache_create(TBCache *c)
+{
+    char *tmp = g_strdup_printf("%s.XXXXXX", c->path);
+    int fd, err;
+
+    fd = mkstemp(tmp);
+    if (fd < 0 || fcntl(fd, F_SETFL, O_APPEND) < 0) {
+        goto fail;
+    }
+    if (qemu_write_full(fd, &c->header, sizeof(c->header)) !=
+        sizeof(c->header) || rename(tmp, c->path) < 0) {
+        goto fail;
+    }
+    g_free(tmp);
+
+    close(c->fd);
+    c->fd = fd;
+    c->file_size = sizeof(c->header);
+    return true;
+
+fail:
+    err = errno;
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    error_report("Could not create TB cache '%s': %s", c->path,
+                 strerror(err));
+    g_free(tmp);
+    return false;
+}
+
+/* Index the records of the file; stop at the first damaged record.  */
+static bool tb_cache_index(TBCache *c)
+{
+    size_t ofs = sizeof(TBCacheHeader);
+
+    while (ofs + sizeof(TBCacheEntry) <= c->map_size) {
+        TBCacheEntry *e = c->map + ofs;
+        size_t size;
+
+        if (e->nb_relocs > TCG_MAX_CODE_RELOCS ||
+            e->code_size > c->map_size || e->size == 0) {
+            return false;
+        }
+        size = tb_cache_record_size(e);
+        if (size > c->map_size - ofs ||
+            e->checksum != tb_cache_checksum(e, size)) {
+            return false;
+        }
+        if (!g_hash_table_lookup(c->index, e)) {
+            g_hash_table_insert(c->index, e, e);
+        }
+        ofs += size;
+    }
+    return ofs == c->map_size;
+}
+
+static void tb_cache_open(TBCache *c)
+{
+    TBCacheHeader header;
+    struct stat st;
+
+    c->header.config_id = tb_cache_config_id(current_machine);
+    c->index = g_hash_table_new(tb_cache_key_hash, tb_cache_key_equal);
+    c->pending = g_byte_array_new();
+
+    flock(c->fd, LOCK_EX);
+    if (fstat(c->fd, &st) < 0 || st.st_size < sizeof(header) ||
+        st.st_size > TB_CACHE_MAX_SIZE ||
+        pread(c->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(&header, &c->header, sizeof(header))) {
+        goto reset;
+    }
+
+    c->map_size = st.st_size;
+    c->file_size = st.st_size;
+    c->map = mmap(NULL, c->map_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        goto reset;
+    }
+    if (tb_cache_index(c)) {
+        flock(c->fd, LOCK_UN);
+        return;
+    }
+
+    /* Keep what could be indexed, but don't append after a damaged
+       record.  */
+    error_report("TB cache '%s' is damaged, starting a new one", c->path);
+reset:
+    flock(c->fd, LOCK_UN);
+    if (!tb_cache_create(c)) {
+        g_hash_table_remove_all(c->index);
+        if (c->map) {
+            munmap(c->map, c->map_size);
+            c->map = NULL;
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void tb_cache_flush(TBCache *c)
+{
+    if (c->fd < 0 || !c->pending->len) {
+        return;
+    }
+    flock(c->fd, LOCK_EX);
+    if (qemu_write_full(c->fd, c->pending->data, c->pending->len) ==
+        c->pending->len) {
+        c->file_size += c->pending->len;
+    }
+    flock(c->fd, LOCK_UN);
+    g_byte_array_set_size(c->pending, 0);
+}
+
+static void tb_cache_init_done(Notifier *n, void *data)
+{
+    TBCache *c = container_of(n, TBCache, init_done);
+
+    tb_cache_open(c);
+    if (c->fd >= 0) {
+        tcg_ctx.code_relocs = g_new(TCGCodeReloc, TCG_MAX_CODE_RELOCS);
+        tcg_ctx.code_reloc_enabled = true;
+    }
+}
+
+static void tb_cache_exit(Notifier *n, void *data)
+{
+    TBCache *c = container_of(n, TBCache, exit);
+
+    tb_cache_flush(c);
+}
+
+void tb_cache_init(const char *path, Error **errp)
+{
+#if TCG_TARGET_HAS_code_reloc
+    TBCache *c;
+    struct stat st;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not open TB cache '%s'", path);
+        return;
+    }
+
+    /* The file holds host code that is run as is, and the checksums only
+       catch damage; nobody else may be able to write it.  */
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not open TB cache '%s'", path);
+        close(fd);
+        return;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        error_setg(errp, "TB cache '%s' must be owned by the current user "
+                   "and must not be writable by group or others", path);
+        close(fd);
+        return;
+    }
+
+    c = g_new0(TBCache, 1);
+    c->path = g_strdup(path);
+    c->fd = fd;
+    c->header.magic = TB_CACHE_MAGIC;
+    c->header.version = TB_CACHE_VERSION;
+    c->header.page_bits = TARGET_PAGE_BITS;
+    if (!tb_cache_build_id(&c->header.build_id)) {
+        error_setg_errno(errp, errno, "Could not identify the QEMU binary "
+                         "for the TB cache");
+        close(fd);
+        g_free(c->path);
+        g_free(c);
+        return;
+    }
+    tb_cache = c;
+
+    c->init_done.notify = tb_cache_init_done;
+    qemu_add_machine_init_done_notifier(&c->init_done);
+    c->exit.notify = tb_cache_exit;
+    qemu_add_exit_notifier(&c->exit);
+#else
+    error_setg(errp, "The TB cache is not supported on this host");
+#endif
+}
+
+/* Blocks translated for the debugger contain debug exceptions that
+   depend on the breakpoints of this run, so they are neither loaded nor
+   saved.  */
+static bool tb_cache_usable(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_cache && tcg_ctx.code_reloc_enabled &&
+           !(tb->cflags & CF_NOCACHE) &&
+           !cpu->singlestep_enabled && !singlestep &&
+           QTAILQ_EMPTY(&cpu->breakpoints);
+}
+
+/* Find the guest code of TB, which may continue on a second page.
+   Return the number of bytes on the first page.  */
+static int tb_cache_guest_ptrs(CPUState *cpu, TranslationBlock *tb,
+                               tb_page_addr_t phys_pc, int size,
+                               uint8_t **p1, uint8_t **p2)
+{
+    target_ulong virt_page2 = (tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+    int len1 = virt_page2 - tb->pc;
+
+    *p1 = qemu_get_ram_ptr(phys_pc);
+    *p2 = NULL;
+    if (size <= len1) {
+        return size;
+    }
+    *p2 = qemu_get_ram_ptr(get_page_addr_code(cpu->env_ptr, virt_page2));
+    return len1;
+}
+
+static inline uint64_t tb_cache_hash_page(uint8_t *p)
+{
+    p = (uint8_t *)((uintptr_t)p & TARGET_PAGE_MASK);
+    return tb_cache_hash(p, TARGET_PAGE_SIZE, 0);
+}
+
+uint64_t tb_cache_page_hash(CPUState *cpu, TranslationBlock *tb,
+                            tb_page_addr_t phys_pc)
+{
+    if (!tb_cache_usable(cpu, tb)) {
+        return 0;
+    }
+    return tb_cache_hash_page(qemu_get_ram_ptr(phys_pc));
+}
+
+static void tb_cache_key(TBCacheEntry *key, TranslationBlock *tb,
+                         uint64_t page_hash)
+{
+    memset(key, 0, sizeof(*key));
+    key->pc = tb->pc;
+    key->cs_base = tb->cs_base;
+    key->flags = tb->flags;
+    key->cflags = tb->cflags;
+    key->page_hash[0] = page_hash;
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, uint64_t page_hash,
+                   int *code_size)
+{
+    TBCacheEntry key;
+    const TBCacheEntry *e;
+    const uint8_t *guest;
+    uint8_t *p1, *p2;
+    int len1;
+
+    if (!tb_cache_usable(cpu, tb)) {
+        return false;
+    }
+
+    tb_cache_key(&key, tb, page_hash);
+    e = g_hash_table_lookup(tb_cache->index, &key);
+    if (!e) {
+        tb_cache->misses++;
+        return false;
+    }
+
+    guest = tb_cache_guest(e);
+    len1 = tb_cache_guest_ptrs(cpu, tb, phys_pc, e->size, &p1, &p2);
+    if (memcmp(p1, guest, len1) ||
+        (p2 && (tb_cache_hash_page(p2) != e->page_hash[1] ||
+                memcmp(p2, guest + len1, e->size - len1)))) {
+        tb_cache->rejected++;
+        return false;
+    }
+
+    memcpy(tb->tc_ptr, tb_cache_code(e), e->code_size);
+    if (!tcg_code_relocate(&tcg_ctx, tb->tc_ptr, tb, tb_cache_relocs(e),
+                           e->nb_relocs)) {
+        tb_cache->rejected++;
+        return false;
+    }
+    flush_icache_range((uintptr_t)tb->tc_ptr,
+                       (uintptr_t)tb->tc_ptr + e->code_size);
+
+    tb->size = e->size;
+    tb->icount = e->icount;
+    tb->tb_next_offset[0] = e->tb_next_offset[0];
+    tb->tb_next_offset[1] = e->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+    tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+#endif
+    *code_size = e->code_size;
+    tb_cache->hits++;
+    return true;
+}
+
+void tb_cache_save(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, uint64_t page_hash,
+                   int code_size)
+{
+    TBCache *c = tb_cache;
+    TBCacheEntry *e;
+    uint8_t *p1, *p2;
+    size_t ofs, used, size;
+    int len1;
+
+    if (!tb_cache_usable(cpu, tb) || c->fd < 0) {
+        return;
+    }
+    if (tcg_ctx.code_reloc_failed) {
+        c->uncacheable++;
+        return;
+    }
+
+    ofs = c->pending->len;
+    g_byte_array_set_size(c->pending, ofs + sizeof(*e));
+    e = (TBCacheEntry *)(c->pending->data + ofs);
+    tb_cache_key(e, tb, page_hash);
+    if (g_hash_table_lookup(c->index, e)) {
+        g_byte_array_set_size(c->pending, ofs);
+        return;
+    }
+
+    e->code_size = code_size;
+    e->nb_relocs = tcg_ctx.nb_code_relocs;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->tb_next_offset[0] = tb->tb_next_offset[0];
+    e->tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    e->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+#endif
+    used = sizeof(*e) + e->nb_relocs * sizeof(TCGCodeReloc) +
+           code_size + tb->size;
+    size = tb_cache_record_size(e);
+    len1 = tb_cache_guest_ptrs(cpu, tb, phys_pc, tb->size, &p1, &p2);
+    if (p2) {
+        e->page_hash[1] = tb_cache_hash_page(p2);
+    }
+    if (c->file_size + ofs + size > TB_CACHE_MAX_SIZE) {
+        g_byte_array_set_size(c->pending, ofs);
+        return;
+    }
+
+    g_byte_array_append(c->pending, (guint8 *)tcg_ctx.code_relocs,
+                        e->nb_relocs * sizeof(TCGCodeReloc));
+    g_byte_array_append(c->pending, tb->tc_ptr, code_size);
+    g_byte_array_append(c->pending, p1, len1);
+    if (p2) {
+        g_byte_array_append(c->pending, p2, tb->size - len1);
+    }
+    g_byte_array_set_size(c->pending, ofs + size);
+
+    memset(c->pending->data + ofs + used, 0, size - used);
+
+    /* The array may have moved.  */
+    e = (TBCacheEntry *)(c->pending->data + ofs);
+    e->checksum = tb_cache_checksum(e, size);
+    c->saved++;
+
+    if (c->pending->len >= TB_CACHE_FLUSH_SIZE) {
+        tb_cache_flush(c);
+    }
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    TBCache *c = tb_cache;
+
+    if (!c || !c->index) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %u blocks, %zu KB\n",
+                g_hash_table_size(c->index),
+                (c->file_size + c->pending->len) / 1024);
+    cpu_fprintf(f, "TB cache hits       %lu (misses %lu, rejected %lu)\n",
+                c->hits, c->misses, c->rejected);
+    cpu_fprintf(f, "TB cache saved      %lu (uncacheable %lu)\n",
+                c->saved, c->uncacheable);
+}
@@ -139,6 +139,14 @@ static bool have_bmi2;
 # define have_bmi2 0
 #endif
 
+/* AVX2 is used for 32-byte vector ops; SSE2 is always present on x86_64.  */
+#if TCG_TARGET_REG_BITS == 64 && defined(CONFIG_CPUID_H) \
+    && defined(bit_AVX2) && defined(bit_OSXSAVE)
+static bool have_avx2;
+#else
+# define have_avx2 0
+#endif
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void patch_reloc(tcg_insn_unit *code_ptr, int type,
@@ -300,6 +308,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #endif
 #define P_SIMDF3        0x10000         /* 0xf3 opcode prefix */
 #define P_SIMDF2        0x20000         /* 0xf2 opcode prefix */
+#define P_VEXL          0x40000         /* Set VEX.L = 1 */
 
 #define OPC_ARITH_EvIz	(0x81)
 #define OPC_ARITH_EvIb	(0x83)
@@ -328,11 +337,36 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVL_Iv     (0xb8)
 #define OPC_MOVBE_GyMy  (0xf0 | P_EXT38)
 #define OPC_MOVBE_MyGy  (0xf1 | P_EXT38)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
 #define OPC_MOVSBL	(0xbe | P_EXT)
 #define OPC_MOVSWL	(0xbf | P_EXT)
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVQ_VqEq   (0x6e | P_EXT | P_DATA16 | P_REXW)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16) /* /2 /6 */
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PUNPCKLQDQ  (0x6c | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -347,6 +381,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_SHRX        (0xf7 | P_EXT38 | P_SIMDF2)
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
+#define OPC_VZEROUPPER  (0x77 | P_EXT)
 
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
@@ -369,6 +404,11 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define SHIFT_SHR 5
 #define SHIFT_SAR 7
 
+/* Group 12-14 opcode extensions for OPC_PSHIFT*_Ib.  */
+#define PSHIFT_SRL 2
+#define PSHIFT_SRA 4
+#define PSHIFT_SLL 6
+
 /* Group 3 opcode extensions for 0xf6, 0xf7.  To be used with OPC_GRP3.  */
 #define EXT3_NOT   2
 #define EXT3_NEG   3
@@ -424,10 +464,14 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, 0x65);
     }
     if (opc & P_DATA16) {
-        /* We should never be asking for both 16 and 64-bit operation.  */
-        assert((opc & P_REXW) == 0);
+        /* We should never be asking for both 16 and 64-bit operation,
+           except for SSE opcodes where 0x66 selects the vector form.  */
+        assert((opc & P_REXW) == 0 || (opc & P_EXT));
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -465,6 +509,9 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -485,11 +532,15 @@ static void tcg_out_modrm(TCGContext *s, int opc, int r, int rm)
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
-static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+/* Output a VEX prefix and opcode.  R is the MODRM.reg operand, V the
+   extra source operand and RM and INDEX the registers used by MODRM.rm,
+   with 0 for none.  */
+static void tcg_out_vex_opc(TCGContext *s, int opc, int r, int v,
+                            int rm, int index)
 {
     int tmp;
 
-    if ((opc & (P_REXW | P_EXT | P_EXT38)) || (rm & 8)) {
+    if ((opc & (P_REXW | P_EXT38)) || ((rm | index) & 8)) {
         /* Three byte VEX prefix.  */
         tcg_out8(s, 0xc4);
 
@@ -501,14 +552,15 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
         } else {
             tcg_abort();
         }
-        tmp |= 0x40;                       /* VEX.X */
         tmp |= (r & 8 ? 0 : 0x80);         /* VEX.R */
+        tmp |= (index & 8 ? 0 : 0x40);     /* VEX.X */
         tmp |= (rm & 8 ? 0 : 0x20);        /* VEX.B */
         tcg_out8(s, tmp);
 
         tmp = (opc & P_REXW ? 0x80 : 0);   /* VEX.W */
     } else {
-        /* Two byte VEX prefix.  */
+        /* Two byte VEX prefix, which implies the 0x0f opcode map.  */
+        tcg_debug_assert(opc & P_EXT);
         tcg_out8(s, 0xc5);
 
         tmp = (r & 8 ? 0 : 0x80);          /* VEX.R */
@@ -521,9 +573,15 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
     } else if (opc & P_SIMDF2) {
         tmp |= 3;                          /* 0xf2 */
     }
+    tmp |= (opc & P_VEXL ? 0x04 : 0);      /* VEX.L */
     tmp |= (~v & 15) << 3;                 /* VEX.vvvv */
     tcg_out8(s, tmp);
     tcg_out8(s, opc);
+}
+
+static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    tcg_out_vex_opc(s, opc, r, v, rm, 0);
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
@@ -621,6 +679,37 @@ static inline void tcg_out_modrm_offset(TCGContext *s, int opc, int r,
     tcg_out_modrm_sib_offset(s, opc, r, rm, -1, 0, offset);
 }
 
+#if TCG_TARGET_HAS_vec
+/* The VEX-encoded equivalent of the above, for a base register only.  */
+static void tcg_out_vex_modrm_offset(TCGContext *s, int opc, int r, int v,
+                                     int rm, intptr_t offset)
+{
+    int mod, len;
+
+    if (offset == 0 && LOWREGMASK(rm) != TCG_REG_EBP) {
+        mod = 0, len = 0;
+    } else if (offset == (int8_t)offset) {
+        mod = 0x40, len = 1;
+    } else {
+        mod = 0x80, len = 4;
+    }
+
+    tcg_out_vex_opc(s, opc, r, v, rm, 0);
+    if (LOWREGMASK(rm) != TCG_REG_ESP) {
+        tcg_out8(s, mod | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
+    } else {
+        tcg_out8(s, mod | (LOWREGMASK(r) << 3) | 4);
+        tcg_out8(s, (4 << 3) | LOWREGMASK(rm));
+    }
+
+    if (len == 1) {
+        tcg_out8(s, offset);
+    } else if (len == 4) {
+        tcg_out32(s, offset);
+    }
+}
+#endif
+
 /* Generate dest op= src.  Uses the same ARITH_* codes as tgen_arithi.  */
 static inline void tgen_arithr(TCGContext *s, int subop, int dest, int src)
 {
@@ -1099,15 +1188,44 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 }
 #endif
 
+/* Load a host address that may need relocating for the TB cache.  */
+static void tcg_out_movi_ptr(TCGContext *s, TCGReg ret, uintptr_t arg)
+{
+    if (!TCG_TARGET_HAS_code_reloc || !s->code_reloc_enabled || arg == 0) {
+        tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+        return;
+    }
+    /* Always use the 10 byte movq, so that the value can be patched.  */
+    tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_code_reloc(s, s->code_ptr, TCG_RELOC_ABS64, arg);
+    tcg_out64(s, arg);
+}
+
+/* Load the address of code within the current TB.  */
+static void tcg_out_movi_code(TCGContext *s, TCGReg ret, tcg_insn_unit *ptr)
+{
+    if (!TCG_TARGET_HAS_code_reloc || !s->code_reloc_enabled) {
+        tcg_out_movi(s, TCG_TYPE_PTR, ret, (uintptr_t)ptr);
+        return;
+    }
+    /* A pc-relative lea keeps the code position independent.  */
+    tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
+    tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
+    tcg_out32(s, tcg_pcrel_diff(s, ptr) - 4);
+}
+
 static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 {
     intptr_t disp = tcg_pcrel_diff(s, dest) - 5;
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (TCG_TARGET_HAS_code_reloc && s->code_reloc_enabled) {
+            tcg_code_reloc(s, s->code_ptr, TCG_RELOC_REL32, (uintptr_t)dest);
+        }
         tcg_out32(s, disp);
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, (uintptr_t)dest);
+        tcg_out_movi_ptr(s, TCG_REG_R10, (uintptr_t)dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
@@ -1156,6 +1274,7 @@ static void * const qemu_st_helpers[16] = {
    ADDRLO and ADDRHI contain the low and high part of the address.
 
    MEM_INDEX and S_BITS are the memory context and log2 size of the load.
+   OPC supplies the alignment requirement.
 
    WHICH is the offset into the CPUTLBEntry structure of the slot to read.
    This should be offsetof addr_read or addr_write.
@@ -1172,7 +1291,7 @@ static void * const qemu_st_helpers[16] = {
    First argument register is clobbered.  */
 
 static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
-                                    int mem_index, TCGMemOp opc,
+                                    int mem_index, TCGMemOp opc, int s_bits,
                                     tcg_insn_unit **label_ptr, int which)
 {
     const TCGReg r0 = TCG_REG_L0;
@@ -1180,7 +1299,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     TCGType ttype = TCG_TYPE_I32;
     TCGType tlbtype = TCG_TYPE_I32;
     int trexw = 0, hrexw = 0, tlbrexw = 0;
-    int s_mask = (1 << (opc & MO_SIZE)) - 1;
+    int s_mask = (1 << s_bits) - 1;
     bool aligned = (opc & MO_AMASK) == MO_ALIGN || s_mask == 0;
 
     if (TCG_TARGET_REG_BITS == 64) {
@@ -1255,15 +1374,17 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
  * Record the context of a call to the out of line helper code for the slow path
  * for a load or store, so that we can later generate the correct helper code
  */
-static void add_qemu_ldst_label(TCGContext *s, bool is_ld, TCGMemOpIdx oi,
-                                TCGReg datalo, TCGReg datahi,
-                                TCGReg addrlo, TCGReg addrhi,
-                                tcg_insn_unit *raddr,
-                                tcg_insn_unit **label_ptr)
+static TCGLabelQemuLdst *add_qemu_ldst_label(TCGContext *s, bool is_ld,
+                                             TCGMemOpIdx oi,
+                                             TCGReg datalo, TCGReg datahi,
+                                             TCGReg addrlo, TCGReg addrhi,
+                                             tcg_insn_unit *raddr,
+                                             tcg_insn_unit **label_ptr)
 {
     TCGLabelQemuLdst *label = new_ldst_label(s);
 
     label->is_ld = is_ld;
+    label->is_v128 = false;
     label->oi = oi;
     label->datalo_reg = datalo;
     label->datahi_reg = datahi;
@@ -1274,8 +1395,11 @@ static void add_qemu_ldst_label(TCGContext *s, bool is_ld, TCGMemOpIdx oi,
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
         label->label_ptr[1] = label_ptr[1];
     }
+    return label;
 }
 
+static void tcg_out_qemu_v128_slow_path(TCGContext *s, TCGLabelQemuLdst *l);
+
 /*
  * Generate code for the slow path for a load at the end of block
  */
@@ -1286,6 +1410,11 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     TCGReg data_reg;
     tcg_insn_unit **label_ptr = &l->label_ptr[0];
 
+    if (l->is_v128) {
+        tcg_out_qemu_v128_slow_path(s, l);
+        return;
+    }
+
     /* resolve label address */
     tcg_patch32(label_ptr[0], s->code_ptr - label_ptr[0] - 4);
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
@@ -1314,8 +1443,7 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
         /* The second argument is already loaded with addrlo.  */
         tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], oi);
-        tcg_out_movi(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[3],
-                     (uintptr_t)l->raddr);
+        tcg_out_movi_code(s, tcg_target_call_iarg_regs[3], l->raddr);
     }
 
     tcg_out_call(s, qemu_ld_helpers[opc & (MO_BSWAP | MO_SIZE)]);
@@ -1370,6 +1498,11 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     tcg_insn_unit **label_ptr = &l->label_ptr[0];
     TCGReg retaddr;
 
+    if (l->is_v128) {
+        tcg_out_qemu_v128_slow_path(s, l);
+        return;
+    }
+
     /* resolve label address */
     tcg_patch32(label_ptr[0], s->code_ptr - label_ptr[0] - 4);
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
@@ -1402,7 +1535,7 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         ofs += 4;
 
         retaddr = TCG_REG_EAX;
-        tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+        tcg_out_movi_code(s, retaddr, l->raddr);
         tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP, ofs);
     } else {
         tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
@@ -1413,10 +1546,10 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
 
         if (ARRAY_SIZE(tcg_target_call_iarg_regs) > 4) {
             retaddr = tcg_target_call_iarg_regs[4];
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_code(s, retaddr, l->raddr);
         } else {
             retaddr = TCG_REG_RAX;
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_code(s, retaddr, l->raddr);
             tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP,
                        TCG_TARGET_CALL_STACK_OFFSET);
         }
@@ -1426,6 +1559,49 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     tcg_out_push(s, retaddr);
     tcg_out_jmp(s, qemu_st_helpers[opc & (MO_BSWAP | MO_SIZE)]);
 }
+
+/*
+ * Generate code for the slow path for a 128-bit load or store at the end
+ * of block.  Only 64-bit hosts implement qemu_ld/st_v128.
+ */
+static void tcg_out_qemu_v128_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    tcg_insn_unit **label_ptr = &l->label_ptr[0];
+    TCGReg retaddr;
+
+    /* resolve label address */
+    tcg_patch32(label_ptr[0], s->code_ptr - label_ptr[0] - 4);
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        tcg_patch32(label_ptr[1], s->code_ptr - label_ptr[1] - 4);
+    }
+
+    if (TCG_TARGET_REG_BITS == 32) {
+        tcg_abort();
+    }
+
+    /* The base register may be one of the later argument registers, so
+       compute the host pointer first.  */
+    tcg_out_modrm_offset(s, OPC_LEA + P_REXW, tcg_target_call_iarg_regs[2],
+                         l->datalo_reg, l->data_ofs);
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+    /* The second argument is already loaded with addrlo.  */
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[3], l->oi);
+
+    if (ARRAY_SIZE(tcg_target_call_iarg_regs) > 4) {
+        retaddr = tcg_target_call_iarg_regs[4];
+        tcg_out_movi_code(s, retaddr, l->raddr);
+    } else {
+        retaddr = TCG_REG_RAX;
+        tcg_out_movi_code(s, retaddr, l->raddr);
+        tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP,
+                   TCG_TARGET_CALL_STACK_OFFSET);
+    }
+
+    /* "Tail call" to the helper, with the return address back inline.  */
+    tcg_out_push(s, retaddr);
+    tcg_out_jmp(s, l->is_ld ? (tcg_insn_unit *)helper_ld_v128_mmu
+                            : (tcg_insn_unit *)helper_st_v128_mmu);
+}
 #elif defined(__x86_64__) && defined(__linux__)
 # include <asm/prctl.h>
 # include <sys/prctl.h>
@@ -1569,7 +1745,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     mem_index = get_mmuidx(oi);
 
-    tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc,
+    tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc, opc & MO_SIZE,
                      label_ptr, offsetof(CPUTLBEntry, addr_read));
 
     /* TLB Hit.  */
@@ -1709,7 +1885,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     mem_index = get_mmuidx(oi);
 
-    tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc,
+    tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc, opc & MO_SIZE,
                      label_ptr, offsetof(CPUTLBEntry, addr_write));
 
     /* TLB Hit.  */
@@ -1754,6 +1930,302 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* Move 16 bytes between guest memory and host memory at BASE + OFS,
+   with a single unaligned vector load and store through %xmm0.  TCG
+   does not allocate vector registers, so %xmm0 is free here.  */
+static void tcg_out_qemu_v128_direct(TCGContext *s, bool is_ld,
+                                     TCGReg gbase, int gindex, intptr_t gofs,
+                                     int seg, TCGReg base, intptr_t ofs)
+{
+    if (is_ld) {
+        tcg_out_modrm_sib_offset(s, OPC_MOVDQU_VxWx + seg, 0,
+                                 gbase, gindex, 0, gofs);
+        tcg_out_modrm_offset(s, OPC_MOVDQU_WxVx, 0, base, ofs);
+    } else {
+        tcg_out_modrm_offset(s, OPC_MOVDQU_VxWx, 0, base, ofs);
+        tcg_out_modrm_sib_offset(s, OPC_MOVDQU_WxVx + seg, 0,
+                                 gbase, gindex, 0, gofs);
+    }
+}
+
+static void tcg_out_qemu_ldst_v128(TCGContext *s, const TCGArg *args,
+                                   bool is_ld)
+{
+    TCGReg base, addrlo;
+    TCGReg addrhi __attribute__((unused));
+    TCGMemOpIdx oi;
+    intptr_t ofs;
+#if defined(CONFIG_SOFTMMU)
+    TCGLabelQemuLdst *label;
+    tcg_insn_unit *label_ptr[2];
+#endif
+
+    base = *args++;
+    addrlo = *args++;
+    addrhi = (TARGET_LONG_BITS > TCG_TARGET_REG_BITS ? *args++ : 0);
+    oi = *args++;
+    ofs = *args++;
+
+#if defined(CONFIG_SOFTMMU)
+    /* A single TLB compare covers all 16 bytes: accesses that cross a
+       page, or that are not 16-byte aligned with MO_ALIGN, take the
+       slow path.  */
+    tcg_out_tlb_load(s, addrlo, addrhi, get_mmuidx(oi), get_memop(oi), 4,
+                     label_ptr, is_ld ? offsetof(CPUTLBEntry, addr_read)
+                                      : offsetof(CPUTLBEntry, addr_write));
+
+    /* TLB Hit.  */
+    tcg_out_qemu_v128_direct(s, is_ld, TCG_REG_L1, -1, 0, 0, base, ofs);
+
+    /* Record the current context of the access into ldst label */
+    label = add_qemu_ldst_label(s, is_ld, oi, base, 0, addrlo, addrhi,
+                                s->code_ptr, label_ptr);
+    label->is_v128 = true;
+    label->data_ofs = ofs;
+#else
+    {
+        int32_t offset = guest_base;
+        TCGReg gbase = addrlo;
+        int index = -1;
+        int seg = 0;
+
+        /* See comment in tcg_out_qemu_ld re zero-extension of addrlo.  */
+        if (guest_base == 0 || guest_base_flags) {
+            seg = guest_base_flags;
+            offset = 0;
+            if (TCG_TARGET_REG_BITS > TARGET_LONG_BITS) {
+                seg |= P_ADDR32;
+            }
+        } else if (TCG_TARGET_REG_BITS == 64) {
+            if (TARGET_LONG_BITS == 32) {
+                tcg_out_ext32u(s, TCG_REG_L0, gbase);
+                gbase = TCG_REG_L0;
+            }
+            if (offset != guest_base) {
+                tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, guest_base);
+                index = TCG_REG_L1;
+                offset = 0;
+            }
+        }
+
+        tcg_out_qemu_v128_direct(s, is_ld, gbase, index, offset, seg,
+                                 base, ofs);
+    }
+#endif
+}
+
+#if TCG_TARGET_HAS_vec
+/* The *_vec ops work on memory, through %xmm0 and %xmm1, or %ymm0 and
+   %ymm1 for 32-byte operations.  TCG does not allocate the vector
+   registers and they are call-clobbered, so they are free here.  */
+
+bool tcg_can_emit_vec_op(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+    if (oprsz == 32 && !have_avx2 && opc != INDEX_op_dup_vec) {
+        return false;
+    }
+    if (oprsz != 16 && oprsz != 32) {
+        return false;
+    }
+
+    switch (opc) {
+    case INDEX_op_mov_vec:
+    case INDEX_op_dup_vec:
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+        return true;
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+        /* There are no byte shifts.  */
+        return vece != MO_8;
+    case INDEX_op_sari_vec:
+        return vece == MO_16 || vece == MO_32;
+    case INDEX_op_cmp_vec:
+        /* PCMPEQQ and PCMPGTQ need SSE4.  */
+        return vece != MO_64;
+    default:
+        return false;
+    }
+}
+
+static void tcg_out_vec_ld(TCGContext *s, uint32_t oprsz, int xr,
+                           TCGReg base, intptr_t ofs)
+{
+    if (oprsz == 32) {
+        tcg_out_vex_modrm_offset(s, OPC_MOVDQU_VxWx | P_VEXL, xr, 0,
+                                 base, ofs);
+    } else {
+        tcg_out_modrm_offset(s, OPC_MOVDQU_VxWx, xr, base, ofs);
+    }
+}
+
+static void tcg_out_vec_st(TCGContext *s, uint32_t oprsz, int xr,
+                           TCGReg base, intptr_t ofs)
+{
+    if (oprsz == 32) {
+        tcg_out_vex_modrm_offset(s, OPC_MOVDQU_WxVx | P_VEXL, xr, 0,
+                                 base, ofs);
+    } else {
+        tcg_out_modrm_offset(s, OPC_MOVDQU_WxVx, xr, base, ofs);
+    }
+}
+
+/* XD = XD op XS.  */
+static void tcg_out_vec_rr(TCGContext *s, uint32_t oprsz, int opc,
+                           int xd, int xs)
+{
+    if (oprsz == 32) {
+        tcg_out_vex_modrm(s, opc | P_VEXL, xd, xd, xs);
+    } else {
+        tcg_out_modrm(s, opc, xd, xs);
+    }
+}
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[3] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD
+    };
+    static const int cmpgt_insn[3] = {
+        OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD
+    };
+    static const int shift_insn[4] = {
+        0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+    TCGReg base = args[0];
+    TCGArg desc = args[tcg_op_defs[opc].nb_args - 1];
+    uint32_t oprsz = TCG_VEC_OPRSZ(desc);
+    unsigned vece = TCG_VEC_VECE(desc);
+    intptr_t dofs, aofs, bofs;
+    int insn, ext;
+    bool inv;
+
+    switch (opc) {
+    case INDEX_op_mov_vec:
+        tcg_out_vec_ld(s, oprsz, 0, base, args[2]);
+        tcg_out_vec_st(s, oprsz, 0, base, args[1]);
+        break;
+
+    case INDEX_op_dup_vec:
+        /* The generic code has already replicated the value to 64 bits.
+           A 32-byte dup is two SSE stores, to avoid the AVX transition.  */
+        dofs = args[2];
+        tcg_out_modrm(s, OPC_MOVQ_VqEq, 0, args[1]);
+        tcg_out_modrm(s, OPC_PUNPCKLQDQ, 0, 0);
+        tcg_out_vec_st(s, 16, 0, base, dofs);
+        if (oprsz == 32) {
+            tcg_out_vec_st(s, 16, 0, base, dofs + 16);
+        }
+        return;
+
+    case INDEX_op_add_vec:
+        insn = add_insn[vece];
+        goto gen_rr;
+    case INDEX_op_sub_vec:
+        insn = sub_insn[vece];
+        goto gen_rr;
+    case INDEX_op_and_vec:
+        insn = OPC_PAND;
+        goto gen_rr;
+    case INDEX_op_or_vec:
+        insn = OPC_POR;
+        goto gen_rr;
+    case INDEX_op_xor_vec:
+        insn = OPC_PXOR;
+    gen_rr:
+        tcg_out_vec_ld(s, oprsz, 0, base, args[2]);
+        tcg_out_vec_ld(s, oprsz, 1, base, args[3]);
+        tcg_out_vec_rr(s, oprsz, insn, 0, 1);
+        tcg_out_vec_st(s, oprsz, 0, base, args[1]);
+        break;
+
+    case INDEX_op_andc_vec:
+        /* PANDN complements its destination operand.  */
+        tcg_out_vec_ld(s, oprsz, 0, base, args[3]);
+        tcg_out_vec_ld(s, oprsz, 1, base, args[2]);
+        tcg_out_vec_rr(s, oprsz, OPC_PANDN, 0, 1);
+        tcg_out_vec_st(s, oprsz, 0, base, args[1]);
+        break;
+
+    case INDEX_op_shli_vec:
+        ext = PSHIFT_SLL;
+        goto gen_shift;
+    case INDEX_op_shri_vec:
+        ext = PSHIFT_SRL;
+        goto gen_shift;
+    case INDEX_op_sari_vec:
+        ext = PSHIFT_SRA;
+    gen_shift:
+        tcg_out_vec_ld(s, oprsz, 0, base, args[2]);
+        if (oprsz == 32) {
+            tcg_out_vex_modrm(s, shift_insn[vece] | P_VEXL, ext, 0, 0);
+        } else {
+            tcg_out_modrm(s, shift_insn[vece], ext, 0);
+        }
+        tcg_out8(s, args[3]);
+        tcg_out_vec_st(s, oprsz, 0, base, args[1]);
+        break;
+
+    case INDEX_op_cmp_vec:
+        dofs = args[2];
+        aofs = args[3];
+        bofs = args[4];
+        switch (args[1]) {
+        case TCG_COND_EQ:
+            insn = cmpeq_insn[vece], inv = false;
+            break;
+        case TCG_COND_NE:
+            insn = cmpeq_insn[vece], inv = true;
+            break;
+        case TCG_COND_GT:
+            insn = cmpgt_insn[vece], inv = false;
+            break;
+        case TCG_COND_LE:
+            insn = cmpgt_insn[vece], inv = true;
+            break;
+        case TCG_COND_LT:
+            insn = cmpgt_insn[vece], inv = false;
+            aofs = args[4], bofs = args[3];
+            break;
+        case TCG_COND_GE:
+            insn = cmpgt_insn[vece], inv = true;
+            aofs = args[4], bofs = args[3];
+            break;
+        default:
+            tcg_abort();
+        }
+        tcg_out_vec_ld(s, oprsz, 0, base, aofs);
+        tcg_out_vec_ld(s, oprsz, 1, base, bofs);
+        tcg_out_vec_rr(s, oprsz, insn, 0, 1);
+        if (inv) {
+            tcg_out_vec_rr(s, oprsz, OPC_PCMPEQB, 1, 1);
+            tcg_out_vec_rr(s, oprsz, OPC_PXOR, 0, 1);
+        }
+        tcg_out_vec_st(s, oprsz, 0, base, dofs);
+        break;
+
+    default:
+        tcg_abort();
+    }
+
+    if (oprsz == 32) {
+        /* Avoid the penalty for mixing AVX and legacy SSE code, which
+           the helpers may contain.  */
+        tcg_out_vex_opc(s, OPC_VZEROUPPER, 0, 0, 0, 0);
+    }
+}
+#endif /* TCG_TARGET_HAS_vec */
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1771,7 +2243,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_ptr(s, TCG_REG_EAX, args[0]);
         tcg_out_jmp(s, tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1787,6 +2259,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp to the given host address (could be epilogue) */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, arg_label(args[0]), 0);
         break;
@@ -1999,6 +2475,29 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_qemu_st_i64:
         tcg_out_qemu_st(s, args, 1);
         break;
+    case INDEX_op_qemu_ld_v128:
+        tcg_out_qemu_ldst_v128(s, args, 1);
+        break;
+    case INDEX_op_qemu_st_v128:
+        tcg_out_qemu_ldst_v128(s, args, 0);
+        break;
+
+#if TCG_TARGET_HAS_vec
+    case INDEX_op_mov_vec:
+    case INDEX_op_dup_vec:
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+    case INDEX_op_sari_vec:
+    case INDEX_op_cmp_vec:
+        tcg_out_vec_op(s, opc, args);
+        break;
+#endif
 
     OP_32_64(mulu2):
         tcg_out_modrm(s, OPC_GRP3_Ev + rexw, EXT3_MUL, args[3]);
@@ -2112,6 +2611,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
     { INDEX_op_ld8u_i32, { "r", "r" } },
     { INDEX_op_ld8s_i32, { "r", "r" } },
@@ -2227,6 +2727,21 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_st_i32, { "L", "L" } },
     { INDEX_op_qemu_ld_i64, { "r", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L" } },
+    { INDEX_op_qemu_ld_v128, { "L", "L" } },
+    { INDEX_op_qemu_st_v128, { "L", "L" } },
+
+    { INDEX_op_mov_vec, { "r" } },
+    { INDEX_op_dup_vec, { "r", "r" } },
+    { INDEX_op_add_vec, { "r" } },
+    { INDEX_op_sub_vec, { "r" } },
+    { INDEX_op_and_vec, { "r" } },
+    { INDEX_op_or_vec, { "r" } },
+    { INDEX_op_xor_vec, { "r" } },
+    { INDEX_op_andc_vec, { "r" } },
+    { INDEX_op_shli_vec, { "r" } },
+    { INDEX_op_shri_vec, { "r" } },
+    { INDEX_op_sari_vec, { "r" } },
+    { INDEX_op_cmp_vec, { "r" } },
 #elif TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
     { INDEX_op_qemu_ld_i32, { "r", "L" } },
     { INDEX_op_qemu_st_i32, { "L", "L" } },
@@ -2307,6 +2822,13 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /*
+     * Return path for goto_ptr. Set return value to 0, a-la exit_tb,
+     * and fall through to the rest of the epilogue.
+     */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2325,11 +2847,22 @@ static void tcg_target_qemu_prologue(TCGContext *s)
 #endif
 }
 
+#if TCG_TARGET_HAS_code_reloc
+uint32_t tcg_target_code_features(void)
+{
+    return have_cmov | have_movbe << 1 | have_bmi1 << 2
+           | have_bmi2 << 3 | have_avx2 << 4;
+}
+#endif
+
 static void tcg_target_init(TCGContext *s)
 {
 #ifdef CONFIG_CPUID_H
     unsigned a, b, c, d;
     int max = __get_cpuid_max(0, 0);
+#ifndef have_avx2
+    bool have_ymm = false;
+#endif
 
     if (max >= 1) {
         __cpuid(1, a, b, c, d);
@@ -2343,6 +2876,14 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifndef have_avx2
+        /* The OS must also have enabled saving the YMM registers.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            unsigned xcrl, xcrh;
+            asm("xgetbv" : "=a" (xcrl), "=d" (xcrh) : "c" (0));
+            have_ymm = (xcrl & 6) == 6;
+        }
 #endif
     }
 
@@ -2354,6 +2895,9 @@ static void tcg_target_init(TCGContext *s)
 #endif
 #ifndef have_bmi2
         have_bmi2 = (b & bit_BMI2) != 0;
+#endif
+#ifndef have_avx2
+        have_avx2 = have_ymm && (b & bit_AVX2) != 0;
 #endif
     }
 #endif
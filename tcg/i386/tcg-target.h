@@ -100,6 +100,15 @@ extern bool have_bmi1;
 #define TCG_TARGET_HAS_muls2_i32        1
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_qemu_ldst_v128   (TCG_TARGET_REG_BITS == 64)
+#define TCG_TARGET_HAS_vec              (TCG_TARGET_REG_BITS == 64)
+#define TCG_TARGET_HAS_goto_ptr         1
+/* Relocations are anchored on the linker-provided __executable_start.  */
+#if TCG_TARGET_REG_BITS == 64 && defined(__linux__)
+#define TCG_TARGET_HAS_code_reloc       1
+#else
+#define TCG_TARGET_HAS_code_reloc       0
+#endif
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_extrl_i64_i32    0
@@ -143,6 +152,15 @@ extern bool have_bmi1;
 # define TCG_AREG0 TCG_REG_EBP
 #endif
 
+/* This defines the natural memory order supported by this
+ * architecture before guarantees made by various barrier
+ * instructions.
+ *
+ * The x86 has a pretty strong memory ordering which only really
+ * allows for some stores to be re-ordered after loads.
+ */
+#define TCG_TARGET_DEFAULT_MO (TCG_MO_ALL & ~TCG_MO_ST_LD)
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
 }
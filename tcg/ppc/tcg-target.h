@@ -73,6 +73,10 @@ typedef enum {
 #define TCG_TARGET_HAS_muls2_i32        0
 #define TCG_TARGET_HAS_muluh_i32        1
 #define TCG_TARGET_HAS_mulsh_i32        1
+#define TCG_TARGET_HAS_qemu_ldst_v128   0
+#define TCG_TARGET_HAS_vec              0
+#define TCG_TARGET_HAS_code_reloc       0
+#define TCG_TARGET_HAS_goto_ptr         0
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_add2_i32         0
@@ -108,6 +112,8 @@ typedef enum {
 #define TCG_TARGET_HAS_mulsh_i64        1
 #endif
 
+#define TCG_TARGET_DEFAULT_MO (0)
+
 void flush_icache_range(uintptr_t start, uintptr_t stop);
 
 #endif
@@ -32,6 +32,8 @@ typedef struct TCGLabelQemuLdst {
     TCGReg datahi_reg;      /* reg index for high word to be loaded or stored */
     tcg_insn_unit *raddr;   /* gen code addr of the next IR of qemu_ld/st IR */
     tcg_insn_unit *label_ptr[2]; /* label pointers to be updated */
+    bool is_v128;           /* qemu_ld/st_v128: datalo_reg is the host base */
+    intptr_t data_ofs;      /* host offset from datalo_reg for v128 */
     struct TCGLabelQemuLdst *next;
 } TCGLabelQemuLdst;
 
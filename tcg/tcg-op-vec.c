@@ -0,0 +1,521 @@
+/*
+ * Tiny Code Generator for QEMU: vector operations
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "tcg.h"
+#include "tcg-op.h"
+
+/* Each operation is expanded in two steps.  As much of it as possible
+   is done with the host's *_vec ops, in 32 and then 16 byte chunks;
+   the rest is done 8 bytes at a time with i64 ops, treating the i64 as
+   a vector of smaller elements where needed.  Elements are stored in
+   host byte order, so none of this depends on host endianness.  */
+
+/* Replicate the low element of C, of size VECE, across 64 bits.  */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        tcg_abort();
+    }
+}
+
+static bool vec_host_ok(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+#if TCG_TARGET_HAS_vec
+    return tcg_can_emit_vec_op(opc, vece, oprsz);
+#else
+    return false;
+#endif
+}
+
+/* Emit OPC for the leading part of an OPRSZ-byte operation that the
+   host can do, and return the number of bytes covered.  ARG is the
+   second source offset, or the shift count or condition.  */
+static uint32_t gen_vec_host(TCGOpcode opc, TCGv_ptr base, unsigned vece,
+                             uint32_t dofs, uint32_t aofs, TCGArg arg,
+                             uint32_t oprsz)
+{
+    TCGArg b = GET_TCGV_PTR(base);
+    uint32_t done = 0;
+    uint32_t lnsz;
+
+    for (lnsz = 32; lnsz >= 16; lnsz /= 2) {
+        TCGArg desc = TCG_VEC_DESC(lnsz, vece);
+
+        if (oprsz - done < lnsz || !vec_host_ok(opc, vece, lnsz)) {
+            continue;
+        }
+        for (; done + lnsz <= oprsz; done += lnsz) {
+            switch (opc) {
+            case INDEX_op_mov_vec:
+                tcg_gen_op4(&tcg_ctx, opc, b, dofs + done, aofs + done, desc);
+                break;
+            case INDEX_op_shli_vec:
+            case INDEX_op_shri_vec:
+            case INDEX_op_sari_vec:
+                tcg_gen_op5(&tcg_ctx, opc, b, dofs + done, aofs + done,
+                            arg, desc);
+                break;
+            default:
+                tcg_gen_op5(&tcg_ctx, opc, b, dofs + done, aofs + done,
+                            arg + done, desc);
+                break;
+            }
+        }
+    }
+    return done;
+}
+
+typedef void GenVec3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+typedef void GenVec2iFn(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c);
+
+static void expand_3(TCGOpcode opc, TCGv_ptr base, unsigned vece,
+                     uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz, GenVec3Fn *fn)
+{
+    uint32_t i;
+    TCGv_i64 t0, t1;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    i = gen_vec_host(opc, base, vece, dofs, aofs, bofs, oprsz);
+    if (i == oprsz) {
+        return;
+    }
+
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_ld_i64(t1, base, bofs + i);
+        fn(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_2i(TCGOpcode opc, TCGv_ptr base, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, unsigned c,
+                      uint32_t oprsz, GenVec2iFn *fn)
+{
+    uint32_t i;
+    TCGv_i64 t0;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    tcg_debug_assert(c < (8u << vece));
+    i = gen_vec_host(opc, base, vece, dofs, aofs, c, oprsz);
+    if (i == oprsz) {
+        return;
+    }
+
+    t0 = tcg_temp_new_i64();
+    for (; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        fn(vece, t0, t0, c);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_mov(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz)
+{
+    uint32_t i;
+    TCGv_i64 t0;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    if (dofs == aofs) {
+        return;
+    }
+    i = gen_vec_host(INDEX_op_mov_vec, base, MO_64, dofs, aofs, 0, oprsz);
+    if (i == oprsz) {
+        return;
+    }
+
+    t0 = tcg_temp_new_i64();
+    for (; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Store the 64-bit pattern IN to every 8 bytes at DOFS.  */
+static void expand_dup(TCGv_ptr base, uint32_t dofs, uint32_t oprsz,
+                       TCGv_i64 in)
+{
+    uint32_t i = 0;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+#if TCG_TARGET_HAS_vec
+    {
+        uint32_t lnsz;
+
+        for (lnsz = 32; lnsz >= 16; lnsz /= 2) {
+            if (oprsz - i < lnsz
+                || !tcg_can_emit_vec_op(INDEX_op_dup_vec, MO_64, lnsz)) {
+                continue;
+            }
+            for (; i + lnsz <= oprsz; i += lnsz) {
+                tcg_gen_op4(&tcg_ctx, INDEX_op_dup_vec, GET_TCGV_PTR(base),
+                            GET_TCGV_I64(in), dofs + i,
+                            TCG_VEC_DESC(lnsz, MO_64));
+            }
+        }
+    }
+#endif
+    for (; i < oprsz; i += 8) {
+        tcg_gen_st_i64(in, base, dofs + i);
+    }
+}
+
+void tcg_gen_gvec_dup_i64(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i64 in)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(t0, in);
+        tcg_gen_muli_i64(t0, t0, dup_const(MO_8, 1));
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(t0, in);
+        tcg_gen_muli_i64(t0, t0, dup_const(MO_16, 1));
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(t0, in, in, 32, 32);
+        break;
+    default:
+        tcg_gen_mov_i64(t0, in);
+        break;
+    }
+    expand_dup(base, dofs, oprsz, t0);
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_dup_i32(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i32 in)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+
+    tcg_debug_assert(vece <= MO_32);
+    tcg_gen_extu_i32_i64(t0, in);
+    tcg_gen_gvec_dup_i64(base, vece, dofs, oprsz, t0);
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_dupi(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint64_t x)
+{
+    TCGv_i64 t0 = tcg_const_i64(dup_const(vece, x));
+
+    expand_dup(base, dofs, oprsz, t0);
+    tcg_temp_free_i64(t0);
+}
+
+/* Add or subtract the elements of A and B, with M holding the sign bit
+   of every element: the sign bits are computed separately so that no
+   carry or borrow crosses into the neighbouring element.  */
+static void gen_addv_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = dup_const(vece, 1ull << ((8 << vece) - 1));
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static void gen_subv_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = dup_const(vece, 1ull << ((8 << vece) - 1));
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_add(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_add_vec, base, vece, dofs, aofs, bofs, oprsz,
+             gen_addv_i64);
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_sub_vec, base, vece, dofs, aofs, bofs, oprsz,
+             gen_subv_i64);
+}
+
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_and_vec, base, MO_64, dofs, aofs, bofs, oprsz,
+             gen_and_i64);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_or_vec, base, MO_64, dofs, aofs, bofs, oprsz,
+             gen_or_i64);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_xor_vec, base, MO_64, dofs, aofs, bofs, oprsz,
+             gen_xor_i64);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(INDEX_op_andc_vec, base, MO_64, dofs, aofs, bofs, oprsz,
+             gen_andc_i64);
+}
+
+/* Shift the whole i64, then clear the bits that crossed in from the
+   neighbouring element.  */
+static void gen_shli_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    uint64_t mask = dup_const(vece, dup_const(vece, -1) << c);
+
+    tcg_gen_shli_i64(d, a, c);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, mask);
+    }
+}
+
+static void gen_shri_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    tcg_gen_shri_i64(d, a, c);
+    if (vece != MO_64) {
+        uint64_t emask = (1ull << (8 << vece)) - 1;
+        tcg_gen_andi_i64(d, d, dup_const(vece, emask >> c));
+    }
+}
+
+static void gen_sari_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    unsigned bits = 8 << vece;
+    uint64_t s_mask, c_mask;
+    TCGv_i64 s;
+
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, c);
+        return;
+    }
+    if (c == 0) {
+        tcg_gen_mov_i64(d, a);
+        return;
+    }
+
+    /* Shift logically, then multiply each isolated (shifted) sign bit
+       to fill the C bits above it.  */
+    s_mask = dup_const(vece, 1ull << (bits - 1 - c));
+    c_mask = dup_const(vece, ((1ull << bits) - 1) >> c);
+    s = tcg_temp_new_i64();
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(s, d, s_mask);
+    tcg_gen_muli_i64(s, s, (2ull << c) - 2);
+    tcg_gen_andi_i64(d, d, c_mask);
+    tcg_gen_or_i64(d, d, s);
+    tcg_temp_free_i64(s);
+}
+
+void tcg_gen_gvec_shli(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    expand_2i(INDEX_op_shli_vec, base, vece, dofs, aofs, shift, oprsz,
+              gen_shli_i64);
+}
+
+void tcg_gen_gvec_shri(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    expand_2i(INDEX_op_shri_vec, base, vece, dofs, aofs, shift, oprsz,
+              gen_shri_i64);
+}
+
+void tcg_gen_gvec_sari(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    expand_2i(INDEX_op_sari_vec, base, vece, dofs, aofs, shift, oprsz,
+              gen_sari_i64);
+}
+
+static void gen_ld_elem(TCGMemOp mop, TCGv_i64 t, TCGv_ptr base, uint32_t ofs)
+{
+    switch (mop) {
+    case MO_UB:
+        tcg_gen_ld8u_i64(t, base, ofs);
+        break;
+    case MO_SB:
+        tcg_gen_ld8s_i64(t, base, ofs);
+        break;
+    case MO_UW:
+        tcg_gen_ld16u_i64(t, base, ofs);
+        break;
+    case MO_SW:
+        tcg_gen_ld16s_i64(t, base, ofs);
+        break;
+    case MO_UL:
+        tcg_gen_ld32u_i64(t, base, ofs);
+        break;
+    case MO_SL:
+        tcg_gen_ld32s_i64(t, base, ofs);
+        break;
+    default:
+        tcg_gen_ld_i64(t, base, ofs);
+        break;
+    }
+}
+
+static void gen_st_elem(unsigned vece, TCGv_i64 t, TCGv_ptr base, uint32_t ofs)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_st8_i64(t, base, ofs);
+        break;
+    case MO_16:
+        tcg_gen_st16_i64(t, base, ofs);
+        break;
+    case MO_32:
+        tcg_gen_st32_i64(t, base, ofs);
+        break;
+    default:
+        tcg_gen_st_i64(t, base, ofs);
+        break;
+    }
+}
+
+void tcg_gen_gvec_cmp(TCGv_ptr base, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    TCGMemOp mop = vece;
+    uint32_t esz = 1 << vece;
+    uint32_t i = 0;
+    TCGv_i64 t0, t1;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    if (cond == TCG_COND_NEVER || cond == TCG_COND_ALWAYS) {
+        tcg_gen_gvec_dupi(base, MO_64, dofs, oprsz,
+                          cond == TCG_COND_ALWAYS ? -1 : 0);
+        return;
+    }
+
+    /* The host op only has to handle signed and equality conditions.  */
+    if (!is_unsigned_cond(cond)) {
+        TCGArg b = GET_TCGV_PTR(base);
+        uint32_t lnsz;
+
+        for (lnsz = 32; lnsz >= 16; lnsz /= 2) {
+            if (oprsz - i < lnsz
+                || !vec_host_ok(INDEX_op_cmp_vec, vece, lnsz)) {
+                continue;
+            }
+            for (; i + lnsz <= oprsz; i += lnsz) {
+                tcg_gen_op6(&tcg_ctx, INDEX_op_cmp_vec, b, cond, dofs + i,
+                            aofs + i, bofs + i, TCG_VEC_DESC(lnsz, vece));
+            }
+        }
+        if (i == oprsz) {
+            return;
+        }
+        if (cond != TCG_COND_EQ && cond != TCG_COND_NE) {
+            mop |= MO_SIGN;
+        }
+    }
+
+    /* Otherwise compare one element at a time.  */
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (; i < oprsz; i += esz) {
+        gen_ld_elem(mop, t0, base, aofs + i);
+        gen_ld_elem(mop, t1, base, bofs + i);
+        tcg_gen_setcond_i64(cond, t0, t0, t1);
+        tcg_gen_neg_i64(t0, t0);
+        gen_st_elem(vece, t0, base, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
@@ -1843,6 +1843,22 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* End the TB by jumping to the TB for the current CPU state, if it is in
+   the jump cache; otherwise return to the main loop.  This is meant for
+   indirect jumps and for direct jumps to another page, which cannot be
+   chained with goto_tb.  */
+void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr, env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     switch (op & MO_SIZE) {
@@ -1941,3 +1957,75 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 1, 1);
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
+
+static void gen_ldst_v128(TCGOpcode opc, TCGv_ptr base, tcg_target_long ofs,
+                          TCGv addr, TCGMemOp memop, TCGArg idx)
+{
+    TCGMemOpIdx oi = make_memop_idx(memop, idx);
+#if TARGET_LONG_BITS == 32
+    tcg_gen_op4(&tcg_ctx, opc, GET_TCGV_PTR(base), GET_TCGV_I32(addr),
+                oi, ofs);
+#else
+    if (TCG_TARGET_REG_BITS == 32) {
+        tcg_gen_op5(&tcg_ctx, opc, GET_TCGV_PTR(base),
+                    GET_TCGV_I32(TCGV_LOW(addr)),
+                    GET_TCGV_I32(TCGV_HIGH(addr)), oi, ofs);
+    } else {
+        tcg_gen_op4(&tcg_ctx, opc, GET_TCGV_PTR(base), GET_TCGV_I64(addr),
+                    oi, ofs);
+    }
+#endif
+}
+
+/* 128-bit accesses between guest memory at ADDR and host memory at
+   BASE + OFS, as two 64-bit words in guest address order.  The
+   endianness and alignment in MEMOP apply to each word, its size is
+   ignored.  BASE + OFS must not back a TCG global.  */
+void tcg_gen_qemu_ld_v128(TCGv_ptr base, tcg_target_long ofs, TCGv addr,
+                          TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 lo, hi;
+    TCGv addr_hi;
+
+    memop = (memop & ~MO_SSIZE) | MO_64;
+    if (TCG_TARGET_HAS_qemu_ldst_v128 && !(memop & MO_BSWAP)) {
+        gen_ldst_v128(INDEX_op_qemu_ld_v128, base, ofs, addr, memop, idx);
+        return;
+    }
+
+    /* Read both words before writing either, as the host op does.  */
+    lo = tcg_temp_new_i64();
+    hi = tcg_temp_new_i64();
+    addr_hi = tcg_temp_new();
+    tcg_gen_qemu_ld_i64(lo, addr, idx, memop);
+    tcg_gen_addi_tl(addr_hi, addr, 8);
+    tcg_gen_qemu_ld_i64(hi, addr_hi, idx, memop);
+    tcg_gen_st_i64(lo, base, ofs);
+    tcg_gen_st_i64(hi, base, ofs + 8);
+    tcg_temp_free(addr_hi);
+    tcg_temp_free_i64(hi);
+    tcg_temp_free_i64(lo);
+}
+
+void tcg_gen_qemu_st_v128(TCGv_ptr base, tcg_target_long ofs, TCGv addr,
+                          TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 val;
+    TCGv addr_hi;
+
+    memop = (memop & ~MO_SSIZE) | MO_64;
+    if (TCG_TARGET_HAS_qemu_ldst_v128 && !(memop & MO_BSWAP)) {
+        gen_ldst_v128(INDEX_op_qemu_st_v128, base, ofs, addr, memop, idx);
+        return;
+    }
+
+    val = tcg_temp_new_i64();
+    addr_hi = tcg_temp_new();
+    tcg_gen_ld_i64(val, base, ofs);
+    tcg_gen_qemu_st_i64(val, addr, idx, memop);
+    tcg_gen_addi_tl(addr_hi, addr, 8);
+    tcg_gen_ld_i64(val, base, ofs + 8);
+    tcg_gen_qemu_st_i64(val, addr_hi, idx, memop);
+    tcg_temp_free(addr_hi);
+    tcg_temp_free_i64(val);
+}
@@ -718,6 +718,7 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
 }
 
 void tcg_gen_goto_tb(unsigned idx);
+void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env);
 
 #if TARGET_LONG_BITS == 32
 #define TCGv TCGv_i32
@@ -749,6 +750,8 @@ void tcg_gen_qemu_ld_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_ld_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
+void tcg_gen_qemu_ld_v128(TCGv_ptr, tcg_target_long, TCGv, TCGArg, TCGMemOp);
+void tcg_gen_qemu_st_v128(TCGv_ptr, tcg_target_long, TCGv, TCGArg, TCGMemOp);
 
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -805,6 +808,43 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
     tcg_gen_qemu_st_i64(arg, addr, mem_index, MO_TEQ);
 }
 
+/* Vector operations on OPRSZ bytes of host memory at BASE + offset,
+   normally guest registers in env.  OPRSZ is a multiple of 8 and VECE
+   is the log2 of the element size, MO_8 ... MO_64.  Operands must
+   either coincide or not overlap, and must not back a TCG global.
+   These use host SIMD instructions where the backend has them.  */
+void tcg_gen_gvec_mov(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz);
+void tcg_gen_gvec_dup_i32(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i32 in);
+void tcg_gen_gvec_dup_i64(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i64 in);
+void tcg_gen_gvec_dupi(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint64_t x);
+void tcg_gen_gvec_add(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz);
+/* The shift count must be less than the element size in bits.  */
+void tcg_gen_gvec_shli(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_shri(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_sari(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+/* Set each element to all ones if COND holds for it, else to zero.  */
+void tcg_gen_gvec_cmp(TCGv_ptr base, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+
 #if TARGET_LONG_BITS == 64
 #define tcg_gen_movi_tl tcg_gen_movi_i64
 #define tcg_gen_mov_tl tcg_gen_mov_i64
@@ -408,6 +408,121 @@ void tcg_func_start(TCGContext *s)
     s->gen_next_parm_idx = 0;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
+
+    s->nb_code_relocs = 0;
+    s->code_reloc_failed = false;
+}
+
+#if TCG_TARGET_HAS_code_reloc
+/* Provided by the linker.  */
+extern const char __executable_start[], etext[];
+#endif
+
+/* Record that PTR holds TARGET, either as an absolute address or as an
+   offset from the end of a 32-bit field.  Targets inside the block being
+   generated need no relocation when they are pc-relative; anything that
+   cannot be expressed relative to one of the TCGCodeRelocBase anchors
+   makes the whole block non-relocatable.  */
+void tcg_code_reloc(TCGContext *s, tcg_insn_unit *ptr,
+                    TCGCodeRelocType type, uintptr_t target)
+{
+#if TCG_TARGET_HAS_code_reloc
+    uintptr_t code = (uintptr_t)s->code_buf;
+    uintptr_t prologue = (uintptr_t)s->code_gen_prologue;
+    uintptr_t tb = (uintptr_t)s->code_reloc_tb;
+    TCGCodeReloc *r;
+    TCGCodeRelocBase base;
+    uintptr_t start;
+
+    if (target >= code && target <= (uintptr_t)s->code_ptr) {
+        if (type == TCG_RELOC_REL32) {
+            return;
+        }
+        base = TCG_RELOC_BASE_CODE;
+        start = code;
+    } else if (target >= prologue && target < prologue + 1024) {
+        base = TCG_RELOC_BASE_PROLOGUE;
+        start = prologue;
+    } else if (tb && target - tb < 4) {
+        /* exit_tb values carry the jump slot in the low bits */
+        base = TCG_RELOC_BASE_TB;
+        start = tb;
+    } else if (target >= (uintptr_t)__executable_start &&
+               target < (uintptr_t)etext) {
+        base = TCG_RELOC_BASE_TEXT;
+        start = (uintptr_t)__executable_start;
+    } else {
+        s->code_reloc_failed = true;
+        return;
+    }
+
+    if (s->nb_code_relocs >= TCG_MAX_CODE_RELOCS) {
+        s->code_reloc_failed = true;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = tcg_ptr_byte_diff(ptr, s->code_buf);
+    r->type = type;
+    r->base = base;
+    r->pad = 0;
+    r->addend = target - start;
+#else
+    s->code_reloc_failed = true;
+#endif
+}
+
+/* Apply relocations recorded by tcg_code_reloc to a copy of the code at
+   CODE, whose TranslationBlock is TB.  Return false if a target is now
+   out of range.  */
+bool tcg_code_relocate(TCGContext *s, tcg_insn_unit *code, void *tb,
+                       const TCGCodeReloc *relocs, int nb_relocs)
+{
+#if TCG_TARGET_HAS_code_reloc
+    int i;
+
+    for (i = 0; i < nb_relocs; i++) {
+        const TCGCodeReloc *r = &relocs[i];
+        void *p = (uint8_t *)code + r->offset;
+        uintptr_t target;
+        intptr_t disp;
+
+        switch (r->base) {
+        case TCG_RELOC_BASE_TEXT:
+            target = (uintptr_t)__executable_start;
+            break;
+        case TCG_RELOC_BASE_PROLOGUE:
+            target = (uintptr_t)s->code_gen_prologue;
+            break;
+        case TCG_RELOC_BASE_CODE:
+            target = (uintptr_t)code;
+            break;
+        case TCG_RELOC_BASE_TB:
+            target = (uintptr_t)tb;
+            break;
+        default:
+            return false;
+        }
+        target += r->addend;
+
+        switch (r->type) {
+        case TCG_RELOC_ABS64:
+            stq_he_p(p, target);
+            break;
+        case TCG_RELOC_REL32:
+            disp = target - ((uintptr_t)p + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            stl_he_p(p, disp);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
 }
 
 static inline void tcg_temp_alloc(TCGContext *s, int n)
@@ -1054,6 +1169,7 @@ void tcg_dump_ops(TCGContext *s)
             case INDEX_op_brcond_i64:
             case INDEX_op_setcond_i64:
             case INDEX_op_movcond_i64:
+            case INDEX_op_cmp_vec:
                 if (args[k] < ARRAY_SIZE(cond_name) && cond_name[args[k]]) {
                     qemu_log(",%s", cond_name[args[k++]]);
                 } else {
@@ -1065,6 +1181,8 @@ void tcg_dump_ops(TCGContext *s)
             case INDEX_op_qemu_st_i32:
             case INDEX_op_qemu_ld_i64:
             case INDEX_op_qemu_st_i64:
+            case INDEX_op_qemu_ld_v128:
+            case INDEX_op_qemu_st_v128:
                 {
                     TCGMemOpIdx oi = args[k++];
                     TCGMemOp op = get_memop(oi);
@@ -1283,17 +1401,18 @@ void tcg_op_remove(TCGContext *s, TCGOp *op)
 /* liveness analysis: end of function: all temps are dead, and globals
    should be in memory. */
 static inline void tcg_la_func_end(TCGContext *s, uint8_t *dead_temps,
-                                   uint8_t *mem_temps)
+                                   uint8_t *mem_temps, TCGRegSet *prefs)
 {
     memset(dead_temps, 1, s->nb_temps);
     memset(mem_temps, 1, s->nb_globals);
     memset(mem_temps + s->nb_globals, 0, s->nb_temps - s->nb_globals);
+    memset(prefs, 0, s->nb_temps * sizeof(TCGRegSet));
 }
 
 /* liveness analysis: end of basic block: all temps are dead, globals
    and local temps should be in memory. */
 static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
-                                 uint8_t *mem_temps)
+                                 uint8_t *mem_temps, TCGRegSet *prefs)
 {
     int i;
 
@@ -1302,23 +1421,109 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     for(i = s->nb_globals; i < s->nb_temps; i++) {
         mem_temps[i] = s->temps[i].temp_local;
     }
+    memset(prefs, 0, s->nb_temps * sizeof(TCGRegSet));
+}
+
+/* liveness analysis: conditional branch.  Globals and local temps should
+   be in memory for the branch target, but they stay live on the
+   fall-through path, which extends the basic block.  Temps are dead, as
+   at the end of any basic block. */
+static inline void tcg_la_bb_sync(TCGContext *s, uint8_t *dead_temps,
+                                  uint8_t *mem_temps, TCGRegSet *prefs)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            mem_temps[i] = 1;
+        } else {
+            dead_temps[i] = 1;
+            mem_temps[i] = 0;
+            prefs[i] = 0;
+        }
+    }
+}
+
+/* liveness analysis: the globals are dead before a helper that may
+   modify them */
+static inline void tcg_la_globals_dead(TCGContext *s, uint8_t *dead_temps,
+                                       TCGRegSet *prefs)
+{
+    memset(dead_temps, 1, s->nb_globals);
+    memset(prefs, 0, s->nb_globals * sizeof(TCGRegSet));
+}
+
+/* liveness analysis: call-clobbered registers.  Steer the values that are
+   live across the call towards call-saved registers, so that they do not
+   have to be spilled around it. */
+static void tcg_la_call_clobber(TCGContext *s, const uint8_t *dead_temps,
+                                TCGRegSet *prefs)
+{
+    int i;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        if (!dead_temps[i]) {
+            TCGRegSet set = prefs[i] & ~tcg_target_call_clobber_regs;
+
+            if (set == 0) {
+                set = tcg_target_available_regs[s->temps[i].type]
+                      & ~tcg_target_call_clobber_regs;
+            }
+            prefs[i] = set;
+        }
+    }
+}
+
+/* liveness analysis: narrow the register preferences of the inputs of an
+   op down to what its constraints accept.  An input aliased to an output
+   also prefers the registers wanted by the uses of that output. */
+static void tcg_la_input_prefs(const TCGOpDef *def, const TCGArg *args,
+                               int nb_oargs, int nb_iargs,
+                               const TCGRegSet *output_pref, TCGRegSet *prefs)
+{
+    int i;
+
+    for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+        const TCGArgConstraint *arg_ct = &def->args_ct[i];
+        TCGRegSet set = prefs[args[i]] & arg_ct->u.regs;
+
+        if ((arg_ct->ct & TCG_CT_IALIAS)
+            && arg_ct->alias_index < TCG_MAX_PREF_OARGS
+            && (set & output_pref[arg_ct->alias_index])) {
+            set &= output_pref[arg_ct->alias_index];
+        }
+        /* if the combination is not possible, restart from the
+           constraint alone */
+        if (set == 0) {
+            set = arg_ct->u.regs;
+        }
+        prefs[args[i]] = set;
+    }
 }
 
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed.  The analysis runs backwards across
+   conditional branches, so values can stay in registers over an
+   extended basic block.  It also records in op_output_pref the
+   registers that the later uses of each output prefer. */
 static void tcg_liveness_analysis(TCGContext *s)
 {
     uint8_t *dead_temps, *mem_temps;
+    TCGRegSet *prefs;
     int oi, oi_prev, nb_ops;
 
     nb_ops = s->gen_next_op_idx;
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
-    
+    s->op_output_pref = tcg_malloc(nb_ops * TCG_MAX_PREF_OARGS *
+                                   sizeof(TCGRegSet));
+
     dead_temps = tcg_malloc(s->nb_temps);
     mem_temps = tcg_malloc(s->nb_temps);
-    tcg_la_func_end(s, dead_temps, mem_temps);
+    prefs = tcg_malloc(s->nb_temps * sizeof(TCGRegSet));
+    tcg_la_func_end(s, dead_temps, mem_temps, prefs);
 
     for (oi = s->gen_last_op_idx; oi >= 0; oi = oi_prev) {
         int i, nb_iargs, nb_oargs;
@@ -1330,10 +1535,13 @@ static void tcg_liveness_analysis(TCGContext *s)
 
         TCGOp * const op = &s->gen_op_buf[oi];
         TCGArg * const args = &s->gen_opparam_buf[op->args];
+        TCGRegSet * const output_pref =
+            &s->op_output_pref[oi * TCG_MAX_PREF_OARGS];
         TCGOpcode opc = op->opc;
         const TCGOpDef *def = &tcg_op_defs[opc];
 
         oi_prev = op->prev;
+        memset(output_pref, 0, TCG_MAX_PREF_OARGS * sizeof(TCGRegSet));
 
         switch (opc) {
         case INDEX_op_call:
@@ -1367,8 +1575,12 @@ static void tcg_liveness_analysis(TCGContext *s)
                         if (mem_temps[arg]) {
                             sync_args |= (1 << i);
                         }
+                        if (i < TCG_MAX_PREF_OARGS) {
+                            output_pref[i] = prefs[arg];
+                        }
                         dead_temps[arg] = 1;
                         mem_temps[arg] = 0;
+                        prefs[arg] = 0;
                     }
 
                     if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
@@ -1378,8 +1590,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                     if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
                                         TCG_CALL_NO_READ_GLOBALS))) {
                         /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                        tcg_la_globals_dead(s, dead_temps, prefs);
                     }
+                    tcg_la_call_clobber(s, dead_temps, prefs);
 
                     /* record arguments that die in this helper */
                     for (i = nb_oargs; i < nb_iargs + nb_oargs; i++) {
@@ -1390,9 +1603,23 @@ static void tcg_liveness_analysis(TCGContext *s)
                             }
                         }
                     }
-                    /* input arguments are live for preceding opcodes */
+                    /* input arguments are live for preceding opcodes;
+                       those that die in the helper and are passed in
+                       registers prefer their argument register */
                     for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                        int iarg = i - nb_oargs;
+
                         arg = args[i];
+                        if (arg == TCG_CALL_DUMMY_ARG) {
+                            continue;
+                        }
+                        if (dead_temps[arg]) {
+                            prefs[arg] = 0;
+                            if (iarg < ARRAY_SIZE(tcg_target_call_iarg_regs)) {
+                                tcg_regset_set_reg(prefs[arg],
+                                    tcg_target_call_iarg_regs[iarg]);
+                            }
+                        }
                         dead_temps[arg] = 0;
                     }
                     s->op_dead_args[oi] = dead_args;
@@ -1406,6 +1633,7 @@ static void tcg_liveness_analysis(TCGContext *s)
             /* mark the temporary as dead */
             dead_temps[args[0]] = 1;
             mem_temps[args[0]] = 0;
+            prefs[args[0]] = 0;
             break;
 
         case INDEX_op_add2_i32:
@@ -1517,17 +1745,26 @@ static void tcg_liveness_analysis(TCGContext *s)
                     if (mem_temps[arg]) {
                         sync_args |= (1 << i);
                     }
+                    if (i < TCG_MAX_PREF_OARGS) {
+                        output_pref[i] = prefs[arg];
+                    }
                     dead_temps[arg] = 1;
                     mem_temps[arg] = 0;
+                    prefs[arg] = 0;
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, dead_temps, mem_temps);
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_bb_sync(s, dead_temps, mem_temps, prefs);
+                } else if (def->flags & TCG_OPF_BB_END) {
+                    tcg_la_bb_end(s, dead_temps, mem_temps, prefs);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
                 }
+                if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                    tcg_la_call_clobber(s, dead_temps, prefs);
+                }
 
                 /* record arguments that die in this opcode */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
@@ -1536,11 +1773,29 @@ static void tcg_liveness_analysis(TCGContext *s)
                         dead_args |= (1 << i);
                     }
                 }
-                /* input arguments are live for preceding opcodes */
+                /* input arguments are live for preceding opcodes; at
+                   their last use, any register of their type will do
+                   until the constraints narrow it down */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
                     arg = args[i];
+                    if (dead_temps[arg]) {
+                        prefs[arg] = tcg_target_available_regs[
+                            s->temps[arg].type];
+                    }
                     dead_temps[arg] = 0;
                 }
+
+                if (opc == INDEX_op_mov_i32 || opc == INDEX_op_mov_i64) {
+                    /* moves have no constraints, but when the source dies
+                       the output takes over its register */
+                    if ((dead_args & 2) && output_pref[0]) {
+                        prefs[args[1]] = output_pref[0];
+                    }
+                } else {
+                    /* the op may have been replaced above */
+                    tcg_la_input_prefs(&tcg_op_defs[opc], args, nb_oargs,
+                                       nb_iargs, output_pref, prefs);
+                }
                 s->op_dead_args[oi] = dead_args;
                 s->op_sync_args[oi] = sync_args;
             }
@@ -1557,6 +1812,10 @@ static void tcg_liveness_analysis(TCGContext *s)
 
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
+    s->op_output_pref = tcg_malloc(nb_ops * TCG_MAX_PREF_OARGS *
+                                   sizeof(TCGRegSet));
+    memset(s->op_output_pref, 0,
+           nb_ops * TCG_MAX_PREF_OARGS * sizeof(TCGRegSet));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
     memset(s->op_sync_args, 0, nb_ops * sizeof(uint8_t));
 }
@@ -1669,10 +1928,24 @@ static inline void tcg_reg_sync(TCGContext *s, int reg)
             temp_allocate_frame(s, temp);
         }
         tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+#ifdef CONFIG_PROFILER
+        s->spill_count++;
+#endif
     }
     ts->mem_coherent = 1;
 }
 
+/* load temporary 'temp' from its memory location into register 'reg' */
+static inline void tcg_reg_reload(TCGContext *s, int temp, int reg)
+{
+    TCGTemp *ts = &s->temps[temp];
+
+    tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+#ifdef CONFIG_PROFILER
+    s->reload_count++;
+#endif
+}
+
 /* free register 'reg' by spilling the corresponding temporary if necessary */
 static void tcg_reg_free(TCGContext *s, int reg)
 {
@@ -1686,22 +1959,44 @@ static void tcg_reg_free(TCGContext *s, int reg)
     }
 }
 
-/* Allocate a register belonging to reg1 & ~reg2 */
-static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
+/* Allocate a register belonging to reg1 & ~reg2, preferably one that
+   also belongs to 'preferred' */
+static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2,
+                         TCGRegSet preferred)
 {
     int i, reg;
-    TCGRegSet reg_ct;
+    TCGRegSet reg_ct, pref_ct;
 
     tcg_regset_andnot(reg_ct, reg1, reg2);
-
-    /* first try free registers */
+    tcg_regset_and(pref_ct, reg_ct, preferred);
+
+    /* first try free registers, preferred ones first */
+    if (pref_ct) {
+        for (i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+            reg = tcg_target_reg_alloc_order[i];
+            if (tcg_regset_test_reg(pref_ct, reg)
+                && s->reg_to_temp[reg] == -1) {
+                return reg;
+            }
+        }
+    }
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg) && s->reg_to_temp[reg] == -1)
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* then spill a register whose value is already in memory, which
+       does not need a store */
+    for (i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        reg = tcg_target_reg_alloc_order[i];
+        if (tcg_regset_test_reg(reg_ct, reg)
+            && s->temps[s->reg_to_temp[reg]].mem_coherent) {
+            tcg_reg_free(s, reg);
+            return reg;
+        }
+    }
+
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
@@ -1742,7 +2037,7 @@ static inline void temp_sync(TCGContext *s, int temp, TCGRegSet allocated_regs)
         switch(ts->val_type) {
         case TEMP_VAL_CONST:
             ts->reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type],
-                                    allocated_regs);
+                                    allocated_regs, 0);
             ts->val_type = TEMP_VAL_REG;
             s->reg_to_temp[ts->reg] = temp;
             ts->mem_coherent = 0;
@@ -1828,6 +2123,36 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, globals and local temps must be in memory for
+   the branch target, but they keep their registers for the fall-through
+   path.  Temps are dead. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    sync_globals(s, allocated_regs);
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+#ifdef USE_LIVENESS_ANALYSIS
+        /* The liveness analysis already ensures that local temps are
+           synced and temps are dead.  Keep an assert for safety. */
+        if (ts->temp_local) {
+            assert(ts->val_type != TEMP_VAL_REG || ts->mem_coherent);
+        } else {
+            assert(ts->val_type == TEMP_VAL_DEAD);
+        }
+#else
+        if (ts->temp_local) {
+            temp_sync(s, i, allocated_regs);
+        } else {
+            temp_dead(s, i);
+        }
+#endif
+    }
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1861,7 +2186,7 @@ static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args,
 
 static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                               const TCGArg *args, uint16_t dead_args,
-                              uint8_t sync_args)
+                              uint8_t sync_args, const TCGRegSet *output_pref)
 {
     TCGRegSet allocated_regs;
     TCGTemp *ts, *ots;
@@ -1882,9 +2207,10 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
     if (((NEED_SYNC_ARG(0) || ots->fixed_reg) && ts->val_type != TEMP_VAL_REG)
         || ts->val_type == TEMP_VAL_MEM) {
         ts->reg = tcg_reg_alloc(s, tcg_target_available_regs[itype],
-                                allocated_regs);
+                                allocated_regs,
+                                IS_DEAD_ARG(1) ? output_pref[0] : 0);
         if (ts->val_type == TEMP_VAL_MEM) {
-            tcg_out_ld(s, itype, ts->reg, ts->mem_reg, ts->mem_offset);
+            tcg_reg_reload(s, args[1], ts->reg);
             ts->mem_coherent = 1;
         } else if (ts->val_type == TEMP_VAL_CONST) {
             tcg_out_movi(s, itype, ts->reg, ts->val);
@@ -1935,7 +2261,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                    input one. */
                 tcg_regset_set_reg(allocated_regs, ts->reg);
                 ots->reg = tcg_reg_alloc(s, tcg_target_available_regs[otype],
-                                         allocated_regs);
+                                         allocated_regs, output_pref[0]);
             }
             tcg_out_mov(s, otype, ots->reg, ts->reg);
         }
@@ -1951,7 +2277,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
 static void tcg_reg_alloc_op(TCGContext *s, 
                              const TCGOpDef *def, TCGOpcode opc,
                              const TCGArg *args, uint16_t dead_args,
-                             uint8_t sync_args)
+                             uint8_t sync_args, const TCGRegSet *output_pref)
 {
     TCGRegSet allocated_regs;
     int i, k, nb_iargs, nb_oargs, reg;
@@ -1960,6 +2286,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
     TCGTemp *ts;
     TCGArg new_args[TCG_MAX_OP_ARGS];
     int const_args[TCG_MAX_OP_ARGS];
+    TCGRegSet preferred;
 
     nb_oargs = def->nb_oargs;
     nb_iargs = def->nb_iargs;
@@ -1976,9 +2303,16 @@ static void tcg_reg_alloc_op(TCGContext *s,
         arg = args[i];
         arg_ct = &def->args_ct[i];
         ts = &s->temps[arg];
+        /* an input that dies in an output's register should be loaded
+           where that output's uses want it */
+        preferred = 0;
+        if ((arg_ct->ct & TCG_CT_IALIAS) && IS_DEAD_ARG(i)
+            && arg_ct->alias_index < TCG_MAX_PREF_OARGS) {
+            preferred = output_pref[arg_ct->alias_index];
+        }
         if (ts->val_type == TEMP_VAL_MEM) {
-            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
-            tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs, preferred);
+            tcg_reg_reload(s, arg, reg);
             ts->val_type = TEMP_VAL_REG;
             ts->reg = reg;
             ts->mem_coherent = 1;
@@ -1991,7 +2325,8 @@ static void tcg_reg_alloc_op(TCGContext *s,
                 goto iarg_end;
             } else {
                 /* need to move to a register */
-                reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+                reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs,
+                                    preferred);
                 tcg_out_movi(s, ts->type, reg, ts->val);
                 ts->val_type = TEMP_VAL_REG;
                 ts->reg = reg;
@@ -2032,7 +2367,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
         allocate_in_reg:
             /* allocate a new register matching the constraint 
                and move the temporary register into it */
-            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs, preferred);
             tcg_out_mov(s, ts->type, reg, ts->reg);
         }
         new_args[i] = reg;
@@ -2048,7 +2383,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2081,7 +2418,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
                     tcg_regset_test_reg(arg_ct->u.regs, reg)) {
                     goto oarg_end;
                 }
-                reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+                preferred = i < TCG_MAX_PREF_OARGS ? output_pref[i] : 0;
+                reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs,
+                                    preferred);
             }
             tcg_regset_set_reg(allocated_regs, reg);
             /* if a fixed register is used, then a move will be done afterwards */
@@ -2170,13 +2509,13 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
                 tcg_out_st(s, ts->type, ts->reg, TCG_REG_CALL_STACK, stack_offset);
             } else if (ts->val_type == TEMP_VAL_MEM) {
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
-                                    s->reserved_regs);
+                                    s->reserved_regs, 0);
                 /* XXX: not correct if reading values from the stack */
-                tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_reg_reload(s, arg, reg);
                 tcg_out_st(s, ts->type, reg, TCG_REG_CALL_STACK, stack_offset);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
-                                    s->reserved_regs);
+                                    s->reserved_regs, 0);
                 /* XXX: sign extend may be needed on some targets */
                 tcg_out_movi(s, ts->type, reg, ts->val);
                 tcg_out_st(s, ts->type, reg, TCG_REG_CALL_STACK, stack_offset);
@@ -2202,7 +2541,7 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
                     tcg_out_mov(s, ts->type, reg, ts->reg);
                 }
             } else if (ts->val_type == TEMP_VAL_MEM) {
-                tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_reg_reload(s, arg, reg);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 /* XXX: sign extend ? */
                 tcg_out_movi(s, ts->type, reg, ts->val);
@@ -2344,6 +2683,8 @@ static inline int tcg_gen_code_common(TCGContext *s,
         const TCGOpDef *def = &tcg_op_defs[opc];
         uint16_t dead_args = s->op_dead_args[oi];
         uint8_t sync_args = s->op_sync_args[oi];
+        const TCGRegSet *output_pref =
+            &s->op_output_pref[oi * TCG_MAX_PREF_OARGS];
 
         oi_next = op->next;
 #ifdef CONFIG_PROFILER
@@ -2353,7 +2694,8 @@ static inline int tcg_gen_code_common(TCGContext *s,
         switch (opc) {
         case INDEX_op_mov_i32:
         case INDEX_op_mov_i64:
-            tcg_reg_alloc_mov(s, def, args, dead_args, sync_args);
+            tcg_reg_alloc_mov(s, def, args, dead_args, sync_args,
+                              output_pref);
             break;
         case INDEX_op_movi_i32:
         case INDEX_op_movi_i64:
@@ -2380,7 +2722,8 @@ static inline int tcg_gen_code_common(TCGContext *s,
             /* Note: in order to speed up the code, it would be much
                faster to have specialized register allocator functions for
                some common argument patterns */
-            tcg_reg_alloc_op(s, def, opc, args, dead_args, sync_args);
+            tcg_reg_alloc_op(s, def, opc, args, dead_args, sync_args,
+                             output_pref);
             break;
         }
         if (search_pc >= 0 && search_pc < tcg_current_code_size(s)) {
@@ -2413,6 +2756,12 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
         if (n > s->temp_count_max) {
             s->temp_count_max = n;
         }
+
+        for (n = s->gen_first_op_idx; n >= 0; n = s->gen_op_buf[n].next) {
+            if (s->gen_op_buf[n].opc == INDEX_op_debug_insn_start) {
+                s->insn_count++;
+            }
+        }
     }
 #endif
 
@@ -2431,7 +2780,19 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
 int tcg_gen_code_search_pc(TCGContext *s, tcg_insn_unit *gen_code_buf,
                            long offset)
 {
+#ifdef CONFIG_PROFILER
+    /* only count the spills and reloads of the code that is emitted */
+    int64_t spill_count = s->spill_count;
+    int64_t reload_count = s->reload_count;
+    int ret;
+
+    ret = tcg_gen_code_common(s, gen_code_buf, offset);
+    s->spill_count = spill_count;
+    s->reload_count = reload_count;
+    return ret;
+#else
     return tcg_gen_code_common(s, gen_code_buf, offset);
+#endif
 }
 
 #ifdef CONFIG_PROFILER
@@ -2456,6 +2817,14 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
                 s->temp_count_max);
+    cpu_fprintf(f, "avg guest insns/TB  %0.2f\n",
+                s->tb_count ? (double)s->insn_count / s->tb_count : 0);
+    cpu_fprintf(f, "host bytes/insn     %0.1f\n",
+                s->insn_count ? (double)s->code_out_len / s->insn_count : 0);
+    cpu_fprintf(f, "spills/insn         %0.2f\n",
+                s->insn_count ? (double)s->spill_count / s->insn_count : 0);
+    cpu_fprintf(f, "reloads/insn        %0.2f\n",
+                s->insn_count ? (double)s->reload_count / s->insn_count : 0);
     
     cpu_fprintf(f, "cycles/op           %0.1f\n", 
                 s->op_count ? (double)tot / s->op_count : 0);
@@ -287,6 +287,17 @@ typedef enum TCGMemOp {
     MO_SSIZE = MO_SIZE | MO_SIGN,
 } TCGMemOp;
 
+/* Orderings between memory accesses, as guaranteed by a guest or host
+   architecture without barrier instructions.  TCG_MO_ST_LD means that a
+   later load cannot be performed before an earlier store, and so on.  */
+typedef enum {
+    TCG_MO_LD_LD  = 0x01,
+    TCG_MO_ST_LD  = 0x02,
+    TCG_MO_LD_ST  = 0x04,
+    TCG_MO_ST_ST  = 0x08,
+    TCG_MO_ALL    = 0x0F,
+} TCGBar;
+
 typedef tcg_target_ulong TCGArg;
 
 /* Define a type and accessor macros for variables.  Using pointer types
@@ -461,6 +472,31 @@ typedef struct TCGTemp {
 
 typedef struct TCGContext TCGContext;
 
+/* Host addresses embedded in generated code, recorded so that the code
+   can be copied into the code buffer of another process by the
+   persistent TB cache.  The patched value is BASE + ADDEND.  */
+typedef enum TCGCodeRelocType {
+    TCG_RELOC_ABS64,            /* 64-bit absolute address */
+    TCG_RELOC_REL32,            /* 32-bit offset from the end of the field */
+} TCGCodeRelocType;
+
+typedef enum TCGCodeRelocBase {
+    TCG_RELOC_BASE_TEXT,        /* start of the QEMU executable */
+    TCG_RELOC_BASE_PROLOGUE,    /* tcg_ctx.code_gen_prologue */
+    TCG_RELOC_BASE_CODE,        /* start of the block's own code */
+    TCG_RELOC_BASE_TB,          /* the block's TranslationBlock */
+} TCGCodeRelocBase;
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;            /* of the field, from the start of the code */
+    uint8_t type;
+    uint8_t base;
+    uint16_t pad;
+    int64_t addend;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 1024
+
 typedef struct TCGTempSet {
     unsigned long l[BITS_TO_LONGS(TCG_MAX_TEMPS)];
 } TCGTempSet;
@@ -497,12 +533,22 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* code relocations, only recorded if code_reloc_enabled */
+    bool code_reloc_enabled;
+    bool code_reloc_failed;     /* the code cannot be relocated */
+    void *code_reloc_tb;
+    int nb_code_relocs;
+    TCGCodeReloc *code_relocs;
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
     uint8_t *op_sync_args;  /* for each operation, each bit tells if the
                                corresponding output argument needs to be
                                sync to memory. */
+    TCGRegSet *op_output_pref; /* for each operation, TCG_MAX_PREF_OARGS
+                                  sets of registers preferred by the later
+                                  uses of its outputs (0: no preference) */
     
     TCGRegSet reserved_regs;
     intptr_t current_frame_offset;
@@ -531,6 +577,9 @@ struct TCGContext {
     int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
+    int64_t insn_count; /* guest insn count */
+    int64_t spill_count; /* temps stored to memory by the allocator */
+    int64_t reload_count; /* temps loaded from memory by the allocator */
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -549,6 +598,7 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     /* threshold to flush the translated code buffer */
@@ -683,6 +733,10 @@ typedef struct TCGArgConstraint {
 
 #define TCG_MAX_OP_ARGS 16
 
+/* Number of outputs of an op for which the liveness analysis records
+   register preferences */
+#define TCG_MAX_PREF_OARGS 2
+
 /* Bits for TCGOpDef->flags, 8 bits available.  */
 enum {
     /* Instruction defines the end of a basic block.  */
@@ -697,6 +751,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: the fall-through path extends
+       the basic block, so values can stay in registers across it.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -750,7 +807,10 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+/* A host pointer in the opcode stream cannot be relocated.  */
+#define tcg_const_ptr(V) \
+    (tcg_ctx.code_reloc_failed = true, \
+     TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -765,6 +825,29 @@ void tcg_gen_callN(TCGContext *s, void *func,
 void tcg_op_remove(TCGContext *s, TCGOp *op);
 void tcg_optimize(TCGContext *s);
 
+/* The last constant argument of the *_vec ops packs the size of the
+   operation in bytes, a multiple of 16, with the log2 of the element
+   size (MO_8 ... MO_64).  */
+#define TCG_VEC_DESC(oprsz, vece)  ((oprsz) | (vece))
+#define TCG_VEC_OPRSZ(desc)        ((desc) & ~(TCGArg)15)
+#define TCG_VEC_VECE(desc)         ((desc) & 3)
+
+#if TCG_TARGET_HAS_vec
+/* Provided by the backend: return true if OPC can be emitted for an
+   OPRSZ-byte operation on elements of size VECE.  */
+bool tcg_can_emit_vec_op(TCGOpcode opc, unsigned vece, uint32_t oprsz);
+#endif
+
+void tcg_code_reloc(TCGContext *s, tcg_insn_unit *ptr,
+                    TCGCodeRelocType type, uintptr_t target);
+bool tcg_code_relocate(TCGContext *s, tcg_insn_unit *code, void *tb,
+                       const TCGCodeReloc *relocs, int nb_relocs);
+#if TCG_TARGET_HAS_code_reloc
+/* Provided by the backend: a digest of the host CPU features that the
+   generated code depends on.  */
+uint32_t tcg_target_code_features(void);
+#endif
+
 /* only used for debugging purposes */
 void tcg_dump_ops(TCGContext *s);
 
@@ -990,6 +1073,13 @@ void helper_be_stl_mmu(CPUArchState *env, target_ulong addr, uint32_t val,
 void helper_be_stq_mmu(CPUArchState *env, target_ulong addr, uint64_t val,
                        TCGMemOpIdx oi, uintptr_t retaddr);
 
+/* 128-bit accesses between guest memory and the 16 bytes at HOST, which
+   hold two host-endian 64-bit words in guest address order.  */
+void helper_ld_v128_mmu(CPUArchState *env, target_ulong addr, void *host,
+                        TCGMemOpIdx oi, uintptr_t retaddr);
+void helper_st_v128_mmu(CPUArchState *env, target_ulong addr,
+                        const void *host, TCGMemOpIdx oi, uintptr_t retaddr);
+
 uint8_t helper_ret_ldb_cmmu(CPUArchState *env, target_ulong addr,
                             TCGMemOpIdx oi, uintptr_t retaddr);
 uint16_t helper_le_ldw_cmmu(CPUArchState *env, target_ulong addr,
@@ -0,0 +1,231 @@
+/*
+ * softfloat throughput benchmark
+ *
+ * usage: fp-bench [-d secs] [-o op] [-p prec] [-s]
+ *
+ * Runs float32/float64 add, sub, mul, div and sqrt over a table of
+ * random normal operands with round-to-nearest-even and reports millions
+ * of operations per second.  By default the inexact flag is left raised,
+ * as it is for most guest code, so that the host FPU fast path can be
+ * used; with -s the flags are cleared before every operation, forcing
+ * the pure software implementation for comparison.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "fpu/softfloat.h"
+
+#define N_OPS 4096
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+static unsigned int duration = 1;
+static int only_op = -1;
+static int only_prec;
+static bool soft_only;
+
+static float32 f32_a[N_OPS], f32_b[N_OPS];
+static float64 f64_a[N_OPS], f64_b[N_OPS];
+static volatile uint64_t sink;
+
+static uint64_t xorshift64star(uint64_t *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 2685821657736338717ULL;
+}
+
+/* Positive normal numbers well away from overflow and underflow.  */
+static void init_operands(void)
+{
+    uint64_t r = 1;
+    int i;
+
+    for (i = 0; i < N_OPS; i++) {
+        f32_a[i] = make_float32((uint32_t)(100 + xorshift64star(&r) % 50) << 23
+                                | (xorshift64star(&r) & 0x7fffff));
+        f32_b[i] = make_float32((uint32_t)(100 + xorshift64star(&r) % 50) << 23
+                                | (xorshift64star(&r) & 0x7fffff));
+        f64_a[i] = make_float64((uint64_t)(1000 + xorshift64star(&r) % 50) << 52
+                                | (xorshift64star(&r) & 0xfffffffffffffULL));
+        f64_b[i] = make_float64((uint64_t)(1000 + xorshift64star(&r) % 50) << 52
+                                | (xorshift64star(&r) & 0xfffffffffffffULL));
+    }
+}
+
+static uint64_t run_f32(enum op op, float_status *st)
+{
+    uint64_t acc = 0;
+    int i;
+
+    for (i = 0; i < N_OPS; i++) {
+        float32 r;
+
+        if (soft_only) {
+            st->float_exception_flags = 0;
+        }
+        switch (op) {
+        case OP_ADD:
+            r = float32_add(f32_a[i], f32_b[i], st);
+            break;
+        case OP_SUB:
+            r = float32_sub(f32_a[i], f32_b[i], st);
+            break;
+        case OP_MUL:
+            r = float32_mul(f32_a[i], f32_b[i], st);
+            break;
+        case OP_DIV:
+            r = float32_div(f32_a[i], f32_b[i], st);
+            break;
+        case OP_SQRT:
+            r = float32_sqrt(f32_a[i], st);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        acc += float32_val(r);
+    }
+    return acc;
+}
+
+static uint64_t run_f64(enum op op, float_status *st)
+{
+    uint64_t acc = 0;
+    int i;
+
+    for (i = 0; i < N_OPS; i++) {
+        float64 r;
+
+        if (soft_only) {
+            st->float_exception_flags = 0;
+        }
+        switch (op) {
+        case OP_ADD:
+            r = float64_add(f64_a[i], f64_b[i], st);
+            break;
+        case OP_SUB:
+            r = float64_sub(f64_a[i], f64_b[i], st);
+            break;
+        case OP_MUL:
+            r = float64_mul(f64_a[i], f64_b[i], st);
+            break;
+        case OP_DIV:
+            r = float64_div(f64_a[i], f64_b[i], st);
+            break;
+        case OP_SQRT:
+            r = float64_sqrt(f64_a[i], st);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        acc += float64_val(r);
+    }
+    return acc;
+}
+
+static void run_one(enum op op, int prec)
+{
+    float_status st = { 0 };
+    int64_t start, end, deadline;
+    uint64_t ops = 0;
+
+    set_float_rounding_mode(float_round_nearest_even, &st);
+    set_float_exception_flags(float_flag_inexact, &st);
+
+    start = get_clock();
+    deadline = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        sink += prec == 32 ? run_f32(op, &st) : run_f64(op, &st);
+        ops += N_OPS;
+        end = get_clock();
+    } while (end < deadline);
+
+    printf("float%d_%-5s %10.2f MFlops\n", prec, op_names[op],
+           (double)ops * 1e3 / (end - start));
+}
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options]\n"
+           "  -d secs     duration of each measurement (default %u)\n"
+           "  -o op       only run add, sub, mul, div or sqrt\n"
+           "  -p prec     only run precision 32 or 64\n"
+           "  -s          clear the flags before each operation, so that\n"
+           "              the software implementation is always used\n",
+           progname, duration);
+}
+
+int main(int argc, char *argv[])
+{
+    int op, c;
+
+    while ((c = getopt(argc, argv, "d:o:p:sh")) != -1) {
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'o':
+            for (op = 0; op < OP_COUNT; op++) {
+                if (!strcmp(optarg, op_names[op])) {
+                    only_op = op;
+                }
+            }
+            if (only_op < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'p':
+            only_prec = atoi(optarg);
+            break;
+        case 's':
+            soft_only = true;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (duration == 0 || (only_prec && only_prec != 32 && only_prec != 64)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    init_operands();
+    for (op = 0; op < OP_COUNT; op++) {
+        if (only_op >= 0 && op != only_op) {
+            continue;
+        }
+        if (only_prec != 64) {
+            run_one(op, 32);
+        }
+        if (only_prec != 32) {
+            run_one(op, 64);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * QTest testcase for postcopy migration
+ *
+ * Migrates a guest between two QEMU instances on the same host, switching
+ * to postcopy while most of RAM is still on the source.  Pages that were
+ * redirtied after they had been sent must be discarded on the destination,
+ * and pages that the destination reads before they arrive must be fetched
+ * on demand; in the end every page has to hold what the source wrote last.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "libqtest.h"
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#endif
+
+#define PAGE_SIZE       4096
+#define RAM_START       (1 << 20)   /* keep clear of the ROMs below 1 MB */
+#define RAM_END         (32 << 20)
+#define DIRTY_PAGES     64
+#define TIMEOUT_SECONDS 120
+
+static char *tmpfs;
+
+static bool ufd_version_check(void)
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+    struct uffdio_api api_struct;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        g_test_message("Skipping test: userfaultfd not available");
+        return false;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        g_test_message("Skipping test: UFFDIO_API failed");
+        close(ufd);
+        return false;
+    }
+    close(ufd);
+
+    return true;
+#else
+    g_test_message("Skipping test: userfaultfd not available");
+    return false;
+#endif
+}
+
+/* The first byte of each page tells which page it is and how often the
+ * source wrote to it */
+static uint8_t page_pattern(uint64_t addr, int generation)
+{
+    return (addr / PAGE_SIZE) ^ (generation ? 0xa5 : 0x5a);
+}
+
+/* Send a command and wait for its reply, skipping the events on the way */
+static QDict *wait_command(QTestState *who, const char *command)
+{
+    QDict *response;
+
+    qtest_async_qmp(who, command);
+    while (true) {
+        response = qtest_qmp_receive(who);
+        if (!qdict_haskey(response, "event")) {
+            break;
+        }
+        QDECREF(response);
+    }
+    g_assert(qdict_haskey(response, "return"));
+    return response;
+}
+
+static void run_command(QTestState *who, const char *command)
+{
+    QDECREF(wait_command(who, command));
+}
+
+/* Returns the status of the outgoing migration, which the caller frees */
+static char *migration_status(QTestState *who, int64_t *transferred)
+{
+    QDict *rsp, *rsp_return;
+    char *status;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate' }");
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert(qdict_haskey(rsp_return, "status"));
+    status = g_strdup(qdict_get_str(rsp_return, "status"));
+    g_assert_cmpstr(status, !=, "failed");
+    if (transferred) {
+        *transferred = 0;
+        if (qdict_haskey(rsp_return, "ram")) {
+            *transferred = qdict_get_int(qdict_get_qdict(rsp_return, "ram"),
+                                         "transferred");
+        }
+    }
+    QDECREF(rsp);
+
+    return status;
+}
+
+static void wait_for_status(QTestState *who, const char *wanted)
+{
+    int i;
+
+    for (i = 0; i < TIMEOUT_SECONDS * 10; i++) {
+        char *status = migration_status(who, NULL);
+        bool done = !strcmp(status, wanted);
+
+        g_free(status);
+        if (done) {
+            return;
+        }
+        g_usleep(100 * 1000);
+    }
+    g_assert_not_reached();
+}
+
+/* The destination runs once it has been told to listen for pages */
+static void wait_for_running(QTestState *who)
+{
+    int i;
+
+    for (i = 0; i < TIMEOUT_SECONDS * 10; i++) {
+        QDict *rsp = wait_command(who, "{ 'execute': 'query-status' }");
+        bool running = qdict_get_bool(qdict_get_qdict(rsp, "return"),
+                                      "running");
+
+        QDECREF(rsp);
+        if (running) {
+            return;
+        }
+        g_usleep(100 * 1000);
+    }
+    g_assert_not_reached();
+}
+
+static bool page_dirtied(uint64_t addr)
+{
+    return addr < RAM_START + DIRTY_PAGES * PAGE_SIZE;
+}
+
+static void test_migrate(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    char *cmd;
+    uint64_t addr;
+    int64_t transferred = 0;
+    int i;
+
+    from = qtest_init("-m 32M -nodefaults -name source");
+    cmd = g_strdup_printf("-m 32M -nodefaults -name target -incoming %s", uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    for (addr = RAM_START; addr < RAM_END; addr += PAGE_SIZE) {
+        qtest_writeb(from, addr, page_pattern(addr, 0));
+    }
+
+    run_command(from, "{ 'execute': 'migrate-set-capabilities',"
+                      "'arguments': { "
+                      "'capabilities': [ {"
+                      "'capability': 'x-postcopy-ram',"
+                      "'state': true } ] } }");
+
+    /* Slow enough that most of RAM is left for postcopy */
+    run_command(from, "{ 'execute': 'migrate_set_speed',"
+                      "'arguments': { 'value': 1048576 } }");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }", uri);
+    run_command(from, cmd);
+    g_free(cmd);
+
+    /* Redirty pages that precopy has already sent */
+    for (i = 0; i < TIMEOUT_SECONDS * 10; i++) {
+        g_free(migration_status(from, &transferred));
+        if (transferred > RAM_START + DIRTY_PAGES * PAGE_SIZE) {
+            break;
+        }
+        g_usleep(100 * 1000);
+    }
+    g_assert_cmpint(transferred, >, RAM_START + DIRTY_PAGES * PAGE_SIZE);
+    for (i = 0; i < DIRTY_PAGES; i++) {
+        addr = RAM_START + i * PAGE_SIZE;
+        qtest_writeb(from, addr, page_pattern(addr, 1));
+    }
+
+    run_command(from, "{ 'execute': 'migrate-start-postcopy' }");
+    wait_for_running(to);
+
+    /* Most of these pages haven't been sent yet and have to be requested */
+    for (addr = RAM_END - PAGE_SIZE; addr > RAM_START; addr -= 64 * PAGE_SIZE) {
+        g_assert_cmpint(qtest_readb(to, addr), ==,
+                        page_pattern(addr, page_dirtied(addr)));
+    }
+    g_assert_cmpint(qtest_readb(to, RAM_START), ==,
+                    page_pattern(RAM_START, 1));
+
+    run_command(from, "{ 'execute': 'migrate_set_speed',"
+                      "'arguments': { 'value': 1073741824 } }");
+    wait_for_status(from, "completed");
+
+    for (addr = RAM_START; addr < RAM_END; addr += PAGE_SIZE) {
+        g_assert_cmpint(qtest_readb(to, addr), ==,
+                        page_pattern(addr, page_dirtied(addr)));
+    }
+
+    qtest_quit(from);
+    qtest_quit(to);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/postcopy-test-XXXXXX";
+    char *sock;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!ufd_version_check()) {
+        return 0;
+    }
+
+    tmpfs = mkdtemp(template);
+    g_assert(tmpfs);
+
+    qtest_add_func("/postcopy", test_migrate);
+
+    ret = g_test_run();
+
+    sock = g_strdup_printf("%s/migsocket", tmpfs);
+    unlink(sock);
+    g_free(sock);
+    rmdir(tmpfs);
+
+    return ret;
+}
@@ -0,0 +1,215 @@
+/*
+ * QHT lookup microbenchmark
+ *
+ * usage: qht-bench [-d secs] [-n threads] [-k keys] [-K keys] [-u updaters]
+ *                  [-r]
+ *
+ * Measures lookup throughput and latency for table sizes doubling from
+ * -k to -K keys, optionally while updater threads keep removing and
+ * re-inserting keys.  With -r the table starts tiny and has to resize
+ * itself as the keys are inserted.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/tb-hash-xx.h"
+
+#define MAX_THREADS 64
+
+struct thread_info {
+    QemuThread thread;
+    uint64_t r;
+    uint64_t ops;
+    bool updater;
+} __attribute__((aligned(64)));
+
+static struct qht ht;
+static uint64_t *keys;
+static size_t n_keys;
+static volatile bool test_start;
+static volatile bool test_stop;
+static int n_ready;
+
+static unsigned int duration = 1;
+static unsigned int n_readers = 1;
+static unsigned int n_updaters;
+static size_t min_keys = 1024;
+static size_t max_keys = 4 * 1024 * 1024;
+static bool resize_test;
+
+static inline uint32_t h(uint64_t key)
+{
+    return tb_hash_func6(key, 0, 0);
+}
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const uint64_t *a = obj;
+    const uint64_t *b = userp;
+
+    return *a == *b;
+}
+
+/* xorshift64*: cheap enough not to dominate the measured loop */
+static inline uint64_t xorshift64star(uint64_t *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 2685821657736338717ULL;
+}
+
+static void *thread_func(void *arg)
+{
+    struct thread_info *info = arg;
+
+    rcu_register_thread();
+    atomic_inc(&n_ready);
+    while (!test_start) {
+        /* wait for the other threads */
+    }
+
+    while (!test_stop) {
+        size_t i = xorshift64star(&info->r) % n_keys;
+        uint64_t *key = &keys[i];
+
+        if (info->updater) {
+            if (qht_remove(&ht, key, h(*key))) {
+                qht_insert(&ht, key, h(*key));
+            }
+        } else {
+            qht_lookup(&ht, is_equal, key, h(*key));
+        }
+        info->ops++;
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void run_one(size_t n)
+{
+    struct thread_info *info;
+    struct qht_stats stats;
+    unsigned int n_threads = n_readers + n_updaters;
+    uint64_t reads = 0;
+    uint64_t updates = 0;
+    unsigned int i;
+
+    n_keys = n;
+    keys = g_new(uint64_t, n_keys);
+    qht_init(&ht, resize_test ? 1 : n_keys,
+             resize_test ? QHT_MODE_AUTO_RESIZE : 0);
+    for (i = 0; i < n_keys; i++) {
+        keys[i] = i;
+        qht_insert(&ht, &keys[i], h(keys[i]));
+    }
+
+    info = qemu_memalign(64, sizeof(*info) * n_threads);
+    memset(info, 0, sizeof(*info) * n_threads);
+    test_start = false;
+    test_stop = false;
+    n_ready = 0;
+    for (i = 0; i < n_threads; i++) {
+        info[i].r = i + 1;
+        info[i].updater = i >= n_readers;
+        qemu_thread_create(&info[i].thread, "qht-bench", thread_func,
+                           &info[i], QEMU_THREAD_JOINABLE);
+    }
+    while (atomic_read(&n_ready) != n_threads) {
+        g_usleep(1000);
+    }
+    test_start = true;
+    g_usleep(duration * G_USEC_PER_SEC);
+    test_stop = true;
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&info[i].thread);
+        if (info[i].updater) {
+            updates += info[i].ops;
+        } else {
+            reads += info[i].ops;
+        }
+    }
+
+    qht_statistics(&ht, &stats);
+    printf("%10zu %10zu %8.3f %3zu %10.2f %10.2f %10.2f\n",
+           n_keys, stats.head_buckets,
+           stats.used_head_buckets ?
+           (double)stats.chain_total / stats.used_head_buckets : 0,
+           stats.chain_max,
+           (double)reads / duration / 1e6,
+           reads ? (double)duration * 1e9 * n_readers / reads : 0,
+           (double)updates / duration / 1e6);
+
+    qemu_vfree(info);
+    qht_destroy(&ht);
+    g_free(keys);
+}
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options]\n"
+           "  -d secs     duration of each measurement (default %u)\n"
+           "  -n threads  number of reader threads (default %u)\n"
+           "  -u threads  number of updater threads (default %u)\n"
+           "  -k keys     smallest number of keys (default %zu)\n"
+           "  -K keys     largest number of keys (default %zu)\n"
+           "  -r          start with a tiny table and let it resize\n",
+           progname, duration, n_readers, n_updaters, min_keys, max_keys);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:n:u:k:K:rh")) != -1) {
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_readers = atoi(optarg);
+            break;
+        case 'u':
+            n_updaters = atoi(optarg);
+            break;
+        case 'k':
+            min_keys = atol(optarg);
+            break;
+        case 'K':
+            max_keys = atol(optarg);
+            break;
+        case 'r':
+            resize_test = true;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (duration == 0 || min_keys == 0 || max_keys < min_keys ||
+        n_readers == 0 || n_readers + n_updaters > MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%10s %10s %8s %3s %10s %10s %10s\n", "keys", "buckets",
+           "avgchain", "max", "Mlookup/s", "ns/lookup", "Mupdate/s");
+    for (n = min_keys; n <= max_keys; n *= 2) {
+        run_one(n);
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Multi-threaded atomics scaling test
+ *
+ * Each thread increments a shared counter with atomic read-modify-write
+ * operations and also does private work, so that the run time shows
+ * both the cost of the atomics and how well guest threads run in
+ * parallel.  Compare
+ *
+ *     time qemu-arm ./atomic-mt-arm 1
+ *     time qemu-arm ./atomic-mt-arm 4
+ *
+ * and likewise qemu-aarch64 with atomic-mt-aarch64, which is built for
+ * ARMv8.0 so that the atomics are LDXR/STXR loops.
+ *
+ * A scalable user-mode emulator should take about the same time for
+ * both, on a host with at least four cores.  The final count checks
+ * that no increment was lost.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+
+static unsigned long iterations = 2000000;
+static volatile uint32_t shared_counter;
+
+static void *thread_func(void *arg)
+{
+    uint32_t x = (uintptr_t)arg + 1;
+    unsigned long i;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+        __sync_fetch_and_add(&shared_counter, 1);
+        for (j = 0; j < 16; j++) {
+            x = x * 1103515245 + 12345;
+        }
+    }
+    return (void *)(uintptr_t)x;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    uint32_t expected;
+    int i;
+
+    if (argc > 2) {
+        iterations = strtoul(argv[2], NULL, 0);
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [threads (1-%d)] [iterations]\n",
+                argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func,
+                           (void *)(uintptr_t)i)) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    expected = (uint32_t)(nthreads * iterations);
+    printf("%d threads: counter %u, expected %u\n",
+           nthreads, shared_counter, expected);
+    return shared_counter != expected;
+}
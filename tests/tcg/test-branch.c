@@ -0,0 +1,108 @@
+/*
+ * Indirect branch speed test
+ *
+ * Spends its time in returns, calls through function pointers and
+ * switch jump tables, with the targets spread over several pages so
+ * that most of the jumps cannot be chained directly.  Compare
+ *
+ *     time ./branch
+ *     time qemu-i386 ./branch-i386
+ *
+ * before and after changes to TB lookup and chaining.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PAGE_ALIGNED __attribute__((noinline, aligned(4096)))
+
+static PAGE_ALIGNED uint32_t op_add(uint32_t x, uint32_t i)
+{
+    return x + i;
+}
+
+static PAGE_ALIGNED uint32_t op_xor(uint32_t x, uint32_t i)
+{
+    return x ^ (i * 0x9e3779b9);
+}
+
+static PAGE_ALIGNED uint32_t op_rot(uint32_t x, uint32_t i)
+{
+    return (x << 5) | (x >> 27);
+}
+
+static PAGE_ALIGNED uint32_t op_mul(uint32_t x, uint32_t i)
+{
+    return x * 33 + 1;
+}
+
+static uint32_t (*const ops[])(uint32_t, uint32_t) = {
+    op_add, op_xor, op_rot, op_mul,
+};
+
+/* Calls through a table of function pointers, plus their returns.  */
+static uint32_t test_calls(uint32_t n)
+{
+    uint32_t x = 1, i;
+
+    for (i = 0; i < n; i++) {
+        x = ops[(x ^ i) & 3](x, i);
+    }
+    return x;
+}
+
+/* A switch that compiles to a jump table.  */
+static PAGE_ALIGNED uint32_t test_switch(uint32_t n)
+{
+    uint32_t x = 1, i;
+
+    for (i = 0; i < n; i++) {
+        switch ((x >> 3) & 7) {
+        case 0:
+            x += 7;
+            break;
+        case 1:
+            x ^= i;
+            break;
+        case 2:
+            x = x * 5 + 3;
+            break;
+        case 3:
+            x -= i >> 1;
+            break;
+        case 4:
+            x = (x << 3) | (x >> 29);
+            break;
+        case 5:
+            x += i * 3;
+            break;
+        case 6:
+            x ^= 0x5a5a5a5a;
+            break;
+        default:
+            x = ~x;
+            break;
+        }
+    }
+    return x;
+}
+
+/* Deep recursion: every return is an indirect jump.  */
+static PAGE_ALIGNED uint32_t fib(uint32_t n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+
+    printf("calls:  %08x\n", test_calls(n));
+    printf("switch: %08x\n", test_switch(n));
+    printf("fib:    %u\n", fib(30));
+    return 0;
+}
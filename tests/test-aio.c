@@ -343,6 +343,43 @@ static void test_wait_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifdef CONFIG_POSIX
+static int poll_calls;
+
+static bool poll_ready_cb(void *opaque)
+{
+    poll_calls++;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_ready_cb);
+    aio_context_set_poll_params(ctx, 60 * 1000000000LL, 0, 0, &error_abort);
+    while (aio_poll(ctx, false));
+    poll_calls = 0;
+
+    /* The polling window starts closed, this one waits in ppoll() */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(poll_calls, ==, 0);
+
+    /* A short wait opens the window, so the next call finds work by polling */
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(poll_calls, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_flush_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
@@ -417,6 +454,54 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Wake up aio_poll through one of @n registered event notifiers at a
+ * time.  Past EPOLL_ENABLE_THRESHOLD file descriptors this goes through
+ * epoll, and the time per wakeup should stop growing with @n; run with
+ * -m perf to see it.
+ */
+static void test_wait_event_notifier_many(void)
+{
+    static const int counts[] = { 1, 16, 128, 512 };
+    const int iterations = 4096;
+    int c, i;
+
+    for (c = 0; c < ARRAY_SIZE(counts); c++) {
+        int n = counts[c];
+        EventNotifierTestData *data = g_new0(EventNotifierTestData, n);
+        int64_t start, ns;
+
+        for (i = 0; i < n; i++) {
+            event_notifier_init(&data[i].e, false);
+            aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+        }
+        while (aio_poll(ctx, false));
+
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        for (i = 0; i < iterations; i++) {
+            EventNotifierTestData *d = &data[(i * 7) % n];
+
+            d->active = 1;
+            event_notifier_set(&d->e);
+            g_assert(aio_poll(ctx, true));
+            g_assert_cmpint(d->active, ==, 0);
+        }
+        ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+        if (g_test_perf()) {
+            g_test_message("%4d fds: %"PRId64" ns per wakeup",
+                           n, ns / iterations);
+        }
+
+        for (i = 0; i < n; i++) {
+            g_assert_cmpint(data[i].n, >, 0);
+            aio_set_event_notifier(ctx, &data[i].e, NULL);
+            event_notifier_cleanup(&data[i].e);
+        }
+        g_assert(!aio_poll(ctx, false));
+        g_free(data);
+    }
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -826,7 +911,11 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/event/wait/many",         test_wait_event_notifier_many);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
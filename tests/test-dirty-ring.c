@@ -0,0 +1,166 @@
+/*
+ * Test the dirty page ring, using the software producer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/dirty-ring.h"
+
+#define RING_SIZE 64
+
+typedef struct TestRing {
+    DirtyGfn gfns[RING_SIZE];
+    DirtyRing ring;
+    DirtyRingProducer producer;
+} TestRing;
+
+typedef struct Collected {
+    uint64_t count;
+    uint64_t next_offset;
+    uint64_t sum;
+} Collected;
+
+static void test_ring_init(TestRing *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->ring.gfns = t->gfns;
+    t->ring.size = RING_SIZE;
+    t->producer.ring = &t->ring;
+}
+
+/* Pages are pushed with increasing offsets and must come out in order */
+static void collect(void *opaque, uint32_t slot, uint64_t offset)
+{
+    Collected *c = opaque;
+
+    g_assert_cmpuint(slot, ==, (1 << 16) | 3);
+    g_assert_cmpuint(offset, ==, c->next_offset);
+    c->next_offset++;
+    c->count++;
+    c->sum += offset;
+}
+
+static void count_reprotect(void *opaque, uint32_t slot, uint64_t offset)
+{
+    (*(uint64_t *)opaque)++;
+}
+
+static void test_harvest(void)
+{
+    TestRing t;
+    Collected c = { 0 };
+    uint64_t reprotected = 0;
+    int i;
+
+    test_ring_init(&t);
+    g_assert_cmpuint(dirty_ring_harvest(&t.ring, collect, &c), ==, 0);
+
+    for (i = 0; i < 10; i++) {
+        g_assert(dirty_ring_push(&t.producer, (1 << 16) | 3, i));
+    }
+    g_assert_cmpuint(dirty_ring_harvest(&t.ring, collect, &c), ==, 10);
+    g_assert_cmpuint(c.count, ==, 10);
+    /* Nothing new was published */
+    g_assert_cmpuint(dirty_ring_harvest(&t.ring, collect, &c), ==, 0);
+
+    g_assert_cmpuint(dirty_ring_reset(&t.producer, count_reprotect,
+                                      &reprotected), ==, 10);
+    g_assert_cmpuint(reprotected, ==, 10);
+    g_assert_cmpuint(dirty_ring_reset(&t.producer, NULL, NULL), ==, 0);
+}
+
+static void test_full(void)
+{
+    TestRing t;
+    Collected c = { 0 };
+    int i;
+
+    test_ring_init(&t);
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert(dirty_ring_push(&t.producer, (1 << 16) | 3, i));
+    }
+    g_assert(!dirty_ring_push(&t.producer, (1 << 16) | 3, i));
+
+    /* Harvested entries are not reused until they are reset */
+    g_assert_cmpuint(dirty_ring_harvest(&t.ring, collect, &c), ==, RING_SIZE);
+    g_assert(!dirty_ring_push(&t.producer, (1 << 16) | 3, i));
+
+    g_assert_cmpuint(dirty_ring_reset(&t.producer, NULL, NULL), ==,
+                     RING_SIZE);
+    g_assert(dirty_ring_push(&t.producer, (1 << 16) | 3, i));
+    g_assert_cmpuint(dirty_ring_harvest(&t.ring, collect, &c), ==, 1);
+    g_assert_cmpuint(c.count, ==, RING_SIZE + 1);
+}
+
+static void test_wrap(void)
+{
+    TestRing t;
+    Collected c = { 0 };
+    uint64_t offset = 0;
+    int round, i;
+
+    test_ring_init(&t);
+    /* Uneven batches so that harvests and resets straddle the end */
+    for (round = 0; round < 1000; round++) {
+        for (i = 0; i < round % RING_SIZE; i++) {
+            g_assert(dirty_ring_push(&t.producer, (1 << 16) | 3, offset++));
+        }
+        dirty_ring_harvest(&t.ring, collect, &c);
+        dirty_ring_reset(&t.producer, NULL, NULL);
+    }
+    g_assert_cmpuint(c.count, ==, offset);
+}
+
+/* A vCPU dirtying pages while the migration thread harvests them */
+#define THREAD_PAGES 20000
+
+static TestRing thread_ring;
+static bool producer_done;
+
+static void *producer_thread(void *opaque)
+{
+    uint64_t i;
+
+    for (i = 0; i < THREAD_PAGES; i++) {
+        while (!dirty_ring_push(&thread_ring.producer, (1 << 16) | 3, i)) {
+            /* Ring full: wait for the harvester, then recycle */
+            dirty_ring_reset(&thread_ring.producer, NULL, NULL);
+        }
+    }
+    atomic_mb_set(&producer_done, true);
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    QemuThread thread;
+    Collected c = { 0 };
+    bool done;
+
+    test_ring_init(&thread_ring);
+    qemu_thread_create(&thread, "producer", producer_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    do {
+        done = atomic_mb_read(&producer_done);
+        dirty_ring_harvest(&thread_ring.ring, collect, &c);
+    } while (!done);
+    qemu_thread_join(&thread);
+
+    g_assert_cmpuint(c.count, ==, THREAD_PAGES);
+    g_assert_cmpuint(c.sum, ==, (uint64_t)THREAD_PAGES * (THREAD_PAGES - 1) / 2);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dirty-ring/harvest", test_harvest);
+    g_test_add_func("/dirty-ring/full", test_full);
+    g_test_add_func("/dirty-ring/wrap", test_wrap);
+    g_test_add_func("/dirty-ring/threads", test_threads);
+    return g_test_run();
+}
@@ -0,0 +1,169 @@
+/*
+ * Test the QHT concurrent hash table
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include "qemu/osdep.h"
+#include "qemu/qht.h"
+
+#define N 5000
+
+static struct qht ht;
+static int32_t arr[N * 2];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* use a weak hash so that chains do get long enough to be resized */
+static uint32_t hash_of(int32_t v)
+{
+    return (uint32_t)v >> 1;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        bool inserted;
+
+        arr[i] = i;
+        inserted = qht_insert(&ht, &arr[i], hash_of(i));
+        g_assert(inserted);
+    }
+}
+
+static void rm(int init, int end)
+{
+    int i;
+
+    for (i = init; i < end; i++) {
+        bool removed = qht_remove(&ht, &arr[i], hash_of(i));
+
+        g_assert(removed);
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p;
+
+        p = qht_lookup(&ht, is_equal, &val, hash_of(i));
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+}
+
+static void count_func(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    unsigned int *curr = userp;
+
+    (*curr)++;
+}
+
+static void iter_check(unsigned int count)
+{
+    unsigned int curr = 0;
+
+    qht_iter(&ht, count_func, &curr);
+    g_assert_cmpuint(curr, ==, count);
+}
+
+static void check_n(size_t expected)
+{
+    struct qht_stats stats;
+
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.entries, ==, expected);
+    iter_check(expected);
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries)
+{
+    bool ret;
+
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+    check(-N, -1, false);
+
+    /* duplicates are rejected */
+    ret = qht_insert(&ht, &arr[0], hash_of(0));
+    g_assert(!ret);
+
+    /* remove from the middle of chains, then refill the holes */
+    rm(1, 2);
+    check(1, 2, false);
+    check(2, N, true);
+    check_n(N - 1);
+    ret = qht_remove(&ht, &arr[1], hash_of(1));
+    g_assert(!ret);
+    insert(1, 2);
+    check_n(N);
+
+    rm(N / 2, N);
+    check(0, N / 2, true);
+    check(N / 2, N, false);
+    check_n(N / 2);
+
+    insert(N, N * 2);
+    check(N, N * 2, true);
+    check_n(N + N / 2);
+
+    qht_resize(&ht, N * 4);
+    check(0, N / 2, true);
+    check(N, N * 2, true);
+    check_n(N + N / 2);
+
+    qht_reset(&ht);
+    check(0, N * 2, false);
+    check_n(0);
+
+    insert(0, N);
+    check(0, N, true);
+    qht_reset_size(&ht, 0);
+    check(0, N, false);
+    check_n(0);
+
+    insert(0, N);
+    rm(0, N);
+    check_n(0);
+
+    qht_destroy(&ht);
+}
+
+static void test_default(void)
+{
+    qht_do_test(0, 0);
+}
+
+static void test_resize(void)
+{
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,292 @@
+/*
+ * Test the encoding and decoding of QEMU_VM_COMMAND stream elements
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "qemu/bswap.h"
+
+static QEMUSizedBuffer *test_qsb;
+
+static QEMUFile *open_write(void)
+{
+    test_qsb = qsb_create(NULL, 0);
+    g_assert(test_qsb);
+    return qemu_bufopen("w", test_qsb);
+}
+
+/* Close the file written so far and read it back */
+static QEMUFile *reopen_read(QEMUFile *f)
+{
+    qemu_fclose(f);
+    return qemu_bufopen("r", test_qsb);
+}
+
+static void close_read(QEMUFile *f)
+{
+    g_assert_cmpint(qemu_file_get_error(f), ==, 0);
+    qemu_fclose(f);
+    qsb_free(test_qsb);
+}
+
+/* Read a command element, including its type byte */
+static int get_command(QEMUFile *f, uint16_t *cmd, uint16_t *len)
+{
+    g_assert_cmpint(qemu_get_byte(f), ==, QEMU_VM_COMMAND);
+    return qemu_loadvm_get_command(f, cmd, len);
+}
+
+static void test_command(void)
+{
+    QEMUFile *f = open_write();
+    uint64_t arg = cpu_to_be64(4096);
+    uint16_t cmd, len;
+
+    qemu_savevm_send_open_return_path(f);
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 8, (uint8_t *)&arg);
+    qemu_savevm_send_postcopy_listen(f);
+    qemu_savevm_send_postcopy_run(f);
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    f = reopen_read(f);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(cmd, ==, MIG_CMD_OPEN_RETURN_PATH);
+    g_assert_cmpint(len, ==, 0);
+
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(cmd, ==, MIG_CMD_POSTCOPY_ADVISE);
+    g_assert_cmpint(len, ==, 8);
+    g_assert_cmpint(qemu_get_be64(f), ==, 4096);
+
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(cmd, ==, MIG_CMD_POSTCOPY_LISTEN);
+    g_assert_cmpint(len, ==, 0);
+
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(cmd, ==, MIG_CMD_POSTCOPY_RUN);
+    g_assert_cmpint(len, ==, 0);
+
+    g_assert_cmpint(qemu_get_byte(f), ==, QEMU_VM_EOF);
+    close_read(f);
+}
+
+static void test_command_invalid(void)
+{
+    QEMUFile *f = open_write();
+    uint8_t arg[4] = { 0 };
+    uint16_t cmd, len;
+
+    qemu_savevm_command_send(f, MIG_CMD_INVALID, 0, NULL);
+    qemu_savevm_command_send(f, MIG_CMD_MAX, 0, NULL);
+    qemu_savevm_command_send(f, MIG_CMD_MAX + 1, 0, NULL);
+    /* Fixed length commands with the wrong length */
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 4, arg);
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 0, NULL);
+
+    f = reopen_read(f);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, -EINVAL);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, -EINVAL);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, -EINVAL);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, -ERANGE);
+    qemu_get_buffer(f, arg, len);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, -ERANGE);
+    close_read(f);
+}
+
+/* Check that qsb holds size bytes of the pattern written by fill_package */
+static void check_package(const QEMUSizedBuffer *qsb, size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    size_t i;
+
+    g_assert_cmpint(qsb_get_length(qsb), ==, size);
+    g_assert_cmpint(qsb_get_buffer(qsb, 0, size, buf), ==, size);
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(buf[i], ==, (uint8_t)(i * 7));
+    }
+    g_free(buf);
+}
+
+static void fill_package(QEMUSizedBuffer *qsb, size_t size)
+{
+    QEMUFile *f = qemu_bufopen("w", qsb);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        qemu_put_byte(f, i * 7);
+    }
+    qemu_fclose(f);
+}
+
+static void test_packaged(void)
+{
+    /* Several iovs, with the last one only partially filled */
+    const size_t sizes[] = { 0, 1, 4096, 3 * 65536 + 123 };
+    QEMUSizedBuffer *package[ARRAY_SIZE(sizes)];
+    QEMUFile *f = open_write();
+    uint16_t cmd, len;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        package[i] = qsb_create(NULL, 0);
+        fill_package(package[i], sizes[i]);
+        g_assert_cmpint(qemu_savevm_send_packaged(f, package[i]), ==, 0);
+        qsb_free(package[i]);
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    f = reopen_read(f);
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        QEMUSizedBuffer *qsb;
+
+        g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+        g_assert_cmpint(cmd, ==, MIG_CMD_PACKAGED);
+        g_assert_cmpint(len, ==, 4);
+        g_assert_cmpint(qemu_loadvm_get_packaged(f, &qsb), ==, 0);
+        check_package(qsb, sizes[i]);
+        qsb_free(qsb);
+    }
+    /* The package must not have eaten into the stream following it */
+    g_assert_cmpint(qemu_get_byte(f), ==, QEMU_VM_EOF);
+    close_read(f);
+}
+
+static void test_packaged_invalid(void)
+{
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+    uint8_t buf[16] = { 0 };
+
+    /* Too large to send */
+    qsb = qsb_create(NULL, 0);
+    fill_package(qsb, MAX_VM_CMD_PACKAGED_SIZE + 1);
+    f = open_write();
+    g_assert_cmpint(qemu_savevm_send_packaged(f, qsb), <, 0);
+    qsb_free(qsb);
+    qemu_fclose(f);
+    qsb_free(test_qsb);
+
+    /* Announcing too much */
+    f = open_write();
+    qemu_put_be32(f, MAX_VM_CMD_PACKAGED_SIZE + 1);
+    f = reopen_read(f);
+    g_assert_cmpint(qemu_loadvm_get_packaged(f, &qsb), <, 0);
+    qemu_fclose(f);
+    qsb_free(test_qsb);
+
+    /* Truncated */
+    f = open_write();
+    qemu_put_be32(f, sizeof(buf) + 1);
+    qemu_put_buffer(f, buf, sizeof(buf));
+    f = reopen_read(f);
+    g_assert_cmpint(qemu_loadvm_get_packaged(f, &qsb), <, 0);
+    qemu_fclose(f);
+    qsb_free(test_qsb);
+}
+
+static void test_discard(void)
+{
+    uint64_t starts[] = { 0, 0x1000, 0x7fffffffff000ULL };
+    uint64_t lengths[] = { 0x1000, 0x200000, 0x1000 };
+    const char *name = "pc.ram";
+    QEMUFile *f = open_write();
+    uint8_t header[2 + 6];
+    char ramid[256];
+    uint16_t cmd, len, count;
+    int i;
+
+    qemu_savevm_send_postcopy_ram_discard(f, name, ARRAY_SIZE(starts),
+                                          starts, lengths);
+    qemu_savevm_send_postcopy_ram_discard(f, "x", 1, starts, lengths);
+
+    /* The layout on the wire */
+    f = reopen_read(f);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(cmd, ==, MIG_CMD_POSTCOPY_RAM_DISCARD);
+    g_assert_cmpint(len, ==, sizeof(header) + 16 * ARRAY_SIZE(starts));
+    qemu_get_buffer(f, header, sizeof(header));
+    g_assert_cmpint(header[0], ==, 0);
+    g_assert_cmpint(header[1], ==, strlen(name));
+    g_assert(!memcmp(header + 2, name, strlen(name)));
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        g_assert_cmpint(qemu_get_be64(f), ==, starts[i]);
+        g_assert_cmpint(qemu_get_be64(f), ==, lengths[i]);
+    }
+    qemu_fclose(f);
+
+    /* And what the destination makes of it */
+    f = qemu_bufopen("r", test_qsb);
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(qemu_loadvm_get_discard_header(f, len, ramid, &count),
+                    ==, 0);
+    g_assert_cmpstr(ramid, ==, name);
+    g_assert_cmpint(count, ==, ARRAY_SIZE(starts));
+    for (i = 0; i < count; i++) {
+        uint64_t start, length;
+
+        qemu_loadvm_get_discard_range(f, &start, &length);
+        g_assert_cmpint(start, ==, starts[i]);
+        g_assert_cmpint(length, ==, lengths[i]);
+    }
+
+    g_assert_cmpint(get_command(f, &cmd, &len), ==, 0);
+    g_assert_cmpint(qemu_loadvm_get_discard_header(f, len, ramid, &count),
+                    ==, 0);
+    g_assert_cmpstr(ramid, ==, "x");
+    g_assert_cmpint(count, ==, 1);
+    close_read(f);
+}
+
+static void test_discard_invalid(void)
+{
+    static const struct {
+        uint8_t version;
+        uint8_t name_len;
+        uint16_t len;
+    } cases[] = {
+        { 0, 1, 1 + 1 + 1 + 15 },  /* shorter than one range */
+        { 1, 1, 1 + 1 + 1 + 16 },  /* unknown version */
+        { 0, 0, 1 + 1 + 16 + 1 },  /* no name */
+        { 0, 1, 1 + 1 + 1 + 17 },  /* partial range */
+        { 0, 1, 1 + 1 + 1 + 24 },  /* one and a half ranges */
+        { 0, 20, 1 + 1 + 1 + 16 }, /* name longer than the command */
+    };
+    char ramid[256];
+    uint16_t count;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        QEMUFile *f = open_write();
+        int j;
+
+        qemu_put_byte(f, cases[i].version);
+        qemu_put_byte(f, cases[i].name_len);
+        for (j = 2; j < cases[i].len; j++) {
+            qemu_put_byte(f, 'a');
+        }
+
+        f = reopen_read(f);
+        g_assert_cmpint(qemu_loadvm_get_discard_header(f, cases[i].len, ramid,
+                                                       &count), ==, -1);
+        qemu_fclose(f);
+        qsb_free(test_qsb);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/savevm-cmd/command", test_command);
+    g_test_add_func("/savevm-cmd/command/invalid", test_command_invalid);
+    g_test_add_func("/savevm-cmd/packaged", test_packaged);
+    g_test_add_func("/savevm-cmd/packaged/invalid", test_packaged_invalid);
+    g_test_add_func("/savevm-cmd/discard", test_discard);
+    g_test_add_func("/savevm-cmd/discard/invalid", test_discard_invalid);
+    return g_test_run();
+}
@@ -0,0 +1,269 @@
+/*
+ * Compare the host FPU fast path of softfloat with the software code
+ *
+ * float32/float64 add, sub, mul, div and sqrt use the host FPU when the
+ * inexact flag is already raised.  Each operation is done once with the
+ * flags cleared, which always takes the software path, and once with
+ * inexact raised; the results must be identical and the flags may only
+ * differ by inexact.  Operands include zeroes, denormals, the smallest
+ * and largest normals, infinities, NaNs and nearly cancelling pairs, and
+ * every rounding mode, tininess and flush-to-zero setting is tried.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include "qemu/osdep.h"
+#include "fpu/softfloat.h"
+
+#define N_RANDOM 20000
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+static const int rounding_modes[] = {
+    float_round_nearest_even,
+    float_round_down,
+    float_round_up,
+    float_round_to_zero,
+    float_round_ties_away,
+};
+
+static uint64_t seed = 1;
+
+static uint64_t xorshift64star(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ULL;
+}
+
+/* A random exponent, biased towards the interesting ends of the range.  */
+static uint64_t random_exp(uint64_t max)
+{
+    uint64_t r = xorshift64star();
+
+    switch (r % 8) {
+    case 0:
+        return 0;                       /* zero or denormal */
+    case 1:
+        return 1 + (r >> 8) % 3;        /* smallest normals */
+    case 2:
+        return max - 1 - (r >> 8) % 3;  /* largest normals */
+    case 3:
+        return max;                     /* infinity or NaN */
+    default:
+        return (r >> 8) % max;
+    }
+}
+
+static float32 random_f32(void)
+{
+    uint64_t r = xorshift64star();
+    uint32_t frac = r & 0x7fffff;
+
+    if ((r >> 32) % 4 == 0) {
+        frac = 0;                       /* exact zero, infinity, power of 2 */
+    }
+    return make_float32((uint32_t)(r >> 63) << 31 |
+                        (uint32_t)random_exp(0xff) << 23 | frac);
+}
+
+static float64 random_f64(void)
+{
+    uint64_t r = xorshift64star();
+    uint64_t frac = r & 0xfffffffffffffULL;
+
+    if ((r >> 52) % 4 == 0) {
+        frac = 0;
+    }
+    return make_float64((r >> 63) << 63 | random_exp(0x7ff) << 52 | frac);
+}
+
+/* Operands whose sum or difference cancels to few or no bits.  */
+static float32 near_f32(float32 a)
+{
+    uint64_t r = xorshift64star();
+
+    return make_float32((float32_val(a) ^ (r & 1) << 31) + (r >> 1) % 5 - 2);
+}
+
+static float64 near_f64(float64 a)
+{
+    uint64_t r = xorshift64star();
+
+    return make_float64((float64_val(a) ^ (r & 1) << 63) + (r >> 1) % 5 - 2);
+}
+
+static float32 do_f32(enum op op, float32 a, float32 b, float_status *st)
+{
+    switch (op) {
+    case OP_ADD:
+        return float32_add(a, b, st);
+    case OP_SUB:
+        return float32_sub(a, b, st);
+    case OP_MUL:
+        return float32_mul(a, b, st);
+    case OP_DIV:
+        return float32_div(a, b, st);
+    case OP_SQRT:
+        return float32_sqrt(a, st);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static float64 do_f64(enum op op, float64 a, float64 b, float_status *st)
+{
+    switch (op) {
+    case OP_ADD:
+        return float64_add(a, b, st);
+    case OP_SUB:
+        return float64_sub(a, b, st);
+    case OP_MUL:
+        return float64_mul(a, b, st);
+    case OP_DIV:
+        return float64_div(a, b, st);
+    case OP_SQRT:
+        return float64_sqrt(a, st);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void check_f32(enum op op, float32 a, float32 b,
+                      const float_status *mode)
+{
+    float_status soft = *mode, hard = *mode;
+    float32 rs, rh;
+
+    set_float_exception_flags(0, &soft);
+    set_float_exception_flags(float_flag_inexact, &hard);
+    rs = do_f32(op, a, b, &soft);
+    rh = do_f32(op, a, b, &hard);
+    if (float32_val(rs) != float32_val(rh) ||
+        (soft.float_exception_flags | float_flag_inexact) !=
+        hard.float_exception_flags) {
+        g_test_message("float32_%s(%08x, %08x) rounding %d tininess %d "
+                       "ftz %d: %08x flags %x, expected %08x flags %x",
+                       op_names[op], float32_val(a), float32_val(b),
+                       mode->float_rounding_mode,
+                       mode->float_detect_tininess, mode->flush_to_zero,
+                       float32_val(rh), hard.float_exception_flags,
+                       float32_val(rs),
+                       soft.float_exception_flags | float_flag_inexact);
+        g_assert_not_reached();
+    }
+}
+
+static void check_f64(enum op op, float64 a, float64 b,
+                      const float_status *mode)
+{
+    float_status soft = *mode, hard = *mode;
+    float64 rs, rh;
+
+    set_float_exception_flags(0, &soft);
+    set_float_exception_flags(float_flag_inexact, &hard);
+    rs = do_f64(op, a, b, &soft);
+    rh = do_f64(op, a, b, &hard);
+    if (float64_val(rs) != float64_val(rh) ||
+        (soft.float_exception_flags | float_flag_inexact) !=
+        hard.float_exception_flags) {
+        g_test_message("float64_%s(%016" PRIx64 ", %016" PRIx64 ") "
+                       "rounding %d tininess %d ftz %d: %016" PRIx64
+                       " flags %x, expected %016" PRIx64 " flags %x",
+                       op_names[op], float64_val(a), float64_val(b),
+                       mode->float_rounding_mode,
+                       mode->float_detect_tininess, mode->flush_to_zero,
+                       float64_val(rh), hard.float_exception_flags,
+                       float64_val(rs),
+                       soft.float_exception_flags | float_flag_inexact);
+        g_assert_not_reached();
+    }
+}
+
+/* Run FN for every combination of the status settings that matter.  */
+static void for_each_mode(void (*fn)(const float_status *mode))
+{
+    int i, tininess, ftz;
+
+    for (i = 0; i < ARRAY_SIZE(rounding_modes); i++) {
+        for (tininess = 0; tininess < 2; tininess++) {
+            for (ftz = 0; ftz < 2; ftz++) {
+                float_status mode = { 0 };
+
+                set_float_rounding_mode(rounding_modes[i], &mode);
+                set_float_detect_tininess(tininess ?
+                                          float_tininess_before_rounding :
+                                          float_tininess_after_rounding,
+                                          &mode);
+                set_flush_to_zero(ftz, &mode);
+                set_flush_inputs_to_zero(ftz, &mode);
+                fn(&mode);
+            }
+        }
+    }
+}
+
+static void run_f32(const float_status *mode)
+{
+    int i, op;
+
+    for (i = 0; i < N_RANDOM; i++) {
+        float32 a = random_f32();
+        float32 b = i & 1 ? near_f32(a) : random_f32();
+
+        for (op = 0; op < OP_COUNT; op++) {
+            check_f32(op, a, b, mode);
+        }
+    }
+}
+
+static void run_f64(const float_status *mode)
+{
+    int i, op;
+
+    for (i = 0; i < N_RANDOM; i++) {
+        float64 a = random_f64();
+        float64 b = i & 1 ? near_f64(a) : random_f64();
+
+        for (op = 0; op < OP_COUNT; op++) {
+            check_f64(op, a, b, mode);
+        }
+    }
+}
+
+static void test_float32(void)
+{
+    for_each_mode(run_f32);
+}
+
+static void test_float64(void)
+{
+    for_each_mode(run_f64);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/softfloat/fast/float32", test_float32);
+    g_test_add_func("/softfloat/fast/float64", test_float64);
+    return g_test_run();
+}
@@ -177,6 +177,119 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Straightforward byte at a time encoder, to check that the optimized one
+ * finds exactly the same runs.
+ */
+static int encode_reference(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst)
+{
+    int d = 0, i = 0, run;
+
+    while (i < slen) {
+        for (run = 0; i < slen && old_buf[i] == new_buf[i]; run++, i++) {
+            /* zrun */
+        }
+        if (i == slen) {
+            break;
+        }
+        d += uleb128_encode_small(dst + d, run);
+        for (run = 0; i < slen && old_buf[i] != new_buf[i]; run++, i++) {
+            /* nzrun */
+        }
+        d += uleb128_encode_small(dst + d, run);
+        memcpy(dst + d, new_buf + i - run, run);
+        d += run;
+    }
+    return d;
+}
+
+static void test_encode_runs(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * 2);
+    uint8_t *reference = g_malloc(PAGE_SIZE * 2);
+    int i, j, dlen, rlen;
+
+    for (i = 0; i < 1000; i++) {
+        /* Runs of all lengths around the vector and word sizes */
+        int max_run = g_test_rand_int_range(1, 80);
+        bool differ = g_test_rand_bit();
+
+        for (j = 0; j < PAGE_SIZE; ) {
+            int run = g_test_rand_int_range(1, max_run + 1);
+
+            for (; run && j < PAGE_SIZE; run--, j++) {
+                old_buf[j] = g_test_rand_int();
+                new_buf[j] = differ ? old_buf[j] ^ 0x5a : old_buf[j];
+            }
+            differ = !differ;
+        }
+
+        rlen = encode_reference(old_buf, new_buf, PAGE_SIZE, reference);
+        dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                    PAGE_SIZE * 2);
+        g_assert_cmpint(dlen, ==, rlen);
+        g_assert(memcmp(compressed, reference, dlen) == 0);
+
+        g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen, old_buf,
+                                             PAGE_SIZE), ==, PAGE_SIZE);
+        g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(reference);
+}
+
+static void perf_zero_page(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    unsigned int i, max = 1000000;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert(buffer_find_nonzero_offset(buffer, PAGE_SIZE) == PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Zero page check: %u pages in %f s, %f GB/s\n", max,
+                   duration, max * (double)PAGE_SIZE / duration / 1e9);
+    g_free(buffer);
+}
+
+/* A page with a few short changes, as the guest typically leaves them */
+static void perf_encode(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    unsigned int i, max = 1000000;
+    double duration;
+
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new_buf[i + 17] = 1;
+        new_buf[i + 18] = 2;
+        new_buf[i + 100] = 3;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                             PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("XBZRLE encode: %u pages in %f s, %f GB/s\n", max,
+                   duration, max * (double)PAGE_SIZE / duration / 1e9);
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -189,6 +302,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_runs", test_encode_runs);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/zero_page", perf_zero_page);
+        g_test_add_func("/xbzrle/perf/encode", perf_encode);
+    }
 
     return g_test_run();
 }
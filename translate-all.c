@@ -59,6 +59,7 @@
 
 #include "exec/cputlb.h"
 #include "exec/tb-hash.h"
+#include "exec/tb-cache.h"
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
@@ -127,36 +128,45 @@ static void *l1_map[V_L1_SIZE];
 TCGContext tcg_ctx;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
-void tb_lock(void)
+/* In system emulation the TB structures are only shared between threads
+ * when multi-threaded TCG is enabled; in round-robin mode the single TCG
+ * thread owns them and the lock is elided.
+ */
+static inline bool tb_lock_needed(void)
 {
 #ifdef CONFIG_USER_ONLY
-    assert(!have_tb_lock);
-    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
-    have_tb_lock++;
+    return true;
+#else
+    return qemu_tcg_mttcg_enabled();
 #endif
 }
 
+void tb_lock(void)
+{
+    if (tb_lock_needed()) {
+        assert(!have_tb_lock);
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+        have_tb_lock++;
+    }
+}
+
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
-    assert(have_tb_lock);
-    have_tb_lock--;
-    qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
+    if (tb_lock_needed()) {
+        assert(have_tb_lock);
+        have_tb_lock--;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -208,6 +218,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     s->tb_jmp_offset = NULL;
     s->tb_next = tb->tb_next;
 #endif
+    s->code_reloc_tb = tb;
 
 #ifdef CONFIG_PROFILER
     s->tb_count++;
@@ -296,7 +307,14 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool locked = !have_tb_lock;
+    bool r = false;
 
+    /* This can be reached from a fault during translation, in which
+     * case the lock is already held by this thread.  */
+    if (locked) {
+        tb_lock();
+    }
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -306,9 +324,12 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        r = true;
     }
-    return false;
+    if (locked) {
+        tb_unlock();
+    }
+    return r;
 }
 
 #ifdef _WIN32
@@ -709,6 +730,45 @@ static inline void code_gen_alloc(size_t tb_size)
     qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
 }
 
+static void code_gen_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t headroom = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    size_t region_size;
+    int n = CODE_GEN_MAX_REGIONS;
+    int i;
+
+    /* Every region keeps room for a worst-case TB at its end; do not let
+       that waste more than 1/16th of a region.  */
+    while (n > 1 && tcg_ctx.code_gen_buffer_size / n < headroom * 16) {
+        n /= 2;
+    }
+    region_size = (tcg_ctx.code_gen_buffer_size / n) &
+                  ~(size_t)(CODE_GEN_ALIGN - 1);
+
+    ctx->nb_regions = n;
+    ctx->region_size = region_size;
+    tcg_ctx.code_gen_buffer_max_size = n * (region_size - headroom);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * region_size;
+        r->end = r->start + region_size - headroom;
+        r->ptr = r->start;
+        r->tbs = ctx->tbs + i * ctx->region_max_tbs;
+        r->nb_tbs = 0;
+    }
+    ctx->cur_region = 0;
+}
+
+static void tb_htable_init(void)
+{
+    unsigned int mode = QHT_MODE_AUTO_RESIZE;
+
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE, mode);
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -716,9 +776,11 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    code_gen_regions_init();
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
+    tb_htable_init();
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -731,18 +793,20 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region. Return NULL
+   if the region has too many translation blocks or too much generated
+   code; the caller must then move on to the next region. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tcg_ctx.tb_ctx.region_max_tbs ||
+        tcg_ctx.code_gen_ptr >= r->end) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -750,16 +814,52 @@ static TranslationBlock *tb_alloc(target_ulong pc)
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
 
+/* Hashes of recently discarded TBs, used to estimate how much of the
+   translation work after a flush or an eviction is spent regenerating
+   code that had been thrown away.  Collisions make this approximate.  */
+#define TB_DISCARDED_BITS 15
+#define TB_DISCARDED_SIZE (1 << TB_DISCARDED_BITS)
+static uint32_t tb_discarded[TB_DISCARDED_SIZE];
+
+static inline uint32_t tb_discard_key(tb_page_addr_t phys_pc, target_ulong pc,
+                                      uint64_t flags)
+{
+    /* 0 marks an empty slot */
+    return tb_hash_func(phys_pc, pc, flags) | 1;
+}
+
+static void tb_record_discard(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    uint32_t key = tb_discard_key(phys_pc, tb->pc, tb->flags);
+
+    tb_discarded[key & (TB_DISCARDED_SIZE - 1)] = key;
+}
+
+static void tb_check_retranslation(tb_page_addr_t phys_pc, target_ulong pc,
+                                   uint64_t flags)
+{
+    uint32_t key = tb_discard_key(phys_pc, pc, flags);
+    uint32_t *slot = &tb_discarded[key & (TB_DISCARDED_SIZE - 1)];
+
+    if (*slot == key) {
+        *slot = 0;
+        tcg_ctx.tb_ctx.tb_retranslate_count++;
+    }
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     g_free(p->code_bitmap);
@@ -800,91 +900,199 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void tb_region_check_overflow(CPUState *cpu)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    if ((size_t)(tcg_ctx.code_gen_ptr - r->start) >
+        tcg_ctx.tb_ctx.region_size) {
+        cpu_abort(cpu, "Internal error: code buffer overflow\n");
+    }
+}
+
+/* flush all the translation blocks; must be called with tb_lock held
+ * and with no other vCPU executing translated code.  */
+static void do_tb_flush(CPUState *cpu)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i, j;
+
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush nb_tbs=%d\n", ctx->nb_tbs);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(cpu, "Internal error: code buffer overflow\n");
+    tb_region_check_overflow(cpu);
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            if (!(r->tbs[j].cflags & CF_INVALID)) {
+                tb_record_discard(&r->tbs[j]);
+            }
+        }
+        r->nb_tbs = 0;
+        r->ptr = r->start;
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    ctx->nb_tbs = 0;
+    ctx->cur_region = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tcg_ctx.code_gen_ptr = ctx->regions[0].start;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_set(&tcg_ctx.tb_ctx.tb_flush_count,
+               tcg_ctx.tb_ctx.tb_flush_count + 1);
 }
 
-#ifdef DEBUG_TB_CHECK
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_flush_safe(void *data)
+{
+    int tb_flush_req = GPOINTER_TO_INT(data);
 
-static void tb_invalidate_check(target_ulong address)
+    tb_lock();
+    /* Several vCPUs may have asked for a flush of the same buffer;
+     * only the first request does any work.  */
+    if (tcg_ctx.tb_ctx.tb_flush_count == tb_flush_req) {
+        do_tb_flush(current_cpu ? current_cpu : first_cpu);
+    }
+    tb_unlock();
+}
+#endif
+
+void tb_flush(CPUState *cpu)
 {
-    TranslationBlock *tb;
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Other vCPUs may be running code from the buffer, so the flush
+         * is deferred until all of them have left their execution loop.
+         */
+        int tb_flush_req = atomic_read(&tcg_ctx.tb_ctx.tb_flush_count);
+
+        async_safe_run_on_cpu(cpu, do_tb_flush_safe,
+                              GINT_TO_POINTER(tb_flush_req));
+        return;
+    }
+#endif
+    do_tb_flush(cpu);
+}
+
+static void do_tb_phys_invalidate(TranslationBlock *tb,
+                                  tb_page_addr_t page_addr);
+
+static bool tb_region_full(void)
+{
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    return r->nb_tbs >= tcg_ctx.tb_ctx.region_max_tbs ||
+           tcg_ctx.code_gen_ptr >= r->end;
+}
+
+/* Make the oldest region the current one, discarding the TBs it holds.
+ * Jumps into those TBs from the other regions are unchained; everything
+ * else stays in place.  Same locking rules as do_tb_flush.  */
+static void do_tb_evict(CPUState *cpu)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int next = (ctx->cur_region + 1) % ctx->nb_regions;
+    TBRegion *r = &ctx->regions[next];
     int i;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    tb_region_check_overflow(cpu);
+#if defined(DEBUG_FLUSH)
+    printf("qemu: evict region %d nb_tbs=%d\n", next, r->nb_tbs);
+#endif
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (!(tb->cflags & CF_INVALID)) {
+            tb_record_discard(tb);
+            do_tb_phys_invalidate(tb, -1);
+            ctx->tb_evicted_tbs++;
         }
     }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    ctx->regions[ctx->cur_region].ptr = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = next;
+    tcg_ctx.code_gen_ptr = r->start;
+    ctx->tb_evict_count++;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_evict_safe(void *data)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
+    CPUState *cpu = data;
+
+    tb_lock();
+    /* another vCPU may already have made room */
+    if (tb_region_full()) {
+        do_tb_evict(cpu);
     }
+    tb_unlock();
 }
+#endif
 
+/* Make room in the code buffer after tb_alloc failed.  Returns false if
+ * the eviction had to be deferred until the other vCPUs stop.  */
+static bool tb_evict(CPUState *cpu)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        async_safe_run_on_cpu(cpu, do_tb_evict_safe, cpu);
+        return false;
+    }
 #endif
+    do_tb_evict(cpu);
+    return true;
+}
+
+#ifdef DEBUG_TB_CHECK
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void
+do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void
+do_tb_page_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
+    }
+}
+
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -938,19 +1146,20 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
-/* invalidate one TB */
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+static void do_tb_phys_invalidate(TranslationBlock *tb,
+                                  tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
-    unsigned int h, n1;
+    uint32_t h;
+    unsigned int n1;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -969,8 +1178,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -992,7 +1201,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
+}
 
+/* invalidate one TB */
+void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+{
+    do_tb_phys_invalidate(tb, page_addr);
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
@@ -1034,16 +1249,25 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     TranslationBlock *tb;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
+    uint64_t page_hash;
     int code_gen_size;
 
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (!(cflags & CF_NOCACHE)) {
+        tb_check_retranslation(phys_pc, pc, flags);
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the current region is full, evict the oldest one */
+        if (!tb_evict(cpu)) {
+            /* The eviction has only been queued; leave the execution
+             * loop so that it can run, then retry the translation.  */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1053,7 +1277,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    page_hash = tb_cache_page_hash(cpu, tb, phys_pc);
+    if (!tb_cache_load(cpu, tb, phys_pc, page_hash, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_save(cpu, tb, phys_pc, page_hash, code_gen_size);
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1377,14 +1605,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    uint32_t h;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1406,6 +1627,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last, so that lookups, which do not take
+       tb_lock, only ever see fully initialized TBs */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1415,23 +1641,31 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    uintptr_t start = (uintptr_t)tcg_ctx.code_gen_buffer;
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < start ||
+        tc_ptr >= start + ctx->nb_regions * ctx->region_size) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+    r = &ctx->regions[(tc_ptr - start) / ctx->region_size];
+    if (r->nb_tbs <= 0) {
+        return NULL;
+    }
+    if (r == &ctx->regions[ctx->cur_region] &&
         tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
         return NULL;
     }
-    /* binary search (cf Knuth) */
+    /* binary search (cf Knuth); TBs are sorted within a region */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1441,7 +1675,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1460,7 +1694,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1469,6 +1705,7 @@ void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(cpu->mem_io_pc);
     if (tb) {
         /* We can use retranslation to find the PC.  */
@@ -1486,6 +1723,7 @@ void tb_check_watchpoint(CPUState *cpu)
         addr = get_page_addr_code(env, pc);
         tb_invalidate_phys_range(addr, addr + 1);
     }
+    tb_unlock();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1501,6 +1739,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    /* The lock is released by cpu_exec when we longjmp out below.  */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1575,51 +1815,68 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+/* size of the host code generated so far */
+static size_t tb_code_size(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+        void *end = i == ctx->cur_region ? tcg_ctx.code_gen_ptr : r->ptr;
+
+        size += end - r->start;
+    }
+    return size;
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    struct qht_stats hst;
+    size_t code_size = tb_code_size();
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (i = 0; i < ctx->nb_regions; i++) {
+        for (j = 0; j < ctx->regions[i].nb_tbs; j++) {
+            tb = &ctx->regions[i].tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d x %zd KB (current %d)\n",
+                ctx->nb_regions, ctx->region_size / 1024, ctx->cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+            ctx->nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
-            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
-                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            ctx->nb_tbs ? target_code_size / ctx->nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            ctx->nb_tbs ? code_size / ctx->nb_tbs : 0,
+            target_code_size ? (double)code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1630,11 +1887,27 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ? (double)hst.used_head_buckets /
+                                   hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets (max=%zu)\n",
+                hst.used_head_buckets ? (double)hst.chain_total /
+                                        hst.used_head_buckets : 0,
+                hst.chain_max);
+
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB evict count      %d regions, %lu TBs\n",
+            tcg_ctx.tb_ctx.tb_evict_count, tcg_ctx.tb_ctx.tb_evicted_tbs);
+    cpu_fprintf(f, "TB retranslations   %lu (approx.)\n",
+            tcg_ctx.tb_ctx.tb_retranslate_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -30,6 +30,10 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "net/net.h"
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
@@ -161,6 +165,77 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
+#ifdef CONFIG_AVX2_OPT
+/*
+ * Returns true if the host CPU has AVX2 and the OS saves the YMM state,
+ * so that functions built with __attribute__((target("avx2"))) can run.
+ */
+bool qemu_cpu_has_avx2(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* XCR0 must have both the SSE and AVX state enabled */
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
+static bool buffer_find_nonzero_offset_use_avx2;
+
+static void __attribute__((constructor)) buffer_find_nonzero_offset_init(void)
+{
+    buffer_find_nonzero_offset_use_avx2 = qemu_cpu_has_avx2();
+}
+
+/*
+ * Same as below with 32 byte vectors; len must be a multiple of
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(__m256i).
+ */
+static size_t __attribute__((target("avx2")))
+buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    __m256i tmp;
+    size_t i;
+
+    /* Most pages that aren't zero have data right at the start */
+    tmp = _mm256_loadu_si256(p);
+    if (!_mm256_testz_si256(tmp, tmp)) {
+        return 0;
+    }
+
+    for (i = 0; i < len / sizeof(__m256i);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(p + i + 0),
+                                       _mm256_loadu_si256(p + i + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+                                       _mm256_loadu_si256(p + i + 3));
+        __m256i tmp2 = _mm256_or_si256(_mm256_loadu_si256(p + i + 4),
+                                       _mm256_loadu_si256(p + i + 5));
+        __m256i tmp3 = _mm256_or_si256(_mm256_loadu_si256(p + i + 6),
+                                       _mm256_loadu_si256(p + i + 7));
+
+        tmp = _mm256_or_si256(_mm256_or_si256(tmp0, tmp1),
+                              _mm256_or_si256(tmp2, tmp3));
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+#endif
+
 /*
  * Searches for an area with non-zero content in a buffer
  *
@@ -176,7 +251,8 @@ int qemu_fdatasync(int fd)
  * down to a multiple of sizeof(VECTYPE) for the first
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
+ * afterwards; when AVX2 is used it may be rounded down further,
+ * to a multiple of BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * 32.
  *
  * If the buffer is all zero the return value is equal to len.
  */
@@ -193,6 +269,14 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         return 0;
     }
 
+#ifdef CONFIG_AVX2_OPT
+    if (buffer_find_nonzero_offset_use_avx2 &&
+        len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+               sizeof(__m256i)) == 0) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
+    }
+#endif
+
     for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
         if (!ALL_EQ(p[i], zero)) {
             return i * sizeof(VECTYPE);
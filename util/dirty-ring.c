@@ -0,0 +1,87 @@
+/*
+ * Dirty page rings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/dirty-ring.h"
+#include "qemu/atomic.h"
+
+static inline DirtyGfn *dirty_ring_entry(DirtyRing *ring, uint32_t index)
+{
+    return &ring->gfns[index & (ring->size - 1)];
+}
+
+uint32_t dirty_ring_harvest(DirtyRing *ring, DirtyRingFunc *func,
+                            void *opaque)
+{
+    uint32_t start = ring->fetch_index;
+    uint32_t i;
+
+    /* The flags are only changed once the loop is over, so stop after
+     * one lap: a full ring would otherwise be walked again from the start.
+     */
+    while (ring->fetch_index - start < ring->size) {
+        DirtyGfn *gfn = dirty_ring_entry(ring, ring->fetch_index);
+
+        if ((atomic_read(&gfn->flags) & DIRTY_GFN_F_MASK) !=
+            DIRTY_GFN_F_DIRTY) {
+            break;
+        }
+        /* Read slot and offset only after seeing the flag */
+        smp_rmb();
+        func(opaque, gfn->slot, gfn->offset);
+        ring->fetch_index++;
+    }
+
+    if (ring->fetch_index == start) {
+        return 0;
+    }
+
+    /* Hand the entries back only after they have all been read */
+    smp_mb();
+    for (i = start; i != ring->fetch_index; i++) {
+        atomic_set(&dirty_ring_entry(ring, i)->flags, DIRTY_GFN_F_RESET);
+    }
+    return ring->fetch_index - start;
+}
+
+bool dirty_ring_push(DirtyRingProducer *p, uint32_t slot, uint64_t offset)
+{
+    DirtyGfn *gfn;
+
+    if (p->dirty_index - p->reset_index == p->ring->size) {
+        return false;
+    }
+    gfn = dirty_ring_entry(p->ring, p->dirty_index);
+    gfn->slot = slot;
+    gfn->offset = offset;
+    /* Publish slot and offset before the flag */
+    smp_wmb();
+    atomic_set(&gfn->flags, DIRTY_GFN_F_DIRTY);
+    p->dirty_index++;
+    return true;
+}
+
+uint32_t dirty_ring_reset(DirtyRingProducer *p, DirtyRingFunc *reprotect,
+                          void *opaque)
+{
+    uint32_t count = 0;
+
+    while (p->reset_index != p->dirty_index) {
+        DirtyGfn *gfn = dirty_ring_entry(p->ring, p->reset_index);
+
+        if (!(atomic_read(&gfn->flags) & DIRTY_GFN_F_RESET)) {
+            break;
+        }
+        smp_rmb();
+        if (reprotect) {
+            reprotect(opaque, gfn->slot, gfn->offset);
+        }
+        atomic_set(&gfn->flags, 0);
+        p->reset_index++;
+        count++;
+    }
+    return count;
+}
@@ -159,6 +159,14 @@ static QemuOptsList machine_opts = {
             .name = "accel",
             .type = QEMU_OPT_STRING,
             .help = "accelerator list",
+        },{
+            .name = "tcg-thread",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG vCPU threading (single or multi)",
+        },{
+            .name = "tb-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "file caching translated code across runs",
         },{
             .name = "kernel_irqchip",
             .type = QEMU_OPT_BOOL,
@@ -167,6 +175,10 @@ static QemuOptsList machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        },{
+            .name = "kvm-dirty-ring-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "entries in each vCPU's KVM dirty ring",
         },{
             .name = "kernel",
             .type = QEMU_OPT_STRING,
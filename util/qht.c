@@ -0,0 +1,616 @@
+/*
+ * QHT: a concurrent, resizable hash table
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <assert.h>
+#include "qemu/osdep.h"
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/seqlock.h"
+#include "qemu/host-utils.h"
+
+/* The table is an array of head buckets, each of which can be followed by
+ * a chain of buckets allocated as the head fills up.  A bucket fits in a
+ * host cache line and holds QHT_BUCKET_ENTRIES (pointer, hash) pairs, so
+ * that most lookups touch a single cache line and never compare against
+ * the pointed-to objects unless the full 32-bit hash matches.
+ *
+ * Within a chain, entries are kept packed: the free slots, if any, are all
+ * at the end of the chain.  Removal moves the last entry of the chain into
+ * the hole it leaves behind.
+ *
+ * Writers to a chain hold the spinlock of its head bucket and bump the
+ * head's seqlock around each change, so that a lookup that raced with a
+ * writer retries instead of missing an entry that was being moved.
+ *
+ * Resizing allocates a new bucket array, takes every bucket lock of the old
+ * array, copies the entries over and publishes the new array with RCU.  A
+ * writer that acquires a head bucket lock and then finds that ht->map has
+ * changed under its feet retries on the new array.
+ */
+
+#define QHT_BUCKET_ALIGN 64
+
+/* define these to keep sizeof(qht_bucket) within QHT_BUCKET_ALIGN */
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else /* 64-bit */
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/* Grow the table once 1/QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV of its head
+ * buckets have had to be extended with a chained bucket.
+ */
+#define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+struct qht_bucket {
+    QemuSpin lock;
+    QemuSeqLock sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct qht_bucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
+
+struct qht_map {
+    struct rcu_head rcu;
+    struct qht_bucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+};
+
+static inline size_t qht_elems_to_buckets(size_t n_elems)
+{
+    return pow2ceil(n_elems / QHT_BUCKET_ENTRIES);
+}
+
+static inline struct qht_bucket *qht_map_to_bucket(struct qht_map *map,
+                                                   uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline bool qht_map_needs_resize(struct qht_map *map)
+{
+    return atomic_read(&map->n_added_buckets) >
+           map->n_added_buckets_threshold;
+}
+
+static void qht_bucket_init(struct qht_bucket *b)
+{
+    memset(b, 0, sizeof(*b));
+    qemu_spin_init(&b->lock);
+    seqlock_init(&b->sequence);
+}
+
+static void qht_map_lock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_lock(&map->buckets[i].lock);
+    }
+}
+
+static void qht_map_unlock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_unlock(&map->buckets[i].lock);
+    }
+}
+
+static struct qht_map *qht_map_create(size_t n_buckets)
+{
+    struct qht_map *map;
+    size_t i;
+
+    map = g_new(struct qht_map, 1);
+    map->n_buckets = n_buckets;
+    map->n_added_buckets = 0;
+    map->n_added_buckets_threshold = n_buckets /
+        QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
+    /* let tiny tables grow too */
+    if (map->n_added_buckets_threshold == 0) {
+        map->n_added_buckets_threshold = 1;
+    }
+
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 sizeof(*map->buckets) * n_buckets);
+    for (i = 0; i < n_buckets; i++) {
+        qht_bucket_init(&map->buckets[i]);
+    }
+    return map;
+}
+
+static void qht_chain_destroy(struct qht_bucket *head)
+{
+    struct qht_bucket *curr = head->next;
+    struct qht_bucket *prev;
+
+    while (curr) {
+        prev = curr;
+        curr = curr->next;
+        qemu_vfree(prev);
+    }
+}
+
+/* call only when there are no readers or writers left */
+static void qht_map_destroy(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_chain_destroy(&map->buckets[i]);
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+
+    ht->mode = mode;
+    qemu_mutex_init(&ht->lock);
+    atomic_rcu_set(&ht->map, qht_map_create(n_buckets));
+}
+
+void qht_destroy(struct qht *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+/* call with the head bucket lock held */
+static void qht_bucket_reset__locked(struct qht_bucket *head)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    seqlock_write_lock(&head->sequence);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            atomic_set(&b->hashes[i], 0);
+            atomic_set(&b->pointers[i], NULL);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    seqlock_write_unlock(&head->sequence);
+}
+
+/* call with all bucket locks held */
+static void qht_map_reset__all_locked(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_bucket_reset__locked(&map->buckets[i]);
+    }
+}
+
+static void qht_do_resize(struct qht *ht, size_t n_buckets, bool reset);
+
+void qht_reset(struct qht *ht)
+{
+    struct qht_map *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_reset_size(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool resize = false;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, n_buckets, true);
+        resize = true;
+    } else {
+        qht_map_lock_buckets(ht->map);
+        qht_map_reset__all_locked(ht->map);
+        qht_map_unlock_buckets(ht->map);
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return resize;
+}
+
+static void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
+                           const void *userp, uint32_t hash)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_rcu_read(&b->pointers[i]);
+
+                if (likely(p) && likely(func(p, userp))) {
+                    return p;
+                }
+            }
+        }
+        b = atomic_rcu_read(&b->next);
+    } while (b);
+
+    return NULL;
+}
+
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+    unsigned int version;
+    void *ret;
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    b = qht_map_to_bucket(map, hash);
+    do {
+        version = seqlock_read_begin(&b->sequence);
+        ret = qht_do_lookup(b, func, userp, hash);
+    } while (seqlock_read_retry(&b->sequence, version));
+    rcu_read_unlock();
+    return ret;
+}
+
+/* Lock the head bucket for @hash in the current map, retrying on the new
+ * map if a resize replaced it before we got the lock.  Call inside an RCU
+ * read-side critical section.
+ */
+static struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht,
+                                                    uint32_t hash,
+                                                    struct qht_map **pmap)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+
+    map = atomic_rcu_read(&ht->map);
+    b = qht_map_to_bucket(map, hash);
+    qemu_spin_lock(&b->lock);
+    if (likely(map == ht->map)) {
+        *pmap = map;
+        return b;
+    }
+    qemu_spin_unlock(&b->lock);
+
+    /* we raced with a resize; ht->lock is held for its whole duration */
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    b = qht_map_to_bucket(map, hash);
+    qemu_spin_lock(&b->lock);
+    qemu_mutex_unlock(&ht->lock);
+    *pmap = map;
+    return b;
+}
+
+/* call with the head bucket lock held, or on a map that is not yet
+ * visible to other threads */
+static bool qht_insert__locked(struct qht_map *map, struct qht_bucket *head,
+                               void *p, uint32_t hash, bool *needs_resize)
+{
+    struct qht_bucket *b = head;
+    struct qht_bucket *prev = NULL;
+    struct qht_bucket *new = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i]) {
+                if (unlikely(b->pointers[i] == p)) {
+                    return false;
+                }
+            } else {
+                goto found;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+    memset(b, 0, sizeof(*b));
+    new = b;
+    i = 0;
+    atomic_inc(&map->n_added_buckets);
+    if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
+        *needs_resize = true;
+    }
+
+ found:
+    seqlock_write_lock(&head->sequence);
+    if (new) {
+        atomic_rcu_set(&prev->next, b);
+    }
+    atomic_set(&b->hashes[i], hash);
+    atomic_set(&b->pointers[i], p);
+    seqlock_write_unlock(&head->sequence);
+    return true;
+}
+
+static void qht_grow_maybe(struct qht *ht)
+{
+    struct qht_map *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    /* another thread might have just resized the table */
+    if (qht_map_needs_resize(map)) {
+        qht_do_resize(ht, map->n_buckets * 2, false);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_insert(struct qht *ht, void *p, uint32_t hash)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+    bool needs_resize = false;
+    bool ret;
+
+    /* NULL pointers are not supported */
+    assert(p);
+
+    rcu_read_lock();
+    b = qht_bucket_lock__no_stale(ht, hash, &map);
+    ret = qht_insert__locked(map, b, p, hash, &needs_resize);
+    qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
+
+    if (unlikely(needs_resize) && (ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_grow_maybe(ht);
+    }
+    return ret;
+}
+
+static inline bool qht_entry_is_last(struct qht_bucket *b, int pos)
+{
+    if (pos == QHT_BUCKET_ENTRIES - 1) {
+        if (b->next == NULL) {
+            return true;
+        }
+        return b->next->pointers[0] == NULL;
+    }
+    return b->pointers[pos + 1] == NULL;
+}
+
+static void qht_entry_move(struct qht_bucket *to, int i,
+                           struct qht_bucket *from, int j)
+{
+    atomic_set(&to->hashes[i], from->hashes[j]);
+    atomic_set(&to->pointers[i], from->pointers[j]);
+
+    atomic_set(&from->hashes[j], 0);
+    atomic_set(&from->pointers[j], NULL);
+}
+
+/* Find the last valid entry in @orig's chain and move it to @pos, keeping
+ * the chain packed.  Call with the head bucket lock held.
+ */
+static void qht_bucket_remove_entry(struct qht_bucket *orig, int pos)
+{
+    struct qht_bucket *b = orig;
+    struct qht_bucket *prev = NULL;
+    int i;
+
+    if (qht_entry_is_last(orig, pos)) {
+        atomic_set(&orig->hashes[pos], 0);
+        atomic_set(&orig->pointers[pos], NULL);
+        return;
+    }
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i]) {
+                continue;
+            }
+            if (i > 0) {
+                qht_entry_move(orig, pos, b, i - 1);
+                return;
+            }
+            assert(prev != NULL);
+            qht_entry_move(orig, pos, prev, QHT_BUCKET_ENTRIES - 1);
+            return;
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+    /* the chain is full; move its very last entry */
+    qht_entry_move(orig, pos, prev, QHT_BUCKET_ENTRIES - 1);
+}
+
+/* call with the head bucket lock held */
+static bool qht_remove__locked(struct qht_bucket *head, const void *p,
+                               uint32_t hash)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *q = b->pointers[i];
+
+            if (unlikely(q == NULL)) {
+                return false;
+            }
+            if (q == p) {
+                assert(b->hashes[i] == hash);
+                seqlock_write_lock(&head->sequence);
+                qht_bucket_remove_entry(b, i);
+                seqlock_write_unlock(&head->sequence);
+                return true;
+            }
+        }
+        b = b->next;
+    } while (b);
+    return false;
+}
+
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+    bool ret;
+
+    /* NULL pointers are not supported */
+    assert(p);
+
+    rcu_read_lock();
+    b = qht_bucket_lock__no_stale(ht, hash, &map);
+    ret = qht_remove__locked(b, p, hash);
+    qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
+    return ret;
+}
+
+/* call with all bucket locks held */
+static void qht_map_iter__all_locked(struct qht *ht, struct qht_map *map,
+                                     qht_iter_func_t func, void *userp)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = &map->buckets[i];
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j] == NULL) {
+                    goto next_chain;
+                }
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+            b = b->next;
+        } while (b);
+    next_chain:
+        ;
+    }
+}
+
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
+{
+    struct qht_map *map;
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    qht_map_lock_buckets(map);
+    /* a resize may have published a new map while we were locking */
+    if (unlikely(map != ht->map)) {
+        qht_map_unlock_buckets(map);
+        qemu_mutex_lock(&ht->lock);
+        map = ht->map;
+        qht_map_lock_buckets(map);
+        qemu_mutex_unlock(&ht->lock);
+    }
+    qht_map_iter__all_locked(ht, map, func, userp);
+    qht_map_unlock_buckets(map);
+    rcu_read_unlock();
+}
+
+static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    struct qht_map *new = userp;
+    struct qht_bucket *b = qht_map_to_bucket(new, hash);
+
+    /* no need to acquire b->lock because no thread has seen this map yet */
+    qht_insert__locked(new, b, p, hash, NULL);
+}
+
+/* call with ht->lock held */
+static void qht_do_resize(struct qht *ht, size_t n_buckets, bool reset)
+{
+    struct qht_map *old = ht->map;
+    struct qht_map *new;
+
+    new = qht_map_create(n_buckets);
+    qht_map_lock_buckets(old);
+    if (!reset) {
+        qht_map_iter__all_locked(ht, old, qht_map_copy, new);
+    }
+    atomic_rcu_set(&ht->map, new);
+    qht_map_unlock_buckets(old);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+bool qht_resize(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool ret = false;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, n_buckets, false);
+        ret = true;
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+void qht_statistics(struct qht *ht, struct qht_stats *stats)
+{
+    struct qht_map *map;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    stats->head_buckets = map->n_buckets;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *head = &map->buckets[i];
+        struct qht_bucket *b;
+        unsigned int version;
+        size_t buckets;
+        size_t entries;
+        int j;
+
+        do {
+            version = seqlock_read_begin(&head->sequence);
+            buckets = 0;
+            entries = 0;
+            b = head;
+            do {
+                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                    if (atomic_read(&b->pointers[j]) == NULL) {
+                        break;
+                    }
+                    entries++;
+                }
+                buckets++;
+                b = atomic_rcu_read(&b->next);
+            } while (b);
+        } while (seqlock_read_retry(&head->sequence, version));
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->chain_total += buckets;
+            if (buckets > stats->chain_max) {
+                stats->chain_max = buckets;
+            }
+        }
+    }
+    rcu_read_unlock();
+}